@@ -0,0 +1,422 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Shape sweep benchmark for matmul and conv2d.
+ *
+ * npu_bench <matmul_fp16|matmul_int8|conv2d_fp16> <iterations> <warmup> <json file> <shape>...
+ *
+ * Shapes are MxKxN for matmul and HxWxCxOC for conv2d. Every iteration
+ * times generate, pack, submit and unpack separately with CLOCK_MONOTONIC_RAW
+ * and the results are written as JSON for tracking regressions. The cost
+ * model prediction is reported alongside and calibrated over the sweep.
+ * Shapes found in the tuning cache (NPU_TUNE_CACHE, see npu_tune) run
+ * with their tuned configuration.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include <libdrm/drm.h>
+
+#include "rknpu-ioctl.h"
+#include "npu_interface.h"
+#include "npu_hw.h"
+#include "npu_matmul.h"
+#include "npu_conv.h"
+#include "npu_bw.h"
+#include "npu_cost.h"
+#include "npu_tune.h"
+
+enum { bench_matmul_fp16 = 0,
+       bench_matmul_int8 = 1,
+       bench_conv2d_fp16 = 2 };
+
+enum { stage_generate = 0,
+       stage_pack,
+       stage_submit,
+       stage_unpack,
+       stage_total,
+       stages };
+
+static const char *stage_names[stages] = { "generate", "pack", "submit", "unpack", "total" };
+
+typedef struct {
+  int type;
+  int m, k, n;              // conv2d maps to m = H*W, k = C, n = OC
+  int h, w;
+  int iterations;
+  int warmup;
+  int ntasks;
+  uint64_t *samples[stages];
+  uint64_t bytes;
+  uint8_t counters_valid;
+  npu_cost_t cost;
+} bench_t;
+
+  uint64_t npu_regs[NPU_TUNE_MAX_TASKS*NPU_TASK_OPS];
+
+  npu_cost_model_t cost_model;
+  npu_tune_cache_t tune_cache;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static uint64_t percentile(uint64_t *sorted, int n, int pct) {
+  int idx = (n * pct + 99) / 100 - 1;
+  idx = idx < 0 ? 0 : (idx >= n ? n - 1 : idx);
+  return sorted[idx];
+}
+
+static int elem_size(int type) {
+  return (type == bench_matmul_int8) ? sizeof(int8_t) : sizeof(_Float16);
+}
+
+static int out_size(int type) {
+  return (type == bench_matmul_int8) ? sizeof(int32_t) : sizeof(float);
+}
+
+static int run_shape(int fd, bench_t *b, uint8_t *src_a, uint8_t *src_b, float *dst) {
+
+  int M = b->m, K = b->k, N = b->n;
+  int es = elem_size(b->type);
+  int ret = 0;
+
+  uint64_t regcmd_dma, regcmd_obj, tasks_dma, tasks_obj;
+  uint64_t input_dma, input_obj, weights_dma, weights_obj, output_dma, output_obj;
+  uint32_t regcmd_handle, tasks_handle, input_handle, weights_handle, output_handle;
+
+  uint64_t *regcmd = mem_allocate(fd, sizeof(npu_regs), &regcmd_dma, &regcmd_obj, 0, &regcmd_handle);
+  struct rknpu_task *tasks = mem_allocate(fd, 1024, &tasks_dma, &tasks_obj, RKNPU_MEM_KERNEL_MAPPING, &tasks_handle);
+  void *input = mem_allocate(fd, (size_t)M*K*es, &input_dma, &input_obj, 0, &input_handle);
+  void *weights = mem_allocate(fd, (size_t)N*K*es, &weights_dma, &weights_obj, 0, &weights_handle);
+  void *output = mem_allocate(fd, (size_t)M*N*out_size(b->type), &output_dma, &output_obj, 0, &output_handle);
+
+  if ((regcmd == NULL) || (tasks == NULL) || (input == NULL) || (weights == NULL) || (output == NULL)) {
+    printf("Failed to allocate memory \n");
+    return -1;
+  }
+
+  struct rknpu_submit submit = {
+    .flags = RKNPU_JOB_PC | RKNPU_JOB_BLOCK | RKNPU_JOB_PINGPONG,
+    .timeout = 6000,
+    .task_start = 0,
+    .task_number = 1,
+    .task_obj_addr = tasks_obj,
+    .core_mask = 1,
+    .fence_fd = -1,
+    .subcore_task = { {0, 1}, {1, 0}, {2, 0}, {0, 0}, {0, 0} },
+  };
+  const npu_tune_cfg_t *tune = npu_tune_lookup(&tune_cache,
+    (b->type == bench_matmul_int8) ? npu_tune_matmul_int8 : npu_tune_matmul_fp16, M, K, N);
+
+  for (int it = 0; it < b->warmup + b->iterations; it++) {
+    uint64_t t[stages + 1];
+    npu_bw_op_t op;
+
+    memset(&op, 0, sizeof(op));
+
+    t[0] = now_ns();
+    if (b->type == bench_conv2d_fp16) {
+      conv2d_params_t params;
+      memset(&params, 0, sizeof(params));
+      params.height = b->h;
+      params.width = b->w;
+      params.in_channels = K;
+      params.kernel_h = 1;
+      params.kernel_w = 1;
+      params.out_channels = N;
+      params.stride_x = 1;
+      params.stride_y = 1;
+      params.input_dma = input_dma;
+      params.weights_dma = weights_dma;
+      params.output_dma = output_dma;
+      params.tasks = (uint64_t *)&npu_regs;
+      params.tune = tune;
+      ret = gen_conv2d_fp16(&params);
+      b->ntasks = 1;
+    } else {
+      matmul_params_t params;
+      memset(&params, 0, sizeof(params));
+      params.m = M;
+      params.k = K;
+      params.n = N;
+      params.input_dma = input_dma;
+      params.weights_dma = weights_dma;
+      params.output_dma = output_dma;
+      params.tasks = (uint64_t *)&npu_regs;
+      params.tune = tune;
+      params.regcmd_dma = regcmd_dma;
+      ret = (b->type == bench_matmul_int8) ? gen_matmul_int8(&params) : gen_matmul_fp16(&params);
+      b->ntasks = matmul_task_count(&params);
+    }
+    if (ret != 0) {
+      printf("generate failed %d for %dx%dx%d\n", ret, M, K, N);
+      goto cleanup;
+    }
+    memcpy(regcmd, npu_regs, b->ntasks*NPU_TASK_OPS*sizeof(uint64_t));
+    npu_cost_tasks(&cost_model, npu_regs, b->ntasks, NULL, &b->cost);
+    for (int i = 0; i < b->ntasks; i++) {
+      tasks[i].flags = 0;
+      tasks[i].op_idx = 0;
+      tasks[i].enable_mask = 0xd;
+      tasks[i].int_mask = 0x300;
+      tasks[i].int_clear = 0x1ffff;
+      tasks[i].int_status = 0;
+      tasks[i].regcfg_amount = NPU_TASK_OPS-(RKNPU_PC_DATA_EXTRA_AMOUNT+4);
+      tasks[i].regcfg_offset = 0;
+      tasks[i].regcmd_addr = regcmd_dma + i*NPU_TASK_OPS*sizeof(uint64_t);
+    }
+    submit.task_number = b->ntasks;
+    submit.subcore_task[0].task_number = b->ntasks;
+
+    t[1] = now_ns();
+    if (b->type == bench_matmul_int8) {
+      int8_t *wi = weights, *fi = input;
+      for (int n = 1; n <= N; n++) {
+        for (int k = 1; k <= K; k++) {
+          wi[weight_int8(K, n, k)] = ((int8_t *)src_b)[(n-1)*K + (k-1)];
+        }
+      }
+      for (int m = 1; m <= M; m++) {
+        for (int k = 1; k <= K; k++) {
+          fi[feature_data(K, M, 1, 16, k, m, 1)] = ((int8_t *)src_a)[(m-1)*K + (k-1)];
+        }
+      }
+    } else {
+      _Float16 *wf = weights, *ff = input;
+      for (int n = 1; n <= N; n++) {
+        for (int k = 1; k <= K; k++) {
+          wf[weight_fp16(K, n, k)] = ((_Float16 *)src_b)[(n-1)*K + (k-1)];
+        }
+      }
+      for (int m = 1; m <= M; m++) {
+        for (int k = 1; k <= K; k++) {
+          ff[feature_data(K, M, 1, 8, k, m, 1)] = ((_Float16 *)src_a)[(m-1)*K + (k-1)];
+        }
+      }
+    }
+
+    t[2] = now_ns();
+    ret = npu_submit_measured(fd, &submit, &op);
+    if (ret < 0) {
+      goto cleanup;
+    }
+
+    t[3] = now_ns();
+    if (b->type == bench_matmul_int8) {
+      int32_t *oi = output;
+      for (int m = 1; m <= M; m++) {
+        for (int n = 1; n <= N; n++) {
+          dst[(m-1)*N + (n-1)] = oi[feature_data(N, M, 1, 4, n, m, 1)];
+        }
+      }
+    } else {
+      float *of = output;
+      for (int m = 1; m <= M; m++) {
+        for (int n = 1; n <= N; n++) {
+          dst[(m-1)*N + (n-1)] = of[feature_data(N, M, 1, 4, n, m, 1)];
+        }
+      }
+    }
+    t[4] = now_ns();
+
+    if (it >= b->warmup) {
+      int i = it - b->warmup;
+      for (int s = 0; s < stage_total; s++) {
+        b->samples[s][i] = t[s+1] - t[s];
+      }
+      b->samples[stage_total][i] = t[4] - t[0];
+      b->counters_valid = op.counters_valid;
+      b->bytes = op.counters_valid ? op.total_bytes :
+        (uint64_t)(M*K + N*K)*es + (uint64_t)M*N*out_size(b->type);
+    }
+  }
+
+cleanup:
+  munmap(regcmd, sizeof(npu_regs));
+  munmap(tasks, 1024);
+  munmap(input, (size_t)M*K*es);
+  munmap(weights, (size_t)N*K*es);
+  munmap(output, (size_t)M*N*out_size(b->type));
+  mem_destroy(fd, regcmd_handle, regcmd_obj);
+  mem_destroy(fd, tasks_handle, tasks_obj);
+  mem_destroy(fd, input_handle, input_obj);
+  mem_destroy(fd, weights_handle, weights_obj);
+  mem_destroy(fd, output_handle, output_obj);
+  return ret;
+}
+
+static void write_json(FILE *out, const char *op, bench_t *b, int first) {
+  uint64_t flops = 2ULL * b->m * b->k * b->n;
+
+  fprintf(out, "%s    {\"op\": \"%s\", \"m\": %d, \"k\": %d, \"n\": %d", first ? "" : ",\n", op, b->m, b->k, b->n);
+  if (b->type == bench_conv2d_fp16) {
+    fprintf(out, ", \"h\": %d, \"w\": %d", b->h, b->w);
+  }
+  fprintf(out, ", \"iterations\": %d, \"warmup\": %d, \"tasks\": %d", b->iterations, b->warmup, b->ntasks);
+  for (int s = 0; s < stages; s++) {
+    qsort(b->samples[s], b->iterations, sizeof(uint64_t), cmp_u64);
+    fprintf(out, ", \"%s_p50_us\": %.3f, \"%s_p99_us\": %.3f", stage_names[s],
+      percentile(b->samples[s], b->iterations, 50) / 1000.0, stage_names[s],
+      percentile(b->samples[s], b->iterations, 99) / 1000.0);
+  }
+  uint64_t p50 = percentile(b->samples[stage_submit], b->iterations, 50);
+  fprintf(out, ", \"gflops\": %.3f, \"bytes\": %llu, \"bytes_measured\": %s, \"gbps\": %.3f",
+    p50 ? (double)flops / p50 : 0.0, (unsigned long long)b->bytes,
+    b->counters_valid ? "true" : "false", p50 ? (double)b->bytes / p50 : 0.0);
+  fprintf(out, ", \"predicted_us\": %.3f, \"bound\": \"%s\"}", npu_cost_us(&cost_model, &b->cost),
+    npu_cost_bound_name(b->cost.bound));
+}
+
+int main(int argc, char **argv) {
+
+  const char *ops[] = { "matmul_fp16", "matmul_int8", "conv2d_fp16" };
+  bench_t b;
+  int ret = 0;
+
+  if (argc < 6) {
+    printf("Usage: npu_bench <matmul_fp16|matmul_int8|conv2d_fp16> <iterations> <warmup> <json file> <shape>...\n");
+    return -1;
+  }
+
+  memset(&b, 0, sizeof(b));
+  b.type = -1;
+  for (int i = 0; i < 3; i++) {
+    if (strcmp(argv[1], ops[i]) == 0) {
+      b.type = i;
+    }
+  }
+  b.iterations = atoi(argv[2]);
+  b.warmup = atoi(argv[3]);
+  if ((b.type < 0) || (b.iterations <= 0) || (b.warmup < 0)) {
+    printf("Invalid op [%s] or iterations [%s] / warmup [%s]\n", argv[1], argv[2], argv[3]);
+    return -1;
+  }
+
+  FILE *json = fopen(argv[4], "w");
+  if (json == NULL) {
+    printf("Failed to open %s\n", argv[4]);
+    return -1;
+  }
+
+  for (int s = 0; s < stages; s++) {
+    b.samples[s] = calloc(b.iterations, sizeof(uint64_t));
+  }
+
+  if (npu_tune_cache_load(&tune_cache, NULL) > 0) {
+    printf("Loaded %d tuned shapes\n", tune_cache.count);
+  }
+
+  int fd = npu_open();
+  npu_reset(fd);
+
+  uint32_t freq = 0;
+  npu_action(fd, RKNPU_GET_FREQ, &freq);
+  npu_cost_model_init(&cost_model, freq);
+  int nshapes = argc - 5;
+  uint64_t (*shape_regs)[NPU_TUNE_MAX_TASKS*NPU_TASK_OPS] = calloc(nshapes, sizeof(*shape_regs));
+  npu_cost_sample_t *cost_samples = calloc(nshapes, sizeof(npu_cost_sample_t));
+
+  fprintf(json, "{\n  \"benchmark\": \"%s\",\n  \"results\": [\n", argv[1]);
+  srand(time(NULL));
+
+  for (int i = 5; i < argc; i++) {
+    int h = 0, w = 0, c = 0, oc = 0;
+    if (b.type == bench_conv2d_fp16) {
+      if (sscanf(argv[i], "%dx%dx%dx%d", &h, &w, &c, &oc) != 4) {
+        printf("Invalid conv2d shape %s, expected HxWxCxOC\n", argv[i]);
+        ret = -1;
+        break;
+      }
+      b.h = h;
+      b.w = w;
+      b.m = h * w;
+      b.k = c;
+      b.n = oc;
+    } else if (sscanf(argv[i], "%dx%dx%d", &b.m, &b.k, &b.n) != 3) {
+      printf("Invalid matmul shape %s, expected MxKxN\n", argv[i]);
+      ret = -1;
+      break;
+    }
+
+    int es = elem_size(b.type);
+    uint8_t *src_a = malloc((size_t)b.m * b.k * es);
+    uint8_t *src_b = malloc((size_t)b.n * b.k * es);
+    float *dst = malloc((size_t)b.m * b.n * sizeof(float));
+    for (int j = 0; j < b.m * b.k; j++) {
+      if (es == 1) ((int8_t *)src_a)[j] = rand() % 10; else ((_Float16 *)src_a)[j] = rand() % 10;
+    }
+    for (int j = 0; j < b.n * b.k; j++) {
+      if (es == 1) ((int8_t *)src_b)[j] = rand() % 10; else ((_Float16 *)src_b)[j] = rand() % 10;
+    }
+
+    ret = run_shape(fd, &b, src_a, src_b, dst);
+    free(src_a);
+    free(src_b);
+    free(dst);
+    if (ret != 0) {
+      break;
+    }
+
+    memcpy(shape_regs[i-5], npu_regs, sizeof(npu_regs));
+    cost_samples[i-5].tasks = shape_regs[i-5];
+    cost_samples[i-5].ntasks = b.ntasks;
+    cost_samples[i-5].measured_us = percentile(b.samples[stage_submit], b.iterations, 50) / 1000.0;
+
+    write_json(json, argv[1], &b, i == 5);
+    printf("%s %s submit p50 %.1fus p99 %.1fus total p50 %.1fus\n", argv[1], argv[i],
+      percentile(b.samples[stage_submit], b.iterations, 50) / 1000.0,
+      percentile(b.samples[stage_submit], b.iterations, 99) / 1000.0,
+      percentile(b.samples[stage_total], b.iterations, 50) / 1000.0);
+  }
+
+  fprintf(json, "\n  ]");
+  if ((ret == 0) && (npu_cost_calibrate(&cost_model, cost_samples, nshapes) > 0)) {
+    fprintf(json, ",\n  \"cost_model\": {\"freq_hz\": %u, \"mac_scale\": %.4f, \"dma_scale\": %.4f}",
+      cost_model.freq_hz, cost_model.mac_scale, cost_model.dma_scale);
+    printf("cost model calibrated mac scale %.3f dma scale %.3f\n", cost_model.mac_scale, cost_model.dma_scale);
+  }
+  fprintf(json, "\n}\n");
+  fclose(json);
+  free(shape_regs);
+  free(cost_samples);
+  npu_tune_cache_free(&tune_cache);
+
+  for (int s = 0; s < stages; s++) {
+    free(b.samples[s]);
+  }
+  npu_close(fd);
+  return ret;
+}
@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Decode matrix vector products, single task against N split over the cores.
+ *
+ * npu_gemv <iterations> <json file> <KxN>...
+ *
+ * Each shape [1,K] x [N,K] is submitted iterations times as the single
+ * task gen_matmul_fp16 mapping and as gen_matmul_gemv_fp16, the outputs
+ * compared and the mean submit times and speedup reported and written
+ * as JSON.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "npu_hw.h"
+#include "npu_matmul.h"
+#include "npu_context.h"
+
+enum { mapping_single = 0,
+       mapping_gemv = 1,
+       mappings };
+
+static const char *mapping_names[mappings] = { "single", "gemv" };
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int gen(int mapping, int k, int n, const npu_buffer_t *input, const npu_buffer_t *weights,
+  const npu_buffer_t *output, npu_scratch_t *scratch, uint16_t *start, uint16_t *number) {
+
+  if (mapping == mapping_single) {
+    matmul_params_t params;
+    memset(&params, 0, sizeof(params));
+    params.m = 1;
+    params.k = k;
+    params.n = n;
+    params.input_dma = input->dma;
+    params.weights_dma = weights->dma;
+    params.output_dma = output->dma;
+    params.tasks = scratch->regs;
+    start[0] = 0;
+    number[0] = 1;
+    return gen_matmul_fp16(&params) == 0 ? 1 : -1;
+  }
+
+  matmul_batch_params_t params;
+  memset(&params, 0, sizeof(params));
+  params.m = 1;
+  params.k = k;
+  params.n = n;
+  params.input_dma = input->dma;
+  params.weights_dma = weights->dma;
+  params.output_dma = output->dma;
+  params.tasks = scratch->regs;
+  int ntasks = gen_matmul_gemv_fp16(&params);
+  memcpy(start, params.core_task_start, sizeof(params.core_task_start));
+  memcpy(number, params.core_task_number, sizeof(params.core_task_number));
+  return ntasks;
+}
+
+static int bench(npu_context_t *ctx, int iterations, int k, int n, double *us, int *ntasks) {
+
+  npu_buffer_t input, weights, output[mappings];
+  uint16_t start[NPU_CORES], number[NPU_CORES];
+  int ret = -1;
+
+  memset(output, 0, sizeof(output));
+  if ((npu_buffer_alloc(ctx, k * sizeof(__fp16), 0, &input) != 0) ||
+    (npu_buffer_alloc(ctx, (size_t)n * k * sizeof(__fp16), 0, &weights) != 0) ||
+    (npu_buffer_alloc(ctx, n * sizeof(float), 0, &output[mapping_single]) != 0) ||
+    (npu_buffer_alloc(ctx, n * sizeof(float), 0, &output[mapping_gemv]) != 0)) {
+    printf("failed to allocate [1,%d] x [%d,%d]\n", k, n, k);
+    return -1;
+  }
+  // Whole numbers keep the two mappings' sums comparable bit for bit
+  for (int i = 0; i < k; i++) {
+    ((__fp16 *)input.map)[i] = (__fp16)(rand() % 3 - 1);
+  }
+  for (size_t i = 0; i < (size_t)n * k; i++) {
+    ((__fp16 *)weights.map)[i] = (__fp16)(rand() % 3 - 1);
+  }
+
+  npu_scratch_t *scratch = npu_context_scratch(ctx, NPU_CORES);
+  for (int mapping = 0; mapping < mappings; mapping++) {
+    memset(start, 0, sizeof(start));
+    memset(number, 0, sizeof(number));
+    if ((scratch == NULL) || ((ntasks[mapping] = gen(mapping, k, n, &input, &weights, &output[mapping],
+      scratch, start, number)) < 0) || (npu_context_prepare(scratch, ntasks[mapping]) != 0)) {
+      printf("%s mapping of [1,%d] x [%d,%d] failed\n", mapping_names[mapping], k, n, k);
+      goto cleanup;
+    }
+    uint64_t total = 0;
+    for (int i = 0; i < iterations; i++) {
+      uint64_t t = now_ns();
+      if (npu_context_run(ctx, scratch, ntasks[mapping], start, number) < 0) {
+        goto cleanup;
+      }
+      total += now_ns() - t;
+    }
+    us[mapping] = total / 1000.0 / iterations;
+  }
+
+  if (memcmp(output[mapping_single].map, output[mapping_gemv].map, n * sizeof(float)) != 0) {
+    printf("[1,%d] x [%d,%d] gemv output differs from the single task\n", k, n, k);
+    goto cleanup;
+  }
+  ret = 0;
+
+cleanup:
+  npu_buffer_free(ctx, &input);
+  npu_buffer_free(ctx, &weights);
+  for (int mapping = 0; mapping < mappings; mapping++) {
+    npu_buffer_free(ctx, &output[mapping]);
+  }
+  return ret;
+}
+
+int main(int argc, char **argv) {
+
+  int ret = 0;
+
+  if (argc < 4) {
+    printf("Usage: npu_gemv <iterations> <json file> <KxN>...\n");
+    return -1;
+  }
+  int iterations = atoi(argv[1]);
+  if (iterations <= 0) {
+    printf("Invalid iterations %s\n", argv[1]);
+    return -1;
+  }
+  FILE *out = fopen(argv[2], "w");
+  if (out == NULL) {
+    printf("Failed to open %s\n", argv[2]);
+    return -1;
+  }
+  npu_context_t *ctx = npu_context_create();
+  if (ctx == NULL) {
+    fclose(out);
+    return -1;
+  }
+
+  srand(1);
+  fprintf(out, "[");
+  printf("%12s %12s %12s %8s\n", "shape", "single us", "gemv us", "speedup");
+  for (int i = 3; (i < argc) && (ret == 0); i++) {
+    double us[mappings];
+    int ntasks[mappings];
+    int k, n;
+    if ((sscanf(argv[i], "%dx%d", &k, &n) != 2) || (k <= 0) || (k % 32) || (n <= 0) || (n % 16)) {
+      printf("Invalid shape %s, K needs to be a multiple of 32 and N of 16\n", argv[i]);
+      ret = -1;
+      break;
+    }
+    if ((ret = bench(ctx, iterations, k, n, us, ntasks)) != 0) {
+      break;
+    }
+    printf("%12s %12.1f %12.1f %7.2fx\n", argv[i], us[mapping_single], us[mapping_gemv],
+      us[mapping_single] / us[mapping_gemv]);
+    fprintf(out, "%s\n  {\"k\": %d, \"n\": %d, \"iterations\": %d, \"single_us\": %.3f, \"gemv_us\": %.3f, "
+      "\"gemv_tasks\": %d, \"speedup\": %.3f}", (i > 3) ? "," : "", k, n, iterations, us[mapping_single],
+      us[mapping_gemv], ntasks[mapping_gemv], us[mapping_single] / us[mapping_gemv]);
+  }
+  fprintf(out, "\n]\n");
+  fclose(out);
+  npu_context_destroy(ctx);
+  return ret;
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Greedy decode from a llama2.c checkpoint and report tokens/s.
+ *
+ * npu_llama [--kv-int8] <checkpoint> [steps] [json file]
+ *
+ * Generation starts from the BOS token (1) and runs steps tokens, or up
+ * to seq_len. Token ids are printed as the tokenizer isn't loaded.
+ * --kv-int8 keeps the KV cache in int8.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "npu_context.h"
+#include "npu_llama.h"
+
+int main(int argc, char **argv) {
+
+  npu_llama_stats_t stats;
+  npu_llama_opts_t opts = { 0 };
+
+  if ((argc > 1) && (strcmp(argv[1], "--kv-int8") == 0)) {
+    opts.kv_int8 = 1;
+    argv++;
+    argc--;
+  }
+  if (argc < 2) {
+    printf("Usage: npu_llama [--kv-int8] <checkpoint> [steps] [json file]\n");
+    return -1;
+  }
+
+  npu_context_t *ctx = npu_context_create();
+  if (ctx == NULL) {
+    return -1;
+  }
+  npu_llama_t *model = npu_llama_load(ctx, argv[1], &opts);
+  if (model == NULL) {
+    npu_context_destroy(ctx);
+    return -1;
+  }
+  const npu_llama_config_t *cfg = npu_llama_config(model);
+  int steps = (argc > 2) ? atoi(argv[2]) : cfg->seq_len;
+  if ((steps <= 0) || (steps > cfg->seq_len)) {
+    steps = cfg->seq_len;
+  }
+  printf("dim %d hidden %d layers %d heads %d kv heads %d vocab %d seq %d\n", cfg->dim, cfg->hidden_dim,
+    cfg->n_layers, cfg->n_heads, cfg->n_kv_heads, cfg->vocab_size, cfg->seq_len);
+
+  int token = 1;
+  for (int pos = 0; pos < steps; pos++) {
+    float *logits = npu_llama_forward(model, token, pos);
+    if (logits == NULL) {
+      printf("forward failed at %d\n", pos);
+      break;
+    }
+    int next = 0;
+    for (int i = 1; i < cfg->vocab_size; i++) {
+      next = logits[i] > logits[next] ? i : next;
+    }
+    printf("%d ", next);
+    fflush(stdout);
+    token = next;
+  }
+  printf("\n");
+
+  npu_llama_stats(model, &stats);
+  double seconds = stats.total_ns / 1e9;
+  double tok_s = seconds > 0 ? stats.tokens / seconds : 0.0;
+  double npu = stats.total_ns ? 100.0 * stats.npu_ns / stats.total_ns : 0.0;
+  printf("achieved tok/s: %.2f (%llu tokens, %llu submits, %.1f%% npu)\n", tok_s,
+    (unsigned long long)stats.tokens, (unsigned long long)stats.submits, npu);
+
+  if (argc > 3) {
+    FILE *out = fopen(argv[3], "w");
+    if (out != NULL) {
+      fprintf(out, "{\"checkpoint\": \"%s\", \"kv_int8\": %d, \"tokens\": %llu, \"tok_s\": %.3f, \"submits\": %llu, \"npu_pct\": %.1f}\n",
+        argv[1], opts.kv_int8, (unsigned long long)stats.tokens, tok_s, (unsigned long long)stats.submits, npu);
+      fclose(out);
+    }
+  }
+
+  npu_llama_free(model);
+  npu_context_destroy(ctx);
+  return stats.tokens == (uint64_t)steps ? 0 : -1;
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Tune matmul shapes and record the winners in the tuning cache.
+ *
+ * npu_tune <matmul_fp16|matmul_int8> <iterations> <cache file> <shape>...
+ *
+ * Shapes are MxKxN. Existing entries for other shapes are kept, the
+ * cache is read by npu_bench and anything using npu_tune_lookup.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "npu_interface.h"
+#include "npu_tune.h"
+
+int main(int argc, char **argv) {
+
+  const char *ops[] = { "matmul_fp16", "matmul_int8" };
+  npu_tune_cache_t cache;
+  npu_tune_cfg_t cfg;
+  int op = -1, ret = 0;
+
+  if (argc < 5) {
+    printf("Usage: npu_tune <matmul_fp16|matmul_int8> <iterations> <cache file> <shape>...\n");
+    return -1;
+  }
+
+  for (int i = 0; i < 2; i++) {
+    if (strcmp(argv[1], ops[i]) == 0) {
+      op = i;
+    }
+  }
+  int iterations = atoi(argv[2]);
+  if ((op < 0) || (iterations <= 0)) {
+    printf("Invalid op [%s] or iterations [%s]\n", argv[1], argv[2]);
+    return -1;
+  }
+
+  memset(&cache, 0, sizeof(cache));
+  if (npu_tune_cache_load(&cache, argv[3]) < 0) {
+    return -1;
+  }
+
+  int fd = npu_open();
+  npu_reset(fd);
+
+  for (int i = 4; i < argc; i++) {
+    int m, k, n;
+    if (sscanf(argv[i], "%dx%dx%d", &m, &k, &n) != 3) {
+      printf("Invalid matmul shape %s, expected MxKxN\n", argv[i]);
+      ret = -1;
+      break;
+    }
+    if ((ret = npu_tune_matmul(fd, &cache, op, m, k, n, iterations, &cfg)) != 0) {
+      break;
+    }
+    for (int e = 0; e < cache.count; e++) {
+      if ((cache.entries[e].op == op) && (cache.entries[e].m == m) && (cache.entries[e].k == k) &&
+        (cache.entries[e].n == n)) {
+        printf("%s %s tile_n %u data_banks %u data_burst %u weight_burst %u dpu_burst %u %.1fus\n",
+          argv[1], argv[i], cfg.tile_n, cfg.data_banks, cfg.data_burst_len, cfg.weight_burst_len,
+          cfg.dpu_burst_len, cache.entries[e].us);
+      }
+    }
+  }
+
+  if (ret == 0) {
+    ret = npu_tune_cache_save(&cache, argv[3]);
+  }
+  npu_tune_cache_free(&cache);
+  npu_close(fd);
+  return ret;
+}
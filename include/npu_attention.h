@@ -0,0 +1,67 @@
+#ifndef NPU_ATTENTION_H
+#define NPU_ATTENTION_H
+
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdint.h>
+
+#include "npu_context.h"
+
+// Scaled dot product attention of query rows over a context, softmax(q k^T
+// / sqrt(head_size)) v per head, for prefill as well as decode. The context
+// is split into tiles of positions so each matmul's keys, values and
+// softmax weights fit the CBUF however long it is:
+//
+//   scores[h][t] = q[h] k[kv][t]^T      one submit, every head and tile
+//   p[h][t] = softmax over all tiles    CPU, written as fp16 matmul inputs
+//   out[h] += p[h][t] v[kv][t]          one submit, tiles summed by the CPU
+//
+// The 1 / sqrt(head_size) scale is folded into the fp16 queries. Query head
+// h reads kv head h / (heads / kv_heads). With causal set query row r sees
+// positions up to seq - m + r, the rows being the last m positions.
+
+typedef struct {
+  uint16_t  heads;
+  uint16_t  kv_heads;           // divides heads
+  uint16_t  m;                  // query rows per head
+  uint16_t  seq;                // context positions
+  uint16_t  head_size;
+  uint16_t  tile;               // positions per tile, multiple of 32, 0 for the default
+  uint8_t   causal;
+} npu_attention_cfg_t;
+
+typedef struct {
+  uint64_t  submits;
+  uint64_t  npu_ns;             // time in submits
+} npu_attention_stats_t;
+
+typedef struct npu_attention npu_attention_t;
+
+npu_attention_t *npu_attention_create(npu_context_t *ctx, const npu_attention_cfg_t *cfg);
+void npu_attention_destroy(npu_attention_t *att);
+void npu_attention_stats(const npu_attention_t *att, npu_attention_stats_t *stats);
+
+// q and out are [heads][m][head_size], k and v [kv_heads][seq][head_size]
+int npu_attention_run(npu_attention_t *att, const float *q, const float *k, const float *v, float *out);
+void npu_attention_reference(const npu_attention_cfg_t *cfg, const float *q, const float *k, const float *v,
+  float *out);
+
+#endif // NPU_ATTENTION_H
@@ -0,0 +1,59 @@
+#ifndef NPU_BW_H
+#define NPU_BW_H
+
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "npu_interface.h"
+
+struct rknpu_submit;
+
+// Rough single core peaks for the roofline, 1GHz clock
+#define NPU_PEAK_GFLOPS_FP16 1024.0
+#define NPU_PEAK_GFLOPS_INT8 2048.0
+#define NPU_PEAK_DRAM_GBPS   34.0
+
+// DRAM traffic of one op, read from the driver's rw amount counters
+typedef struct {
+  const char *name;
+  uint64_t  macs;           // multiply accumulates performed by the op
+  uint64_t  est_bytes;      // expected traffic, used if the counters are unavailable
+  uint64_t  est_wt_bytes;   // weight traffic if every task fetched its weights, 0 if unknown
+  uint32_t  dt_rd_bytes;    // feature data read
+  uint32_t  wt_rd_bytes;    // weight read
+  uint32_t  dt_wr_bytes;    // output written
+  uint32_t  total_bytes;
+  uint8_t   counters_valid;
+  uint64_t  elapsed_ns;
+} npu_bw_op_t;
+
+int npu_bw_begin(int fd, npu_action_fn action);
+int npu_bw_end(int fd, npu_action_fn action, npu_bw_op_t *op);
+int npu_submit_measured(int fd, struct rknpu_submit *submit, npu_bw_op_t *op);
+uint64_t npu_bw_bytes(const npu_bw_op_t *op);
+double npu_bw_gbps(const npu_bw_op_t *op);
+double npu_bw_intensity(const npu_bw_op_t *op);
+uint64_t npu_bw_wt_saved(const npu_bw_op_t *op);
+void npu_bw_report(FILE *out, const npu_bw_op_t *ops, int n, double peak_gflops, double peak_gbps);
+
+#endif // NPU_BW_H
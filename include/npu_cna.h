@@ -42,16 +42,26 @@ typedef struct npu_cna_desc {
   uint8_t weight_width;       // 0x1038
   uint8_t weight_height;      // 0x1038
   uint16_t weight_kernels;    // 0x1038
+  uint8_t weight_reuse;       // 0x1040
+  uint8_t data_reuse;         // 0x1040
   uint8_t weight_bank;        // 0x1040
   uint8_t data_bank;          // 0x1040
   uint16_t data_entries;      // 0x1044
   uint8_t data_sign;          // 0x104c
   uint8_t cvt_type;           // 0x104c
   uint8_t cvt_bypass;         // 0x104c
+  uint8_t cvt_truncate0;      // 0x104c
+  uint8_t cvt_truncate1;      // 0x104c
+  uint8_t cvt_truncate2;      // 0x104c
+  uint8_t cvt_truncate3;      // 0x104c
   uint16_t cvt_scale0;        // 0x1050
+  uint16_t cvt_offset0;       // 0x1050
   uint16_t cvt_scale1;        // 0x1054
+  uint16_t cvt_offset1;       // 0x1054
   uint16_t cvt_scale2;        // 0x1058
+  uint16_t cvt_offset2;       // 0x1058
   uint16_t cvt_scale3;        // 0x105C
+  uint16_t cvt_offset3;       // 0x105C
   uint8_t fc_skip_en;         // 0x1060
   uint16_t data_offset;       // 0x1064
   uint8_t pad_left;           // 0x1068
@@ -65,7 +75,11 @@ typedef struct npu_cna_desc {
   uint16_t dma_width;         // 0x1084
   uint16_t dma_height;        // 0x1084
   uint16_t dma_channel;       // 0x1088
+  uint8_t dcomp_ctrl;         // 0x1100 bit 0 assumed to enable decompress, unverified
+  uint8_t dcomp_regnum;       // 0x1104
   uint32_t decompress_addr0;  // 0x1110
+  uint32_t dcomp_amount[16];  // 0x1140 - 0x117C
+  uint32_t cvt_channel_en;    // 0x1180 CNA_CVT_CON5 bit per channel to convert
 
   uint16_t dataout_height;
 } npu_cna_desc;
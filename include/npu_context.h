@@ -0,0 +1,77 @@
+#ifndef NPU_CONTEXT_H
+#define NPU_CONTEXT_H
+
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "npu_matmul.h"
+
+/*
+ * An open NPU with the buffers, cached command streams and per thread
+ * scratch allocated through it.
+ *
+ * Thread safety: every function may be called concurrently from any
+ * thread except npu_context_destroy, which must only run once the other
+ * threads are done with the context. Buffers and command cache entries
+ * use short internal locks, scratch is per thread and submits go
+ * straight to the driver, which queues concurrent jobs itself. A buffer
+ * or scratch must only be written by one thread at a time.
+ */
+
+typedef struct npu_context npu_context_t;
+
+typedef struct {
+  void      *map;
+  size_t    size;
+  uint64_t  dma;
+  uint64_t  obj;
+  uint32_t  handle;
+  int       placement;    // mem_placement_sram when RKNPU_MEM_TRY_ALLOC_SRAM got it SRAM
+} npu_buffer_t;
+
+// Staging for generated tasks, owned by one thread
+typedef struct {
+  uint64_t      *regs;          // NPU_TASK_OPS values per task, pass as params.tasks
+  npu_buffer_t  regcmd;         // regs are copied here on submit, pass regcmd.dma as params.regcmd_dma
+  npu_buffer_t  tasks;
+  int           capacity;       // tasks the scratch holds
+} npu_scratch_t;
+
+npu_context_t *npu_context_create(void);
+void npu_context_destroy(npu_context_t *ctx);
+int npu_context_fd(const npu_context_t *ctx);
+
+int npu_buffer_alloc(npu_context_t *ctx, size_t size, uint32_t flags, npu_buffer_t *buf);
+void npu_buffer_free(npu_context_t *ctx, npu_buffer_t *buf);
+
+npu_scratch_t *npu_context_scratch(npu_context_t *ctx, int ntasks);
+int npu_context_submit(npu_context_t *ctx, npu_scratch_t *scratch, int ntasks,
+  const uint16_t *core_task_start, const uint16_t *core_task_number);
+int npu_context_prepare(npu_scratch_t *scratch, int ntasks);
+int npu_context_run(npu_context_t *ctx, const npu_scratch_t *scratch, int ntasks,
+  const uint16_t *core_task_start, const uint16_t *core_task_number);
+
+int npu_cmd_cache_get(npu_context_t *ctx, const void *key, size_t key_len, uint64_t *ops, int max_tasks);
+int npu_cmd_cache_put(npu_context_t *ctx, const void *key, size_t key_len, const uint64_t *ops, int ntasks);
+
+#endif // NPU_CONTEXT_H
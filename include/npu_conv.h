@@ -23,6 +23,8 @@
 
 #include <stdint.h>
 
+#include "npu_tune.h"
+
 // Parameters for a single conv2d operation. Currently supports stride >=1 and padding top/left.
 // Kernel size 1x1 is fully supported using existing weight/feature packing helpers.
 // Other kernel sizes can be enabled once weight packing is confirmed.
@@ -49,11 +51,51 @@ typedef struct {
   uint32_t weights_dma;
   uint32_t output_dma;
 
-  // Where to emit the register command stream (size must be >= 112 uint64s)
+  // Where to emit the register command stream (size must be >= 112 uint64s
+  // per image in the batch)
   uint64_t *tasks;
 
-  // For fp16 path: set to 0 to output fp32, 1 to output fp16
+  // For fp16 path: set to 0 to output fp32, 1 to output fp16. fp16 output
+  // is in the feature layout the next fp16 conv2d or matmul reads.
   uint8_t fp32tofp16;
+
+  // Clamp the output at 0 in the DPU, a ReLU fused into the op
+  uint8_t relu;
+
+  // Batch of images sharing the same weights, 0 or 1 for a single image.
+  // Image i is read from input_dma + i * input_stride and written to
+  // output_dma + i * output_stride, one task per image.
+  uint16_t batch;
+  uint32_t input_stride;
+  uint32_t output_stride;
+
+  // Set when the previous task on the core used the same weights, eg the
+  // previous frame of a stream, so the first image skips the weight fetch
+  // as well.
+  uint8_t weights_resident;
+
+  // DMA address tasks will be copied to, used to chain the per image
+  // register blocks so the batch runs from a single submit. Required
+  // when batch > 1.
+  uint32_t regcmd_dma;
+
+  // Hardware input conversion for raw 8 bit images. When cvt_enable is set
+  // input_dma holds uint8 pixels (int8 if cvt_signed) in the int8 feature
+  // layout and the CNA computes (x - cvt_mean[c]) * cvt_scale[c] for the
+  // first 4 channels before the convolution, so no CPU normalize pass is
+  // needed. The CNA has 4 converters, channels padding an RGB(A) image to
+  // in_channels are read unconverted and should be zero. Unverified: the
+  // sign of the offset cvt_mean is written as hasn't been confirmed on
+  // hardware, the conv2d_cvt test runs against the emulator which uses the
+  // same convention so can't catch it being the wrong way round.
+  uint8_t cvt_enable;
+  uint8_t cvt_signed;
+  float cvt_mean[4];
+  float cvt_scale[4];
+
+  // Tuned bank split and burst lengths, NULL for the defaults. A 1x1
+  // conv is tuned as the matmul_fp16 of [H*W,C] x [OC,C].
+  const npu_tune_cfg_t *tune;
 } conv2d_params_t;
 
 int gen_conv2d_fp16(conv2d_params_t *params);
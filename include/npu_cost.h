@@ -0,0 +1,73 @@
+#ifndef NPU_COST_H
+#define NPU_COST_H
+
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdint.h>
+
+// Analytic model of a generated task list. Each task is decoded from its
+// register commands and costed as MAC cycles (CNA atomics) and DMA cycles
+// (feature, weight and output bytes at the DRAM rate, derated by the burst
+// length), the slower of the two being the bound resource.
+
+typedef struct {
+  uint32_t  freq_hz;
+  uint32_t  macs_per_cycle_fp16;    // 32 channels x 16 kernels per atomic
+  uint32_t  macs_per_cycle_int8;    // 32 channels x 32 kernels per atomic
+  double    dram_bytes_per_cycle;
+  uint32_t  burst_overhead;         // idle beats per DMA burst
+  uint32_t  task_overhead;          // cycles to fetch the regcmd and start a task
+
+  // Calibration factors fitted by npu_cost_calibrate, 1.0 uncalibrated
+  double    mac_scale;
+  double    dma_scale;
+} npu_cost_model_t;
+
+enum { npu_bound_compute = 0,
+       npu_bound_dma = 1,
+       npu_bound_overhead = 2 };
+
+typedef struct {
+  uint64_t  macs;
+  uint64_t  mac_cycles;
+  uint64_t  data_bytes;
+  uint64_t  weight_bytes;
+  uint64_t  output_bytes;
+  uint64_t  dma_cycles;
+  uint64_t  cycles;
+  uint8_t   bound;
+  uint8_t   cbuf_ok;                // feature data fits the data banks
+} npu_cost_t;
+
+typedef struct {
+  const uint64_t  *tasks;           // NPU_TASK_OPS register commands per task
+  int             ntasks;
+  double          measured_us;
+} npu_cost_sample_t;
+
+void npu_cost_model_init(npu_cost_model_t *model, uint32_t freq_hz);
+int npu_cost_tasks(const npu_cost_model_t *model, const uint64_t *tasks, int ntasks, npu_cost_t *costs, npu_cost_t *total);
+double npu_cost_us(const npu_cost_model_t *model, const npu_cost_t *cost);
+const char *npu_cost_bound_name(uint8_t bound);
+int npu_cost_calibrate(npu_cost_model_t *model, const npu_cost_sample_t *samples, int n);
+int npu_cost_pick(const npu_cost_model_t *model, const uint64_t *const *plans, const int *ntasks, int nplans, npu_cost_t *best);
+
+#endif // NPU_COST_H
@@ -0,0 +1,57 @@
+#ifndef NPU_DCOMP_H
+#define NPU_DCOMP_H
+
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdint.h>
+
+// Weight compression for the CNA decompressor (CNA_DCOMP_*). Packed weights
+// are split into up to 16 segments, one per CNA_DCOMP_AMOUNTn register.
+// Each segment is a run of blocks of 32 elements, a block being a 32 bit
+// mask of non zero elements followed by the non zero elements only (similar
+// to the NVDLA weight mask scheme). Segments are padded to 16 bytes.
+// Dense weights grow by the mask overhead, so only use the compressed
+// stream when total_bytes is below raw_bytes.
+//
+// Unverified: it hasn't been checked that the CNA decompressor reads this
+// format. The compressor and decompressor are safe to use on the CPU, but
+// the generators only emit CNA_DCOMP_* for compressed weights when
+// NPU_DCOMP_EXPERIMENTAL is set.
+
+#define NPU_DCOMP_SEGMENTS 16
+#define NPU_DCOMP_BLOCK 32
+#define NPU_DCOMP_ALIGN 16
+
+typedef struct {
+  uint8_t   elem_size;                      // 1 for int8, 2 for fp16
+  uint8_t   segments;                       // segments used, 1..16
+  uint32_t  raw_bytes;                      // size of the packed weights
+  uint32_t  total_bytes;                    // size of the compressed stream
+  uint32_t  offset[NPU_DCOMP_SEGMENTS];     // segment offset in compressed stream
+  uint32_t  amount[NPU_DCOMP_SEGMENTS];     // compressed bytes per segment
+} npu_dcomp_info_t;
+
+uint32_t weight_compress_bound(uint32_t raw_bytes, uint8_t elem_size, uint8_t segments);
+int weight_compress(const void *packed, uint32_t raw_bytes, uint8_t elem_size, uint8_t segments,
+  void *dst, uint32_t dst_size, npu_dcomp_info_t *info);
+int weight_decompress(const void *src, const npu_dcomp_info_t *info, void *dst);
+
+#endif // NPU_DCOMP_H
@@ -56,9 +56,18 @@ typedef struct npu_dpu_desc {
  uint8_t ew_lut_bypass;     // 0x4070
  uint8_t ew_op_cvt_bypass;  // 0x4070
  uint8_t ew_relu_bypass;    // 0x4070
+ uint8_t ew_op_type;        // 0x4070 0 ALU add, 1 MUL
+ uint8_t ew_op_src;         // 0x4070 1 operand read by the RDMA
+ uint32_t ew_base_addr;     // 0x5038
+ uint32_t ew_surf_stride;   // 0x5040
  uint8_t fp32tofp16_en;     // 0x4084
  uint16_t out_cvt_scale;    // 0x4084
  uint32_t surf_add;         // 0x40C0
+ uint32_t lut_cfg;          // 0x4108
+ uint32_t lut_info;         // 0x410C
+ uint32_t lut_lo_start;     // 0x4118
+ uint32_t lut_lo_end;       // 0x411C
+ uint32_t lut_lo_slope_scale; // 0x4128
 } npu_dpu_desc;
 
 #endif // NPU_DPU_H
@@ -0,0 +1,62 @@
+#ifndef NPU_DVFS_H
+#define NPU_DVFS_H
+
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdint.h>
+
+#include "npu_interface.h"
+
+#define NPU_DVFS_MAX_LEVELS 16
+
+typedef struct {
+  int       fd;
+  npu_action_fn action;
+
+  // Frequency steps in Hz, ascending
+  uint32_t  freqs[NPU_DVFS_MAX_LEVELS];
+  uint8_t   levels;
+  uint8_t   level;
+
+  // Governor tuning, see npu_dvfs_init for defaults
+  uint32_t  target_us;      // latency SLO per submit, 0 for none
+  uint32_t  window_us;      // utilisation sample window
+  uint32_t  idle_us;        // no submits for this long drops to the lowest step
+  uint8_t   up_pct;         // busy % above which we step up
+  uint8_t   down_pct;       // busy % below which we step down
+
+  uint64_t  window_start_us;
+  uint64_t  busy_us;
+  uint64_t  last_submit_us;
+  uint32_t  last_latency_us;
+} npu_dvfs_t;
+
+int npu_get_freq(int fd, uint32_t *hz);
+int npu_set_freq(int fd, uint32_t hz);
+int npu_get_volt(int fd, uint32_t *uv);
+int npu_set_volt(int fd, uint32_t uv);
+
+int npu_dvfs_init(npu_dvfs_t *dvfs, int fd, const uint32_t *freqs, uint8_t levels, npu_action_fn action);
+int npu_dvfs_set_level(npu_dvfs_t *dvfs, uint8_t level);
+int npu_dvfs_boost(npu_dvfs_t *dvfs, uint64_t now_us);
+int npu_dvfs_update(npu_dvfs_t *dvfs, uint64_t now_us, uint32_t busy_us, uint32_t latency_us);
+
+#endif // NPU_DVFS_H
@@ -0,0 +1,47 @@
+#ifndef NPU_EMU_H
+#define NPU_EMU_H
+
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Userspace stand in for the rknpu driver. Buffers are host memory with
+// fake 32 bit DMA addresses and submits decode the NPUOP register stream
+// and execute it on the CPU. As on the hardware each core starts from the
+// first rknpu_task of its subcore_task range (indexed from 2 when all
+// three cores are used) and follows the PC chain for the rest, with its
+// own registers and CBUF. Feature data is read through the CNA line and
+// surface strides, and reusing CBUF contents another task left fails.
+// Buffers asking for SRAM get it from a 1MB pool until it runs out.
+//
+// npu_open() uses the emulator when NPU_EMULATOR is set in the environment.
+// Programs that call ioctl/mmap themselves (like the tests) can instead be
+// run with LD_PRELOAD=libnpu-emu-preload.so, which redirects /dev/dri/card*.
+
+int npu_emu_open(void);
+int npu_emu_close(int fd);
+int npu_emu_is_fd(int fd);
+int npu_emu_ioctl(int fd, unsigned long request, void *arg);
+void *npu_emu_mmap(int fd, size_t size, off_t offset);
+
+#endif // NPU_EMU_H
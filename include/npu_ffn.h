@@ -0,0 +1,65 @@
+#ifndef NPU_FFN_H
+#define NPU_FFN_H
+
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdint.h>
+
+#include "npu_context.h"
+#include "npu_lut.h"
+
+// Gated feed forward of llama style models, w2 (silu(w1 x) * (w3 x)), as
+// three chained tasks run by one submit with nothing left for the CPU:
+//
+//   gate = silu(w1 x)        SiLU by the DPU LUT, written fp16
+//   hb = (w3 x) * gate       EW multiply by gate read by the DPU RDMA
+//   out = w2 hb              hb read as the fp16 [M,hidden] input
+//
+// The SiLU table is uploaded by register commands ahead of the first task.
+// The first two tasks rely on the EW multiply and LUT of gen_matmul_fp16,
+// which are unverified on hardware (see matmul_params_t), so the FFN has
+// only been checked against the emulator.
+// The weights are in the weight_fp16 layout, the input an fp16 [M,dim]
+// feature and the output a float32 [M,dim] feature.
+
+typedef struct {
+  uint16_t  m;                  // rows, 1 or a multiple of 4
+  uint16_t  dim;                // multiple of 32
+  uint16_t  hidden;             // multiple of 32
+  uint16_t  count;              // FFNs generated, eg one per layer
+} npu_ffn_cfg_t;
+
+typedef struct {
+  uint32_t  input_dma;
+  uint32_t  w1_dma;             // [hidden,dim]
+  uint32_t  w3_dma;             // [hidden,dim]
+  uint32_t  w2_dma;             // [dim,hidden]
+  uint32_t  output_dma;
+} npu_ffn_io_t;
+
+typedef struct npu_ffn npu_ffn_t;
+
+npu_ffn_t *npu_ffn_create(npu_context_t *ctx, const npu_ffn_cfg_t *cfg);
+void npu_ffn_destroy(npu_ffn_t *ffn);
+int npu_ffn_gen(npu_ffn_t *ffn, int index, const npu_ffn_io_t *io);
+int npu_ffn_run(npu_ffn_t *ffn, int index);
+
+#endif // NPU_FFN_H
@@ -0,0 +1,62 @@
+#ifndef NPU_GRAPH_H
+#define NPU_GRAPH_H
+
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdint.h>
+
+#include "npu_context.h"
+#include "npu_conv.h"
+#include "npu_plan.h"
+
+// A sequence of ops over tensors in NPU layout, compiled once into a
+// single chained task list that runs with one submit. Nodes are added in
+// execution order and each tensor is written by at most one node.
+//
+// A matmul takes a feature [M,K] (h M, w 1, c K) and weights of h N
+// kernels by c K, writing [M,N], or a feature h x w x K multiplied per
+// pixel. A conv2d takes a feature h x w x c and weights of h out_channels
+// kernels by c channels with w kernel_h * kernel_w, writing out_h x out_w
+// x out_channels. fp16 inputs write float32, or float16 which a following
+// fp16 op can read directly, int8 inputs write int32. A ReLU can be fused
+// into any node, so MLPs and conv stacks run layer to layer on the NPU.
+
+enum { npu_layout_feature = 0,
+       npu_layout_weights = 1 };
+
+typedef struct npu_graph npu_graph_t;
+
+npu_graph_t *npu_graph_create(npu_context_t *ctx);
+void npu_graph_destroy(npu_graph_t *graph);
+
+int npu_graph_tensor(npu_graph_t *graph, uint8_t layout, uint8_t precision, uint16_t h, uint16_t w, uint16_t c);
+int npu_graph_bind(npu_graph_t *graph, int tensor, const npu_buffer_t *buf);
+npu_buffer_t *npu_graph_buffer(npu_graph_t *graph, int tensor);
+
+int npu_graph_matmul(npu_graph_t *graph, int input, int weights, int output);
+int npu_graph_conv2d(npu_graph_t *graph, int input, int weights, int output, const conv2d_params_t *params);
+int npu_graph_relu(npu_graph_t *graph, int node);
+
+int npu_graph_compile(npu_graph_t *graph);
+int npu_graph_run(npu_graph_t *graph);
+int npu_graph_memory(npu_graph_t *graph, npu_plan_stats_t *stats);
+
+#endif // NPU_GRAPH_H
@@ -136,6 +136,14 @@
 #define DPU_LUT_LO_SLOPE_SCALE   0x4128 // LO LUT slope scale
 #define DPU_LUT_LO_SLOPE_SHIFT   0x412C // LO LUT slope shift
 
+#define RDMA_DATA_CUBE_WIDTH     0x500C // Width of the EW operand cube
+#define RDMA_DATA_CUBE_HEIGHT    0x5010 // Height of the EW operand cube
+#define RDMA_DATA_CUBE_CHANNEL   0x5014 // Channel of the EW operand cube
+#define RDMA_ERDMA_CFG           0x5034 // Configuration of the EW operand read
+#define RDMA_EW_BASE_ADDR        0x5038 // EW operand base address
+#define RDMA_EW_SURF_STRIDE      0x5040 // EW operand surface stride
+#define RDMA_FEATURE_MODE_CFG    0x5044 // Configuration of the RDMA feature mode
+
 // TODO Add PPU
 
 // NPU capability is limited to the following units
@@ -155,6 +163,7 @@
 #define OP_REG_CNA  (BLOCK_CNA | PC_OP_01)  // ??
 #define OP_REG_CORE (BLOCK_CORE | PC_OP_01) // ??
 #define OP_REG_DPU  (BLOCK_DPU | PC_OP_01)  // ??
+#define OP_REG_DPU_RDMA (BLOCK_DPU_RDMA | PC_OP_01) // ??
 
 #define OP_40     (PC_OP_40 | PC_OP_01)     // ??
 #define OP_ENABLE (PC_OP_ENABLE | PC_OP_01) // ??
@@ -164,12 +173,20 @@
 #define PC_ENABLE_CNA  0x04  // ?? Interrupt
 #define PC_ENABLE_DPU  0x08  // ?? Interrupt
 #define PC_ENABLE_PPU  0x10  // ?? Interrupt
+#define PC_ENABLE_DPU_RDMA 0x10  // ?? Same bit as PPU, unverified, set when the EW reads an operand
 
-#define NPUOP(op, value, reg) (((uint64_t)(op & 0xffff))<< 48) | ( ((uint64_t)(value & 0xffffffff)) << 16) | (uint64_t)(reg & 0xffff)
+#define NPUOP(op, value, reg) ((((uint64_t)((op) & 0xffff))<< 48) | ( ((uint64_t)((value) & 0xffffffff)) << 16) | (uint64_t)((reg) & 0xffff))
 
 #define NPU_CBUF_BANK_SIZE 32768
 #define NPU_CBUF_BANKS 12
 
+// Register command block emitted per task, the last 8 entries are the PC
+// chain/enable ops and driver extra amount so aren't counted as regcfg.
+#define NPU_TASK_OPS 112
+#define NPU_TASK_REGCFG_AMOUNT (NPU_TASK_OPS - 8)
+#define NPU_PC_DATA_EXTRA_AMOUNT 4
+#define NPU_PC_DATA_AMOUNT_SCALE 2
+
 enum  { direct_convolution = 0}; 
 enum  { precision_int8 = 0,
         precision_float16 = 2,
@@ -1,13 +1,27 @@
 #ifndef NPU_INTERFACE_H
 #define NPU_INTERFACE_H
 
+#include <stddef.h>
 #include <stdint.h>
 
+struct rknpu_submit;
+
+// Signature of npu_action, lets callers substitute a stub for testing
+typedef int (*npu_action_fn)(int fd, uint32_t flags, uint32_t *value);
+
+enum { mem_placement_dram = 0,
+       mem_placement_sram = 1 };
+
 void* mem_allocate(int fd, size_t size, uint64_t *dma_addr, uint64_t *obj, uint32_t flags, uint32_t *handle);
+void* mem_allocate_sram(int fd, size_t size, uint64_t *dma_addr, uint64_t *obj, uint32_t flags, uint32_t *handle, int *placement);
 void mem_destroy(int fd, uint32_t handle, uint64_t obj_addr);
 
 int npu_open();
+int npu_ioctl(int fd, unsigned long request, void *arg);
 int npu_close(int fd);
 int npu_reset(int fd);
+int npu_action(int fd, uint32_t flags, uint32_t *value);
+int npu_get_sram_size(int fd, uint32_t *total, uint32_t *free_size);
+void npu_submit_cores(struct rknpu_submit *submit, const uint16_t *core_task_start, const uint16_t *core_task_number);
 
 #endif // NPU_INTERFACE_H
@@ -0,0 +1,65 @@
+#ifndef NPU_KVCACHE_H
+#define NPU_KVCACHE_H
+
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "npu_context.h"
+
+// Key/value cache kept in the layouts the attention matmuls read, so a
+// new position is written in place and nothing is repacked per token.
+//
+// Keys of a kv head are weights with a kernel per position and head_size
+// channels (zero padded to 32): scores = q x K^T reads the first
+// pos + 1 kernels. Values are a feature of head_size rows by a channel
+// per position: out^T = V^T x att^T reads the first pos + 1 channel
+// planes, with the softmax weights as the weights.
+//
+// int8 halves the cache, keys and values are quantized per position and
+// the scales applied to the int32 results.
+
+typedef struct {
+  uint16_t  layers;
+  uint16_t  kv_heads;
+  uint16_t  q_heads;            // query heads per kv head
+  uint16_t  head_size;          // multiple of 4
+  uint16_t  seq_len;
+  uint8_t   int8;
+} npu_kvcache_cfg_t;
+
+typedef struct {
+  uint64_t  submits;
+  uint64_t  npu_ns;             // time in submits
+} npu_kvcache_stats_t;
+
+typedef struct npu_kvcache npu_kvcache_t;
+
+npu_kvcache_t *npu_kvcache_create(npu_context_t *ctx, const npu_kvcache_cfg_t *cfg);
+void npu_kvcache_destroy(npu_kvcache_t *kv);
+size_t npu_kvcache_bytes(const npu_kvcache_t *kv);
+void npu_kvcache_stats(const npu_kvcache_t *kv, npu_kvcache_stats_t *stats);
+
+int npu_kvcache_append(npu_kvcache_t *kv, int layer, int pos, const float *k, const float *v);
+int npu_kvcache_attend(npu_kvcache_t *kv, int layer, int pos, const float *q, float *out);
+
+#endif // NPU_KVCACHE_H
@@ -0,0 +1,71 @@
+#ifndef NPU_LLAMA_H
+#define NPU_LLAMA_H
+
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdint.h>
+
+#include "npu_context.h"
+
+// Transformer decoder running llama2.c checkpoints. Weights are packed
+// once to fp16 in DMA memory and every projection (QKV, output, FFN and
+// classifier) is generated at load time, the QKV, output and classifier
+// projections split along N over the cores, so a token costs a few
+// submits plus the CPU side rmsnorm, RoPE and softmax, which read and
+// write the NPU activation buffers in place. The SwiGLU FFN is an npu_ffn,
+// one submit per layer. Keys and values
+// are appended to an npu_kvcache, the attention matmuls reading it as is.
+//
+// The checkpoint is the llama2.c export (version 0): the config below
+// followed by float32 weights, a negative vocab_size marks an unshared
+// classifier. dim, hidden_dim and kv_dim must be multiples of 32 to fit
+// the matmul layouts, vocab_size can be any size.
+
+typedef struct {
+  int32_t   dim;
+  int32_t   hidden_dim;
+  int32_t   n_layers;
+  int32_t   n_heads;
+  int32_t   n_kv_heads;
+  int32_t   vocab_size;
+  int32_t   seq_len;
+} npu_llama_config_t;
+
+typedef struct {
+  uint64_t  tokens;
+  uint64_t  submits;
+  uint64_t  npu_ns;             // time in submits
+  uint64_t  total_ns;           // time in npu_llama_forward
+} npu_llama_stats_t;
+
+typedef struct {
+  uint8_t   kv_int8;            // int8 KV cache
+} npu_llama_opts_t;
+
+typedef struct npu_llama npu_llama_t;
+
+npu_llama_t *npu_llama_load(npu_context_t *ctx, const char *checkpoint, const npu_llama_opts_t *opts);
+void npu_llama_free(npu_llama_t *model);
+const npu_llama_config_t *npu_llama_config(const npu_llama_t *model);
+float *npu_llama_forward(npu_llama_t *model, int token, int pos);
+void npu_llama_stats(const npu_llama_t *model, npu_llama_stats_t *stats);
+
+#endif // NPU_LLAMA_H
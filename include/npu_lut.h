@@ -0,0 +1,49 @@
+#ifndef NPU_LUT_H
+#define NPU_LUT_H
+
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdint.h>
+
+// Lookup table applied to the DPU output by the EW stage, eg an activation
+// fused into a matmul. The DPU LUT follows the NVDLA SDP one, this only
+// uses its LO table of 257 entries spaced linearly from start, interpolated
+// between entries and continued with a slope below the first and past the
+// last entry. The table is written to the LUT RAM by register commands
+// (gen_lut_upload) that have to run before the task using it.
+
+#define NPU_LUT_ENTRIES 257
+#define NPU_LUT_UPLOAD_OPS (NPU_LUT_ENTRIES + 1)
+
+typedef struct {
+  float     start;
+  int8_t    step_log2;                  // entries are 2^step_log2 apart
+  __fp16    table[NPU_LUT_ENTRIES];
+  __fp16    uflow_slope;                // below start
+  __fp16    oflow_slope;                // past the last entry
+} npu_lut_t;
+
+void npu_lut_silu(npu_lut_t *lut);
+float npu_lut_end(const npu_lut_t *lut);
+float npu_lut_eval(const npu_lut_t *lut, float x);
+int gen_lut_upload(const npu_lut_t *lut, uint64_t *ops);
+
+#endif // NPU_LUT_H
@@ -21,6 +21,10 @@
  *
  */
 
+#include "npu_dcomp.h"
+#include "npu_lut.h"
+#include "npu_tune.h"
+
 typedef struct {
   uint16_t  m;
   uint16_t  k;
@@ -32,11 +36,153 @@ typedef struct {
 
   uint64_t  *tasks;
 
+  // Write fp16 instead of float32. The output is then in the fp16
+  // feature layout of an [M,N] input, so it can be passed as input_dma of
+  // the next matmul (N a multiple of 32) or of a conv2d reading it as H x
+  // W pixels with H * W = M, no unpacking between layers.
   uint8_t   fp32tofp16;
+
+  // Clamp the output at 0 in the DPU, a ReLU fused into the op
+  uint8_t   relu;
+
+  // fp16 only, the DPU EW stage after the ReLU. ew_mul_dma multiplies the
+  // output elementwise by an fp16 [M,N] feature (eg the fp16 output of
+  // another matmul), 0 for none. lut then maps each value through a lookup
+  // table, already uploaded to the LUT RAM with gen_lut_upload, NULL for
+  // none. Neither supports a batch. Unverified on hardware: the EW_CFG,
+  // DPU RDMA and LUT register values and the PC_ENABLE_DPU_RDMA enable bit
+  // are inferred from NVDLA and only checked against the emulator.
+  uint32_t  ew_mul_dma;
+  const npu_lut_t *lut;
+
+  // Set when weights_dma holds weights compressed by weight_compress.
+  // Experimental, rejected unless NPU_DCOMP_EXPERIMENTAL is set (see
+  // npu_dcomp.h).
+  const npu_dcomp_info_t *dcomp;
+
+  // Tuned tiling, bank split and burst lengths, NULL for the defaults.
+  // When N is split over several tasks (see matmul_task_count) they are
+  // chained for a single submit from regcmd_dma, the address tasks will
+  // be copied to. Required whenever there is more than one task.
+  const npu_tune_cfg_t *tune;
+  uint32_t  regcmd_dma;
+
+  // Batch of inputs sharing the weights, 0 or 1 for a single input. Input
+  // i is read from input_dma + i * input_stride and written to output_dma
+  // + i * output_stride, one task per input and N tile. The weights are
+  // kept stationary in the CBUF across the batch when they fit the weight
+  // banks.
+  uint16_t  batch;
+  uint32_t  input_stride;
+  uint32_t  output_stride;
+
+  // Set when the previous task on the core used the same weights (an
+  // earlier submit with the same weights_dma and N untiled) so even the
+  // first task skips the weight fetch.
+  uint8_t   weights_resident;
 } matmul_params_t;
 
+#define NPU_CORES 3
+
+// One matmul of a batch, addresses as in matmul_params_t
+typedef struct {
+  uint16_t  m;
+  uint16_t  k;
+  uint16_t  n;
+
+  uint32_t  input_dma;
+  uint32_t  weights_dma;
+  uint32_t  output_dma;
+} matmul_gemm_t;
+
+// Independent matmuls emitted as one task list for a single submit
+typedef struct {
+  // count matmuls taken from gemms, or when gemms is NULL a strided batch
+  // of m x k x n matmuls with matmul i at input_dma + i * input_stride,
+  // weights_dma + i * weights_stride and output_dma + i * output_stride.
+  const matmul_gemm_t *gemms;
+  uint16_t  count;
+
+  uint16_t  m;
+  uint16_t  k;
+  uint16_t  n;
+  uint32_t  input_dma;
+  uint32_t  weights_dma;
+  uint32_t  output_dma;
+  uint32_t  input_stride;
+  uint32_t  weights_stride;
+  uint32_t  output_stride;
+
+  // 112 values per matmul, chained per core from regcmd_dma (required
+  // when a core gets more than one matmul)
+  uint64_t  *tasks;
+  uint32_t  regcmd_dma;
+
+  uint8_t   fp32tofp16;
+  uint8_t   relu;
+
+  // Cores to spread the matmuls over, 0 for all NPU_CORES
+  uint8_t   cores;
+
+  // Filled in with each core's contiguous range of tasks, set in the
+  // submit with npu_submit_cores as subcore_task is indexed differently
+  // when all three cores are used
+  uint16_t  core_task_start[NPU_CORES];
+  uint16_t  core_task_number[NPU_CORES];
+} matmul_batch_params_t;
+
+#define MATMUL_FUSED_MAX 4
+
+// Weight matrices sharing an input packed back to back along N, so they
+// run as a single matmul of n_total kernels reading the input once.
+// Matrix i starts at kernel first[i], a whole kernel group of the
+// weight_fp16/weight_int8 layout so its weights are one contiguous block,
+// and a whole channel plane of the output so its [M,n[i]] result is a
+// feature of its own at matmul_fused_output_offset.
+typedef struct {
+  uint16_t  k;
+  uint8_t   count;
+  uint8_t   int8;
+  uint16_t  n[MATMUL_FUSED_MAX];
+  uint16_t  first[MATMUL_FUSED_MAX];
+  uint16_t  n_total;
+} matmul_fused_t;
+
+// fp16 matmul of any M, K and N. The generators take M of 1 or a multiple
+// of 4, K a multiple of 32 and N of 16, matmul_shape_init rounds up to
+// those and the buffers are laid out for the padded shape. The pack
+// functions zero the pad rows, channels and kernels as they write the
+// valid values so the pads add nothing to the sums, matmul_shape_params
+// sets the padded dimensions in the generator params and unpack reads back
+// only the valid [m,n] output.
+typedef struct {
+  uint16_t  m;
+  uint16_t  k;
+  uint16_t  n;
+  uint16_t  m_pad;
+  uint16_t  k_pad;
+  uint16_t  n_pad;
+} matmul_shape_t;
+
+void gen_task_chain(uint64_t *ops, uint32_t next_regcmd_dma, uint32_t next_regcfg_amount);
 int gen_matmul_fp16(matmul_params_t *params);
 int gen_matmul_int8(matmul_params_t *params);
+int matmul_task_count(const matmul_params_t *params);
+int gen_matmul_batch_fp16(matmul_batch_params_t *params);
+int gen_matmul_batch_int8(matmul_batch_params_t *params);
+int gen_matmul_gemv_fp16(matmul_batch_params_t *params);
+int matmul_fused_init(matmul_fused_t *fused, uint16_t k, const uint16_t *n, int count, uint8_t int8);
+size_t matmul_fused_weights_offset(const matmul_fused_t *fused, int i);
+size_t matmul_fused_output_offset(const matmul_fused_t *fused, int i, uint16_t m, size_t out_size);
+void matmul_fused_pack_fp16(const matmul_fused_t *fused, int i, const float *w, __fp16 *weights);
+int matmul_shape_init(matmul_shape_t *shape, int m, int k, int n);
+size_t matmul_shape_input_size(const matmul_shape_t *shape);
+size_t matmul_shape_weights_size(const matmul_shape_t *shape);
+size_t matmul_shape_output_size(const matmul_shape_t *shape, size_t out_size);
+void matmul_shape_params(const matmul_shape_t *shape, matmul_params_t *params);
+void matmul_shape_pack_input_fp16(const matmul_shape_t *shape, const float *a, __fp16 *input);
+void matmul_shape_pack_weights_fp16(const matmul_shape_t *shape, const float *w, __fp16 *weights);
+void matmul_shape_unpack_output(const matmul_shape_t *shape, const void *output, uint8_t fp16, float *c);
 int feature_data(int C, int H, int W, int C2, int c, int h, int w);
 int weight_fp16(int C, int k, int c);
 int weight_int8(int C, int k, int c);
@@ -0,0 +1,52 @@
+#ifndef NPU_PLAN_H
+#define NPU_PLAN_H
+
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+
+// Static placement of the tensors of an op sequence in one arena. Tensors
+// whose lifetimes (the ops from the first to the last that use them)
+// don't overlap may share memory, so a tensor's address is the arena's
+// DMA address plus its offset, passed to the generators as input_dma or
+// output_dma.
+
+#define NPU_PLAN_ALIGN 64
+
+typedef struct {
+  size_t  size;
+  int     first;            // first op using the tensor
+  int     last;             // last op using the tensor
+  size_t  offset;           // set by npu_plan_arena
+} npu_plan_tensor_t;
+
+typedef struct {
+  size_t  arena;            // bytes of the arena
+  size_t  peak;             // most bytes live during one op, the least any plan needs
+  size_t  naive;            // bytes with a buffer per tensor
+  int     tensors;
+} npu_plan_stats_t;
+
+int npu_plan_arena(npu_plan_tensor_t *tensors, int count, size_t align, npu_plan_stats_t *stats);
+void npu_plan_report(FILE *out, const npu_plan_stats_t *stats);
+
+#endif // NPU_PLAN_H
@@ -0,0 +1,71 @@
+#ifndef NPU_QUEUE_H
+#define NPU_QUEUE_H
+
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+
+#include "npu_context.h"
+
+// Submission queue in front of a context. Any number of threads push jobs
+// (a wait free atomic exchange), a dispatcher thread drains them and merges
+// independent jobs into one multi-task submit, waiting at most budget_us
+// after the oldest job was pushed for others to join it.
+
+typedef struct npu_job {
+  const uint64_t  *ops;         // NPU_TASK_OPS values per task, valid until the job completes
+  int             ntasks;
+  int             result;       // submit result, set on completion
+
+  // Owned by the queue
+  struct npu_job *_Atomic next;
+  sem_t           done;
+  uint64_t        push_ns;
+} npu_job_t;
+
+typedef struct {
+  uint32_t  budget_us;          // longest a job waits to be merged, 0 to merge only what's queued
+  int       max_tasks;          // tasks per submit, 0 for NPU_QUEUE_MAX_TASKS
+  uint8_t   cores;              // cores to spread jobs over, 0 for all NPU_CORES
+} npu_queue_cfg_t;
+
+typedef struct {
+  uint64_t  jobs;
+  uint64_t  tasks;
+  uint64_t  submits;
+} npu_queue_stats_t;
+
+#define NPU_QUEUE_MAX_TASKS 64
+
+typedef struct npu_queue npu_queue_t;
+
+npu_queue_t *npu_queue_create(npu_context_t *ctx, const npu_queue_cfg_t *cfg);
+void npu_queue_destroy(npu_queue_t *queue);
+void npu_queue_stats(npu_queue_t *queue, npu_queue_stats_t *stats);
+
+int npu_job_init(npu_job_t *job, const uint64_t *ops, int ntasks);
+int npu_queue_push(npu_queue_t *queue, npu_job_t *job);
+int npu_job_wait(npu_job_t *job);
+void npu_job_destroy(npu_job_t *job);
+
+#endif // NPU_QUEUE_H
@@ -0,0 +1,54 @@
+#ifndef NPU_SCHED_H
+#define NPU_SCHED_H
+
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdint.h>
+
+#include "npu_context.h"
+#include "npu_queue.h"
+
+// Per core run queues of task groups (npu_job_t, see npu_queue.h) with a
+// worker thread per core submitting through subcore_task/core_mask. A
+// worker whose queue is empty steals the newest group of the core with the
+// most queued tasks.
+
+typedef struct {
+  uint8_t   cores;              // cores to schedule on, 0 for all NPU_CORES
+  uint8_t   no_steal;           // keep groups on the core they were queued to
+} npu_sched_cfg_t;
+
+typedef struct {
+  uint64_t  groups;
+  uint64_t  tasks;
+  uint64_t  steals;             // groups taken from another core's queue
+  uint64_t  busy_ns;            // time spent in submits
+  double    utilization;        // busy_ns over the scheduler's lifetime
+} npu_sched_core_stats_t;
+
+typedef struct npu_sched npu_sched_t;
+
+npu_sched_t *npu_sched_create(npu_context_t *ctx, const npu_sched_cfg_t *cfg);
+void npu_sched_destroy(npu_sched_t *sched);
+int npu_sched_submit(npu_sched_t *sched, npu_job_t **jobs, int njobs, int core);
+void npu_sched_stats(npu_sched_t *sched, npu_sched_core_stats_t *stats);
+
+#endif // NPU_SCHED_H
@@ -0,0 +1,76 @@
+#ifndef NPU_TUNE_H
+#define NPU_TUNE_H
+
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdint.h>
+
+#include "npu_cna.h"
+#include "npu_dpu.h"
+
+// Per shape generator settings found by timing candidates on the NPU. A
+// field of 0 keeps the generator default.
+
+#define NPU_TUNE_TILE_ALIGN 32
+#define NPU_TUNE_MAX_TASKS  8       // tiles per matmul, smaller tile_n is ignored
+
+typedef struct {
+  uint16_t  tile_n;             // output channels per task, a multiple of NPU_TUNE_TILE_ALIGN
+  uint8_t   data_banks;         // CBUF banks for feature data, the rest hold weights
+  uint8_t   data_burst_len;     // CNA_DMA_CON0
+  uint8_t   weight_burst_len;   // CNA_DMA_CON0
+  uint8_t   dpu_burst_len;      // DPU_FEATURE_MODE_CFG
+} npu_tune_cfg_t;
+
+enum { npu_tune_matmul_fp16 = 0,
+       npu_tune_matmul_int8 = 1 };
+
+typedef struct {
+  uint8_t         op;
+  uint16_t        m;
+  uint16_t        k;
+  uint16_t        n;
+  npu_tune_cfg_t  cfg;
+  double          us;           // submit time measured for cfg
+} npu_tune_entry_t;
+
+typedef struct {
+  npu_tune_entry_t  *entries;
+  int               count;
+  int               capacity;
+} npu_tune_cache_t;
+
+// Cache file used when no path is given, overridden by NPU_TUNE_CACHE
+#define NPU_TUNE_CACHE_FILE "npu_tune.cache"
+
+void npu_tune_apply(const npu_tune_cfg_t *tune, npu_cna_desc *cna_desc, npu_dpu_desc *dpu_desc);
+
+int npu_tune_cache_load(npu_tune_cache_t *cache, const char *path);
+int npu_tune_cache_save(const npu_tune_cache_t *cache, const char *path);
+int npu_tune_cache_put(npu_tune_cache_t *cache, uint8_t op, uint16_t m, uint16_t k, uint16_t n,
+  const npu_tune_cfg_t *cfg, double us);
+const npu_tune_cfg_t *npu_tune_lookup(const npu_tune_cache_t *cache, uint8_t op, uint16_t m, uint16_t k, uint16_t n);
+void npu_tune_cache_free(npu_tune_cache_t *cache);
+
+int npu_tune_matmul(int fd, npu_tune_cache_t *cache, uint8_t op, uint16_t m, uint16_t k, uint16_t n,
+  int iterations, npu_tune_cfg_t *best);
+
+#endif // NPU_TUNE_H
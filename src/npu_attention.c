@@ -0,0 +1,380 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include <libdrm/drm.h>
+
+#include "rknpu-ioctl.h"
+#include "npu_hw.h"
+#include "npu_matmul.h"
+#include "npu_context.h"
+#include "npu_attention.h"
+
+#define ATT_ALIGN 64
+#define ATT_TILE 512
+
+struct npu_attention {
+  npu_context_t         *ctx;
+  npu_attention_cfg_t   cfg;
+  int                   m_pad;        // query rows, 1 or a multiple of 4
+  int                   d_pad;        // query and key channels, head_size rounded up to 32
+  int                   d_n;          // value kernels, head_size rounded up to 16
+  int                   seq_pad;      // positions rounded up to 32, the padding zero
+  int                   tile;
+  int                   tiles;
+
+  // Keys per kv head, values per kv head and tile, the rest per head and tile
+  npu_buffer_t          query, keys, values, scores, probs, partial;
+  size_t                query_bytes, key_bytes, value_bytes, scores_bytes, probs_bytes, partial_bytes;
+  float                 *row;
+
+  // Score tasks then value tasks, heads * tiles each, generated once
+  npu_scratch_t         scratch;
+  uint16_t              core_task_start[2][NPU_CORES];
+  uint16_t              core_task_number[2][NPU_CORES];
+
+  npu_attention_stats_t stats;
+};
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int round_up(int x, int align) {
+  return (x + align - 1) / align * align;
+}
+
+static size_t align_bytes(size_t x) {
+  return (x + ATT_ALIGN - 1) & ~(size_t)(ATT_ALIGN - 1);
+}
+
+static int tile_len(const npu_attention_t *att, int t) {
+  int left = att->seq_pad - t * att->tile;
+  return left < att->tile ? left : att->tile;
+}
+
+static int alloc_zeroed(npu_attention_t *att, npu_buffer_t *buf, size_t size) {
+  if (npu_buffer_alloc(att->ctx, size, 0, buf) != 0) {
+    printf("npu_attention failed to allocate %zu bytes\n", size);
+    return -1;
+  }
+  memset(buf->map, 0, size);
+  return 0;
+}
+
+// Generate one phase of heads * tiles matmuls from task first
+static int gen_phase(npu_attention_t *att, int phase, int first, const matmul_gemm_t *gemms, int count) {
+
+  matmul_batch_params_t params;
+
+  memset(&params, 0, sizeof(params));
+  params.gemms = gemms;
+  params.count = count;
+  params.tasks = att->scratch.regs + first * NPU_TASK_OPS;
+  params.regcmd_dma = att->scratch.regcmd.dma + first * NPU_TASK_OPS * sizeof(uint64_t);
+  if (gen_matmul_batch_fp16(&params) != 0) {
+    return -1;
+  }
+  for (int c = 0; c < NPU_CORES; c++) {
+    att->core_task_start[phase][c] = params.core_task_start[c] + first;
+    att->core_task_number[phase][c] = params.core_task_number[c];
+  }
+  return 0;
+}
+
+static int gen_tasks(npu_attention_t *att) {
+
+  npu_attention_cfg_t *p = &att->cfg;
+  int count = p->heads * att->tiles;
+  int group = p->heads / p->kv_heads;
+  matmul_gemm_t *gemms = calloc(count, sizeof(matmul_gemm_t));
+  int ret = -1;
+
+  if (gemms == NULL) {
+    return -1;
+  }
+  for (int h = 0; h < p->heads; h++) {
+    for (int t = 0; t < att->tiles; t++) {
+      matmul_gemm_t *g = &gemms[h * att->tiles + t];
+      g->m = att->m_pad;
+      g->k = att->d_pad;
+      g->n = tile_len(att, t);
+      g->input_dma = att->query.dma + h * att->query_bytes;
+      g->weights_dma = att->keys.dma + (h / group) * att->key_bytes + (size_t)t * att->tile * att->d_pad * sizeof(__fp16);
+      g->output_dma = att->scores.dma + (h * att->tiles + t) * att->scores_bytes;
+    }
+  }
+  if (gen_phase(att, 0, 0, gemms, count) != 0) {
+    goto done;
+  }
+  for (int h = 0; h < p->heads; h++) {
+    for (int t = 0; t < att->tiles; t++) {
+      matmul_gemm_t *g = &gemms[h * att->tiles + t];
+      g->m = att->m_pad;
+      g->k = tile_len(att, t);
+      g->n = att->d_n;
+      g->input_dma = att->probs.dma + (h * att->tiles + t) * att->probs_bytes;
+      g->weights_dma = att->values.dma + ((h / group) * att->tiles + t) * att->value_bytes;
+      g->output_dma = att->partial.dma + (h * att->tiles + t) * att->partial_bytes;
+    }
+  }
+  if (gen_phase(att, 1, count, gemms, count) != 0) {
+    goto done;
+  }
+  ret = npu_context_prepare(&att->scratch, 2 * count);
+
+done:
+  free(gemms);
+  return ret;
+}
+
+npu_attention_t *npu_attention_create(npu_context_t *ctx, const npu_attention_cfg_t *cfg) {
+
+  if ((cfg->heads == 0) || (cfg->kv_heads == 0) || (cfg->heads % cfg->kv_heads) || (cfg->m == 0) ||
+    (cfg->seq == 0) || (cfg->head_size == 0) || (cfg->tile % 32)) {
+    printf("npu_attention invalid config, heads %d kv_heads %d tile %d\n", cfg->heads, cfg->kv_heads, cfg->tile);
+    return NULL;
+  }
+
+  npu_attention_t *att = calloc(1, sizeof(npu_attention_t));
+  if (att == NULL) {
+    return NULL;
+  }
+  att->ctx = ctx;
+  att->cfg = *cfg;
+  att->m_pad = cfg->m == 1 ? 1 : round_up(cfg->m, 4);
+  att->d_pad = round_up(cfg->head_size, 32);
+  att->d_n = round_up(cfg->head_size, 16);
+  att->seq_pad = round_up(cfg->seq, 32);
+
+  // By default the largest tile whose softmax weights fit the CBUF
+  // alongside a weight bank
+  att->tile = cfg->tile;
+  if (att->tile == 0) {
+    att->tile = ATT_TILE;
+    while ((att->tile > 32) &&
+      ((size_t)att->m_pad * att->tile * sizeof(__fp16) > (NPU_CBUF_BANKS - 1) * NPU_CBUF_BANK_SIZE)) {
+      att->tile /= 2;
+    }
+  }
+  att->tile = att->tile < att->seq_pad ? att->tile : att->seq_pad;
+  att->tiles = (att->seq_pad + att->tile - 1) / att->tile;
+
+  size_t heads = cfg->heads, kv_heads = cfg->kv_heads, tiles = att->tiles;
+  att->query_bytes = align_bytes((size_t)att->m_pad * att->d_pad * sizeof(__fp16));
+  att->key_bytes = align_bytes((size_t)att->seq_pad * att->d_pad * sizeof(__fp16));
+  att->value_bytes = align_bytes((size_t)att->d_n * att->tile * sizeof(__fp16));
+  att->scores_bytes = align_bytes((size_t)att->m_pad * att->tile * sizeof(float));
+  att->probs_bytes = align_bytes((size_t)att->m_pad * att->tile * sizeof(__fp16));
+  att->partial_bytes = align_bytes((size_t)att->m_pad * att->d_n * sizeof(float));
+
+  int ntasks = 2 * cfg->heads * att->tiles;
+  npu_scratch_t *scratch = &att->scratch;
+  att->row = calloc(cfg->seq, sizeof(float));
+  scratch->regs = calloc(ntasks, NPU_TASK_OPS * sizeof(uint64_t));
+  if ((att->row == NULL) || (scratch->regs == NULL) ||
+    (alloc_zeroed(att, &att->query, heads * att->query_bytes) != 0) ||
+    (alloc_zeroed(att, &att->keys, kv_heads * att->key_bytes) != 0) ||
+    (alloc_zeroed(att, &att->values, kv_heads * tiles * att->value_bytes) != 0) ||
+    (alloc_zeroed(att, &att->scores, heads * tiles * att->scores_bytes) != 0) ||
+    (alloc_zeroed(att, &att->probs, heads * tiles * att->probs_bytes) != 0) ||
+    (alloc_zeroed(att, &att->partial, heads * tiles * att->partial_bytes) != 0) ||
+    (npu_buffer_alloc(ctx, ntasks * NPU_TASK_OPS * sizeof(uint64_t), 0, &scratch->regcmd) != 0) ||
+    (npu_buffer_alloc(ctx, ntasks * sizeof(struct rknpu_task), RKNPU_MEM_KERNEL_MAPPING, &scratch->tasks) != 0)) {
+    npu_attention_destroy(att);
+    return NULL;
+  }
+  scratch->capacity = ntasks;
+  if (gen_tasks(att) != 0) {
+    printf("npu_attention failed to generate %d tasks of %d positions\n", ntasks, att->tile);
+    npu_attention_destroy(att);
+    return NULL;
+  }
+  return att;
+}
+
+void npu_attention_destroy(npu_attention_t *att) {
+
+  if (att == NULL) {
+    return;
+  }
+  npu_buffer_t *buffers[] = { &att->query, &att->keys, &att->values, &att->scores, &att->probs, &att->partial,
+    &att->scratch.regcmd, &att->scratch.tasks };
+  for (unsigned int i = 0; i < sizeof(buffers) / sizeof(buffers[0]); i++) {
+    npu_buffer_free(att->ctx, buffers[i]);
+  }
+  free(att->scratch.regs);
+  free(att->row);
+  free(att);
+}
+
+void npu_attention_stats(const npu_attention_t *att, npu_attention_stats_t *stats) {
+  *stats = att->stats;
+}
+
+static int run_phase(npu_attention_t *att, int phase) {
+
+  uint64_t start = now_ns();
+  int ret = npu_context_run(att->ctx, &att->scratch, att->scratch.capacity, att->core_task_start[phase],
+    att->core_task_number[phase]);
+  att->stats.npu_ns += now_ns() - start;
+  att->stats.submits++;
+  return ret < 0 ? ret : 0;
+}
+
+// Positions query row r sees
+static int visible(const npu_attention_cfg_t *p, int r) {
+  if (!p->causal) {
+    return p->seq;
+  }
+  int n = p->seq - p->m + r + 1;
+  return n < 0 ? 0 : n;
+}
+
+int npu_attention_run(npu_attention_t *att, const float *q, const float *k, const float *v, float *out) {
+
+  npu_attention_cfg_t *p = &att->cfg;
+  int d = p->head_size;
+  float scale = 1.0f / sqrtf(d);
+
+  // Queries as rows of the score matmuls, keys as their kernels and the
+  // values of each tile as the kernels of its value matmul
+  for (int h = 0; h < p->heads; h++) {
+    __fp16 *dst = (__fp16 *)((uint8_t *)att->query.map + h * att->query_bytes);
+    for (int r = 0; r < p->m; r++) {
+      for (int i = 0; i < d; i++) {
+        dst[feature_data(att->d_pad, att->m_pad, 1, 8, i + 1, r + 1, 1)] = (__fp16)(q[((size_t)h * p->m + r) * d + i] * scale);
+      }
+    }
+  }
+  for (int h = 0; h < p->kv_heads; h++) {
+    __fp16 *keys = (__fp16 *)((uint8_t *)att->keys.map + h * att->key_bytes);
+    for (int s = 0; s < p->seq; s++) {
+      const float *ks = k + ((size_t)h * p->seq + s) * d;
+      const float *vs = v + ((size_t)h * p->seq + s) * d;
+      int t = s / att->tile, len = tile_len(att, t);
+      __fp16 *values = (__fp16 *)((uint8_t *)att->values.map + (h * att->tiles + t) * att->value_bytes);
+      for (int i = 0; i < d; i++) {
+        keys[weight_fp16(att->d_pad, s + 1, i + 1)] = (__fp16)ks[i];
+        values[weight_fp16(len, i + 1, s - t * att->tile + 1)] = (__fp16)vs[i];
+      }
+    }
+  }
+
+  if (run_phase(att, 0) != 0) {
+    return -1;
+  }
+
+  // Softmax of each row across the tiles, masked and padded positions zero
+  for (int h = 0; h < p->heads; h++) {
+    for (int r = 0; r < p->m; r++) {
+      int n = visible(p, r);
+      float max_val = -INFINITY, sum = 0.0f;
+      for (int s = 0; s < n; s++) {
+        int t = s / att->tile;
+        const float *scores = (const float *)((uint8_t *)att->scores.map + (h * att->tiles + t) * att->scores_bytes);
+        att->row[s] = scores[feature_data(tile_len(att, t), att->m_pad, 1, 4, s - t * att->tile + 1, r + 1, 1)];
+        max_val = att->row[s] > max_val ? att->row[s] : max_val;
+      }
+      for (int s = 0; s < n; s++) {
+        att->row[s] = expf(att->row[s] - max_val);
+        sum += att->row[s];
+      }
+      for (int t = 0; t < att->tiles; t++) {
+        int len = tile_len(att, t);
+        __fp16 *probs = (__fp16 *)((uint8_t *)att->probs.map + (h * att->tiles + t) * att->probs_bytes);
+        for (int j = 0; j < len; j++) {
+          int s = t * att->tile + j;
+          probs[feature_data(len, att->m_pad, 1, 8, j + 1, r + 1, 1)] = (__fp16)(s < n ? att->row[s] / sum : 0.0f);
+        }
+      }
+    }
+  }
+
+  if (run_phase(att, 1) != 0) {
+    return -1;
+  }
+
+  for (int h = 0; h < p->heads; h++) {
+    for (int r = 0; r < p->m; r++) {
+      float *o = out + ((size_t)h * p->m + r) * d;
+      for (int i = 0; i < d; i++) {
+        o[i] = 0.0f;
+        for (int t = 0; t < att->tiles; t++) {
+          const float *partial = (const float *)((uint8_t *)att->partial.map + (h * att->tiles + t) * att->partial_bytes);
+          o[i] += partial[feature_data(att->d_n, att->m_pad, 1, 4, i + 1, r + 1, 1)];
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+ * Float32 attention for validating npu_attention_run, same arguments and
+ * masking.
+ */
+void npu_attention_reference(const npu_attention_cfg_t *cfg, const float *q, const float *k, const float *v,
+  float *out) {
+
+  int d = cfg->head_size, group = cfg->heads / cfg->kv_heads;
+  float *att = malloc(cfg->seq * sizeof(float));
+
+  if (att == NULL) {
+    return;
+  }
+  for (int h = 0; h < cfg->heads; h++) {
+    const float *kh = k + (size_t)(h / group) * cfg->seq * d;
+    const float *vh = v + (size_t)(h / group) * cfg->seq * d;
+    for (int r = 0; r < cfg->m; r++) {
+      const float *qr = q + ((size_t)h * cfg->m + r) * d;
+      float *o = out + ((size_t)h * cfg->m + r) * d;
+      int n = visible(cfg, r);
+      float max_val = -INFINITY, sum = 0.0f;
+      for (int s = 0; s < n; s++) {
+        att[s] = 0.0f;
+        for (int i = 0; i < d; i++) {
+          att[s] += qr[i] * kh[(size_t)s * d + i];
+        }
+        att[s] /= sqrtf(d);
+        max_val = att[s] > max_val ? att[s] : max_val;
+      }
+      for (int s = 0; s < n; s++) {
+        att[s] = expf(att[s] - max_val);
+        sum += att[s];
+      }
+      for (int i = 0; i < d; i++) {
+        o[i] = 0.0f;
+        for (int s = 0; s < n; s++) {
+          o[i] += att[s] / sum * vh[(size_t)s * d + i];
+        }
+      }
+    }
+  }
+  free(att);
+}
@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "rknpu-ioctl.h"
+#include "npu_interface.h"
+#include "npu_bw.h"
+
+/*
+ * Clear the driver's DRAM read/write amount counters before a submit.
+ */
+int npu_bw_begin(int fd, npu_action_fn action) {
+  uint32_t value = 0;
+  if (action == NULL) {
+    action = npu_action;
+  }
+  return action(fd, RKNPU_ACT_CLR_TOTAL_RW_AMOUNT, &value);
+}
+
+/*
+ * Read back the counters after a submit. Some driver configs don't enable
+ * the counters and just return 0, in which case counters_valid is cleared
+ * and reports fall back to est_bytes.
+ */
+int npu_bw_end(int fd, npu_action_fn action, npu_bw_op_t *op) {
+  uint32_t dt_rd = 0, dt_wr = 0, wt_rd = 0, total = 0;
+  int ret;
+
+  if (action == NULL) {
+    action = npu_action;
+  }
+  if ((ret = action(fd, RKNPU_GET_DT_RD_AMOUNT, &dt_rd)) < 0) {
+    return ret;
+  }
+  if ((ret = action(fd, RKNPU_GET_DT_WR_AMOUNT, &dt_wr)) < 0) {
+    return ret;
+  }
+  if ((ret = action(fd, RKNPU_GET_WT_RD_AMOUNT, &wt_rd)) < 0) {
+    return ret;
+  }
+  if ((ret = action(fd, RKNPU_GET_TOTAL_RW_AMOUNT, &total)) < 0) {
+    return ret;
+  }
+  op->dt_rd_bytes = dt_rd;
+  op->dt_wr_bytes = dt_wr;
+  op->wt_rd_bytes = wt_rd;
+  op->total_bytes = (total != 0) ? total : dt_rd + dt_wr + wt_rd;
+  op->counters_valid = (op->total_bytes != 0);
+  return 0;
+}
+
+/*
+ * Submit bracketed by the counters and timed with CLOCK_MONOTONIC_RAW.
+ */
+int npu_submit_measured(int fd, struct rknpu_submit *submit, npu_bw_op_t *op) {
+  struct timespec start, end;
+  int ret;
+
+  npu_bw_begin(fd, NULL);
+  clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+  ret = npu_ioctl(fd, DRM_IOCTL_RKNPU_SUBMIT, submit);
+  clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+  if (ret < 0) {
+    printf("RKNPU_SUBMIT failed %d\n", ret);
+    return ret;
+  }
+  op->elapsed_ns = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000ULL + (end.tv_nsec - start.tv_nsec);
+  npu_bw_end(fd, NULL, op);
+  return ret;
+}
+
+uint64_t npu_bw_bytes(const npu_bw_op_t *op) {
+  return op->counters_valid ? op->total_bytes : op->est_bytes;
+}
+
+double npu_bw_gbps(const npu_bw_op_t *op) {
+  if (op->elapsed_ns == 0) {
+    return 0.0;
+  }
+  return (double)npu_bw_bytes(op) / (double)op->elapsed_ns;
+}
+
+// flops per DRAM byte
+double npu_bw_intensity(const npu_bw_op_t *op) {
+  uint64_t bytes = npu_bw_bytes(op);
+  if (bytes == 0) {
+    return 0.0;
+  }
+  return (2.0 * op->macs) / (double)bytes;
+}
+
+/*
+ * Weight bytes not fetched from DRAM thanks to weight reuse in the CBUF,
+ * measured with WT_RD_AMOUNT against est_wt_bytes.
+ */
+uint64_t npu_bw_wt_saved(const npu_bw_op_t *op) {
+  if (!op->counters_valid || (op->est_wt_bytes <= op->wt_rd_bytes)) {
+    return 0;
+  }
+  return op->est_wt_bytes - op->wt_rd_bytes;
+}
+
+/*
+ * Roofline style table, an op is bandwidth bound when its arithmetic
+ * intensity is below the ridge point peak_gflops / peak_gbps. Traffic
+ * marked with * is the caller's estimate as the counters were unavailable.
+ * Weight bytes saved by reuse are noted at the end of the row.
+ */
+void npu_bw_report(FILE *out, const npu_bw_op_t *ops, int n, double peak_gflops, double peak_gbps) {
+  double ridge = peak_gflops / peak_gbps;
+
+  fprintf(out, "%-20s %10s %10s %10s %11s %9s %8s %8s %9s %s\n", "op", "fd_rd", "wt_rd", "wr",
+    "total", "time_us", "GB/s", "GFLOPS", "flop/B", "bound");
+  for (int i = 0; i < n; i++) {
+    const npu_bw_op_t *op = &ops[i];
+    double intensity = npu_bw_intensity(op);
+    double gflops = (op->elapsed_ns > 0) ? (2.0 * op->macs) / (double)op->elapsed_ns : 0.0;
+    double attainable = intensity * peak_gbps < peak_gflops ? intensity * peak_gbps : peak_gflops;
+
+    fprintf(out, "%-20s %10u %10u %10u %10llu%c %9.1f %8.2f %8.1f %9.2f %s (%.0f%% of %.0f GFLOPS)\n",
+      op->name ? op->name : "?", op->dt_rd_bytes, op->wt_rd_bytes, op->dt_wr_bytes,
+      (unsigned long long)npu_bw_bytes(op), op->counters_valid ? ' ' : '*',
+      op->elapsed_ns / 1000.0, npu_bw_gbps(op), gflops, intensity,
+      intensity < ridge ? "bandwidth" : "compute",
+      attainable > 0 ? 100.0 * gflops / attainable : 0.0, attainable);
+    if (npu_bw_wt_saved(op) > 0) {
+      fprintf(out, "%-20s %10s %10llu weight bytes saved by reuse\n", "", "",
+        (unsigned long long)npu_bw_wt_saved(op));
+    }
+  }
+}
@@ -0,0 +1,410 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <libdrm/drm.h>
+
+#include "rknpu-ioctl.h"
+#include "npu_interface.h"
+#include "npu_hw.h"
+#include "npu_context.h"
+
+#define NPU_CMD_CACHE_BUCKETS 64
+#define NPU_CMD_CACHE_ENTRIES 256
+
+typedef struct cmd_entry {
+  struct cmd_entry  *next;
+  uint64_t          hash;
+  size_t            key_len;
+  int               ntasks;
+  uint8_t           *key;
+  uint64_t          *ops;
+} cmd_entry_t;
+
+typedef struct scratch_slot {
+  npu_scratch_t       scratch;
+  npu_context_t       *ctx;
+  struct scratch_slot *next;
+} scratch_slot_t;
+
+struct npu_context {
+  int               fd;
+
+  // Live buffers, released by npu_context_destroy if still allocated
+  pthread_mutex_t   buffers_lock;
+  npu_buffer_t      *buffers;
+  int               nbuffers;
+  int               buffers_capacity;
+
+  pthread_key_t     scratch_key;
+  pthread_mutex_t   scratch_lock;
+  scratch_slot_t    *scratch;
+
+  pthread_rwlock_t  cache_lock;
+  cmd_entry_t       *cache[NPU_CMD_CACHE_BUCKETS];
+  int               cache_count;
+};
+
+static void scratch_release(npu_context_t *ctx, npu_scratch_t *scratch) {
+  npu_buffer_free(ctx, &scratch->regcmd);
+  npu_buffer_free(ctx, &scratch->tasks);
+  free(scratch->regs);
+  memset(scratch, 0, sizeof(*scratch));
+}
+
+// Thread exit, the scratch goes with the thread
+static void scratch_destructor(void *value) {
+  scratch_slot_t *slot = value;
+  npu_context_t *ctx = slot->ctx;
+
+  pthread_mutex_lock(&ctx->scratch_lock);
+  for (scratch_slot_t **p = &ctx->scratch; *p != NULL; p = &(*p)->next) {
+    if (*p == slot) {
+      *p = slot->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&ctx->scratch_lock);
+  scratch_release(ctx, &slot->scratch);
+  free(slot);
+}
+
+npu_context_t *npu_context_create(void) {
+
+  npu_context_t *ctx = calloc(1, sizeof(npu_context_t));
+  if (ctx == NULL) {
+    return NULL;
+  }
+
+  ctx->fd = npu_open();
+  if (ctx->fd < 0) {
+    free(ctx);
+    return NULL;
+  }
+  if (pthread_key_create(&ctx->scratch_key, scratch_destructor) != 0) {
+    npu_close(ctx->fd);
+    free(ctx);
+    return NULL;
+  }
+  pthread_mutex_init(&ctx->buffers_lock, NULL);
+  pthread_mutex_init(&ctx->scratch_lock, NULL);
+  pthread_rwlock_init(&ctx->cache_lock, NULL);
+  return ctx;
+}
+
+void npu_context_destroy(npu_context_t *ctx) {
+
+  if (ctx == NULL) {
+    return;
+  }
+
+  pthread_key_delete(ctx->scratch_key);
+  while (ctx->scratch != NULL) {
+    scratch_slot_t *slot = ctx->scratch;
+    ctx->scratch = slot->next;
+    scratch_release(ctx, &slot->scratch);
+    free(slot);
+  }
+
+  while (ctx->nbuffers > 0) {
+    npu_buffer_t buf = ctx->buffers[ctx->nbuffers - 1];
+    npu_buffer_free(ctx, &buf);
+  }
+  free(ctx->buffers);
+
+  for (int i = 0; i < NPU_CMD_CACHE_BUCKETS; i++) {
+    while (ctx->cache[i] != NULL) {
+      cmd_entry_t *e = ctx->cache[i];
+      ctx->cache[i] = e->next;
+      free(e->key);
+      free(e->ops);
+      free(e);
+    }
+  }
+
+  pthread_mutex_destroy(&ctx->buffers_lock);
+  pthread_mutex_destroy(&ctx->scratch_lock);
+  pthread_rwlock_destroy(&ctx->cache_lock);
+  npu_close(ctx->fd);
+  free(ctx);
+}
+
+int npu_context_fd(const npu_context_t *ctx) {
+  return ctx->fd;
+}
+
+int npu_buffer_alloc(npu_context_t *ctx, size_t size, uint32_t flags, npu_buffer_t *buf) {
+
+  memset(buf, 0, sizeof(*buf));
+  if (flags & RKNPU_MEM_TRY_ALLOC_SRAM) {
+    buf->map = mem_allocate_sram(ctx->fd, size, &buf->dma, &buf->obj, flags & ~RKNPU_MEM_TRY_ALLOC_SRAM, &buf->handle,
+      &buf->placement);
+  } else {
+    buf->map = mem_allocate(ctx->fd, size, &buf->dma, &buf->obj, flags, &buf->handle);
+  }
+  if (buf->map == NULL) {
+    return -1;
+  }
+  buf->size = size;
+
+  pthread_mutex_lock(&ctx->buffers_lock);
+  if (ctx->nbuffers == ctx->buffers_capacity) {
+    int capacity = ctx->buffers_capacity ? ctx->buffers_capacity * 2 : 32;
+    npu_buffer_t *buffers = realloc(ctx->buffers, capacity * sizeof(npu_buffer_t));
+    if (buffers == NULL) {
+      pthread_mutex_unlock(&ctx->buffers_lock);
+      munmap(buf->map, size);
+      mem_destroy(ctx->fd, buf->handle, buf->obj);
+      memset(buf, 0, sizeof(*buf));
+      return -1;
+    }
+    ctx->buffers = buffers;
+    ctx->buffers_capacity = capacity;
+  }
+  ctx->buffers[ctx->nbuffers++] = *buf;
+  pthread_mutex_unlock(&ctx->buffers_lock);
+  return 0;
+}
+
+void npu_buffer_free(npu_context_t *ctx, npu_buffer_t *buf) {
+
+  if (buf->map == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&ctx->buffers_lock);
+  for (int i = 0; i < ctx->nbuffers; i++) {
+    if (ctx->buffers[i].handle == buf->handle) {
+      ctx->buffers[i] = ctx->buffers[--ctx->nbuffers];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&ctx->buffers_lock);
+
+  munmap(buf->map, buf->size);
+  mem_destroy(ctx->fd, buf->handle, buf->obj);
+  memset(buf, 0, sizeof(*buf));
+}
+
+/*
+ * The calling thread's scratch, grown to hold at least ntasks. Growing
+ * replaces regs and the buffers so pointers and DMA addresses taken
+ * before the call are stale.
+ */
+npu_scratch_t *npu_context_scratch(npu_context_t *ctx, int ntasks) {
+
+  scratch_slot_t *slot = pthread_getspecific(ctx->scratch_key);
+
+  if (slot == NULL) {
+    slot = calloc(1, sizeof(scratch_slot_t));
+    if (slot == NULL) {
+      return NULL;
+    }
+    slot->ctx = ctx;
+    pthread_setspecific(ctx->scratch_key, slot);
+    pthread_mutex_lock(&ctx->scratch_lock);
+    slot->next = ctx->scratch;
+    ctx->scratch = slot;
+    pthread_mutex_unlock(&ctx->scratch_lock);
+  }
+
+  npu_scratch_t *scratch = &slot->scratch;
+  if (ntasks > scratch->capacity) {
+    int capacity = (ntasks > 2 * scratch->capacity) ? ntasks : 2 * scratch->capacity;
+    scratch_release(ctx, scratch);
+    scratch->regs = calloc(capacity, NPU_TASK_OPS * sizeof(uint64_t));
+    if ((scratch->regs == NULL) ||
+      (npu_buffer_alloc(ctx, capacity * NPU_TASK_OPS * sizeof(uint64_t), 0, &scratch->regcmd) != 0) ||
+      (npu_buffer_alloc(ctx, capacity * sizeof(struct rknpu_task), RKNPU_MEM_KERNEL_MAPPING, &scratch->tasks) != 0)) {
+      scratch_release(ctx, scratch);
+      return NULL;
+    }
+    scratch->capacity = capacity;
+  }
+  return scratch;
+}
+
+/*
+ * Copy the first ntasks of regs to regcmd and fill in their task
+ * descriptors, so the scratch can be run as is any number of times.
+ */
+int npu_context_prepare(npu_scratch_t *scratch, int ntasks) {
+
+  struct rknpu_task *tasks = scratch->tasks.map;
+
+  if ((ntasks <= 0) || (ntasks > scratch->capacity)) {
+    return -1;
+  }
+
+  memcpy(scratch->regcmd.map, scratch->regs, ntasks * NPU_TASK_OPS * sizeof(uint64_t));
+  memset(tasks, 0, ntasks * sizeof(struct rknpu_task));
+  for (int i = 0; i < ntasks; i++) {
+    tasks[i].enable_mask = 0xd;
+    tasks[i].int_mask = 0x300;
+    tasks[i].int_clear = 0x1ffff;
+    tasks[i].regcfg_amount = NPU_TASK_REGCFG_AMOUNT;
+    tasks[i].regcmd_addr = scratch->regcmd.dma + i * NPU_TASK_OPS * sizeof(uint64_t);
+  }
+  return 0;
+}
+
+/*
+ * Submit ntasks already prepared in the scratch and wait for them. The
+ * per core ranges are as returned by gen_matmul_batch_*, NULL runs every
+ * task on the first core.
+ */
+int npu_context_run(npu_context_t *ctx, const npu_scratch_t *scratch, int ntasks,
+  const uint16_t *core_task_start, const uint16_t *core_task_number) {
+
+  int ret;
+
+  if ((ntasks <= 0) || (ntasks > scratch->capacity)) {
+    return -1;
+  }
+
+  struct rknpu_submit submit = {
+    .flags = RKNPU_JOB_PC | RKNPU_JOB_BLOCK | RKNPU_JOB_PINGPONG,
+    .timeout = 6000,
+    .task_start = 0,
+    .task_number = ntasks,
+    .task_obj_addr = scratch->tasks.obj,
+    .core_mask = 1,
+    .fence_fd = -1,
+    .subcore_task = { {0, ntasks}, {1, 0}, {2, 0}, {0, 0}, {0, 0} },
+  };
+  if ((core_task_start != NULL) && (core_task_number != NULL)) {
+    npu_submit_cores(&submit, core_task_start, core_task_number);
+  }
+
+  ret = npu_ioctl(ctx->fd, DRM_IOCTL_RKNPU_SUBMIT, &submit);
+  if (ret < 0) {
+    printf("RKNPU_SUBMIT failed %d\n", ret);
+  }
+  return ret;
+}
+
+// Prepare and run the first ntasks of the scratch
+int npu_context_submit(npu_context_t *ctx, npu_scratch_t *scratch, int ntasks,
+  const uint16_t *core_task_start, const uint16_t *core_task_number) {
+
+  if (npu_context_prepare(scratch, ntasks) != 0) {
+    return -1;
+  }
+  return npu_context_run(ctx, scratch, ntasks, core_task_start, core_task_number);
+}
+
+static uint64_t cmd_hash(const void *key, size_t key_len) {
+  const uint8_t *p = key;
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < key_len; i++) {
+    hash = (hash ^ p[i]) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static cmd_entry_t *cmd_find(npu_context_t *ctx, uint64_t hash, const void *key, size_t key_len) {
+  for (cmd_entry_t *e = ctx->cache[hash % NPU_CMD_CACHE_BUCKETS]; e != NULL; e = e->next) {
+    if ((e->hash == hash) && (e->key_len == key_len) && (memcmp(e->key, key, key_len) == 0)) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Copy the command stream cached under key (typically the generator
+ * params with the tasks pointer cleared) to ops. Returns the number of
+ * tasks, 0 on a miss or if it's larger than max_tasks.
+ */
+int npu_cmd_cache_get(npu_context_t *ctx, const void *key, size_t key_len, uint64_t *ops, int max_tasks) {
+
+  uint64_t hash = cmd_hash(key, key_len);
+  int ntasks = 0;
+
+  pthread_rwlock_rdlock(&ctx->cache_lock);
+  cmd_entry_t *e = cmd_find(ctx, hash, key, key_len);
+  if ((e != NULL) && (e->ntasks <= max_tasks)) {
+    memcpy(ops, e->ops, e->ntasks * NPU_TASK_OPS * sizeof(uint64_t));
+    ntasks = e->ntasks;
+  }
+  pthread_rwlock_unlock(&ctx->cache_lock);
+  return ntasks;
+}
+
+/*
+ * Cache a generated command stream. The cache is bounded, once full the
+ * bucket the key falls in is dropped to make room.
+ */
+int npu_cmd_cache_put(npu_context_t *ctx, const void *key, size_t key_len, const uint64_t *ops, int ntasks) {
+
+  uint64_t hash = cmd_hash(key, key_len);
+  cmd_entry_t *e = calloc(1, sizeof(cmd_entry_t));
+  if (e == NULL) {
+    return -1;
+  }
+  e->hash = hash;
+  e->key_len = key_len;
+  e->ntasks = ntasks;
+  e->key = malloc(key_len);
+  e->ops = malloc(ntasks * NPU_TASK_OPS * sizeof(uint64_t));
+  if ((e->key == NULL) || (e->ops == NULL)) {
+    free(e->key);
+    free(e->ops);
+    free(e);
+    return -1;
+  }
+  memcpy(e->key, key, key_len);
+  memcpy(e->ops, ops, ntasks * NPU_TASK_OPS * sizeof(uint64_t));
+
+  pthread_rwlock_wrlock(&ctx->cache_lock);
+  cmd_entry_t **bucket = &ctx->cache[hash % NPU_CMD_CACHE_BUCKETS];
+  for (cmd_entry_t **p = bucket; *p != NULL; p = &(*p)->next) {
+    if (((*p)->hash == hash) && ((*p)->key_len == key_len) && (memcmp((*p)->key, key, key_len) == 0)) {
+      cmd_entry_t *old = *p;
+      *p = old->next;
+      free(old->key);
+      free(old->ops);
+      free(old);
+      ctx->cache_count--;
+      break;
+    }
+  }
+  if (ctx->cache_count >= NPU_CMD_CACHE_ENTRIES) {
+    while (*bucket != NULL) {
+      cmd_entry_t *old = *bucket;
+      *bucket = old->next;
+      free(old->key);
+      free(old->ops);
+      free(old);
+      ctx->cache_count--;
+    }
+  }
+  e->next = *bucket;
+  *bucket = e;
+  ctx->cache_count++;
+  pthread_rwlock_unlock(&ctx->cache_lock);
+  return 0;
+}
@@ -30,6 +30,92 @@
 
 extern void gen_matmul_task(uint64_t *ops, npu_cna_desc *cna_desc, npu_core_desc *core_desc, npu_dpu_desc *dpu_desc);
 
+/*
+ * Emit one task per image of the batch. Weights are identical for every
+ * image so if they fit entirely in the weight banks the following tasks
+ * reuse the CBUF copy instead of fetching them from DRAM again. The
+ * tasks are chained from regcmd_dma, without it a batch can't run from
+ * one submit so it's rejected.
+ */
+static int gen_conv2d_batch(conv2d_params_t *params, npu_cna_desc *cna_desc, npu_core_desc *core_desc, npu_dpu_desc *dpu_desc) {
+  unsigned int batch = params->batch > 0 ? params->batch : 1;
+  uint8_t resident = cna_desc->weight_bytes <= (uint32_t)cna_desc->weight_bank * NPU_CBUF_BANK_SIZE;
+
+  if ((batch > 1) && (params->regcmd_dma == 0)) {
+    return -3;
+  }
+
+  for (unsigned int i = 0; i < batch; i++) {
+    uint64_t *ops = params->tasks + (i * NPU_TASK_OPS);
+    cna_desc->feature_base_addr = params->input_dma + i * params->input_stride;
+    cna_desc->weight_reuse = ((i > 0) || params->weights_resident) && resident;
+    dpu_desc->dst_base_addr = params->output_dma + i * params->output_stride;
+    gen_matmul_task(ops, cna_desc, core_desc, dpu_desc);
+    if (i + 1 < batch) {
+      gen_task_chain(ops, params->regcmd_dma + (i + 1) * NPU_TASK_OPS * sizeof(uint64_t), NPU_TASK_REGCFG_AMOUNT);
+    }
+  }
+  return 0;
+}
+
+/*
+ * Program the CNA input converter, which computes (x - offset) * scale
+ * >> truncate like the NVDLA CDMA converter it derives from. For fp16
+ * processing the offset and scale are fp16 values, for int8 processing
+ * the offset is the rounded mean and the scale is fixed point with the
+ * largest truncate (right shift) that keeps it within 16 bits. There are
+ * only 4 offset/scale pairs (CNA_CVT_CON1..4), channels past those are
+ * left out of CNA_CVT_CON5 and pass through unconverted.
+ */
+static void set_input_cvt(conv2d_params_t *params, npu_cna_desc *cna_desc) {
+  uint16_t offset[4] = {0, 0, 0, 0};
+  uint16_t scale[4] = {1, 1, 1, 1};
+  uint8_t truncate[4] = {0, 0, 0, 0};
+  unsigned int channels;
+
+  cna_desc->cvt_type = 0x1;
+  cna_desc->cvt_bypass = 0x1;
+  cna_desc->cvt_channel_en = 0;
+  if (params->cvt_enable) {
+    cna_desc->in_precision = precision_int8;
+    cna_desc->data_sign = params->cvt_signed & 0x1;
+    cna_desc->cvt_bypass = 0x0;
+    channels = params->in_channels < 4 ? params->in_channels : 4;
+    cna_desc->cvt_channel_en = (1 << channels) - 1;
+    for (unsigned int c = 0; c < 4; c++) {
+      if (cna_desc->proc_precision == precision_float16) {
+        __fp16 m = (__fp16)params->cvt_mean[c];
+        __fp16 f = (__fp16)params->cvt_scale[c];
+        memcpy(&offset[c], &m, sizeof(offset[c]));
+        memcpy(&scale[c], &f, sizeof(scale[c]));
+      } else {
+        float f = params->cvt_scale[c] < 0 ? -params->cvt_scale[c] : params->cvt_scale[c];
+        int16_t m = (int16_t)(params->cvt_mean[c] < 0 ? params->cvt_mean[c] - 0.5f : params->cvt_mean[c] + 0.5f);
+        int t = 0;
+        while ((t < 0x3F) && (f * (float)(1ULL << (t + 1)) < 32767.0f)) {
+          t++;
+        }
+        int16_t q = (int16_t)(f * (float)(1ULL << t) + 0.5f);
+        offset[c] = (uint16_t)m;
+        scale[c] = (uint16_t)(params->cvt_scale[c] < 0 ? -q : q);
+        truncate[c] = (uint8_t)t;
+      }
+    }
+  }
+  cna_desc->cvt_offset0 = offset[0];
+  cna_desc->cvt_offset1 = offset[1];
+  cna_desc->cvt_offset2 = offset[2];
+  cna_desc->cvt_offset3 = offset[3];
+  cna_desc->cvt_scale0 = scale[0];
+  cna_desc->cvt_scale1 = scale[1];
+  cna_desc->cvt_scale2 = scale[2];
+  cna_desc->cvt_scale3 = scale[3];
+  cna_desc->cvt_truncate0 = truncate[0];
+  cna_desc->cvt_truncate1 = truncate[1];
+  cna_desc->cvt_truncate2 = truncate[2];
+  cna_desc->cvt_truncate3 = truncate[3];
+}
+
 static int compute_bank_allocation_fp16(uint32_t fd_bytes, uint32_t weight_bytes_per_kernel, unsigned int *fd_banks_out, unsigned int *weight_banks_out) {
   unsigned int fd_banks = (fd_bytes / NPU_CBUF_BANK_SIZE);
   fd_banks = ((fd_bytes % NPU_CBUF_BANK_SIZE) == 0) ? fd_banks : fd_banks + 1;
@@ -92,25 +178,22 @@ int gen_conv2d_fp16(conv2d_params_t *params) {
   cna_desc.weight_bytes_per_kernel = (uint32_t)cna_desc.weight_width * cna_desc.weight_height * cna_desc.datain_channel * sizeof(__fp16);
   cna_desc.weight_bytes = cna_desc.weight_bytes_per_kernel * cna_desc.weight_kernels;
 
-  // Bank allocation
+  // Bank allocation, the input is 8 bit pixels when the converter is enabled
   unsigned int fd_banks = 0, weight_banks = 0;
-  uint32_t fd_bytes = (uint32_t)cna_desc.datain_width * cna_desc.datain_height * cna_desc.datain_channel * sizeof(__fp16);
+  unsigned int in_size = params->cvt_enable ? sizeof(uint8_t) : sizeof(__fp16);
+  uint32_t fd_bytes = (uint32_t)cna_desc.datain_width * cna_desc.datain_height * cna_desc.datain_channel * in_size;
   int ba = compute_bank_allocation_fp16(fd_bytes, cna_desc.weight_bytes_per_kernel, &fd_banks, &weight_banks);
   if (ba != 0) {
     return ba;
   }
 
+  cna_desc.weight_reuse = 0;
+  cna_desc.data_reuse = 0;
   cna_desc.weight_bank = (uint8_t)weight_banks;
   cna_desc.data_bank = (uint8_t)fd_banks;
-  cna_desc.data_entries = (uint16_t)((cna_desc.datain_width * cna_desc.datain_channel) / 32);
-  cna_desc.data_entries = (uint16_t)(((cna_desc.datain_width * cna_desc.datain_channel) % 32) == 0 ? cna_desc.data_entries : (cna_desc.data_entries + 1));
+  cna_desc.data_entries = (uint16_t)((cna_desc.datain_width * cna_desc.datain_channel * in_size + 63) / 64);
   cna_desc.data_sign = 0x1;
-  cna_desc.cvt_type = 0x1;
-  cna_desc.cvt_bypass = 0x1;
-  cna_desc.cvt_scale0 = 0x1;
-  cna_desc.cvt_scale1 = 0x1;
-  cna_desc.cvt_scale2 = 0x1;
-  cna_desc.cvt_scale3 = 0x1;
+  set_input_cvt(params, &cna_desc);
   cna_desc.fc_skip_en = 0;
   cna_desc.data_offset = 0x0;
   cna_desc.pad_left = params->pad_left;
@@ -119,7 +202,9 @@ int gen_conv2d_fp16(conv2d_params_t *params) {
   cna_desc.weight_offset = 0;
   cna_desc.weight_burst_len = 0xF;
   cna_desc.data_burst_len = 0xF;
-  cna_desc.line_stride = cna_desc.datain_width * 4; // fp16 packs 8 per 32B line unit as in matmul
+  // Strides count 4 byte units, a line is datain_width 16 byte atoms of
+  // 8 fp16 or 16 int8 channels so they don't depend on in_size
+  cna_desc.line_stride = cna_desc.datain_width * 4;
   int surf_stride = (int)(cna_desc.line_stride * ((cna_desc.datain_height / 4) - 1));
   surf_stride = surf_stride < 0 ? surf_stride + 1 : surf_stride;
   cna_desc.surf_stride = surf_stride;
@@ -127,6 +212,9 @@ int gen_conv2d_fp16(conv2d_params_t *params) {
   cna_desc.dma_height = cna_desc.datain_height;
   cna_desc.dma_channel = cna_desc.datain_channel;
   cna_desc.decompress_addr0 = params->weights_dma;
+  cna_desc.dcomp_ctrl = 0;
+  cna_desc.dcomp_regnum = 0;
+  memset(cna_desc.dcomp_amount, 0, sizeof(cna_desc.dcomp_amount));
   cna_desc.dataout_height = out_h; // copied for core usage convenience
 
   // Core
@@ -149,10 +237,10 @@ int gen_conv2d_fp16(conv2d_params_t *params) {
   dpu_desc.width = core_desc.dataout_width;
   dpu_desc.height = core_desc.dataout_height;
   dpu_desc.channel = core_desc.dataout_channel;
-  dpu_desc.bs_bypass = 1;
+  dpu_desc.bs_bypass = params->relu ? 0 : 1;
   dpu_desc.bs_alu_bypass = 1;
   dpu_desc.bs_mul_bypass = 1;
-  dpu_desc.bs_relu_bypass = 1;
+  dpu_desc.bs_relu_bypass = params->relu ? 0 : 1;
   dpu_desc.bn_bypass = 1;
   dpu_desc.bn_alu_bypass = 1;
   dpu_desc.bn_mul_bypass = 1;
@@ -179,8 +267,8 @@ int gen_conv2d_fp16(conv2d_params_t *params) {
   dpu_desc.channel_wdma = core_desc.dataout_channel;
   dpu_desc.surf_add = (!params->fp32tofp16) ? dpu_desc.dst_surf_stride * 4 : dpu_desc.dst_surf_stride * 2;
 
-  gen_matmul_task(params->tasks, &cna_desc, &core_desc, &dpu_desc);
-  return 0;
+  npu_tune_apply(params->tune, &cna_desc, &dpu_desc);
+  return gen_conv2d_batch(params, &cna_desc, &core_desc, &dpu_desc);
 }
 
 int gen_conv2d_int8(conv2d_params_t *params) {
@@ -220,17 +308,14 @@ int gen_conv2d_int8(conv2d_params_t *params) {
     return ba;
   }
 
+  cna_desc.weight_reuse = 0;
+  cna_desc.data_reuse = 0;
   cna_desc.weight_bank = (uint8_t)weight_banks;
   cna_desc.data_bank = (uint8_t)fd_banks;
   cna_desc.data_entries = (uint16_t)((cna_desc.datain_width * cna_desc.datain_channel) / 64);
   cna_desc.data_entries = (uint16_t)(((cna_desc.datain_width * cna_desc.datain_channel) % 64) == 0 ? cna_desc.data_entries : (cna_desc.data_entries + 1));
   cna_desc.data_sign = 0x1;
-  cna_desc.cvt_type = 0x1;
-  cna_desc.cvt_bypass = 0x1;
-  cna_desc.cvt_scale0 = 0x1;
-  cna_desc.cvt_scale1 = 0x1;
-  cna_desc.cvt_scale2 = 0x1;
-  cna_desc.cvt_scale3 = 0x1;
+  set_input_cvt(params, &cna_desc);
   cna_desc.fc_skip_en = 0;
   cna_desc.data_offset = 0x0;
   cna_desc.pad_left = params->pad_left;
@@ -247,6 +332,9 @@ int gen_conv2d_int8(conv2d_params_t *params) {
   cna_desc.dma_height = cna_desc.datain_height;
   cna_desc.dma_channel = cna_desc.datain_channel;
   cna_desc.decompress_addr0 = params->weights_dma;
+  cna_desc.dcomp_ctrl = 0;
+  cna_desc.dcomp_regnum = 0;
+  memset(cna_desc.dcomp_amount, 0, sizeof(cna_desc.dcomp_amount));
   cna_desc.dataout_height = out_h;
 
   core_desc.proc_precision = precision_int8;
@@ -267,10 +355,10 @@ int gen_conv2d_int8(conv2d_params_t *params) {
   dpu_desc.width = core_desc.dataout_width;
   dpu_desc.height = core_desc.dataout_height;
   dpu_desc.channel = core_desc.dataout_channel;
-  dpu_desc.bs_bypass = 1;
+  dpu_desc.bs_bypass = params->relu ? 0 : 1;
   dpu_desc.bs_alu_bypass = 1;
   dpu_desc.bs_mul_bypass = 1;
-  dpu_desc.bs_relu_bypass = 1;
+  dpu_desc.bs_relu_bypass = params->relu ? 0 : 1;
   dpu_desc.bn_bypass = 1;
   dpu_desc.bn_alu_bypass = 1;
   dpu_desc.bn_mul_bypass = 1;
@@ -291,6 +379,5 @@ int gen_conv2d_int8(conv2d_params_t *params) {
   dpu_desc.channel_wdma = core_desc.dataout_channel;
   dpu_desc.surf_add = dpu_desc.dst_surf_stride * 8;
 
-  gen_matmul_task(params->tasks, &cna_desc, &core_desc, &dpu_desc);
-  return 0;
+  return gen_conv2d_batch(params, &cna_desc, &core_desc, &dpu_desc);
 }
\ No newline at end of file
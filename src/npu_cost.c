@@ -0,0 +1,310 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "npu_hw.h"
+#include "npu_bw.h"
+#include "npu_cost.h"
+
+#define NPU_CBUF_ENTRY_SIZE 64
+#define NPU_COST_CALIBRATE_ROUNDS 4
+
+/*
+ * Registers the model looks at, registers persist between tasks so
+ * this is carried across the task list.
+ */
+typedef struct {
+  uint32_t  conv_con1;
+  uint32_t  data_size0;
+  uint32_t  data_size1;
+  uint32_t  weight_size0;
+  uint32_t  weight_size2;
+  uint32_t  cbuf_con0;
+  uint32_t  cbuf_con1;
+  uint32_t  dma_con0;
+  uint32_t  dcomp_ctrl;
+  uint32_t  dcomp_regnum;
+  uint32_t  dcomp_amount[16];
+  uint32_t  dataout_size0;
+  uint32_t  dataout_size1;
+  uint32_t  dpu_mode;
+  uint32_t  dpu_format;
+} cost_regs_t;
+
+static uint64_t align_up(uint64_t value, uint64_t align) {
+  return ((value + align - 1) / align) * align;
+}
+
+static int elem_size(uint32_t precision) {
+  switch (precision) {
+    case precision_int8: return 1;
+    case precision_float16: return 2;
+    default: return 4;
+  }
+}
+
+// Fraction of the DRAM rate achieved with bursts of burst_len+1 beats
+static double burst_efficiency(const npu_cost_model_t *model, uint32_t burst_len) {
+  double beats = (double)(burst_len & 0xF) + 1;
+  return beats / (beats + model->burst_overhead);
+}
+
+/*
+ * Update regs from one task, returns 0 once the operation enable is seen.
+ */
+static int decode_task(const uint64_t *ops, cost_regs_t *regs) {
+
+  for (int i = 0; i < NPU_TASK_OPS; i++) {
+    uint32_t op = (ops[i] >> 48) & 0xFFFF;
+    uint32_t value = (ops[i] >> 16) & 0xFFFFFFFF;
+    uint32_t reg = ops[i] & 0xFFFF;
+
+    if (op == OP_ENABLE) {
+      return 0;
+    }
+    if ((reg >= CNA_DCOMP_AMOUNT) && (reg <= CNA_DCOMP_AMOUNT15)) {
+      regs->dcomp_amount[(reg - CNA_DCOMP_AMOUNT) / 4] = value;
+      continue;
+    }
+    switch (reg) {
+      case CNA_CONV_CON1: regs->conv_con1 = value; break;
+      case CNA_DATA_SIZE0: regs->data_size0 = value; break;
+      case CNA_DATA_SIZE1: regs->data_size1 = value; break;
+      case CNA_WEIGHT_SIZE0: regs->weight_size0 = value; break;
+      case CNA_WEIGHT_SIZE2: regs->weight_size2 = value; break;
+      case CNA_CBUF_CON0: regs->cbuf_con0 = value; break;
+      case CNA_CBUF_CON1: regs->cbuf_con1 = value; break;
+      case CNA_DMA_CON0: regs->dma_con0 = value; break;
+      case CNA_DCOMP_CTRL: regs->dcomp_ctrl = value; break;
+      case CNA_DCOMP_REGNUM: regs->dcomp_regnum = value; break;
+      case CORE_DATAOUT_SIZE_0: regs->dataout_size0 = value; break;
+      case CORE_DATAOUT_SIZE_1: regs->dataout_size1 = value; break;
+      case DPU_FEATURE_MODE_CFG: regs->dpu_mode = value; break;
+      case DPU_DATA_FORMAT: regs->dpu_format = value; break;
+    }
+  }
+  return -1;
+}
+
+static void cost_task(const npu_cost_model_t *model, const cost_regs_t *regs, npu_cost_t *cost) {
+
+  uint32_t proc = (regs->conv_con1 >> 7) & 0x7;
+  uint32_t in_prec = (regs->conv_con1 >> 4) & 0x7;
+  uint32_t out_prec = (regs->dpu_format >> 29) & 0x7;
+  uint64_t in_w = (regs->data_size0 >> 16) & 0x7FF;
+  uint64_t in_h = regs->data_size0 & 0x7FF;
+  uint64_t in_c = regs->data_size1 & 0xFFFF;
+  uint64_t k_w = (regs->weight_size2 >> 24) & 0x1F;
+  uint64_t k_h = (regs->weight_size2 >> 16) & 0x1F;
+  uint64_t out_w = (regs->dataout_size0 & 0xFFFF) + 1;
+  uint64_t out_h = ((regs->dataout_size0 >> 16) & 0xFFFF) + 1;
+  uint64_t out_c = (regs->dataout_size1 & 0xFFFF) + 1;
+  int in_es = elem_size(in_prec);
+  int out_es = elem_size(out_prec);
+  uint32_t macs_per_cycle = (proc == precision_int8) ? model->macs_per_cycle_int8 : model->macs_per_cycle_fp16;
+  uint64_t atom_k = (proc == precision_int8) ? 32 : 16;
+
+  memset(cost, 0, sizeof(*cost));
+  cost->macs = out_h * out_w * out_c * in_c * k_h * k_w;
+  cost->mac_cycles = (uint64_t)((double)(out_h * out_w * k_h * k_w * align_up(in_c, 32) * align_up(out_c, atom_k)) /
+    macs_per_cycle * model->mac_scale);
+
+  if (!((regs->cbuf_con0 >> 12) & 0x1)) {
+    cost->data_bytes = in_h * in_w * align_up(in_c, 16 / in_es) * in_es;
+  }
+  if (!((regs->cbuf_con0 >> 13) & 0x1)) {
+    if (regs->dcomp_ctrl & 0x1) {
+      for (uint32_t i = 0; i < regs->dcomp_regnum && i < 16; i++) {
+        cost->weight_bytes += regs->dcomp_amount[i];
+      }
+    } else {
+      cost->weight_bytes = regs->weight_size0;
+    }
+  }
+  cost->output_bytes = out_h * out_w * align_up(out_c, 16 / out_es) * out_es;
+
+  double cna_eff_data = burst_efficiency(model, regs->dma_con0);
+  double cna_eff_weight = burst_efficiency(model, regs->dma_con0 >> 16);
+  double dpu_eff = burst_efficiency(model, regs->dpu_mode >> 5);
+  cost->dma_cycles = (uint64_t)((cost->data_bytes / cna_eff_data + cost->weight_bytes / cna_eff_weight +
+    cost->output_bytes / dpu_eff) / model->dram_bytes_per_cycle * model->dma_scale);
+
+  uint64_t busy = cost->mac_cycles > cost->dma_cycles ? cost->mac_cycles : cost->dma_cycles;
+  cost->cycles = model->task_overhead + busy;
+  if (model->task_overhead > busy) {
+    cost->bound = npu_bound_overhead;
+  } else {
+    cost->bound = (cost->mac_cycles >= cost->dma_cycles) ? npu_bound_compute : npu_bound_dma;
+  }
+
+  // Feature data has to be resident in the data banks for the whole task
+  uint32_t data_bank = regs->cbuf_con0 & 0xF;
+  uint32_t weight_bank = (regs->cbuf_con0 >> 4) & 0xF;
+  uint64_t data_entries = regs->cbuf_con1 & 0x1FFF;
+  cost->cbuf_ok = (data_bank + weight_bank <= NPU_CBUF_BANKS) &&
+    (data_entries * in_h <= (uint64_t)data_bank * (NPU_CBUF_BANK_SIZE / NPU_CBUF_ENTRY_SIZE));
+}
+
+/*
+ * Defaults from the RK3588 datasheet peaks, expect npu_cost_calibrate
+ * to correct them from benchmark results.
+ */
+void npu_cost_model_init(npu_cost_model_t *model, uint32_t freq_hz) {
+
+  memset(model, 0, sizeof(*model));
+  model->freq_hz = freq_hz ? freq_hz : 1000000000;
+  model->macs_per_cycle_fp16 = 32 * 16;
+  model->macs_per_cycle_int8 = 32 * 32;
+  model->dram_bytes_per_cycle = NPU_PEAK_DRAM_GBPS * 1e9 / model->freq_hz;
+  model->burst_overhead = 2;
+  model->task_overhead = 2000;
+  model->mac_scale = 1.0;
+  model->dma_scale = 1.0;
+}
+
+/*
+ * Cost ntasks consecutive register blocks, costs (optional) receives the
+ * per task breakdown and total the sum with the overall bound.
+ */
+int npu_cost_tasks(const npu_cost_model_t *model, const uint64_t *tasks, int ntasks, npu_cost_t *costs, npu_cost_t *total) {
+
+  cost_regs_t regs;
+  npu_cost_t cost;
+
+  if ((model == NULL) || (tasks == NULL) || (ntasks <= 0) || (total == NULL)) {
+    return -1;
+  }
+  memset(&regs, 0, sizeof(regs));
+  memset(total, 0, sizeof(*total));
+  total->cbuf_ok = 1;
+  for (int i = 0; i < ntasks; i++) {
+    if (decode_task(tasks + i * NPU_TASK_OPS, &regs) != 0) {
+      return -2;
+    }
+    cost_task(model, &regs, &cost);
+    if (costs != NULL) {
+      costs[i] = cost;
+    }
+    total->macs += cost.macs;
+    total->mac_cycles += cost.mac_cycles;
+    total->data_bytes += cost.data_bytes;
+    total->weight_bytes += cost.weight_bytes;
+    total->output_bytes += cost.output_bytes;
+    total->dma_cycles += cost.dma_cycles;
+    total->cycles += cost.cycles;
+    total->cbuf_ok &= cost.cbuf_ok;
+  }
+  if ((uint64_t)model->task_overhead * ntasks > total->cycles / 2) {
+    total->bound = npu_bound_overhead;
+  } else {
+    total->bound = (total->mac_cycles >= total->dma_cycles) ? npu_bound_compute : npu_bound_dma;
+  }
+  return 0;
+}
+
+double npu_cost_us(const npu_cost_model_t *model, const npu_cost_t *cost) {
+  return (double)cost->cycles * 1e6 / model->freq_hz;
+}
+
+const char *npu_cost_bound_name(uint8_t bound) {
+  switch (bound) {
+    case npu_bound_compute: return "compute";
+    case npu_bound_dma: return "dma";
+    default: return "overhead";
+  }
+}
+
+/*
+ * Fit mac_scale and dma_scale to measured submit times. Each sample is
+ * attributed to the resource bounding it under the current fit and the
+ * scale set to the mean ratio of measured to raw predicted cycles, a few
+ * rounds are enough for the classification to settle.
+ */
+int npu_cost_calibrate(npu_cost_model_t *model, const npu_cost_sample_t *samples, int n) {
+
+  npu_cost_model_t raw = *model;
+  npu_cost_t cost;
+  int used = 0;
+
+  raw.mac_scale = 1.0;
+  raw.dma_scale = 1.0;
+
+  for (int round = 0; round < NPU_COST_CALIBRATE_ROUNDS; round++) {
+    double mac_sum = 0, dma_sum = 0;
+    int mac_n = 0, dma_n = 0;
+
+    used = 0;
+    for (int i = 0; i < n; i++) {
+      if (npu_cost_tasks(&raw, samples[i].tasks, samples[i].ntasks, NULL, &cost) != 0) {
+        continue;
+      }
+      double cycles = samples[i].measured_us * model->freq_hz / 1e6 -
+        (double)model->task_overhead * samples[i].ntasks;
+      if (cycles <= 0) {
+        continue;
+      }
+      used++;
+      if (cost.mac_cycles * model->mac_scale >= cost.dma_cycles * model->dma_scale) {
+        if (cost.mac_cycles > 0) {
+          mac_sum += cycles / cost.mac_cycles;
+          mac_n++;
+        }
+      } else if (cost.dma_cycles > 0) {
+        dma_sum += cycles / cost.dma_cycles;
+        dma_n++;
+      }
+    }
+    if (mac_n > 0) {
+      model->mac_scale = mac_sum / mac_n;
+    }
+    if (dma_n > 0) {
+      model->dma_scale = dma_sum / dma_n;
+    }
+  }
+  return used > 0 ? used : -1;
+}
+
+/*
+ * Pick the cheapest of several candidate task lists for the same
+ * operation, plans whose feature data overflows the CBUF are skipped.
+ * Returns the plan index or -1 if none is usable.
+ */
+int npu_cost_pick(const npu_cost_model_t *model, const uint64_t *const *plans, const int *ntasks, int nplans, npu_cost_t *best) {
+
+  npu_cost_t cost, pick_cost;
+  int pick = -1;
+
+  for (int i = 0; i < nplans; i++) {
+    if ((npu_cost_tasks(model, plans[i], ntasks[i], NULL, &cost) != 0) || !cost.cbuf_ok) {
+      continue;
+    }
+    if ((pick < 0) || (cost.cycles < pick_cost.cycles)) {
+      pick = i;
+      pick_cost = cost;
+    }
+  }
+  if ((pick >= 0) && (best != NULL)) {
+    *best = pick_cost;
+  }
+  return pick;
+}
@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "npu_dcomp.h"
+
+static uint32_t segment_elems(uint32_t elems, uint8_t segments) {
+  uint32_t per = (elems + segments - 1) / segments;
+  return ((per + NPU_DCOMP_BLOCK - 1) / NPU_DCOMP_BLOCK) * NPU_DCOMP_BLOCK;
+}
+
+static int is_zero(const uint8_t *p, uint8_t elem_size) {
+  for (int i = 0; i < elem_size; i++) {
+    if (p[i] != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Worst case compressed size ie no zeros in the weights
+ */
+uint32_t weight_compress_bound(uint32_t raw_bytes, uint8_t elem_size, uint8_t segments) {
+  uint32_t elems, blocks;
+
+  if ((elem_size == 0) || (segments == 0) || (segments > NPU_DCOMP_SEGMENTS)) {
+    return 0;
+  }
+  elems = raw_bytes / elem_size;
+  blocks = (elems + NPU_DCOMP_BLOCK - 1) / NPU_DCOMP_BLOCK + segments;
+  return blocks * sizeof(uint32_t) + raw_bytes + segments * NPU_DCOMP_ALIGN;
+}
+
+/*
+ * Compress packed weights (ie after weight_fp16/weight_int8 reordering)
+ * into dst, filling in the per segment amounts needed for CNA_DCOMP_AMOUNTn.
+ * Returns compressed size or -1 for invalid args, -2 if dst is too small.
+ */
+int weight_compress(const void *packed, uint32_t raw_bytes, uint8_t elem_size, uint8_t segments,
+  void *dst, uint32_t dst_size, npu_dcomp_info_t *info) {
+
+  const uint8_t *src = packed;
+  uint8_t *out = dst;
+  uint32_t elems, per_seg, pos = 0;
+
+  if ((elem_size != 1 && elem_size != 2) || (segments == 0) || (segments > NPU_DCOMP_SEGMENTS) ||
+      ((raw_bytes % elem_size) != 0)) {
+    return -1;
+  }
+
+  memset(info, 0, sizeof(*info));
+  info->elem_size = elem_size;
+  info->segments = segments;
+  info->raw_bytes = raw_bytes;
+
+  elems = raw_bytes / elem_size;
+  per_seg = segment_elems(elems, segments);
+
+  for (uint32_t s = 0; s < segments; s++) {
+    uint32_t start = s * per_seg;
+    uint32_t end = (start + per_seg) < elems ? start + per_seg : elems;
+
+    info->offset[s] = pos;
+    for (uint32_t b = start; b < end; b += NPU_DCOMP_BLOCK) {
+      uint32_t mask = 0;
+      uint32_t mask_pos = pos;
+      uint32_t n = (end - b) < NPU_DCOMP_BLOCK ? end - b : NPU_DCOMP_BLOCK;
+
+      if (pos + sizeof(uint32_t) + n * elem_size > dst_size) {
+        return -2;
+      }
+      pos += sizeof(uint32_t);
+      for (uint32_t i = 0; i < n; i++) {
+        const uint8_t *e = src + (size_t)(b + i) * elem_size;
+        if (!is_zero(e, elem_size)) {
+          mask |= (1u << i);
+          memcpy(out + pos, e, elem_size);
+          pos += elem_size;
+        }
+      }
+      memcpy(out + mask_pos, &mask, sizeof(mask));
+    }
+    while ((pos % NPU_DCOMP_ALIGN) != 0) {
+      if (pos >= dst_size) {
+        return -2;
+      }
+      out[pos++] = 0;
+    }
+    info->amount[s] = pos - info->offset[s];
+  }
+  info->total_bytes = pos;
+  return (int)pos;
+}
+
+/*
+ * CPU reference of the decompressor, dst must hold info->raw_bytes.
+ * Returns 0 or -1 if the stream is inconsistent with info.
+ */
+int weight_decompress(const void *src, const npu_dcomp_info_t *info, void *dst) {
+
+  const uint8_t *in = src;
+  uint8_t *out = dst;
+  uint8_t elem_size = info->elem_size;
+  uint32_t elems, per_seg;
+
+  if ((elem_size != 1 && elem_size != 2) || (info->segments == 0) ||
+      (info->segments > NPU_DCOMP_SEGMENTS)) {
+    return -1;
+  }
+
+  elems = info->raw_bytes / elem_size;
+  per_seg = segment_elems(elems, info->segments);
+  memset(dst, 0, info->raw_bytes);
+
+  for (uint32_t s = 0; s < info->segments; s++) {
+    uint32_t start = s * per_seg;
+    uint32_t end = (start + per_seg) < elems ? start + per_seg : elems;
+    uint32_t pos = info->offset[s];
+    uint32_t limit = info->offset[s] + info->amount[s];
+
+    for (uint32_t b = start; b < end; b += NPU_DCOMP_BLOCK) {
+      uint32_t mask;
+      uint32_t n = (end - b) < NPU_DCOMP_BLOCK ? end - b : NPU_DCOMP_BLOCK;
+
+      if (pos + sizeof(uint32_t) > limit) {
+        return -1;
+      }
+      memcpy(&mask, in + pos, sizeof(mask));
+      pos += sizeof(uint32_t);
+      for (uint32_t i = 0; i < n; i++) {
+        if (mask & (1u << i)) {
+          if (pos + elem_size > limit) {
+            return -1;
+          }
+          memcpy(out + (size_t)(b + i) * elem_size, in + pos, elem_size);
+          pos += elem_size;
+        }
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "rknpu-ioctl.h"
+#include "npu_interface.h"
+#include "npu_dvfs.h"
+
+// RK3588 NPU OPP table, used when the caller doesn't supply one
+static const uint32_t rk3588_npu_freqs[] = {
+  300000000, 400000000, 500000000, 600000000,
+  700000000, 800000000, 900000000, 1000000000
+};
+
+int npu_get_freq(int fd, uint32_t *hz) {
+  return npu_action(fd, RKNPU_GET_FREQ, hz);
+}
+
+int npu_set_freq(int fd, uint32_t hz) {
+  return npu_action(fd, RKNPU_SET_FREQ, &hz);
+}
+
+int npu_get_volt(int fd, uint32_t *uv) {
+  return npu_action(fd, RKNPU_GET_VOLT, uv);
+}
+
+int npu_set_volt(int fd, uint32_t uv) {
+  return npu_action(fd, RKNPU_SET_VOLT, &uv);
+}
+
+/*
+ * The governor starts at the highest step. Submits are reported through
+ * npu_dvfs_update, which should also be called periodically while idle so
+ * the clock can drop. Voltage is left to the driver's OPP handling.
+ */
+int npu_dvfs_init(npu_dvfs_t *dvfs, int fd, const uint32_t *freqs, uint8_t levels, npu_action_fn action) {
+
+  memset(dvfs, 0, sizeof(*dvfs));
+  if (freqs == NULL) {
+    freqs = rk3588_npu_freqs;
+    levels = sizeof(rk3588_npu_freqs) / sizeof(rk3588_npu_freqs[0]);
+  }
+  if ((levels == 0) || (levels > NPU_DVFS_MAX_LEVELS)) {
+    return -1;
+  }
+
+  dvfs->fd = fd;
+  dvfs->action = (action != NULL) ? action : npu_action;
+  memcpy(dvfs->freqs, freqs, levels * sizeof(uint32_t));
+  dvfs->levels = levels;
+  dvfs->target_us = 0;
+  dvfs->window_us = 50000;
+  dvfs->idle_us = 200000;
+  dvfs->up_pct = 80;
+  dvfs->down_pct = 30;
+  dvfs->level = levels - 1;
+  return npu_dvfs_set_level(dvfs, levels - 1);
+}
+
+int npu_dvfs_set_level(npu_dvfs_t *dvfs, uint8_t level) {
+
+  uint32_t hz;
+  int ret;
+
+  if (level >= dvfs->levels) {
+    level = dvfs->levels - 1;
+  }
+  hz = dvfs->freqs[level];
+  ret = dvfs->action(dvfs->fd, RKNPU_SET_FREQ, &hz);
+  if (ret < 0) {
+    printf("RKNPU_SET_FREQ %u failed %d\n", dvfs->freqs[level], ret);
+    return ret;
+  }
+  dvfs->level = level;
+  return level;
+}
+
+/*
+ * Jump straight to the highest step, eg when a burst of requests arrives.
+ * The boost counts as a submit at now_us so the next tick doesn't see the
+ * NPU as idle and drop straight back.
+ */
+int npu_dvfs_boost(npu_dvfs_t *dvfs, uint64_t now_us) {
+  dvfs->window_start_us = 0;
+  dvfs->busy_us = 0;
+  dvfs->last_submit_us = now_us;
+  return npu_dvfs_set_level(dvfs, dvfs->levels - 1);
+}
+
+/*
+ * Report a submit that kept the NPU busy for busy_us and completed in
+ * latency_us, or pass zeros as a periodic tick. Returns the new level.
+ *
+ * A missed latency target steps up immediately (to the top if we're
+ * more than 2x over). Otherwise the clock follows utilisation over the
+ * sample window, only stepping down when the latency predicted at the
+ * lower frequency still meets the target.
+ */
+int npu_dvfs_update(npu_dvfs_t *dvfs, uint64_t now_us, uint32_t busy_us, uint32_t latency_us) {
+
+  uint8_t level = dvfs->level;
+  uint64_t elapsed;
+
+  if ((busy_us > 0) || (latency_us > 0)) {
+    dvfs->last_submit_us = now_us;
+    dvfs->last_latency_us = latency_us;
+    dvfs->busy_us += busy_us;
+  }
+  if (dvfs->window_start_us == 0) {
+    dvfs->window_start_us = now_us;
+  }
+  elapsed = now_us - dvfs->window_start_us;
+
+  if ((dvfs->idle_us > 0) && (now_us - dvfs->last_submit_us >= dvfs->idle_us)) {
+    level = 0;
+  } else if ((dvfs->target_us > 0) && (latency_us > dvfs->target_us)) {
+    level = (latency_us > 2 * dvfs->target_us) ? dvfs->levels - 1 : level + 1;
+  } else if (elapsed >= dvfs->window_us) {
+    uint32_t util = (uint32_t)((dvfs->busy_us * 100) / (elapsed > 0 ? elapsed : 1));
+    if (util > dvfs->up_pct) {
+      level = level + 1;
+    } else if ((util < dvfs->down_pct) && (level > 0)) {
+      uint64_t predicted = (uint64_t)dvfs->last_latency_us * dvfs->freqs[level] / dvfs->freqs[level - 1];
+      if ((dvfs->target_us == 0) || (predicted <= dvfs->target_us)) {
+        level = level - 1;
+      }
+    }
+    dvfs->window_start_us = now_us;
+    dvfs->busy_us = 0;
+  }
+
+  if (level >= dvfs->levels) {
+    level = dvfs->levels - 1;
+  }
+  if (level != dvfs->level) {
+    return npu_dvfs_set_level(dvfs, level);
+  }
+  return level;
+}
@@ -0,0 +1,851 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+
+#include "rknpu-ioctl.h"
+#include "npu_hw.h"
+#include "npu_matmul.h"
+#include "npu_dcomp.h"
+#include "npu_emu.h"
+
+#define EMU_MAX_FDS     16
+#define EMU_PAGE_SIZE   4096
+#define EMU_DMA_BASE    0x10000000u
+#define EMU_DMA_END     0xFFFFF000u
+#define EMU_OBJ_BASE    0xE000000000000000ull
+#define EMU_FREQ        1000000000u
+#define EMU_VOLT        800000u
+#define EMU_SRAM_SIZE   (1024 * 1024)
+
+#define EMU_CORES       3
+
+#define REG(addr) (emu.core->regs[(addr) >> 2])
+
+/*
+ * State of one core, registers and what its CBUF and LUT RAM hold are
+ * per core on the hardware so a task only sees what its own core ran.
+ */
+typedef struct {
+  uint32_t  cbuf_weight_addr;   // weights currently held in the CBUF, 0 for none
+  uint32_t  cbuf_weight_bytes;
+  uint32_t  cbuf_data_addr;     // feature data currently held in the CBUF, 0 for none
+  uint32_t  cbuf_banks;         // CNA_CBUF_CON0 bank split they were loaded with
+  uint16_t  lut_lo[NPU_LUT_ENTRIES];  // LO LUT RAM, kept across tasks
+  uint32_t  lut_addr;
+  uint32_t  regs[0x10000 / 4];
+} emu_core_t;
+
+/*
+ * Each buffer is backed by a memfd so the emulator keeps its own mapping
+ * while the caller maps and unmaps it as it would with the driver.
+ */
+typedef struct {
+  uint32_t  handle;       // 0 when the slot is free
+  int       memfd;
+  uint8_t   *host;
+  uint64_t  size;
+  uint32_t  dma;
+  uint64_t  sram_size;    // part of the size taken from the SRAM
+} emu_buf_t;
+
+static struct {
+  pthread_mutex_t lock;
+  int       fds[EMU_MAX_FDS];
+  int       nfds;
+  emu_buf_t *bufs;
+  uint32_t  nbufs;
+  uint32_t  next_dma;
+  uint32_t  freq;
+  uint32_t  volt;
+  uint32_t  dt_wr_amount;
+  uint32_t  dt_rd_amount;
+  uint32_t  wt_rd_amount;
+  uint32_t  sram_free;
+  emu_core_t cores[EMU_CORES];
+  emu_core_t *core;             // core running the current task
+} emu = {
+  // Recursive as our own mmap/close calls come back through an LD_PRELOAD shim
+  .lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP,
+  .next_dma = EMU_DMA_BASE,
+  .freq = EMU_FREQ,
+  .volt = EMU_VOLT,
+  .sram_free = EMU_SRAM_SIZE,
+  .core = &emu.cores[0],
+};
+
+static emu_buf_t *emu_buf_handle(uint32_t handle) {
+  if ((handle == 0) || (handle > emu.nbufs) || (emu.bufs[handle-1].handle == 0)) {
+    return NULL;
+  }
+  return &emu.bufs[handle-1];
+}
+
+static emu_buf_t *emu_buf_obj(uint64_t obj_addr) {
+  if ((obj_addr & EMU_OBJ_BASE) != EMU_OBJ_BASE) {
+    return NULL;
+  }
+  return emu_buf_handle((uint32_t)(obj_addr & 0xFFFFFFFF));
+}
+
+static void *emu_dma_ptr(uint32_t dma, uint64_t bytes) {
+  for (uint32_t i = 0; i < emu.nbufs; i++) {
+    emu_buf_t *buf = &emu.bufs[i];
+    if ((buf->handle != 0) && (dma >= buf->dma) && ((uint64_t)(dma - buf->dma) + bytes <= buf->size)) {
+      return buf->host + (dma - buf->dma);
+    }
+  }
+  printf("emu: dma 0x%x (%llu bytes) outside any buffer\n", dma, (unsigned long long)bytes);
+  return NULL;
+}
+
+static int emu_mem_create(struct rknpu_mem_create *mem) {
+
+  uint64_t size = (mem->size + EMU_PAGE_SIZE - 1) & ~(uint64_t)(EMU_PAGE_SIZE - 1);
+  emu_buf_t *buf = NULL;
+
+  if ((size == 0) || (size > (uint64_t)(EMU_DMA_END - emu.next_dma))) {
+    return -ENOMEM;
+  }
+  for (uint32_t i = 0; i < emu.nbufs; i++) {
+    if (emu.bufs[i].handle == 0) {
+      buf = &emu.bufs[i];
+      buf->handle = i + 1;
+      break;
+    }
+  }
+  if (buf == NULL) {
+    emu_buf_t *bufs = realloc(emu.bufs, (emu.nbufs + 1) * sizeof(emu_buf_t));
+    if (bufs == NULL) {
+      return -ENOMEM;
+    }
+    emu.bufs = bufs;
+    buf = &emu.bufs[emu.nbufs++];
+    buf->handle = emu.nbufs;
+  }
+
+  buf->memfd = memfd_create("rknpu-emu", MFD_CLOEXEC);
+  if ((buf->memfd < 0) || (ftruncate(buf->memfd, size) != 0)) {
+    goto fail;
+  }
+  buf->host = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, buf->memfd, 0);
+  if (buf->host == MAP_FAILED) {
+    goto fail;
+  }
+  buf->size = size;
+  // As the driver, the first sram_size bytes from the SRAM when asked for
+  // and there's room, else all DRAM with the flag cleared
+  uint64_t sram_size = (mem->sram_size + EMU_PAGE_SIZE - 1) & ~(uint64_t)(EMU_PAGE_SIZE - 1);
+  sram_size = sram_size < size ? sram_size : size;
+  buf->sram_size = 0;
+  if ((mem->flags & RKNPU_MEM_TRY_ALLOC_SRAM) && (sram_size > 0) && (sram_size <= emu.sram_free)) {
+    buf->sram_size = sram_size;
+    emu.sram_free -= sram_size;
+  } else {
+    mem->flags &= ~RKNPU_MEM_TRY_ALLOC_SRAM;
+  }
+  mem->sram_size = buf->sram_size;
+  // Leave a guard page between buffers so overruns show up as bad dma
+  buf->dma = emu.next_dma;
+  emu.next_dma += size + EMU_PAGE_SIZE;
+
+  mem->handle = buf->handle;
+  mem->obj_addr = EMU_OBJ_BASE | buf->handle;
+  mem->dma_addr = buf->dma;
+  return 0;
+
+fail:
+  if (buf->memfd >= 0) {
+    close(buf->memfd);
+  }
+  buf->handle = 0;
+  return -ENOMEM;
+}
+
+static int emu_mem_destroy(struct rknpu_mem_destroy *destroy) {
+
+  emu_buf_t *buf = emu_buf_handle(destroy->handle);
+
+  if (buf == NULL) {
+    return -EINVAL;
+  }
+  for (int c = 0; c < EMU_CORES; c++) {
+    if (emu.cores[c].cbuf_weight_addr - buf->dma < buf->size) {
+      emu.cores[c].cbuf_weight_addr = 0;
+    }
+    if (emu.cores[c].cbuf_data_addr - buf->dma < buf->size) {
+      emu.cores[c].cbuf_data_addr = 0;
+    }
+  }
+  munmap(buf->host, buf->size);
+  close(buf->memfd);
+  emu.sram_free += buf->sram_size;
+  buf->handle = 0;
+  return 0;
+}
+
+static int emu_action(struct rknpu_action *act) {
+
+  switch (act->flags) {
+    case RKNPU_GET_HW_VERSION:
+      act->value = 0;
+      break;
+    case RKNPU_GET_DRV_VERSION:
+      act->value = RKNPU_GET_DRV_VERSION_CODE(0, 9, 8);
+      break;
+    case RKNPU_GET_FREQ:
+      act->value = emu.freq;
+      break;
+    case RKNPU_SET_FREQ:
+      emu.freq = act->value;
+      break;
+    case RKNPU_GET_VOLT:
+      act->value = emu.volt;
+      break;
+    case RKNPU_SET_VOLT:
+      emu.volt = act->value;
+      break;
+    case RKNPU_ACT_RESET:
+      memset(emu.cores, 0, sizeof(emu.cores));
+      break;
+    case RKNPU_ACT_CLR_TOTAL_RW_AMOUNT:
+      emu.dt_wr_amount = 0;
+      emu.dt_rd_amount = 0;
+      emu.wt_rd_amount = 0;
+      break;
+    case RKNPU_GET_DT_WR_AMOUNT:
+      act->value = emu.dt_wr_amount;
+      break;
+    case RKNPU_GET_DT_RD_AMOUNT:
+      act->value = emu.dt_rd_amount;
+      break;
+    case RKNPU_GET_WT_RD_AMOUNT:
+      act->value = emu.wt_rd_amount;
+      break;
+    case RKNPU_GET_TOTAL_RW_AMOUNT:
+      act->value = emu.dt_wr_amount + emu.dt_rd_amount + emu.wt_rd_amount;
+      break;
+    case RKNPU_GET_IOMMU_EN:
+      act->value = 1;
+      break;
+    case RKNPU_GET_TOTAL_SRAM_SIZE:
+      act->value = EMU_SRAM_SIZE;
+      break;
+    case RKNPU_GET_FREE_SRAM_SIZE:
+      act->value = emu.sram_free;
+      break;
+    case RKNPU_SET_PROC_NICE:
+    case RKNPU_POWER_ON:
+    case RKNPU_POWER_OFF:
+      break;
+    default:
+      return -EINVAL;
+  }
+  return 0;
+}
+
+static float emu_fp16(uint16_t bits) {
+  _Float16 h;
+  memcpy(&h, &bits, sizeof(h));
+  return (float)h;
+}
+
+static int emu_elem_size(uint32_t precision) {
+  switch (precision) {
+    case precision_int8: return 1;
+    case precision_float16: return 2;
+    case precision_int32:
+    case precision_float32: return 4;
+  }
+  return 0;
+}
+
+/*
+ * Read one input element, applying the CNA input converter when it isn't
+ * bypassed. c is 0 based.
+ */
+static float emu_load_input(const uint8_t *src, uint32_t precision, uint32_t proc_precision, int c) {
+
+  uint32_t cvt = REG(CNA_CVT_CON0);
+  float x;
+
+  if (precision == precision_float16) {
+    uint16_t bits;
+    memcpy(&bits, src, sizeof(bits));
+    return emu_fp16(bits);
+  }
+  x = (cvt & 0x8) ? (float)*(const int8_t *)src : (float)*src;
+  if ((cvt & 0x1) || (c >= 4) || !(REG(CNA_CVT_CON5) & (1 << c))) {
+    return x;
+  }
+
+  uint32_t con = emu.core->regs[(CNA_CVT_CON1 >> 2) + c];
+  uint16_t offset = con & 0xFFFF;
+  uint16_t scale = con >> 16;
+  if (proc_precision == precision_float16) {
+    return (float)(_Float16)((x - emu_fp16(offset)) * emu_fp16(scale));
+  }
+  int truncate = (cvt >> (4 + 6 * c)) & 0x3F;
+  int32_t v = (((int32_t)x - (int16_t)offset) * (int16_t)scale) >> truncate;
+  return v < -128 ? -128 : (v > 127 ? 127 : v);
+}
+
+// LO table lookup as configured by gen_matmul_fp16, the LE table unused
+static float emu_lut(float v) {
+
+  int8_t select = (REG(DPU_LUT_INFO) >> 16) & 0xFF;
+  uint32_t scale = REG(DPU_LUT_LO_SLOPE_SCALE);
+  uint32_t start_bits = REG(DPU_LUT_LO_START), end_bits = REG(DPU_LUT_LO_END);
+  float start, end;
+
+  memcpy(&start, &start_bits, sizeof(start));
+  memcpy(&end, &end_bits, sizeof(end));
+  if (v < start) {
+    return emu_fp16(emu.core->lut_lo[0]) + (v - start) * emu_fp16(scale & 0xFFFF);
+  }
+  if (v >= end) {
+    return emu_fp16(emu.core->lut_lo[NPU_LUT_ENTRIES - 1]) + (v - end) * emu_fp16(scale >> 16);
+  }
+  float f = ldexpf(v - start, -select);
+  int i = (int)f;
+  i = i > NPU_LUT_ENTRIES - 2 ? NPU_LUT_ENTRIES - 2 : i;
+  float lo = emu_fp16(emu.core->lut_lo[i]), hi = emu_fp16(emu.core->lut_lo[i+1]);
+  return lo + (hi - lo) * (f - i);
+}
+
+// Either of the BS/BN stages enabled with its relu clamps at 0
+static int emu_dpu_relu(void) {
+
+  uint32_t bs = REG(DPU_BS_CFG);
+  uint32_t bn = REG(DPU_BN_CFG);
+
+  return (!(bs & 0x1) && !(bs & 0x40)) || (!(bn & 0x1) && !(bn & 0x40));
+}
+
+/*
+ * DPU post processing, the BS/BN relu stages then the EW stage with its
+ * operand (read from memory by the caller) added or multiplied and the
+ * LUT. The rest is left bypassed by the generators.
+ */
+static float emu_dpu(float v, float operand) {
+
+  uint32_t ew = REG(DPU_EW_CFG);
+
+  if (emu_dpu_relu() && (v < 0)) {
+    v = 0;
+  }
+  if (!(ew & 0x1)) {
+    if (!(ew & 0x2)) {
+      v = (ew & 0x4) ? v * operand : v + operand;
+    }
+    if (!(ew & 0x80)) {
+      v = emu_lut(v);
+    }
+  }
+  return v;
+}
+
+static void emu_store_output(uint8_t *dst, uint32_t precision, float v, int32_t acc) {
+
+  switch (precision) {
+    case precision_float32:
+      memcpy(dst, &v, sizeof(v));
+      break;
+    case precision_float16: {
+      _Float16 h = (_Float16)v;
+      memcpy(dst, &h, sizeof(h));
+      break;
+    }
+    case precision_int32:
+      memcpy(dst, &acc, sizeof(acc));
+      break;
+    case precision_int8:
+      *(int8_t *)dst = acc < -128 ? -128 : (acc > 127 ? 127 : acc);
+      break;
+  }
+}
+
+/*
+ * Execute the operation described by the current register file. Feature
+ * data and weights are expected in the layouts of feature_data() and
+ * weight_fp16() / weight_int8().
+ */
+static int emu_execute(void) {
+
+  uint32_t con1 = REG(CNA_CONV_CON1);
+  uint32_t proc = (con1 >> 7) & 0x7;
+  uint32_t in_prec = (con1 >> 4) & 0x7;
+  int stride_x = REG(CNA_CONV_CON3) & 0x7;
+  int stride_y = (REG(CNA_CONV_CON3) >> 3) & 0x7;
+  int in_w = (REG(CNA_DATA_SIZE0) >> 16) & 0x7FF;
+  int in_h = REG(CNA_DATA_SIZE0) & 0x7FF;
+  int in_c = REG(CNA_DATA_SIZE1) & 0xFFFF;
+  int k_w = (REG(CNA_WEIGHT_SIZE2) >> 24) & 0x1F;
+  int k_h = (REG(CNA_WEIGHT_SIZE2) >> 16) & 0x1F;
+  int kernels = REG(CNA_WEIGHT_SIZE2) & 0x3FFF;
+  uint32_t weight_bytes = REG(CNA_WEIGHT_SIZE0);
+  int pad_left = (REG(CNA_PAD_CON0) >> 4) & 0xF;
+  int pad_top = REG(CNA_PAD_CON0) & 0xF;
+  int out_w = (REG(CORE_DATAOUT_SIZE_0) & 0xFFFF) + 1;
+  int out_h = ((REG(CORE_DATAOUT_SIZE_0) >> 16) & 0xFFFF) + 1;
+  int out_c = (REG(CORE_DATAOUT_SIZE_1) & 0xFFFF) + 1;
+  uint32_t out_prec = (REG(DPU_DATA_FORMAT) >> 29) & 0x7;
+  uint32_t dst_surf_stride = REG(DPU_DST_SURF_STRIDE) >> 4;
+  uint32_t weight_addr = REG(CNA_DCOMP_ADDR0);
+  // Input strides in 16 byte atoms, a line of line_stride / 4 and a
+  // surface of line_stride + surf_stride (28 bit signed, -3 for M = 1)
+  int32_t line_stride = REG(CNA_DMA_CON1) & 0xFFFFFFF;
+  int32_t surf_stride = (int32_t)(REG(CNA_DMA_CON2) << 4) >> 4;
+  int64_t in_line = line_stride / 4;
+  int64_t in_surf = (int64_t)line_stride + surf_stride;
+  int in_es, w_es, out_es, in_c2, out_c2;
+  uint32_t wt_rd;
+  int ret = 0;
+
+  if ((stride_x == 0) || (stride_y == 0) || (k_w != 1) || (k_h != 1) || (kernels < out_c)) {
+    printf("emu: unsupported conv %dx%d kernel, stride %dx%d, %d kernels for %d channels\n",
+      k_w, k_h, stride_x, stride_y, kernels, out_c);
+    return -1;
+  }
+  if (((proc != precision_float16) && (proc != precision_int8)) || (emu_elem_size(out_prec) == 0)) {
+    printf("emu: unsupported precision proc %d out %d\n", proc, out_prec);
+    return -1;
+  }
+
+  in_es = emu_elem_size(in_prec);
+  w_es = emu_elem_size(proc);
+  out_es = emu_elem_size(out_prec);
+  in_c2 = 16 / in_es;
+  out_c2 = 16 / out_es;
+
+  uint32_t in_planes = (in_c + in_c2 - 1) / in_c2;
+  uint32_t out_planes = (out_c + out_c2 - 1) / out_c2;
+  if ((in_line < in_w) || ((in_planes > 1) && (in_surf < in_line * in_h))) {
+    printf("emu: input line stride %d, surface stride %d overlap a %dx%d surface\n", line_stride, surf_stride,
+      in_w, in_h);
+    return -1;
+  }
+  const uint8_t *in = emu_dma_ptr(REG(CNA_FEATURE_DATA_ADDR),
+    ((uint64_t)(in_planes - 1) * in_surf + (uint64_t)(in_h - 1) * in_line + in_w) * 16);
+  uint8_t *out = emu_dma_ptr(REG(DPU_DST_BASE_ADD),
+    (uint64_t)(out_planes - 1) * dst_surf_stride * 16 + (uint64_t)out_h * out_w * 16);
+  if ((in == NULL) || (out == NULL)) {
+    return -1;
+  }
+
+  // fp16 EW operand in the output's feature layout
+  const uint8_t *ew_in = NULL;
+  uint32_t ew_cfg = REG(DPU_EW_CFG);
+  uint32_t ew_surf_stride = REG(RDMA_EW_SURF_STRIDE) >> 4;
+  if (!(ew_cfg & 0x1) && !(ew_cfg & 0x2) && (ew_cfg & 0x40)) {
+    uint32_t ew_planes = (out_c + 7) / 8;
+    ew_in = emu_dma_ptr(REG(RDMA_EW_BASE_ADDR), (uint64_t)(ew_planes - 1) * ew_surf_stride * 16 +
+      (uint64_t)out_h * out_w * 16);
+    if (ew_in == NULL) {
+      return -1;
+    }
+    emu.dt_rd_amount += (uint32_t)out_h * out_w * out_c * sizeof(uint16_t);
+  }
+
+  // Weights, streamed through the decompressor when enabled
+  const uint8_t *weights;
+  uint8_t *dcomp_weights = NULL;
+  if (REG(CNA_DCOMP_CTRL) & 0x1) {
+    npu_dcomp_info_t info;
+    memset(&info, 0, sizeof(info));
+    info.elem_size = w_es;
+    info.segments = REG(CNA_DCOMP_REGNUM);
+    info.raw_bytes = weight_bytes;
+    for (int i = 0; i < info.segments && i < NPU_DCOMP_SEGMENTS; i++) {
+      info.offset[i] = info.total_bytes;
+      info.amount[i] = emu.core->regs[(CNA_DCOMP_AMOUNT >> 2) + i];
+      info.total_bytes += info.amount[i];
+    }
+    const uint8_t *src = emu_dma_ptr(weight_addr, info.total_bytes);
+    dcomp_weights = malloc(weight_bytes);
+    if ((src == NULL) || (dcomp_weights == NULL) || (weight_decompress(src, &info, dcomp_weights) != 0)) {
+      printf("emu: weight decompress failed\n");
+      free(dcomp_weights);
+      return -1;
+    }
+    weights = dcomp_weights;
+    wt_rd = info.total_bytes;
+  } else {
+    weights = emu_dma_ptr(weight_addr, weight_bytes);
+    if (weights == NULL) {
+      return -1;
+    }
+    wt_rd = weight_bytes;
+  }
+
+  // Weights or feature data reused from the CBUF have to be what this
+  // core's previous task loaded into the same banks, else the hardware
+  // would compute with whatever the banks hold
+  uint32_t banks = REG(CNA_CBUF_CON0) & 0xFF;
+  uint32_t weight_reuse = (REG(CNA_CBUF_CON0) >> 13) & 0x1;
+  uint32_t data_reuse = (REG(CNA_CBUF_CON0) >> 12) & 0x1;
+  if ((weight_reuse && ((emu.core->cbuf_weight_addr != weight_addr) || (emu.core->cbuf_weight_bytes != weight_bytes) ||
+    (emu.core->cbuf_banks != banks))) ||
+    (data_reuse && ((emu.core->cbuf_data_addr != REG(CNA_FEATURE_DATA_ADDR)) || (emu.core->cbuf_banks != banks)))) {
+    printf("emu: core %d reuses %s 0x%x not held in its CBUF banks 0x%x\n", (int)(emu.core - emu.cores),
+      weight_reuse ? "weights" : "feature data", weight_reuse ? weight_addr : REG(CNA_FEATURE_DATA_ADDR), banks);
+    free(dcomp_weights);
+    return -1;
+  }
+  if (!weight_reuse) {
+    emu.wt_rd_amount += wt_rd;
+  }
+  emu.core->cbuf_weight_addr = weight_addr;
+  emu.core->cbuf_weight_bytes = weight_bytes;
+
+  float *fin = malloc((size_t)in_h * in_w * in_c * sizeof(float));
+  float *fw = malloc((size_t)out_c * in_c * sizeof(float));
+  if ((fin == NULL) || (fw == NULL)) {
+    ret = -1;
+    goto done;
+  }
+  for (int h = 1; h <= in_h; h++) {
+    for (int w = 1; w <= in_w; w++) {
+      for (int c = 1; c <= in_c; c++) {
+        size_t atom = (size_t)((c-1) / in_c2) * in_surf + (size_t)(h-1) * in_line + (w-1);
+        size_t idx = atom * in_c2 + (c-1) % in_c2;
+        fin[((h-1) * in_w + (w-1)) * in_c + (c-1)] = emu_load_input(in + idx * in_es, in_prec, proc, c-1);
+      }
+    }
+  }
+  for (int k = 1; k <= out_c; k++) {
+    for (int c = 1; c <= in_c; c++) {
+      if (proc == precision_float16) {
+        uint16_t bits;
+        memcpy(&bits, weights + (size_t)weight_fp16(in_c, k, c) * w_es, sizeof(bits));
+        fw[(k-1) * in_c + (c-1)] = emu_fp16(bits);
+      } else {
+        fw[(k-1) * in_c + (c-1)] = (float)((const int8_t *)weights)[weight_int8(in_c, k, c)];
+      }
+    }
+  }
+
+  for (int oh = 0; oh < out_h; oh++) {
+    for (int ow = 0; ow < out_w; ow++) {
+      int ih = oh * stride_y - pad_top;
+      int iw = ow * stride_x - pad_left;
+      int inside = (ih >= 0) && (ih < in_h) && (iw >= 0) && (iw < in_w);
+      const float *x = inside ? &fin[((size_t)ih * in_w + iw) * in_c] : fin;
+      for (int k = 0; k < out_c; k++) {
+        const float *wk = &fw[(size_t)k * in_c];
+        float acc = 0;
+        int32_t iacc = 0;
+        for (int c = 0; inside && c < in_c; c++) {
+          if (proc == precision_float16) {
+            acc += x[c] * wk[c];
+          } else {
+            iacc += (int32_t)x[c] * (int32_t)wk[c];
+          }
+        }
+        if (proc == precision_int8) {
+          acc = (float)iacc;
+        }
+        float operand = 0;
+        if (ew_in != NULL) {
+          size_t ew_pos = (size_t)(k / 8) * ew_surf_stride * 8 + (size_t)8 * (oh * out_w + ow) + (k % 8);
+          uint16_t bits;
+          memcpy(&bits, ew_in + ew_pos * sizeof(bits), sizeof(bits));
+          operand = emu_fp16(bits);
+        }
+        acc = emu_dpu(acc, operand);
+        // int8 has no EW stage, clamp the exact accumulator for int32 out
+        if ((proc == precision_int8) && emu_dpu_relu() && (iacc < 0)) {
+          iacc = 0;
+        }
+        size_t pos = (size_t)(k / out_c2) * dst_surf_stride * out_c2 + (size_t)out_c2 * (oh * out_w + ow) + (k % out_c2);
+        emu_store_output(out + pos * out_es, out_prec, acc, iacc);
+      }
+    }
+  }
+
+  if (!data_reuse) {
+    emu.dt_rd_amount += (uint32_t)in_h * in_w * in_c * in_es;
+  }
+  emu.core->cbuf_data_addr = REG(CNA_FEATURE_DATA_ADDR);
+  emu.core->cbuf_banks = banks;
+  emu.dt_wr_amount += (uint32_t)out_h * out_w * out_c * out_es;
+
+done:
+  free(fin);
+  free(fw);
+  free(dcomp_weights);
+  return ret;
+}
+
+/*
+ * Walk the register commands of one task fetched from regcmd_addr, amount
+ * being the words the PC fetches. Registers keep their value between
+ * tasks as on the hardware, next is set to the PC_BASE_ADDRESS and
+ * PC_REGISTER_AMOUNTS the task chains to, 0 for none.
+ */
+static int emu_run_regcmd(uint32_t regcmd_addr, uint32_t amount, uint32_t *next, uint32_t *next_amount) {
+
+  uint64_t *ops = emu_dma_ptr(regcmd_addr, (uint64_t)amount * sizeof(uint64_t));
+
+  *next = 0;
+  *next_amount = 0;
+  if (ops == NULL) {
+    return -1;
+  }
+  for (uint32_t i = 0; i < amount; i++) {
+    uint32_t op = (ops[i] >> 48) & 0xFFFF;
+    uint32_t value = (ops[i] >> 16) & 0xFFFFFFFF;
+    uint32_t reg = ops[i] & 0xFFFF;
+
+    if ((op == OP_ENABLE) && (reg == PC_OPERATION_ENABLE)) {
+      return emu_execute();
+    }
+    if ((op == OP_REG_PC) && (reg == PC_BASE_ADDRESS)) {
+      *next = value;
+    } else if ((op == OP_REG_PC) && (reg == PC_REGISTER_AMOUNTS)) {
+      *next_amount = value;
+    }
+    if ((op & PC_OP_01) && (op != OP_40)) {
+      REG(reg) = value;
+      // Writes to the LUT RAM, only the LO table is modelled
+      if (reg == DPU_LUT_ACCESS_CFG) {
+        emu.core->lut_addr = value & 0x3FF;
+      } else if ((reg == DPU_LUT_ACCESS_DATA) && ((REG(DPU_LUT_ACCESS_CFG) >> 16) & 0x3) == 0x3) {
+        if (emu.core->lut_addr < NPU_LUT_ENTRIES) {
+          emu.core->lut_lo[emu.core->lut_addr] = value & 0xFFFF;
+        }
+        emu.core->lut_addr++;
+      }
+    }
+  }
+  printf("emu: task at 0x%x has no operation enable in its %u words\n", regcmd_addr, amount);
+  return -1;
+}
+
+/*
+ * Run number tasks on a core as the PC does: the first from its rknpu_task,
+ * the rest by following the chain each task's register commands set up.
+ */
+static int emu_run_core(struct rknpu_task *tasks, uint32_t start, uint32_t number, uint32_t *done) {
+
+  struct rknpu_task *first = &tasks[start];
+  uint32_t addr = (uint32_t)first->regcmd_addr;
+  uint32_t amount = (first->regcfg_amount + RKNPU_PC_DATA_EXTRA_AMOUNT + NPU_PC_DATA_AMOUNT_SCALE - 1) /
+    NPU_PC_DATA_AMOUNT_SCALE * NPU_PC_DATA_AMOUNT_SCALE;
+
+  for (uint32_t i = 0; i < number; i++) {
+    uint32_t next, next_amount;
+    if (emu_run_regcmd(addr, amount, &next, &next_amount) != 0) {
+      return -1;
+    }
+    tasks[start + i].int_status = tasks[start + i].int_mask;
+    (*done)++;
+    if ((i + 1 < number) && (next == 0)) {
+      printf("emu: core %d chain ends after %u of %u tasks\n", (int)(emu.core - emu.cores), i + 1, number);
+      return -1;
+    }
+    addr = next;
+    amount = (next_amount + 1) * NPU_PC_DATA_AMOUNT_SCALE;
+  }
+  return 0;
+}
+
+/*
+ * Submit as the driver does in PC mode, the task ranges come from
+ * subcore_task[core] with one or two cores and subcore_task[core + 2]
+ * with all three. An automatic core mask runs on core 0.
+ */
+static int emu_submit(struct rknpu_submit *submit) {
+
+  emu_buf_t *buf = emu_buf_obj(submit->task_obj_addr);
+  uint32_t core_mask = (submit->core_mask & 0x7) ? (submit->core_mask & 0x7) : 0x1;
+  int first = (core_mask == 0x7) ? 2 : 0;
+  struct rknpu_task *tasks;
+  uint32_t max_tasks, done = 0;
+
+  if (buf == NULL) {
+    return -EINVAL;
+  }
+  tasks = (struct rknpu_task *)buf->host;
+  max_tasks = buf->size / sizeof(struct rknpu_task);
+
+  for (int core = 0; core < EMU_CORES; core++) {
+    if (!(core_mask & (1 << core))) {
+      continue;
+    }
+    uint32_t start = submit->subcore_task[first + core].task_start;
+    uint32_t number = submit->subcore_task[first + core].task_number;
+    if ((start >= max_tasks) || (number > max_tasks - start)) {
+      return -EINVAL;
+    }
+    emu.core = &emu.cores[core];
+    if (emu_run_core(tasks, start, number, &done) != 0) {
+      submit->task_counter = done;
+      return -EIO;
+    }
+  }
+  submit->task_counter = done;
+  return 0;
+}
+
+static size_t emu_copy_string(char *dst, size_t len, const char *src) {
+  size_t n = strlen(src);
+  if ((dst != NULL) && (len > 0)) {
+    size_t copy = n < len - 1 ? n : len - 1;
+    memcpy(dst, src, copy);
+    dst[copy] = 0;
+  }
+  return n;
+}
+
+int npu_emu_open(void) {
+
+  int fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+
+  if (fd < 0) {
+    return fd;
+  }
+  pthread_mutex_lock(&emu.lock);
+  if (emu.nfds == EMU_MAX_FDS) {
+    pthread_mutex_unlock(&emu.lock);
+    close(fd);
+    errno = EMFILE;
+    return -1;
+  }
+  emu.fds[emu.nfds++] = fd;
+  pthread_mutex_unlock(&emu.lock);
+  return fd;
+}
+
+int npu_emu_is_fd(int fd) {
+
+  int found = 0;
+
+  pthread_mutex_lock(&emu.lock);
+  for (int i = 0; i < emu.nfds; i++) {
+    if (emu.fds[i] == fd) {
+      found = 1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&emu.lock);
+  return found;
+}
+
+int npu_emu_close(int fd) {
+
+  pthread_mutex_lock(&emu.lock);
+  for (int i = 0; i < emu.nfds; i++) {
+    if (emu.fds[i] == fd) {
+      emu.fds[i] = emu.fds[--emu.nfds];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&emu.lock);
+  // Forgotten first so an interposed close() passes this through
+  return close(fd);
+}
+
+int npu_emu_ioctl(int fd, unsigned long request, void *arg) {
+
+  int ret;
+
+  if (!npu_emu_is_fd(fd) || (arg == NULL)) {
+    errno = EBADF;
+    return -1;
+  }
+
+  pthread_mutex_lock(&emu.lock);
+  switch (request) {
+    case DRM_IOCTL_VERSION: {
+      struct drm_version *dv = arg;
+      dv->version_major = 0;
+      dv->version_minor = 9;
+      dv->version_patchlevel = 8;
+      dv->name_len = emu_copy_string(dv->name, dv->name_len, "rknpu");
+      dv->date_len = emu_copy_string(dv->date, dv->date_len, "20240424");
+      dv->desc_len = emu_copy_string(dv->desc, dv->desc_len, "RKNPU userspace emulator");
+      ret = 0;
+      break;
+    }
+    case DRM_IOCTL_RKNPU_MEM_CREATE:
+      ret = emu_mem_create(arg);
+      break;
+    case DRM_IOCTL_RKNPU_MEM_MAP: {
+      struct rknpu_mem_map *map = arg;
+      ret = (emu_buf_handle(map->handle) != NULL) ? 0 : -EINVAL;
+      map->offset = (uint64_t)map->handle * EMU_PAGE_SIZE;
+      break;
+    }
+    case DRM_IOCTL_RKNPU_MEM_DESTROY:
+      ret = emu_mem_destroy(arg);
+      break;
+    case DRM_IOCTL_RKNPU_MEM_SYNC:
+      ret = (emu_buf_obj(((struct rknpu_mem_sync *)arg)->obj_addr) != NULL) ? 0 : -EINVAL;
+      break;
+    case DRM_IOCTL_RKNPU_ACTION:
+      ret = emu_action(arg);
+      break;
+    case DRM_IOCTL_RKNPU_SUBMIT:
+      ret = emu_submit(arg);
+      break;
+    default:
+      ret = -ENOTTY;
+      break;
+  }
+  pthread_mutex_unlock(&emu.lock);
+
+  if (ret < 0) {
+    errno = -ret;
+    return -1;
+  }
+  return 0;
+}
+
+void *npu_emu_mmap(int fd, size_t size, off_t offset) {
+
+  void *map = MAP_FAILED;
+  emu_buf_t *buf;
+
+  if (!npu_emu_is_fd(fd)) {
+    errno = EBADF;
+    return MAP_FAILED;
+  }
+  pthread_mutex_lock(&emu.lock);
+  buf = emu_buf_handle((uint32_t)(offset / EMU_PAGE_SIZE));
+  if ((buf != NULL) && (size <= buf->size)) {
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, buf->memfd, 0);
+  } else {
+    errno = EINVAL;
+  }
+  pthread_mutex_unlock(&emu.lock);
+  return map;
+}
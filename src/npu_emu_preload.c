@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * LD_PRELOAD shim routing /dev/dri/card* to the emulator, eg
+ *
+ *   LD_PRELOAD=./libnpu-emu-preload.so ./matmul_fp16 1 64 64
+ *
+ * Everything else is passed to the next definition (libc).
+ */
+
+#define _GNU_SOURCE
+// Define both the plain and the 64 suffixed symbols, not one redirected to the other
+#undef _FILE_OFFSET_BITS
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include "npu_emu.h"
+
+#define NEXT(name) ((__typeof__(&name)) dlsym(RTLD_NEXT, #name))
+
+static int is_npu_path(const char *path) {
+  return (path != NULL) && (strncmp(path, "/dev/dri/card", 13) == 0);
+}
+
+int open(const char *path, int flags, ...) {
+
+  mode_t mode = 0;
+  va_list ap;
+
+  if (is_npu_path(path)) {
+    return npu_emu_open();
+  }
+  va_start(ap, flags);
+  if (flags & (O_CREAT | O_TMPFILE)) {
+    mode = va_arg(ap, mode_t);
+  }
+  va_end(ap);
+  return NEXT(open)(path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...) {
+
+  mode_t mode = 0;
+  va_list ap;
+
+  if (is_npu_path(path)) {
+    return npu_emu_open();
+  }
+  va_start(ap, flags);
+  if (flags & (O_CREAT | O_TMPFILE)) {
+    mode = va_arg(ap, mode_t);
+  }
+  va_end(ap);
+  return NEXT(open64)(path, flags, mode);
+}
+
+int close(int fd) {
+  if (npu_emu_is_fd(fd)) {
+    return npu_emu_close(fd);
+  }
+  return NEXT(close)(fd);
+}
+
+int ioctl(int fd, unsigned long request, ...) {
+
+  void *arg;
+  va_list ap;
+
+  va_start(ap, request);
+  arg = va_arg(ap, void *);
+  va_end(ap);
+  if (npu_emu_is_fd(fd)) {
+    return npu_emu_ioctl(fd, request, arg);
+  }
+  return NEXT(ioctl)(fd, request, arg);
+}
+
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+  if ((fd >= 0) && npu_emu_is_fd(fd)) {
+    return npu_emu_mmap(fd, length, offset);
+  }
+  return NEXT(mmap)(addr, length, prot, flags, fd, offset);
+}
+
+void *mmap64(void *addr, size_t length, int prot, int flags, int fd, off64_t offset) {
+  if ((fd >= 0) && npu_emu_is_fd(fd)) {
+    return npu_emu_mmap(fd, length, offset);
+  }
+  return NEXT(mmap64)(addr, length, prot, flags, fd, offset);
+}
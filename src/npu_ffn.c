@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libdrm/drm.h>
+
+#include "rknpu-ioctl.h"
+#include "npu_hw.h"
+#include "npu_matmul.h"
+#include "npu_context.h"
+#include "npu_ffn.h"
+
+#define FFN_TASKS 3
+
+// Register commands of one FFN, the LUT upload then the gate, up and down
+// tasks. A multiple of 16 bytes so each block is a valid PC address.
+#define FFN_OPS (NPU_LUT_UPLOAD_OPS + FFN_TASKS * NPU_TASK_OPS)
+
+struct npu_ffn {
+  npu_context_t   *ctx;
+  npu_ffn_cfg_t   cfg;
+  npu_lut_t       silu;
+
+  // fp16 intermediates, shared by the FFNs as they run one at a time
+  npu_buffer_t    gate;
+  npu_buffer_t    hb;
+
+  // FFN_OPS register commands and FFN_TASKS tasks per FFN, generated
+  // straight into the DMA buffers
+  npu_scratch_t   scratch;
+};
+
+npu_ffn_t *npu_ffn_create(npu_context_t *ctx, const npu_ffn_cfg_t *cfg) {
+
+  if ((cfg->count == 0) || ((cfg->m != 1) && ((cfg->m == 0) || (cfg->m % 4))) || (cfg->dim == 0) ||
+    (cfg->dim % 32) || (cfg->hidden == 0) || (cfg->hidden % 32)) {
+    printf("npu_ffn invalid config m %d dim %d hidden %d\n", cfg->m, cfg->dim, cfg->hidden);
+    return NULL;
+  }
+
+  npu_ffn_t *ffn = calloc(1, sizeof(npu_ffn_t));
+  if (ffn == NULL) {
+    return NULL;
+  }
+  ffn->ctx = ctx;
+  ffn->cfg = *cfg;
+  npu_lut_silu(&ffn->silu);
+
+  size_t hidden_bytes = (size_t)cfg->m * cfg->hidden * sizeof(__fp16);
+  int ntasks = cfg->count * FFN_TASKS;
+  if ((npu_buffer_alloc(ctx, hidden_bytes, 0, &ffn->gate) != 0) ||
+    (npu_buffer_alloc(ctx, hidden_bytes, 0, &ffn->hb) != 0) ||
+    (npu_buffer_alloc(ctx, (size_t)cfg->count * FFN_OPS * sizeof(uint64_t), 0, &ffn->scratch.regcmd) != 0) ||
+    (npu_buffer_alloc(ctx, ntasks * sizeof(struct rknpu_task), RKNPU_MEM_KERNEL_MAPPING, &ffn->scratch.tasks) != 0)) {
+    npu_ffn_destroy(ffn);
+    return NULL;
+  }
+  memset(ffn->scratch.tasks.map, 0, ntasks * sizeof(struct rknpu_task));
+  ffn->scratch.capacity = ntasks;
+  return ffn;
+}
+
+void npu_ffn_destroy(npu_ffn_t *ffn) {
+
+  if (ffn == NULL) {
+    return;
+  }
+  npu_buffer_free(ffn->ctx, &ffn->gate);
+  npu_buffer_free(ffn->ctx, &ffn->hb);
+  npu_buffer_free(ffn->ctx, &ffn->scratch.regcmd);
+  npu_buffer_free(ffn->ctx, &ffn->scratch.tasks);
+  free(ffn);
+}
+
+static int gen_ffn_task(npu_ffn_t *ffn, uint64_t *ops, uint16_t k, uint16_t n, uint32_t input_dma,
+  uint32_t weights_dma, uint32_t output_dma, uint8_t fp16, uint32_t ew_mul_dma, const npu_lut_t *lut) {
+
+  matmul_params_t params;
+  int ret;
+
+  memset(&params, 0, sizeof(params));
+  params.m = ffn->cfg.m;
+  params.k = k;
+  params.n = n;
+  params.input_dma = input_dma;
+  params.weights_dma = weights_dma;
+  params.output_dma = output_dma;
+  params.fp32tofp16 = fp16;
+  params.ew_mul_dma = ew_mul_dma;
+  params.lut = lut;
+  params.tasks = ops;
+  if (matmul_task_count(&params) != 1) {
+    printf("npu_ffn [%d,%d]x[%d,%d] needs more than one task\n", params.m, k, n, k);
+    return -1;
+  }
+  ret = gen_matmul_fp16(&params);
+  if (ret != 0) {
+    printf("npu_ffn gen_matmul_fp16 [%d,%d]x[%d,%d] failed %d\n", params.m, k, n, k, ret);
+  }
+  return ret;
+}
+
+/*
+ * Generate FFN index reading and writing the buffers in io, the tasks
+ * chained so npu_ffn_run submits them together.
+ */
+int npu_ffn_gen(npu_ffn_t *ffn, int index, const npu_ffn_io_t *io) {
+
+  npu_ffn_cfg_t *cfg = &ffn->cfg;
+  struct rknpu_task *tasks = (struct rknpu_task *)ffn->scratch.tasks.map + index * FFN_TASKS;
+  uint64_t *ops = (uint64_t *)ffn->scratch.regcmd.map + (size_t)index * FFN_OPS;
+  uint64_t dma = ffn->scratch.regcmd.dma + (uint64_t)index * FFN_OPS * sizeof(uint64_t);
+  uint64_t *task_ops[FFN_TASKS];
+  uint64_t task_dma[FFN_TASKS];
+
+  if ((index < 0) || (index >= cfg->count)) {
+    return -1;
+  }
+  for (int i = 0; i < FFN_TASKS; i++) {
+    size_t offset = NPU_LUT_UPLOAD_OPS + i * NPU_TASK_OPS;
+    task_ops[i] = ops + offset;
+    task_dma[i] = dma + offset * sizeof(uint64_t);
+  }
+
+  gen_lut_upload(&ffn->silu, ops);
+  if ((gen_ffn_task(ffn, task_ops[0], cfg->dim, cfg->hidden, io->input_dma, io->w1_dma, ffn->gate.dma, 1, 0,
+    &ffn->silu) != 0) ||
+    (gen_ffn_task(ffn, task_ops[1], cfg->dim, cfg->hidden, io->input_dma, io->w3_dma, ffn->hb.dma, 1,
+    ffn->gate.dma, NULL) != 0) ||
+    (gen_ffn_task(ffn, task_ops[2], cfg->hidden, cfg->dim, ffn->hb.dma, io->w2_dma, io->output_dma, 0, 0,
+    NULL) != 0)) {
+    return -1;
+  }
+  gen_task_chain(task_ops[0], task_dma[1], NPU_TASK_REGCFG_AMOUNT);
+  gen_task_chain(task_ops[1], task_dma[2], NPU_TASK_REGCFG_AMOUNT);
+
+  // The first task's register commands start with the LUT upload
+  memset(tasks, 0, FFN_TASKS * sizeof(struct rknpu_task));
+  for (int i = 0; i < FFN_TASKS; i++) {
+    tasks[i].enable_mask = PC_ENABLE_DPU | PC_ENABLE_CNA | PC_ENABLE | ((i == 1) ? PC_ENABLE_DPU_RDMA : 0);
+    tasks[i].int_mask = 0x300;
+    tasks[i].int_clear = 0x1ffff;
+    tasks[i].regcfg_amount = NPU_TASK_REGCFG_AMOUNT;
+    tasks[i].regcmd_addr = task_dma[i];
+  }
+  tasks[0].regcfg_amount += NPU_LUT_UPLOAD_OPS;
+  tasks[0].regcmd_addr = dma;
+  return 0;
+}
+
+// Submit FFN index, returns < 0 on failure
+int npu_ffn_run(npu_ffn_t *ffn, int index) {
+
+  uint16_t core_task_start[NPU_CORES] = { 0 }, core_task_number[NPU_CORES] = { 0 };
+
+  if ((index < 0) || (index >= ffn->cfg.count)) {
+    return -1;
+  }
+  core_task_start[0] = index * FFN_TASKS;
+  core_task_number[0] = FFN_TASKS;
+  return npu_context_run(ffn->ctx, &ffn->scratch, (index + 1) * FFN_TASKS, core_task_start, core_task_number);
+}
@@ -0,0 +1,531 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libdrm/drm.h>
+
+#include "rknpu-ioctl.h"
+#include "npu_hw.h"
+#include "npu_matmul.h"
+#include "npu_conv.h"
+#include "npu_context.h"
+#include "npu_plan.h"
+#include "npu_graph.h"
+
+typedef struct {
+  uint8_t       layout;
+  uint8_t       precision;
+  uint16_t      h;
+  uint16_t      w;
+  uint16_t      c;
+  size_t        size;
+  npu_buffer_t  buf;          // the caller's buffer or a view of the arena
+  uint8_t       bound;        // buf belongs to the caller
+  int           producer;     // node writing the tensor, -1 for inputs
+} graph_tensor_t;
+
+enum { graph_op_matmul = 0,
+       graph_op_conv2d = 1 };
+
+typedef struct {
+  uint8_t         op;
+  int             input;
+  int             weights;
+  int             output;
+  conv2d_params_t conv;       // kernel, stride, padding and cvt of a conv2d
+  uint8_t         relu;
+  int             first_task;
+  int             ntasks;
+} graph_node_t;
+
+struct npu_graph {
+  npu_context_t   *ctx;
+
+  graph_tensor_t  *tensors;
+  int             ntensors;
+  int             tensors_capacity;
+
+  graph_node_t    *nodes;
+  int             nnodes;
+  int             nodes_capacity;
+
+  // Unbound tensors placed by npu_plan_arena
+  npu_buffer_t    arena;
+  npu_plan_stats_t plan;
+
+  // Compiled task list, prepared once and run as is
+  npu_scratch_t   scratch;
+  int             ntasks;
+  int             compiled;
+};
+
+static size_t precision_bytes(uint8_t precision) {
+  switch (precision) {
+    case precision_int8:
+      return 1;
+    case precision_float16:
+      return 2;
+    default:
+      return 4;
+  }
+}
+
+// Size of a tensor, channels padded to the layout's grouping
+static size_t tensor_size(const graph_tensor_t *t) {
+
+  size_t bytes = precision_bytes(t->precision);
+
+  if (t->layout == npu_layout_weights) {
+    unsigned int group = (t->precision == precision_int8) ? 32 : 16;
+    return (size_t)((t->h + group - 1) / group) * group * t->w * t->c * bytes;
+  }
+  unsigned int c2;
+  if (t->precision == precision_int8) {
+    c2 = 16;
+  } else if (t->precision == precision_float16) {
+    c2 = 8;
+  } else {
+    c2 = 4;
+  }
+  return (size_t)((t->c + c2 - 1) / c2) * c2 * t->h * t->w * bytes;
+}
+
+// Whether an op reading in can write out
+static int output_precision_ok(uint8_t in, uint8_t out) {
+  if (in == precision_float16) {
+    return (out == precision_float32) || (out == precision_float16);
+  }
+  if (in == precision_int8) {
+    return out == precision_int32;
+  }
+  return 0;
+}
+
+npu_graph_t *npu_graph_create(npu_context_t *ctx) {
+  npu_graph_t *graph = calloc(1, sizeof(npu_graph_t));
+  if (graph == NULL) {
+    return NULL;
+  }
+  graph->ctx = ctx;
+  return graph;
+}
+
+void npu_graph_destroy(npu_graph_t *graph) {
+
+  if (graph == NULL) {
+    return;
+  }
+  npu_buffer_free(graph->ctx, &graph->arena);
+  npu_buffer_free(graph->ctx, &graph->scratch.regcmd);
+  npu_buffer_free(graph->ctx, &graph->scratch.tasks);
+  free(graph->scratch.regs);
+  free(graph->tensors);
+  free(graph->nodes);
+  free(graph);
+}
+
+/*
+ * Add a tensor, returns its id. precision is one of precision_* from
+ * npu_hw.h.
+ */
+int npu_graph_tensor(npu_graph_t *graph, uint8_t layout, uint8_t precision, uint16_t h, uint16_t w, uint16_t c) {
+
+  if (graph->compiled || (h == 0) || (w == 0) || (c == 0)) {
+    return -1;
+  }
+  if (graph->ntensors == graph->tensors_capacity) {
+    int capacity = graph->tensors_capacity ? graph->tensors_capacity * 2 : 16;
+    graph_tensor_t *tensors = realloc(graph->tensors, capacity * sizeof(graph_tensor_t));
+    if (tensors == NULL) {
+      return -1;
+    }
+    graph->tensors = tensors;
+    graph->tensors_capacity = capacity;
+  }
+
+  graph_tensor_t *t = &graph->tensors[graph->ntensors];
+  memset(t, 0, sizeof(*t));
+  t->layout = layout;
+  t->precision = precision;
+  t->h = h;
+  t->w = w;
+  t->c = c;
+  t->size = tensor_size(t);
+  t->producer = -1;
+  return graph->ntensors++;
+}
+
+/*
+ * Use a caller owned buffer for the tensor, eg weights shared between
+ * graphs or an input written by another device. Tensors left unbound are
+ * placed in the graph's arena by npu_graph_compile.
+ */
+int npu_graph_bind(npu_graph_t *graph, int tensor, const npu_buffer_t *buf) {
+
+  if (graph->compiled || (tensor < 0) || (tensor >= graph->ntensors)) {
+    return -1;
+  }
+  graph_tensor_t *t = &graph->tensors[tensor];
+  if (buf->size < t->size) {
+    printf("npu_graph_bind tensor %d needs %zu bytes, buffer has %zu\n", tensor, t->size, buf->size);
+    return -1;
+  }
+  t->buf = *buf;
+  t->bound = 1;
+  return 0;
+}
+
+/*
+ * The tensor's buffer, for unbound tensors valid once compiled. Weights,
+ * graph inputs and outputs (tensors no node reads) keep their own space
+ * in the arena. Intermediates share it with tensors that are not live at
+ * the same time, so their contents are only meaningful during a run.
+ */
+npu_buffer_t *npu_graph_buffer(npu_graph_t *graph, int tensor) {
+  if ((tensor < 0) || (tensor >= graph->ntensors) || (graph->tensors[tensor].buf.map == NULL)) {
+    return NULL;
+  }
+  return &graph->tensors[tensor].buf;
+}
+
+static int graph_add_node(npu_graph_t *graph, const graph_node_t *node) {
+
+  if (graph->nnodes == graph->nodes_capacity) {
+    int capacity = graph->nodes_capacity ? graph->nodes_capacity * 2 : 16;
+    graph_node_t *nodes = realloc(graph->nodes, capacity * sizeof(graph_node_t));
+    if (nodes == NULL) {
+      return -1;
+    }
+    graph->nodes = nodes;
+    graph->nodes_capacity = capacity;
+  }
+  graph->tensors[node->output].producer = graph->nnodes;
+  graph->nodes[graph->nnodes] = *node;
+  return graph->nnodes++;
+}
+
+// Common checks on a node's tensors, returns 0 when they can be used
+static int graph_check_tensors(npu_graph_t *graph, const char *op, int input, int weights, int output) {
+
+  if (graph->compiled || (input < 0) || (input >= graph->ntensors) || (weights < 0) ||
+    (weights >= graph->ntensors) || (output < 0) || (output >= graph->ntensors) ||
+    (output == input) || (output == weights)) {
+    printf("%s invalid tensors %d %d %d\n", op, input, weights, output);
+    return -1;
+  }
+
+  graph_tensor_t *in = &graph->tensors[input];
+  graph_tensor_t *wt = &graph->tensors[weights];
+  graph_tensor_t *out = &graph->tensors[output];
+  if ((in->layout != npu_layout_feature) || (wt->layout != npu_layout_weights) ||
+    (out->layout != npu_layout_feature)) {
+    printf("%s expects feature, weights and feature tensors\n", op);
+    return -1;
+  }
+  if ((in->precision != wt->precision) || !output_precision_ok(in->precision, out->precision)) {
+    printf("%s unsupported precisions %u %u -> %u\n", op, in->precision, wt->precision, out->precision);
+    return -1;
+  }
+  if (out->producer >= 0) {
+    printf("%s tensor %d is already written by node %d\n", op, output, out->producer);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Add a matmul node, returns its index. An input of h x w pixels (the
+ * output of a conv2d) is multiplied per pixel, run as a 1x1 conv2d so
+ * the rows don't have to be a multiple of 4.
+ */
+int npu_graph_matmul(npu_graph_t *graph, int input, int weights, int output) {
+
+  graph_node_t node;
+
+  if (graph_check_tensors(graph, "npu_graph_matmul", input, weights, output) != 0) {
+    return -1;
+  }
+  graph_tensor_t *in = &graph->tensors[input];
+  graph_tensor_t *wt = &graph->tensors[weights];
+  graph_tensor_t *out = &graph->tensors[output];
+  if ((wt->w != 1) || (out->w != in->w) || (wt->c != in->c) || (out->h != in->h) || (out->c != wt->h)) {
+    printf("npu_graph_matmul shape mismatch [%u,%u]x[%u,%u] -> [%u,%u]\n", in->h * in->w, in->c, wt->h, wt->c,
+      out->h * out->w, out->c);
+    return -1;
+  }
+
+  memset(&node, 0, sizeof(node));
+  node.op = (in->w == 1) ? graph_op_matmul : graph_op_conv2d;
+  node.input = input;
+  node.weights = weights;
+  node.output = output;
+  node.conv.kernel_h = 1;
+  node.conv.kernel_w = 1;
+  node.conv.stride_y = 1;
+  node.conv.stride_x = 1;
+  return graph_add_node(graph, &node);
+}
+
+/*
+ * Add a conv2d node, returns its index. Only the kernel, stride, padding,
+ * cvt and relu fields of params are used, dimensions and addresses come
+ * from the tensors.
+ */
+int npu_graph_conv2d(npu_graph_t *graph, int input, int weights, int output, const conv2d_params_t *params) {
+
+  graph_node_t node;
+
+  if (graph_check_tensors(graph, "npu_graph_conv2d", input, weights, output) != 0) {
+    return -1;
+  }
+  graph_tensor_t *in = &graph->tensors[input];
+  graph_tensor_t *wt = &graph->tensors[weights];
+  graph_tensor_t *out = &graph->tensors[output];
+
+  memset(&node, 0, sizeof(node));
+  node.op = graph_op_conv2d;
+  node.input = input;
+  node.weights = weights;
+  node.output = output;
+  node.conv.kernel_h = params->kernel_h > 0 ? params->kernel_h : 1;
+  node.conv.kernel_w = params->kernel_w > 0 ? params->kernel_w : 1;
+  node.conv.stride_y = params->stride_y > 0 ? params->stride_y : 1;
+  node.conv.stride_x = params->stride_x > 0 ? params->stride_x : 1;
+  node.conv.pad_top = params->pad_top;
+  node.conv.pad_left = params->pad_left;
+  node.conv.cvt_enable = params->cvt_enable;
+  node.conv.cvt_signed = params->cvt_signed;
+  memcpy(node.conv.cvt_mean, params->cvt_mean, sizeof(node.conv.cvt_mean));
+  memcpy(node.conv.cvt_scale, params->cvt_scale, sizeof(node.conv.cvt_scale));
+  node.relu = params->relu;
+
+  unsigned int out_h = (in->h + node.conv.pad_top - node.conv.kernel_h) / node.conv.stride_y + 1;
+  unsigned int out_w = (in->w + node.conv.pad_left - node.conv.kernel_w) / node.conv.stride_x + 1;
+  if ((wt->c != in->c) || (wt->w != node.conv.kernel_h * node.conv.kernel_w) ||
+    (out->h != out_h) || (out->w != out_w) || (out->c != wt->h)) {
+    printf("npu_graph_conv2d shape mismatch %ux%ux%u -> %ux%ux%u\n", in->h, in->w, in->c, out->h, out->w, out->c);
+    return -1;
+  }
+  return graph_add_node(graph, &node);
+}
+
+/*
+ * Clamp a node's output at 0, fused into the node so the next one reads
+ * the activation straight from its output.
+ */
+int npu_graph_relu(npu_graph_t *graph, int node) {
+  if (graph->compiled || (node < 0) || (node >= graph->nnodes)) {
+    return -1;
+  }
+  graph->nodes[node].relu = 1;
+  return 0;
+}
+
+static void graph_matmul_params(npu_graph_t *graph, const graph_node_t *node, matmul_params_t *params) {
+
+  graph_tensor_t *in = &graph->tensors[node->input];
+  graph_tensor_t *wt = &graph->tensors[node->weights];
+  graph_tensor_t *out = &graph->tensors[node->output];
+
+  memset(params, 0, sizeof(*params));
+  params->m = in->h;
+  params->k = in->c;
+  params->n = wt->h;
+  params->input_dma = in->buf.dma;
+  params->weights_dma = wt->buf.dma;
+  params->output_dma = out->buf.dma;
+  params->fp32tofp16 = out->precision == precision_float16;
+  params->relu = node->relu;
+}
+
+static void graph_conv2d_params(npu_graph_t *graph, const graph_node_t *node, conv2d_params_t *params) {
+
+  graph_tensor_t *in = &graph->tensors[node->input];
+  graph_tensor_t *wt = &graph->tensors[node->weights];
+  graph_tensor_t *out = &graph->tensors[node->output];
+
+  *params = node->conv;
+  params->height = in->h;
+  params->width = in->w;
+  params->in_channels = in->c;
+  params->out_channels = wt->h;
+  params->input_dma = in->buf.dma;
+  params->weights_dma = wt->buf.dma;
+  params->output_dma = out->buf.dma;
+  params->fp32tofp16 = out->precision == precision_float16;
+  params->relu = node->relu;
+}
+
+static int graph_node_tasks(npu_graph_t *graph, const graph_node_t *node) {
+  if (node->op == graph_op_matmul) {
+    matmul_params_t params;
+    graph_matmul_params(graph, node, &params);
+    return matmul_task_count(&params);
+  }
+  return 1;
+}
+
+static int graph_gen_node(npu_graph_t *graph, const graph_node_t *node) {
+
+  uint64_t *tasks = graph->scratch.regs + node->first_task * NPU_TASK_OPS;
+  uint32_t regcmd_dma = graph->scratch.regcmd.dma + node->first_task * NPU_TASK_OPS * sizeof(uint64_t);
+  int fp16 = graph->tensors[node->input].precision == precision_float16;
+
+  if (node->op == graph_op_matmul) {
+    matmul_params_t params;
+    graph_matmul_params(graph, node, &params);
+    params.tasks = tasks;
+    params.regcmd_dma = regcmd_dma;
+    return fp16 ? gen_matmul_fp16(&params) : gen_matmul_int8(&params);
+  }
+  conv2d_params_t params;
+  graph_conv2d_params(graph, node, &params);
+  params.tasks = tasks;
+  params.regcmd_dma = regcmd_dma;
+  return fp16 ? gen_conv2d_fp16(&params) : gen_conv2d_int8(&params);
+}
+
+/*
+ * Place the unbound tensors in one arena. A tensor is live from the node
+ * writing it to the last node reading it, the others for the whole graph.
+ */
+static int graph_place_tensors(npu_graph_t *graph) {
+
+  npu_plan_tensor_t *plan = calloc(graph->ntensors, sizeof(npu_plan_tensor_t));
+  int ret = -1;
+
+  if (plan == NULL) {
+    return -1;
+  }
+  for (int i = 0; i < graph->ntensors; i++) {
+    plan[i].first = 0;
+    plan[i].last = graph->nnodes - 1;
+    plan[i].size = graph->tensors[i].bound ? 0 : graph->tensors[i].size;
+  }
+  for (int i = 0; i < graph->ntensors; i++) {
+    graph_tensor_t *t = &graph->tensors[i];
+    int last = -1;
+    for (int n = t->producer + 1; (t->producer >= 0) && (n < graph->nnodes); n++) {
+      if ((graph->nodes[n].input == i) || (graph->nodes[n].weights == i)) {
+        last = n;
+      }
+    }
+    if (last >= 0) {
+      plan[i].first = t->producer;
+      plan[i].last = last;
+    }
+  }
+
+  if ((npu_plan_arena(plan, graph->ntensors, NPU_PLAN_ALIGN, &graph->plan) == 0) &&
+    ((graph->plan.arena == 0) || (npu_buffer_alloc(graph->ctx, graph->plan.arena, 0, &graph->arena) == 0))) {
+    for (int i = 0; i < graph->ntensors; i++) {
+      graph_tensor_t *t = &graph->tensors[i];
+      if (!t->bound) {
+        memset(&t->buf, 0, sizeof(t->buf));
+        t->buf.map = (uint8_t *)graph->arena.map + plan[i].offset;
+        t->buf.dma = graph->arena.dma + plan[i].offset;
+        t->buf.size = t->size;
+      }
+    }
+    ret = 0;
+  } else {
+    printf("npu_graph_compile failed to allocate a %zu byte arena\n", graph->plan.arena);
+  }
+  free(plan);
+  return ret;
+}
+
+/*
+ * Place the unbound tensors and generate every node into one task
+ * list chained in node order, so a run is a single submit with nothing
+ * left to do on the host. Returns the number of tasks.
+ */
+int npu_graph_compile(npu_graph_t *graph) {
+
+  int ret;
+
+  if (graph->compiled) {
+    return graph->ntasks;
+  }
+  if (graph->nnodes == 0) {
+    return -1;
+  }
+
+  if (graph_place_tensors(graph) != 0) {
+    return -1;
+  }
+
+  graph->ntasks = 0;
+  for (int i = 0; i < graph->nnodes; i++) {
+    graph->nodes[i].first_task = graph->ntasks;
+    graph->nodes[i].ntasks = graph_node_tasks(graph, &graph->nodes[i]);
+    graph->ntasks += graph->nodes[i].ntasks;
+  }
+
+  npu_scratch_t *scratch = &graph->scratch;
+  scratch->regs = calloc(graph->ntasks, NPU_TASK_OPS * sizeof(uint64_t));
+  if ((scratch->regs == NULL) ||
+    (npu_buffer_alloc(graph->ctx, graph->ntasks * NPU_TASK_OPS * sizeof(uint64_t), 0, &scratch->regcmd) != 0) ||
+    (npu_buffer_alloc(graph->ctx, graph->ntasks * sizeof(struct rknpu_task), RKNPU_MEM_KERNEL_MAPPING, &scratch->tasks) != 0)) {
+    printf("npu_graph_compile failed to allocate %d tasks\n", graph->ntasks);
+    return -1;
+  }
+  scratch->capacity = graph->ntasks;
+
+  for (int i = 0; i < graph->nnodes; i++) {
+    ret = graph_gen_node(graph, &graph->nodes[i]);
+    if (ret != 0) {
+      printf("npu_graph_compile node %d failed %d\n", i, ret);
+      return -1;
+    }
+  }
+
+  // Nodes depend on their predecessors so the whole list runs in order
+  // on one core
+  for (int i = 0; i < graph->ntasks; i++) {
+    uint32_t next = (i + 1 < graph->ntasks) ? scratch->regcmd.dma + (i + 1) * NPU_TASK_OPS * sizeof(uint64_t) : 0;
+    gen_task_chain(scratch->regs + i * NPU_TASK_OPS, next, NPU_TASK_REGCFG_AMOUNT);
+  }
+  if (npu_context_prepare(scratch, graph->ntasks) != 0) {
+    return -1;
+  }
+  graph->compiled = 1;
+  return graph->ntasks;
+}
+
+// Arena placement of the compiled graph's unbound tensors
+int npu_graph_memory(npu_graph_t *graph, npu_plan_stats_t *stats) {
+  if (!graph->compiled) {
+    return -1;
+  }
+  *stats = graph->plan;
+  return 0;
+}
+
+int npu_graph_run(npu_graph_t *graph) {
+  if (!graph->compiled) {
+    return -1;
+  }
+  return npu_context_run(graph->ctx, &graph->scratch, graph->ntasks, NULL, NULL);
+}
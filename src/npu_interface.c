@@ -20,6 +20,7 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
@@ -29,33 +30,89 @@
 
 #include "rknpu-ioctl.h"
 #include "npu_hw.h"
+#include "npu_interface.h"
+#include "npu_matmul.h"
+#include "npu_emu.h"
 
-void* mem_allocate(int fd, size_t size, uint64_t *dma_addr, uint64_t *obj, uint32_t flags, uint32_t *handle) {
+#define NPU_DRI_CARDS 16
+
+/*
+ * All driver calls go through here so a descriptor from the emulator
+ * (see npu_open) is served in userspace.
+ */
+int npu_ioctl(int fd, unsigned long request, void *arg) {
+  if (npu_emu_is_fd(fd)) {
+    return npu_emu_ioctl(fd, request, arg);
+  }
+  return ioctl(fd, request, arg);
+}
+
+/*
+ * sram_size is the part of the buffer asked for in the SRAM, updated with
+ * what the driver placed there. The buffer is destroyed again if it can't
+ * be mapped.
+ */
+static void* mem_create_map(int fd, size_t size, uint64_t *sram_size, uint64_t *dma_addr, uint64_t *obj, uint32_t flags, uint32_t *handle) {
 
   int ret;
   struct rknpu_mem_create mem_create = {
     .flags = flags | RKNPU_MEM_NON_CACHEABLE,
     .size = size,
+    .sram_size = (sram_size != NULL) ? *sram_size : 0,
   };
 
-  ret = ioctl(fd, DRM_IOCTL_RKNPU_MEM_CREATE, &mem_create);
+  ret = npu_ioctl(fd, DRM_IOCTL_RKNPU_MEM_CREATE, &mem_create);
   if(ret < 0)  {
     printf("RKNPU_MEM_CREATE failed %d\n",ret);
     return NULL;
   }
 
   struct rknpu_mem_map mem_map = { .handle = mem_create.handle, .offset=0 };
-  ret = ioctl(fd, DRM_IOCTL_RKNPU_MEM_MAP, &mem_map);
+  ret = npu_ioctl(fd, DRM_IOCTL_RKNPU_MEM_MAP, &mem_map);
   if(ret < 0) {
     printf("RKNPU_MEM_MAP failed %d\n",ret);
+    mem_destroy(fd, mem_create.handle, mem_create.obj_addr);
     return NULL;
   }
 
-  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, mem_map.offset);
+  void *map = npu_emu_is_fd(fd) ? npu_emu_mmap(fd, size, mem_map.offset) :
+    mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, mem_map.offset);
+  if (map == MAP_FAILED) {
+    printf("mmap of handle %d failed %d\n", mem_create.handle, errno);
+    mem_destroy(fd, mem_create.handle, mem_create.obj_addr);
+    return NULL;
+  }
 
   *dma_addr = mem_create.dma_addr;
   *obj = mem_create.obj_addr;
   *handle = mem_create.handle;
+  if (sram_size != NULL) {
+    *sram_size = mem_create.sram_size;
+  }
+  return map;
+}
+
+void* mem_allocate(int fd, size_t size, uint64_t *dma_addr, uint64_t *obj, uint32_t flags, uint32_t *handle) {
+  return mem_create_map(fd, size, NULL, dma_addr, obj, flags, handle);
+}
+
+/*
+ * Allocate a small frequently reused buffer (activations, KV slices, LUTs)
+ * in the NPU SRAM if there's room, otherwise the driver falls back to
+ * DRAM. Placement reports where the buffer ended up, from the SRAM size
+ * the driver hands back.
+ */
+void* mem_allocate_sram(int fd, size_t size, uint64_t *dma_addr, uint64_t *obj, uint32_t flags, uint32_t *handle, int *placement) {
+
+  uint64_t sram_size = size;
+  void *map;
+
+  map = mem_create_map(fd, size, &sram_size, dma_addr, obj, flags | RKNPU_MEM_TRY_ALLOC_SRAM, handle);
+  if (map == NULL) {
+    *placement = mem_placement_dram;
+    return mem_create_map(fd, size, NULL, dma_addr, obj, flags, handle);
+  }
+  *placement = (sram_size >= size) ? mem_placement_sram : mem_placement_dram;
   return map;
 }
 
@@ -67,13 +124,16 @@ void mem_destroy(int fd, uint32_t handle, uint64_t obj_addr) {
     .obj_addr = obj_addr
   };
 
-  ret = ioctl(fd, DRM_IOCTL_RKNPU_MEM_DESTROY, &destroy);
+  ret = npu_ioctl(fd, DRM_IOCTL_RKNPU_MEM_DESTROY, &destroy);
   if (ret <0) {
     printf("RKNPU_MEM_DESTROY failed %d\n",ret);
   }
 }
 
-int npu_open() {
+/*
+ * Query the DRM driver name of fd, returns 1 if it's the rknpu driver.
+ */
+static int npu_is_rknpu(int fd, int verbose) {
 
   char buf1[256], buf2[256], buf3[256];
 
@@ -81,32 +141,66 @@ int npu_open() {
   memset(buf2, 0 ,sizeof(buf2));
   memset(buf3, 0, sizeof(buf3));
 
-  // Open DRI called "rknpu"
-  int fd = open("/dev/dri/card1", O_RDWR);
-  if(fd<0) {
-    printf("Failed to open /dev/dri/card1 %d\n",errno);
-    return fd;
-  }
-
   struct drm_version dv;
   memset(&dv, 0, sizeof(dv));
   dv.name = buf1;
-  dv.name_len = sizeof(buf1);
+  dv.name_len = sizeof(buf1) - 1;
   dv.date = buf2;
-  dv.date_len = sizeof(buf2);
+  dv.date_len = sizeof(buf2) - 1;
   dv.desc = buf3;
-  dv.desc_len = sizeof(buf3);
+  dv.desc_len = sizeof(buf3) - 1;
 
-  int ret = ioctl(fd, DRM_IOCTL_VERSION, &dv);
+  int ret = npu_ioctl(fd, DRM_IOCTL_VERSION, &dv);
   if (ret <0) {
     printf("DRM_IOCTL_VERISON failed %d\n",ret);
-    return ret;
+    return 0;
+  }
+  if (strcmp(dv.name, "rknpu") != 0) {
+    return 0;
+  }
+  if (verbose) {
+    printf("drm name is %s - %s - %s\n", dv.name, dv.date, dv.desc);
+  }
+  return 1;
+}
+
+/*
+ * Open the DRI node of the "rknpu" driver, its card number depends on
+ * the board and the display drivers loaded, or the userspace emulator
+ * when NPU_EMULATOR is set.
+ */
+int npu_open() {
+
+  char path[32];
+
+  if (getenv("NPU_EMULATOR") != NULL) {
+    int fd = npu_emu_open();
+    if ((fd >= 0) && !npu_is_rknpu(fd, 1)) {
+      npu_emu_close(fd);
+      return -1;
+    }
+    return fd;
   }
-  printf("drm name is %s - %s - %s\n", dv.name, dv.date, dv.desc);
-  return fd;
+
+  for (int i = 0; i < NPU_DRI_CARDS; i++) {
+    snprintf(path, sizeof(path), "/dev/dri/card%d", i);
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+      continue;
+    }
+    if (npu_is_rknpu(fd, 1)) {
+      return fd;
+    }
+    close(fd);
+  }
+  printf("Failed to find the rknpu DRI node under /dev/dri\n");
+  return -ENODEV;
 }
 
 int npu_close(int fd) {
+  if (npu_emu_is_fd(fd)) {
+    return npu_emu_close(fd);
+  }
   return close(fd);	
 }
 
@@ -116,5 +210,56 @@ int npu_reset(int fd) {
   struct rknpu_action act = {
     .flags = RKNPU_ACT_RESET,
   };
-  return ioctl(fd, DRM_IOCTL_RKNPU_ACTION, &act);	
+  return npu_ioctl(fd, DRM_IOCTL_RKNPU_ACTION, &act);	
+}
+
+int npu_action(int fd, uint32_t flags, uint32_t *value) {
+
+  int ret;
+  struct rknpu_action act = {
+    .flags = flags,
+    .value = (value != NULL) ? *value : 0,
+  };
+
+  ret = npu_ioctl(fd, DRM_IOCTL_RKNPU_ACTION, &act);
+  if ((ret == 0) && (value != NULL)) {
+    *value = act.value;
+  }
+  return ret;
+}
+
+int npu_get_sram_size(int fd, uint32_t *total, uint32_t *free_size) {
+
+  int ret;
+
+  *total = 0;
+  *free_size = 0;
+  ret = npu_action(fd, RKNPU_GET_TOTAL_SRAM_SIZE, total);
+  if (ret < 0) {
+    return ret;
+  }
+  return npu_action(fd, RKNPU_GET_FREE_SRAM_SIZE, free_size);
+}
+
+/*
+ * Set the submit's core_mask and per core task ranges from core_task_start
+ * and core_task_number (NPU_CORES entries, a core with no tasks is left
+ * out of the mask). The driver reads core c's range from subcore_task[c]
+ * when one or two cores are used but from subcore_task[c + 2] when all
+ * three are.
+ */
+void npu_submit_cores(struct rknpu_submit *submit, const uint16_t *core_task_start, const uint16_t *core_task_number) {
+
+  memset(submit->subcore_task, 0, sizeof(submit->subcore_task));
+  submit->core_mask = 0;
+  for (int c = 0; c < NPU_CORES; c++) {
+    if (core_task_number[c] > 0) {
+      submit->core_mask |= 1 << c;
+    }
+  }
+  int first = (submit->core_mask == 0x7) ? 2 : 0;
+  for (int c = 0; c < NPU_CORES; c++) {
+    submit->subcore_task[first + c].task_start = core_task_start[c];
+    submit->subcore_task[first + c].task_number = core_task_number[c];
+  }
 }
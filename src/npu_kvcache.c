@@ -0,0 +1,365 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include <libdrm/drm.h>
+
+#include "rknpu-ioctl.h"
+#include "npu_hw.h"
+#include "npu_matmul.h"
+#include "npu_context.h"
+#include "npu_kvcache.h"
+
+#define KV_ALIGN 64
+
+struct npu_kvcache {
+  npu_context_t       *ctx;
+  npu_kvcache_cfg_t   cfg;
+  int                 esize;        // bytes per cache element
+  int                 group;        // kernels per weight group, 16 fp16 or 32 int8
+  int                 c2;           // feature channels per plane
+  int                 head_pad;     // key channels, head_size rounded up to 32
+  int                 seq_k;        // key kernels, seq_len rounded up to a group
+  int                 seq_c;        // value channels, seq_len rounded up to 32
+  int                 m_q;          // query rows, q_heads padded to 1 or a multiple of 4
+  int                 att_n;        // softmax kernels, q_heads rounded up to a group
+
+  // Per layer and kv head
+  npu_buffer_t        keys, values;
+  size_t              key_bytes, value_bytes;
+  float               *key_scale, *value_scale;     // int8, per position
+
+  // Per kv head operands of the attention matmuls, shared by the layers
+  npu_buffer_t        query, scores, att, out;
+  size_t              query_bytes, scores_bytes, att_bytes, out_bytes;
+  float               *query_scale, *att_scale;     // int8
+  float               *probs;
+
+  // Score tasks then value tasks, one per kv head, generated per call
+  npu_scratch_t       scratch;
+
+  npu_kvcache_stats_t stats;
+};
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int round_up(int x, int align) {
+  return (x + align - 1) / align * align;
+}
+
+static size_t align_bytes(size_t x) {
+  return (x + KV_ALIGN - 1) & ~(size_t)(KV_ALIGN - 1);
+}
+
+static int alloc_zeroed(npu_kvcache_t *kv, npu_buffer_t *buf, size_t size) {
+  if (npu_buffer_alloc(kv->ctx, size, 0, buf) != 0) {
+    printf("npu_kvcache failed to allocate %zu bytes\n", size);
+    return -1;
+  }
+  memset(buf->map, 0, size);
+  return 0;
+}
+
+// Symmetric int8 scale of size values, 0 when they're all 0
+static float quant_scale(const float *x, int size) {
+  float max_abs = 0.0f;
+  for (int i = 0; i < size; i++) {
+    max_abs = fabsf(x[i]) > max_abs ? fabsf(x[i]) : max_abs;
+  }
+  return max_abs / 127.0f;
+}
+
+static int8_t quant(float x, float scale) {
+  if (scale == 0.0f) {
+    return 0;
+  }
+  long v = lrintf(x / scale);
+  return v < -127 ? -127 : (v > 127 ? 127 : v);
+}
+
+npu_kvcache_t *npu_kvcache_create(npu_context_t *ctx, const npu_kvcache_cfg_t *cfg) {
+
+  if ((cfg->layers == 0) || (cfg->kv_heads == 0) || (cfg->q_heads == 0) || (cfg->seq_len == 0) ||
+    (cfg->head_size == 0) || (cfg->head_size % 4)) {
+    printf("npu_kvcache invalid config, head_size %d must be a multiple of 4\n", cfg->head_size);
+    return NULL;
+  }
+
+  npu_kvcache_t *kv = calloc(1, sizeof(npu_kvcache_t));
+  if (kv == NULL) {
+    return NULL;
+  }
+  kv->ctx = ctx;
+  kv->cfg = *cfg;
+  kv->esize = cfg->int8 ? sizeof(int8_t) : sizeof(__fp16);
+  kv->group = cfg->int8 ? 32 : 16;
+  kv->c2 = cfg->int8 ? 16 : 8;
+  kv->head_pad = round_up(cfg->head_size, 32);
+  kv->seq_k = round_up(cfg->seq_len, kv->group);
+  kv->seq_c = round_up(cfg->seq_len, 32);
+  kv->m_q = cfg->q_heads == 1 ? 1 : round_up(cfg->q_heads, 4);
+  kv->att_n = round_up(cfg->q_heads, kv->group);
+
+  kv->key_bytes = align_bytes((size_t)kv->seq_k * kv->head_pad * kv->esize);
+  kv->value_bytes = align_bytes((size_t)kv->seq_c * cfg->head_size * kv->esize);
+  kv->query_bytes = align_bytes((size_t)kv->m_q * kv->head_pad * kv->esize);
+  kv->scores_bytes = align_bytes((size_t)kv->m_q * round_up(kv->seq_k, 4) * sizeof(float));
+  kv->att_bytes = align_bytes((size_t)kv->att_n * kv->seq_c * kv->esize);
+  kv->out_bytes = align_bytes((size_t)cfg->head_size * kv->att_n * sizeof(float));
+
+  size_t heads = (size_t)cfg->layers * cfg->kv_heads;
+  kv->probs = calloc((size_t)cfg->q_heads * cfg->seq_len, sizeof(float));
+  if (cfg->int8) {
+    kv->key_scale = calloc(heads * cfg->seq_len, sizeof(float));
+    kv->value_scale = calloc(heads * cfg->seq_len, sizeof(float));
+    kv->query_scale = calloc(cfg->kv_heads, sizeof(float));
+    kv->att_scale = calloc((size_t)cfg->kv_heads * cfg->q_heads, sizeof(float));
+  }
+
+  int ntasks = 2 * cfg->kv_heads;
+  npu_scratch_t *scratch = &kv->scratch;
+  scratch->regs = calloc(ntasks, NPU_TASK_OPS * sizeof(uint64_t));
+  if ((kv->probs == NULL) || (cfg->int8 && ((kv->key_scale == NULL) || (kv->value_scale == NULL) ||
+    (kv->query_scale == NULL) || (kv->att_scale == NULL))) || (scratch->regs == NULL) ||
+    (alloc_zeroed(kv, &kv->keys, heads * kv->key_bytes) != 0) ||
+    (alloc_zeroed(kv, &kv->values, heads * kv->value_bytes) != 0) ||
+    (alloc_zeroed(kv, &kv->query, cfg->kv_heads * kv->query_bytes) != 0) ||
+    (alloc_zeroed(kv, &kv->scores, cfg->kv_heads * kv->scores_bytes) != 0) ||
+    (alloc_zeroed(kv, &kv->att, cfg->kv_heads * kv->att_bytes) != 0) ||
+    (alloc_zeroed(kv, &kv->out, cfg->kv_heads * kv->out_bytes) != 0) ||
+    (npu_buffer_alloc(ctx, ntasks * NPU_TASK_OPS * sizeof(uint64_t), 0, &scratch->regcmd) != 0) ||
+    (npu_buffer_alloc(ctx, ntasks * sizeof(struct rknpu_task), RKNPU_MEM_KERNEL_MAPPING, &scratch->tasks) != 0)) {
+    npu_kvcache_destroy(kv);
+    return NULL;
+  }
+  scratch->capacity = ntasks;
+  return kv;
+}
+
+void npu_kvcache_destroy(npu_kvcache_t *kv) {
+
+  if (kv == NULL) {
+    return;
+  }
+  npu_buffer_t *buffers[] = { &kv->keys, &kv->values, &kv->query, &kv->scores, &kv->att, &kv->out,
+    &kv->scratch.regcmd, &kv->scratch.tasks };
+  for (unsigned int i = 0; i < sizeof(buffers) / sizeof(buffers[0]); i++) {
+    npu_buffer_free(kv->ctx, buffers[i]);
+  }
+  free(kv->scratch.regs);
+  free(kv->key_scale);
+  free(kv->value_scale);
+  free(kv->query_scale);
+  free(kv->att_scale);
+  free(kv->probs);
+  free(kv);
+}
+
+size_t npu_kvcache_bytes(const npu_kvcache_t *kv) {
+  return kv->keys.size + kv->values.size;
+}
+
+void npu_kvcache_stats(const npu_kvcache_t *kv, npu_kvcache_stats_t *stats) {
+  *stats = kv->stats;
+}
+
+/*
+ * Write the key and value of every kv head at pos (kv_heads * head_size
+ * floats each, keys after RoPE) straight into the cache layouts.
+ */
+int npu_kvcache_append(npu_kvcache_t *kv, int layer, int pos, const float *k, const float *v) {
+
+  npu_kvcache_cfg_t *p = &kv->cfg;
+  int hs = p->head_size;
+
+  if ((layer < 0) || (layer >= p->layers) || (pos < 0) || (pos >= p->seq_len)) {
+    return -1;
+  }
+  for (int h = 0; h < p->kv_heads; h++) {
+    size_t head = (size_t)layer * p->kv_heads + h;
+    uint8_t *keys = (uint8_t *)kv->keys.map + head * kv->key_bytes;
+    uint8_t *values = (uint8_t *)kv->values.map + head * kv->value_bytes;
+    const float *kh = k + h * hs, *vh = v + h * hs;
+
+    if (p->int8) {
+      float ks = quant_scale(kh, hs), vs = quant_scale(vh, hs);
+      kv->key_scale[head * p->seq_len + pos] = ks;
+      kv->value_scale[head * p->seq_len + pos] = vs;
+      for (int i = 0; i < hs; i++) {
+        ((int8_t *)keys)[weight_int8(kv->head_pad, pos + 1, i + 1)] = quant(kh[i], ks);
+        ((int8_t *)values)[feature_data(kv->seq_c, hs, 1, kv->c2, pos + 1, i + 1, 1)] = quant(vh[i], vs);
+      }
+    } else {
+      for (int i = 0; i < hs; i++) {
+        ((__fp16 *)keys)[weight_fp16(kv->head_pad, pos + 1, i + 1)] = (__fp16)kh[i];
+        ((__fp16 *)values)[feature_data(kv->seq_c, hs, 1, kv->c2, pos + 1, i + 1, 1)] = (__fp16)vh[i];
+      }
+    }
+  }
+  return 0;
+}
+
+// Generate count matmuls from task first and run them in one submit
+static int run_gemms(npu_kvcache_t *kv, int first, const matmul_gemm_t *gemms, int count) {
+
+  matmul_batch_params_t params;
+  int ret;
+
+  memset(&params, 0, sizeof(params));
+  params.gemms = gemms;
+  params.count = count;
+  params.tasks = kv->scratch.regs + first * NPU_TASK_OPS;
+  params.regcmd_dma = kv->scratch.regcmd.dma + first * NPU_TASK_OPS * sizeof(uint64_t);
+  ret = kv->cfg.int8 ? gen_matmul_batch_int8(&params) : gen_matmul_batch_fp16(&params);
+  if ((ret != 0) || (npu_context_prepare(&kv->scratch, first + count) != 0)) {
+    return -1;
+  }
+  for (int c = 0; c < NPU_CORES; c++) {
+    params.core_task_start[c] += first;
+  }
+
+  uint64_t start = now_ns();
+  ret = npu_context_run(kv->ctx, &kv->scratch, first + count, params.core_task_start, params.core_task_number);
+  kv->stats.npu_ns += now_ns() - start;
+  kv->stats.submits++;
+  return ret < 0 ? ret : 0;
+}
+
+/*
+ * Attention of every query head over positions 0..pos of layer, q holds
+ * kv_heads * q_heads heads of head_size (after RoPE), the kv head of
+ * query head h being h / q_heads as in llama2.c. One submit computes the
+ * scores of all kv heads, the softmax runs on the CPU writing the value
+ * matmul's weights and a second submit weights the values into out.
+ */
+int npu_kvcache_attend(npu_kvcache_t *kv, int layer, int pos, const float *q, float *out) {
+
+  npu_kvcache_cfg_t *p = &kv->cfg;
+  int hs = p->head_size, qh = p->q_heads;
+  int n = round_up(pos + 1, kv->group);
+  int kc = round_up(pos + 1, 32);
+  matmul_gemm_t gemms[p->kv_heads];
+  float scale = 1.0f / sqrtf(hs);
+
+  if ((layer < 0) || (layer >= p->layers) || (pos < 0) || (pos >= p->seq_len)) {
+    return -1;
+  }
+
+  // Queries of a kv head are the rows of its score matmul
+  for (int h = 0; h < p->kv_heads; h++) {
+    uint8_t *query = (uint8_t *)kv->query.map + h * kv->query_bytes;
+    const float *qg = q + (size_t)h * qh * hs;
+    float qs = p->int8 ? quant_scale(qg, qh * hs) : 0.0f;
+    if (p->int8) {
+      kv->query_scale[h] = qs;
+    }
+    for (int j = 0; j < qh; j++) {
+      for (int i = 0; i < hs; i++) {
+        int idx = feature_data(kv->head_pad, kv->m_q, 1, kv->c2, i + 1, j + 1, 1);
+        if (p->int8) {
+          ((int8_t *)query)[idx] = quant(qg[j * hs + i], qs);
+        } else {
+          ((__fp16 *)query)[idx] = (__fp16)qg[j * hs + i];
+        }
+      }
+    }
+    gemms[h].m = kv->m_q;
+    gemms[h].k = kv->head_pad;
+    gemms[h].n = n;
+    gemms[h].input_dma = kv->query.dma + h * kv->query_bytes;
+    gemms[h].weights_dma = kv->keys.dma + ((size_t)layer * p->kv_heads + h) * kv->key_bytes;
+    gemms[h].output_dma = kv->scores.dma + h * kv->scores_bytes;
+  }
+  if (run_gemms(kv, 0, gemms, p->kv_heads) != 0) {
+    return -1;
+  }
+
+  // Softmax, written as the kernels of the value matmul. Positions past
+  // pos up to kc are cleared as they may hold an earlier sequence.
+  for (int h = 0; h < p->kv_heads; h++) {
+    size_t head = (size_t)layer * p->kv_heads + h;
+    uint8_t *scores = (uint8_t *)kv->scores.map + h * kv->scores_bytes;
+    uint8_t *att = (uint8_t *)kv->att.map + h * kv->att_bytes;
+    for (int j = 0; j < qh; j++) {
+      float *probs = kv->probs + j * p->seq_len;
+      float max_val = -INFINITY, sum = 0.0f;
+      for (int s = 0; s <= pos; s++) {
+        int idx = feature_data(n, kv->m_q, 1, 4, s + 1, j + 1, 1);
+        float score = p->int8 ? ((int32_t *)scores)[idx] * kv->query_scale[h] * kv->key_scale[head * p->seq_len + s] :
+          ((float *)scores)[idx];
+        probs[s] = score * scale;
+        max_val = probs[s] > max_val ? probs[s] : max_val;
+      }
+      for (int s = 0; s <= pos; s++) {
+        probs[s] = expf(probs[s] - max_val);
+        sum += probs[s];
+      }
+      for (int s = 0; s <= pos; s++) {
+        probs[s] /= sum;
+        if (p->int8) {
+          probs[s] *= kv->value_scale[head * p->seq_len + s];
+        }
+      }
+      float as = p->int8 ? quant_scale(probs, pos + 1) : 0.0f;
+      if (p->int8) {
+        kv->att_scale[h * qh + j] = as;
+      }
+      for (int s = 0; s < kc; s++) {
+        if (p->int8) {
+          ((int8_t *)att)[weight_int8(kc, j + 1, s + 1)] = s <= pos ? quant(probs[s], as) : 0;
+        } else {
+          ((__fp16 *)att)[weight_fp16(kc, j + 1, s + 1)] = s <= pos ? (__fp16)probs[s] : (__fp16)0.0f;
+        }
+      }
+    }
+    gemms[h].m = hs;
+    gemms[h].k = kc;
+    gemms[h].n = kv->att_n;
+    gemms[h].input_dma = kv->values.dma + head * kv->value_bytes;
+    gemms[h].weights_dma = kv->att.dma + h * kv->att_bytes;
+    gemms[h].output_dma = kv->out.dma + h * kv->out_bytes;
+  }
+  if (run_gemms(kv, p->kv_heads, gemms, p->kv_heads) != 0) {
+    return -1;
+  }
+
+  // Column j of the transposed output is query head j
+  for (int h = 0; h < p->kv_heads; h++) {
+    uint8_t *res = (uint8_t *)kv->out.map + h * kv->out_bytes;
+    for (int j = 0; j < qh; j++) {
+      float *o = out + ((size_t)h * qh + j) * hs;
+      for (int i = 0; i < hs; i++) {
+        int idx = feature_data(kv->att_n, hs, 1, 4, j + 1, i + 1, 1);
+        o[i] = p->int8 ? ((int32_t *)res)[idx] * kv->att_scale[h * qh + j] : ((float *)res)[idx];
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,471 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libdrm/drm.h>
+
+#include "rknpu-ioctl.h"
+#include "npu_hw.h"
+#include "npu_matmul.h"
+#include "npu_context.h"
+#include "npu_kvcache.h"
+#include "npu_ffn.h"
+#include "npu_llama.h"
+
+// Projections of a layer, QKV is one fused matmul. Each projection has
+// NPU_CORES task slots for its N slices. The FFN is generated by npu_ffn,
+// a submit of its own per layer.
+enum { llama_qkv = 0,
+       llama_o = 1,
+       llama_layer_projections = 2 };
+
+struct npu_llama {
+  npu_context_t       *ctx;
+  npu_llama_config_t  cfg;
+  int                 head_size;
+  int                 kv_dim;
+
+  // Checkpoint mapping, the embedding and rmsnorm weights are used from it
+  float               *data;
+  size_t              file_size;
+  const float         *token_embedding;
+  const float         *rms_att;
+  const float         *rms_ffn;
+  const float         *rms_final;
+
+  // fp16 weights packed for weight_fp16, all layers of a matrix in one
+  // buffer. wq, wk and wv are fused along N, the classifier is padded to
+  // whole kernel groups for any vocab_size.
+  matmul_fused_t      qkv_fused;
+  matmul_shape_t      cls_shape;
+  npu_buffer_t        wqkv, wo, w1, w2, w3, wcls;
+
+  // Activations, fp16 matmul inputs and float32 outputs. With M = 1 the
+  // feature layout is a plain vector so the CPU steps use them in place,
+  // q, k and v being views of the fused qkv output.
+  npu_buffer_t        xb16, att16;
+  npu_buffer_t        qkv, xo, logits;
+  float               *q, *k, *v;
+
+  // CPU state
+  float               *x;
+  float               *xb;
+
+  npu_kvcache_t       *kv;
+  npu_ffn_t           *ffn;
+
+  // Every projection of the model, generated once at load, with the
+  // number of slices of the layer projections and the classifier
+  npu_scratch_t       scratch;
+  int                 ntasks;
+  int                 projection_tasks[llama_layer_projections];
+  int                 cls_tasks;
+
+  npu_llama_stats_t   stats;
+};
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Pack layers of row major float [N,K] matrices into fp16 weight layout
+static int pack_weights(npu_llama_t *model, npu_buffer_t *buf, const float *w, int layers, int n, int k) {
+
+  size_t matrix = (size_t)n * k;
+
+  if (npu_buffer_alloc(model->ctx, layers * matrix * sizeof(__fp16), 0, buf) != 0) {
+    printf("npu_llama failed to allocate %zu bytes of weights\n", layers * matrix * sizeof(__fp16));
+    return -1;
+  }
+  for (int l = 0; l < layers; l++) {
+    __fp16 *dst = (__fp16 *)buf->map + l * matrix;
+    const float *src = w + l * matrix;
+    for (int i = 1; i <= n; i++) {
+      for (int j = 1; j <= k; j++) {
+        dst[weight_fp16(k, i, j)] = (__fp16)src[(size_t)(i-1) * k + (j-1)];
+      }
+    }
+  }
+  return 0;
+}
+
+// Pack layers of wq, wk and wv into one fused weight matrix per layer
+static int pack_qkv(npu_llama_t *model, const float *wq, const float *wk, const float *wv, int layers) {
+
+  matmul_fused_t *fused = &model->qkv_fused;
+  const float *w[3] = { wq, wk, wv };
+  size_t matrix = (size_t)fused->n_total * fused->k;
+
+  if (npu_buffer_alloc(model->ctx, layers * matrix * sizeof(__fp16), 0, &model->wqkv) != 0) {
+    printf("npu_llama failed to allocate %zu bytes of weights\n", layers * matrix * sizeof(__fp16));
+    return -1;
+  }
+  for (int l = 0; l < layers; l++) {
+    for (int i = 0; i < 3; i++) {
+      matmul_fused_pack_fp16(fused, i, w[i] + (size_t)l * fused->n[i] * fused->k, (__fp16 *)model->wqkv.map + l * matrix);
+    }
+  }
+  return 0;
+}
+
+static int pack_classifier(npu_llama_t *model, const float *wcls) {
+  if (npu_buffer_alloc(model->ctx, matmul_shape_weights_size(&model->cls_shape), 0, &model->wcls) != 0) {
+    printf("npu_llama failed to allocate %zu bytes of weights\n", matmul_shape_weights_size(&model->cls_shape));
+    return -1;
+  }
+  matmul_shape_pack_weights_fp16(&model->cls_shape, wcls, model->wcls.map);
+  return 0;
+}
+
+// Activations read or written by every layer go to the SRAM if there's room
+static int alloc_activation(npu_llama_t *model, npu_buffer_t *buf, size_t size, uint32_t flags) {
+  if (npu_buffer_alloc(model->ctx, size, flags, buf) != 0) {
+    printf("npu_llama failed to allocate %zu bytes of activations\n", size);
+    return -1;
+  }
+  memset(buf->map, 0, size);
+  return 0;
+}
+
+// Projection as N slices over the cores, returns the number of tasks
+static int gen_projection(npu_llama_t *model, int projection, const npu_buffer_t *input, const npu_buffer_t *weights,
+  int layer, int n, int k, const npu_buffer_t *output) {
+
+  matmul_batch_params_t params;
+  int ret;
+
+  memset(&params, 0, sizeof(params));
+  params.m = 1;
+  params.k = k;
+  params.n = n;
+  params.input_dma = input->dma;
+  params.weights_dma = weights->dma + (size_t)layer * n * k * sizeof(__fp16);
+  params.output_dma = output->dma;
+  params.tasks = model->scratch.regs + projection * NPU_CORES * NPU_TASK_OPS;
+  ret = gen_matmul_gemv_fp16(&params);
+  if (ret < 0) {
+    printf("npu_llama gen_matmul_gemv_fp16 [1,%d]x[%d,%d] failed %d\n", k, n, k, ret);
+  }
+  return ret;
+}
+
+static int gen_tasks(npu_llama_t *model) {
+
+  npu_llama_config_t *p = &model->cfg;
+  npu_scratch_t *scratch = &model->scratch;
+
+  int projections = p->n_layers * llama_layer_projections + 1;
+
+  model->ntasks = projections * NPU_CORES;
+  scratch->regs = calloc(model->ntasks, NPU_TASK_OPS * sizeof(uint64_t));
+  if ((scratch->regs == NULL) ||
+    (npu_buffer_alloc(model->ctx, model->ntasks * NPU_TASK_OPS * sizeof(uint64_t), 0, &scratch->regcmd) != 0) ||
+    (npu_buffer_alloc(model->ctx, model->ntasks * sizeof(struct rknpu_task), RKNPU_MEM_KERNEL_MAPPING, &scratch->tasks) != 0)) {
+    return -1;
+  }
+  scratch->capacity = model->ntasks;
+
+  for (int l = 0; l < p->n_layers; l++) {
+    int t = l * llama_layer_projections;
+    if (((model->projection_tasks[llama_qkv] = gen_projection(model, t + llama_qkv, &model->xb16, &model->wqkv, l,
+      model->qkv_fused.n_total, p->dim, &model->qkv)) < 0) ||
+      ((model->projection_tasks[llama_o] = gen_projection(model, t + llama_o, &model->att16, &model->wo, l,
+      p->dim, p->dim, &model->xo)) < 0)) {
+      return -1;
+    }
+    size_t ffn_matrix = (size_t)l * p->hidden_dim * p->dim * sizeof(__fp16);
+    npu_ffn_io_t io = { model->xb16.dma, model->w1.dma + ffn_matrix, model->w3.dma + ffn_matrix,
+      model->w2.dma + ffn_matrix, model->xo.dma };
+    if (npu_ffn_gen(model->ffn, l, &io) != 0) {
+      return -1;
+    }
+  }
+  if ((model->cls_tasks = gen_projection(model, projections - 1, &model->xb16, &model->wcls, 0, model->cls_shape.n_pad, p->dim,
+    &model->logits)) < 0) {
+    return -1;
+  }
+  return npu_context_prepare(scratch, model->ntasks);
+}
+
+/*
+ * Load a llama2.c checkpoint, packing the weights and generating the
+ * tasks for every projection. opts may be NULL for the defaults.
+ */
+npu_llama_t *npu_llama_load(npu_context_t *ctx, const char *checkpoint, const npu_llama_opts_t *opts) {
+
+  struct stat st;
+  int fd;
+
+  npu_llama_t *model = calloc(1, sizeof(npu_llama_t));
+  if (model == NULL) {
+    return NULL;
+  }
+  model->ctx = ctx;
+
+  fd = open(checkpoint, O_RDONLY);
+  if (fd < 0) {
+    printf("npu_llama failed to open %s\n", checkpoint);
+    free(model);
+    return NULL;
+  }
+  if ((fstat(fd, &st) != 0) || (st.st_size < (off_t)sizeof(npu_llama_config_t))) {
+    printf("npu_llama %s is not a checkpoint\n", checkpoint);
+    close(fd);
+    free(model);
+    return NULL;
+  }
+  model->file_size = st.st_size;
+  model->data = mmap(NULL, model->file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (model->data == MAP_FAILED) {
+    model->data = NULL;
+    npu_llama_free(model);
+    return NULL;
+  }
+
+  npu_llama_config_t *p = &model->cfg;
+  memcpy(p, model->data, sizeof(*p));
+  int shared = p->vocab_size > 0;
+  p->vocab_size = abs(p->vocab_size);
+  if ((p->dim <= 0) || (p->n_heads <= 0) || (p->n_kv_heads <= 0) || (p->n_layers <= 0) || (p->seq_len <= 0) ||
+    (p->dim % p->n_heads) || (p->n_heads % p->n_kv_heads)) {
+    printf("npu_llama invalid config in %s\n", checkpoint);
+    npu_llama_free(model);
+    return NULL;
+  }
+  model->head_size = p->dim / p->n_heads;
+  model->kv_dim = p->n_kv_heads * model->head_size;
+  if ((p->dim % 32) || (p->hidden_dim % 32) || (model->kv_dim % 32) ||
+    (matmul_shape_init(&model->cls_shape, 1, p->dim, p->vocab_size) != 0)) {
+    printf("npu_llama dim %d, hidden_dim %d or kv_dim %d not aligned for the NPU\n",
+      p->dim, p->hidden_dim, model->kv_dim);
+    npu_llama_free(model);
+    return NULL;
+  }
+
+  size_t L = p->n_layers, dim = p->dim, hidden = p->hidden_dim, kv = model->kv_dim;
+  size_t floats = p->vocab_size * dim + L * dim + L * dim * dim + 2 * L * dim * kv + L * dim * dim + L * dim +
+    3 * L * dim * hidden + dim + p->seq_len * model->head_size + (shared ? 0 : p->vocab_size * dim);
+  if (sizeof(npu_llama_config_t) + floats * sizeof(float) > model->file_size) {
+    printf("npu_llama %s is truncated\n", checkpoint);
+    npu_llama_free(model);
+    return NULL;
+  }
+
+  const float *ptr = (const float *)((const uint8_t *)model->data + sizeof(npu_llama_config_t));
+  model->token_embedding = ptr; ptr += p->vocab_size * dim;
+  model->rms_att = ptr; ptr += L * dim;
+  const float *wq = ptr; ptr += L * dim * dim;
+  const float *wk = ptr; ptr += L * dim * kv;
+  const float *wv = ptr; ptr += L * dim * kv;
+  const float *wo = ptr; ptr += L * dim * dim;
+  model->rms_ffn = ptr; ptr += L * dim;
+  const float *w1 = ptr; ptr += L * dim * hidden;
+  const float *w2 = ptr; ptr += L * hidden * dim;
+  const float *w3 = ptr; ptr += L * dim * hidden;
+  model->rms_final = ptr; ptr += dim;
+  ptr += p->seq_len * model->head_size;     // legacy RoPE tables, computed on the fly
+  const float *wcls = shared ? model->token_embedding : ptr;
+
+  uint16_t qkv_n[3] = { dim, kv, kv };
+  npu_kvcache_cfg_t kv_cfg = { L, p->n_kv_heads, p->n_heads / p->n_kv_heads, model->head_size, p->seq_len,
+    (opts != NULL) && opts->kv_int8 };
+  npu_ffn_cfg_t ffn_cfg = { 1, dim, hidden, L };
+  model->x = calloc(dim, sizeof(float));
+  model->xb = calloc(dim, sizeof(float));
+  model->kv = npu_kvcache_create(ctx, &kv_cfg);
+  model->ffn = npu_ffn_create(ctx, &ffn_cfg);
+  if ((model->x == NULL) || (model->xb == NULL) || (model->kv == NULL) || (model->ffn == NULL) ||
+    (matmul_fused_init(&model->qkv_fused, dim, qkv_n, 3, 0) != 0) ||
+    (pack_qkv(model, wq, wk, wv, L) != 0) ||
+    (pack_weights(model, &model->wo, wo, L, dim, dim) != 0) ||
+    (pack_weights(model, &model->w1, w1, L, hidden, dim) != 0) ||
+    (pack_weights(model, &model->w2, w2, L, dim, hidden) != 0) ||
+    (pack_weights(model, &model->w3, w3, L, hidden, dim) != 0) ||
+    (pack_classifier(model, wcls) != 0) ||
+    (alloc_activation(model, &model->xb16, dim * sizeof(__fp16), RKNPU_MEM_TRY_ALLOC_SRAM) != 0) ||
+    (alloc_activation(model, &model->att16, dim * sizeof(__fp16), RKNPU_MEM_TRY_ALLOC_SRAM) != 0) ||
+    (alloc_activation(model, &model->qkv, (dim + 2 * kv) * sizeof(float), RKNPU_MEM_TRY_ALLOC_SRAM) != 0) ||
+    (alloc_activation(model, &model->xo, dim * sizeof(float), RKNPU_MEM_TRY_ALLOC_SRAM) != 0) ||
+    (alloc_activation(model, &model->logits, matmul_shape_output_size(&model->cls_shape, sizeof(float)), 0) != 0) ||
+    (gen_tasks(model) != 0)) {
+    npu_llama_free(model);
+    return NULL;
+  }
+  model->q = (float *)((uint8_t *)model->qkv.map + matmul_fused_output_offset(&model->qkv_fused, 0, 1, sizeof(float)));
+  model->k = (float *)((uint8_t *)model->qkv.map + matmul_fused_output_offset(&model->qkv_fused, 1, 1, sizeof(float)));
+  model->v = (float *)((uint8_t *)model->qkv.map + matmul_fused_output_offset(&model->qkv_fused, 2, 1, sizeof(float)));
+  return model;
+}
+
+void npu_llama_free(npu_llama_t *model) {
+
+  if (model == NULL) {
+    return;
+  }
+  npu_buffer_t *buffers[] = { &model->wqkv, &model->wo, &model->w1, &model->w2,
+    &model->w3, &model->wcls, &model->xb16, &model->att16, &model->qkv,
+    &model->xo, &model->logits, &model->scratch.regcmd, &model->scratch.tasks };
+  for (unsigned int i = 0; i < sizeof(buffers) / sizeof(buffers[0]); i++) {
+    npu_buffer_free(model->ctx, buffers[i]);
+  }
+  free(model->scratch.regs);
+  free(model->x);
+  free(model->xb);
+  npu_kvcache_destroy(model->kv);
+  npu_ffn_destroy(model->ffn);
+  if (model->data != NULL) {
+    munmap(model->data, model->file_size);
+  }
+  free(model);
+}
+
+const npu_llama_config_t *npu_llama_config(const npu_llama_t *model) {
+  return &model->cfg;
+}
+
+void npu_llama_stats(const npu_llama_t *model, npu_llama_stats_t *stats) {
+  npu_kvcache_stats_t kv;
+  npu_kvcache_stats(model->kv, &kv);
+  *stats = model->stats;
+  stats->submits += kv.submits;
+  stats->npu_ns += kv.npu_ns;
+}
+
+// Run the count slices of a projection, one per core
+static int run_tasks(npu_llama_t *model, int projection, int count) {
+
+  uint16_t core_task_start[NPU_CORES] = { 0 }, core_task_number[NPU_CORES] = { 0 };
+  int first = projection * NPU_CORES;
+
+  for (int c = 0; c < count; c++) {
+    core_task_start[c] = first + c;
+    core_task_number[c] = 1;
+  }
+  uint64_t start = now_ns();
+  int ret = npu_context_run(model->ctx, &model->scratch, first + count, core_task_start, core_task_number);
+  model->stats.npu_ns += now_ns() - start;
+  model->stats.submits++;
+  return ret;
+}
+
+static int run_ffn(npu_llama_t *model, int layer) {
+
+  uint64_t start = now_ns();
+  int ret = npu_ffn_run(model->ffn, layer);
+  model->stats.npu_ns += now_ns() - start;
+  model->stats.submits++;
+  return ret;
+}
+
+static void rmsnorm_fp16(__fp16 *o, const float *x, const float *weight, int size) {
+  float ss = 0.0f;
+  for (int j = 0; j < size; j++) {
+    ss += x[j] * x[j];
+  }
+  ss = 1.0f / sqrtf(ss / size + 1e-5f);
+  for (int j = 0; j < size; j++) {
+    o[j] = (__fp16)(weight[j] * (ss * x[j]));
+  }
+}
+
+/*
+ * Run one token at position pos, returns the vocab_size logits (valid
+ * until the next call) or NULL on failure.
+ */
+float *npu_llama_forward(npu_llama_t *model, int token, int pos) {
+
+  npu_llama_config_t *p = &model->cfg;
+  int dim = p->dim, kv_dim = model->kv_dim, head_size = model->head_size;
+  float *q = model->q, *k = model->k, *v = model->v;
+  float *xo = model->xo.map;
+  __fp16 *xb16 = model->xb16.map, *att16 = model->att16.map;
+  uint64_t start = now_ns();
+
+  if ((token < 0) || (token >= p->vocab_size) || (pos < 0) || (pos >= p->seq_len)) {
+    return NULL;
+  }
+  memcpy(model->x, model->token_embedding + (size_t)token * dim, dim * sizeof(float));
+
+  for (int l = 0; l < p->n_layers; l++) {
+    int t = l * llama_layer_projections;
+
+    rmsnorm_fp16(xb16, model->x, model->rms_att + l * dim, dim);
+    if (run_tasks(model, t + llama_qkv, model->projection_tasks[llama_qkv]) < 0) {
+      return NULL;
+    }
+
+    // RoPE on q and the new key, then append to the cache
+    for (int i = 0; i < dim; i += 2) {
+      float freq = 1.0f / powf(10000.0f, (i % head_size) / (float)head_size);
+      float fcr = cosf(pos * freq), fci = sinf(pos * freq);
+      float q0 = q[i], q1 = q[i+1];
+      q[i] = q0 * fcr - q1 * fci;
+      q[i+1] = q0 * fci + q1 * fcr;
+      if (i < kv_dim) {
+        float k0 = k[i], k1 = k[i+1];
+        k[i] = k0 * fcr - k1 * fci;
+        k[i+1] = k0 * fci + k1 * fcr;
+      }
+    }
+    if ((npu_kvcache_append(model->kv, l, pos, k, v) != 0) ||
+      (npu_kvcache_attend(model->kv, l, pos, q, model->xb) != 0)) {
+      return NULL;
+    }
+    for (int i = 0; i < dim; i++) {
+      att16[i] = (__fp16)model->xb[i];
+    }
+
+    if (run_tasks(model, t + llama_o, model->projection_tasks[llama_o]) < 0) {
+      return NULL;
+    }
+    for (int i = 0; i < dim; i++) {
+      model->x[i] += xo[i];
+    }
+
+    rmsnorm_fp16(xb16, model->x, model->rms_ffn + l * dim, dim);
+    if (run_ffn(model, l) < 0) {
+      return NULL;
+    }
+    for (int i = 0; i < dim; i++) {
+      model->x[i] += xo[i];
+    }
+  }
+
+  rmsnorm_fp16(xb16, model->x, model->rms_final, dim);
+  if (run_tasks(model, model->ntasks / NPU_CORES - 1, model->cls_tasks) < 0) {
+    return NULL;
+  }
+  model->stats.tokens++;
+  model->stats.total_ns += now_ns() - start;
+  return model->logits.map;
+}
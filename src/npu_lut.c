@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "npu_hw.h"
+#include "npu_lut.h"
+
+/*
+ * SiLU x / (1 + e^-x) over [-8, 8) in steps of 1/16. Below the table it
+ * is held at silu(-8) (within 3e-3 of the true value), above it continues
+ * as x.
+ */
+void npu_lut_silu(npu_lut_t *lut) {
+
+  lut->start = -8.0f;
+  lut->step_log2 = -4;
+  for (int i = 0; i < NPU_LUT_ENTRIES; i++) {
+    float x = lut->start + ldexpf((float)i, lut->step_log2);
+    lut->table[i] = (__fp16)(x / (1.0f + expf(-x)));
+  }
+  lut->uflow_slope = (__fp16)0.0f;
+  lut->oflow_slope = (__fp16)1.0f;
+}
+
+float npu_lut_end(const npu_lut_t *lut) {
+  return lut->start + ldexpf((float)(NPU_LUT_ENTRIES - 1), lut->step_log2);
+}
+
+// The value the DPU produces for x, for references on the CPU
+float npu_lut_eval(const npu_lut_t *lut, float x) {
+
+  float end = npu_lut_end(lut);
+
+  if (x < lut->start) {
+    return (float)lut->table[0] + (x - lut->start) * (float)lut->uflow_slope;
+  }
+  if (x >= end) {
+    return (float)lut->table[NPU_LUT_ENTRIES - 1] + (x - end) * (float)lut->oflow_slope;
+  }
+  float f = ldexpf(x - lut->start, -lut->step_log2);
+  int i = (int)f;
+  i = i > NPU_LUT_ENTRIES - 2 ? NPU_LUT_ENTRIES - 2 : i;
+  return (float)lut->table[i] + ((float)lut->table[i+1] - (float)lut->table[i]) * (f - i);
+}
+
+/*
+ * Register commands writing the table to the LO LUT RAM, the address
+ * incrementing with each data write. Returns the NPU_LUT_UPLOAD_OPS
+ * values written to ops.
+ */
+int gen_lut_upload(const npu_lut_t *lut, uint64_t *ops) {
+
+  // Write access (bit 17) to the LO table (bit 16) from address 0
+  ops[0] = NPUOP(OP_REG_DPU, (0x1 << 17) | (0x1 << 16), DPU_LUT_ACCESS_CFG);
+  for (int i = 0; i < NPU_LUT_ENTRIES; i++) {
+    uint16_t bits;
+    memcpy(&bits, &lut->table[i], sizeof(bits));
+    ops[1 + i] = NPUOP(OP_REG_DPU, bits, DPU_LUT_ACCESS_DATA);
+  }
+  return NPU_LUT_UPLOAD_OPS;
+}
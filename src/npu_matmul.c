@@ -19,6 +19,7 @@
  */
 
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <stdio.h>
@@ -28,6 +29,11 @@
 #include "npu_dpu.h"
 #include "npu_matmul.h"
 
+#ifdef NPU_DEBUG
+#define DEBUG_PRINTF(...) printf(__VA_ARGS__)
+#else
+#define DEBUG_PRINTF(...)
+#endif
 
 /*
  * Were only using cna & core, dpu outputs to memory
@@ -36,12 +42,15 @@
 void gen_matmul_task(uint64_t *ops, npu_cna_desc *cna_desc, npu_core_desc *core_desc, npu_dpu_desc *dpu_desc) {
 
   uint32_t value;
+  // EW fields beyond the bypasses are only set by generators enabling it
+  int ew_rdma = !dpu_desc->ew_bypass && !dpu_desc->ew_op_bypass && dpu_desc->ew_op_src;
+  int lut = !dpu_desc->ew_bypass && !dpu_desc->ew_lut_bypass;
 
-  printf("DEBUG: gen_matmul_task called\n");
-  printf("DEBUG: cna_desc->datain_channel=%u, cna_desc->weight_kernels=%u\n", 
+  DEBUG_PRINTF("DEBUG: gen_matmul_task called\n");
+  DEBUG_PRINTF("DEBUG: cna_desc->datain_channel=%u, cna_desc->weight_kernels=%u\n", 
          cna_desc->datain_channel, cna_desc->weight_kernels);
 
-  printf("DEBUG: Writing ops[0] to ops[10]\n");
+  DEBUG_PRINTF("DEBUG: Writing ops[0] to ops[10]\n");
   ops[0] = NPUOP(OP_REG_DPU, 0xE, DPU_S_POINTER);
   value = ((cna_desc->proc_precision & 0x7) <<7) |  ((cna_desc->in_precision & 0x7)<<4) | 
     (cna_desc->conv_mode & 0xf);
@@ -66,20 +75,23 @@ void gen_matmul_task(uint64_t *ops, npu_cna_desc *cna_desc, npu_core_desc *core_
     (cna_desc->weight_kernels & 0x3FFF);
   ops[10] = NPUOP(OP_REG_CNA, value, CNA_WEIGHT_SIZE2);
   
-  printf("DEBUG: Writing ops[11] to ops[20]\n");
-  value = ((cna_desc->weight_bank & 0xF) << 4) | (cna_desc->data_bank & 0xF);
+  DEBUG_PRINTF("DEBUG: Writing ops[11] to ops[20]\n");
+  value = ((cna_desc->weight_reuse & 0x1) << 13) | ((cna_desc->data_reuse & 0x1) << 12) |
+    ((cna_desc->weight_bank & 0xF) << 4) | (cna_desc->data_bank & 0xF);
   ops[11] = NPUOP(OP_REG_CNA, value, CNA_CBUF_CON0);
   value = cna_desc->data_entries & 0x1FFF;
   ops[12] = NPUOP(OP_REG_CNA, value, CNA_CBUF_CON1);
-  value = ((cna_desc->data_sign & 0x1) << 3) | ((cna_desc->cvt_type & 0x1)<< 1) | (cna_desc->cvt_bypass & 0x1);
+  value = ((cna_desc->cvt_truncate3 & 0x3F) << 22) | ((cna_desc->cvt_truncate2 & 0x3F) << 16) |
+    ((cna_desc->cvt_truncate1 & 0x3F) << 10) | ((cna_desc->cvt_truncate0 & 0x3F) << 4) |
+    ((cna_desc->data_sign & 0x1) << 3) | ((cna_desc->cvt_type & 0x1)<< 1) | (cna_desc->cvt_bypass & 0x1);
   ops[13] = NPUOP(OP_REG_CNA, value, CNA_CVT_CON0);
-  value = ((cna_desc->cvt_scale0 & 0xFFFF) << 16) | 0x0;
+  value = ((cna_desc->cvt_scale0 & 0xFFFF) << 16) | (cna_desc->cvt_offset0 & 0xFFFF);
   ops[14] = NPUOP(OP_REG_CNA, value, CNA_CVT_CON1);
-  value = ((cna_desc->cvt_scale1 & 0xFFFF) << 16) | 0x0;
+  value = ((cna_desc->cvt_scale1 & 0xFFFF) << 16) | (cna_desc->cvt_offset1 & 0xFFFF);
   ops[15] = NPUOP(OP_REG_CNA, value, CNA_CVT_CON2);
-  value = ((cna_desc->cvt_scale2 & 0xFFFF) << 16) | 0x0;
+  value = ((cna_desc->cvt_scale2 & 0xFFFF) << 16) | (cna_desc->cvt_offset2 & 0xFFFF);
   ops[16] = NPUOP(OP_REG_CNA, value, CNA_CVT_CON3);
-  value = ((cna_desc->cvt_scale3 & 0xFFFF) << 16) | 0x0;
+  value = ((cna_desc->cvt_scale3 & 0xFFFF) << 16) | (cna_desc->cvt_offset3 & 0xFFFF);
   ops[17] = NPUOP(OP_REG_CNA, value, CNA_CVT_CON4);
   value = cna_desc->fc_skip_en & 0x1;
   ops[18] = NPUOP(OP_REG_CNA, value, CNA_FC_CON0);
@@ -88,7 +100,7 @@ void gen_matmul_task(uint64_t *ops, npu_cna_desc *cna_desc, npu_core_desc *core_
   value = ((cna_desc->pad_left & 0xF) << 4) | (cna_desc->pad_top & 0xF);
   ops[20] = NPUOP(OP_REG_CNA, value, CNA_PAD_CON0);
 
-  printf("DEBUG: Writing ops[21] to ops[30]\n");
+  DEBUG_PRINTF("DEBUG: Writing ops[21] to ops[30]\n");
   ops[21] = NPUOP(OP_REG_CNA, cna_desc->feature_base_addr, CNA_FEATURE_DATA_ADDR);
   value = cna_desc->weight_offset & 0x1FFFF;
   ops[22] = NPUOP(OP_REG_CNA, value, CNA_FC_CON2);
@@ -102,28 +114,15 @@ void gen_matmul_task(uint64_t *ops, npu_cna_desc *cna_desc, npu_core_desc *core_
   ops[26] = NPUOP(OP_REG_CNA, value, CNA_FC_DATA_SIZE0);
   value = cna_desc->dma_channel & 0xFFFF;
   ops[27] = NPUOP(OP_REG_CNA, value, CNA_FC_DATA_SIZE1);
-  ops[28] = NPUOP(OP_REG_CNA, 0x0, CNA_DCOMP_CTRL);
-  ops[29] = NPUOP(OP_REG_CNA, 0x0, CNA_DCOMP_REGNUM);
+  ops[28] = NPUOP(OP_REG_CNA, cna_desc->dcomp_ctrl, CNA_DCOMP_CTRL);
+  ops[29] = NPUOP(OP_REG_CNA, cna_desc->dcomp_regnum, CNA_DCOMP_REGNUM);
   ops[30] = NPUOP(OP_REG_CNA, cna_desc->decompress_addr0, CNA_DCOMP_ADDR0);
 
-  printf("DEBUG: Writing ops[31] to ops[50]\n");
-  ops[31] = NPUOP(OP_REG_CNA, 0x0, CNA_DCOMP_AMOUNT);
-  ops[32] = NPUOP(OP_REG_CNA, 0x0, CNA_DCOMP_AMOUNT1);
-  ops[33] = NPUOP(OP_REG_CNA, 0x0, CNA_DCOMP_AMOUNT2);
-  ops[34] = NPUOP(OP_REG_CNA, 0x0, CNA_DCOMP_AMOUNT3);
-  ops[35] = NPUOP(OP_REG_CNA, 0x0, CNA_DCOMP_AMOUNT4);
-  ops[36] = NPUOP(OP_REG_CNA, 0x0, CNA_DCOMP_AMOUNT5);
-  ops[37] = NPUOP(OP_REG_CNA, 0x0, CNA_DCOMP_AMOUNT6);
-  ops[38] = NPUOP(OP_REG_CNA, 0x0, CNA_DCOMP_AMOUNT7);
-  ops[39] = NPUOP(OP_REG_CNA, 0x0, CNA_DCOMP_AMOUNT8);
-  ops[40] = NPUOP(OP_REG_CNA, 0x0, CNA_DCOMP_AMOUNT9);
-  ops[41] = NPUOP(OP_REG_CNA, 0x0, CNA_DCOMP_AMOUNT10);
-  ops[42] = NPUOP(OP_REG_CNA, 0x0, CNA_DCOMP_AMOUNT11);
-  ops[43] = NPUOP(OP_REG_CNA, 0x0, CNA_DCOMP_AMOUNT12);
-  ops[44] = NPUOP(OP_REG_CNA, 0x0, CNA_DCOMP_AMOUNT13);
-  ops[45] = NPUOP(OP_REG_CNA, 0x0, CNA_DCOMP_AMOUNT14);
-  ops[46] = NPUOP(OP_REG_CNA, 0x0, CNA_DCOMP_AMOUNT15);
-  ops[47] = NPUOP(OP_REG_CNA, 0x0, CNA_CVT_CON5);
+  DEBUG_PRINTF("DEBUG: Writing ops[31] to ops[50]\n");
+  for (int i = 0; i < 16; i++) {
+    ops[31+i] = NPUOP(OP_REG_CNA, cna_desc->dcomp_amount[i], (CNA_DCOMP_AMOUNT + (i * 4)));
+  }
+  ops[47] = NPUOP(OP_REG_CNA, cna_desc->cvt_channel_en, CNA_CVT_CON5);
   ops[48] = NPUOP(OP_REG_CNA, 0x0, CNA_PAD_CON1);
   value = ((core_desc->proc_precision & 0x7) << 8) | (core_desc->qd_en & 0x1);
   ops[49] = NPUOP(OP_REG_CORE, value, CORE_MISC_CFG);
@@ -134,7 +133,7 @@ void gen_matmul_task(uint64_t *ops, npu_cna_desc *cna_desc, npu_core_desc *core_
   ops[52] = NPUOP(OP_REG_CORE, 0x0, CORE_CLIP_TRUNCATE);
   ops[53] = NPUOP(OP_REG_CORE, 0x0, CORE_3030);
 
-  printf("DEBUG: Writing ops[54] to ops[70]\n");
+  DEBUG_PRINTF("DEBUG: Writing ops[54] to ops[70]\n");
   value = ((dpu_desc->burst_len & 0xF) << 5) | ((dpu_desc->conv_mode & 0x3) <<3) |
     ((dpu_desc->output_mode & 0x3) <<1) | (dpu_desc->flying_mode & 0x1);
   ops[54] = NPUOP(OP_REG_DPU, value, DPU_FEATURE_MODE_CFG);
@@ -175,6 +174,11 @@ void gen_matmul_task(uint64_t *ops, npu_cna_desc *cna_desc, npu_core_desc *core_
   value = ((dpu_desc->ew_relu_bypass & 0x1) << 9) | ((dpu_desc->ew_op_cvt_bypass & 0x1) << 8) |
     ((dpu_desc->ew_lut_bypass & 0x1) <<7) | ((dpu_desc->ew_op_bypass & 0x1) << 1) |
     (dpu_desc->ew_bypass & 0x1);
+  if (ew_rdma) {
+    // fp16 operand per element, same cube as the output. Field positions
+    // are inferred and unverified, as are the RDMA and LUT values below.
+    value |= (0x1 << 28) | (0x1 << 22) | ((dpu_desc->ew_op_src & 0x1) << 6) | ((dpu_desc->ew_op_type & 0x1) << 2);
+  }
   ops[75] = NPUOP(OP_REG_DPU, value, DPU_EW_CFG);
   ops[76] = NPUOP(OP_REG_DPU, 0x0, DPU_EW_CVT_OFFSET_VALUE);
   ops[77] = NPUOP(OP_REG_DPU, 0x1, DPU_EW_CVT_SCALE_VALUE);
@@ -183,46 +187,173 @@ void gen_matmul_task(uint64_t *ops, npu_cna_desc *cna_desc, npu_core_desc *core_
   value = ((dpu_desc->fp32tofp16_en & 0x1) << 16) | (dpu_desc->out_cvt_scale & 0xFFFF);
   ops[80] = NPUOP(OP_REG_DPU, value, DPU_OUT_CVT_SCALE);
   ops[81] = NPUOP(OP_REG_DPU, 0x0, DPU_OUT_CVT_SHIFT);
-  ops[82] = NPUOP(OP_REG_DPU, 0x0, DPU_EW_OP_VALUE_0);
-  ops[83] = NPUOP(OP_REG_DPU, 0x0, DPU_EW_OP_VALUE_1);
-  ops[84] = NPUOP(OP_REG_DPU, 0x0, DPU_EW_OP_VALUE_2);
-  ops[85] = NPUOP(OP_REG_DPU, 0x0, DPU_EW_OP_VALUE_3);
-  ops[86] = NPUOP(OP_REG_DPU, 0x0, DPU_EW_OP_VALUE_4);
-  ops[87] = NPUOP(OP_REG_DPU, 0x0, DPU_EW_OP_VALUE_5);
-  ops[88] = NPUOP(OP_REG_DPU, 0x0, DPU_EW_OP_VALUE_6);
-  ops[89] = NPUOP(OP_REG_DPU, 0x0, DPU_EW_OP_VALUE_7);
+  if (ew_rdma) {
+    // The constant operands are unused with the operand read from memory,
+    // their slots program the DPU RDMA instead
+    ops[82] = NPUOP(OP_REG_DPU_RDMA, dpu_desc->width & 0x1FFF, RDMA_DATA_CUBE_WIDTH);
+    ops[83] = NPUOP(OP_REG_DPU_RDMA, dpu_desc->height & 0x1FFF, RDMA_DATA_CUBE_HEIGHT);
+    ops[84] = NPUOP(OP_REG_DPU_RDMA, dpu_desc->channel & 0x1FFF, RDMA_DATA_CUBE_CHANNEL);
+    ops[85] = NPUOP(OP_REG_DPU_RDMA, (0x1 << 30) | (0x1 << 2), RDMA_ERDMA_CFG);
+    ops[86] = NPUOP(OP_REG_DPU_RDMA, dpu_desc->ew_base_addr, RDMA_EW_BASE_ADDR);
+    value = (dpu_desc->ew_surf_stride & 0xFFFFFFF) << 4;
+    ops[87] = NPUOP(OP_REG_DPU_RDMA, value, RDMA_EW_SURF_STRIDE);
+    value = ((dpu_desc->burst_len & 0xF) << 11) | ((precision_float16 & 0x7) << 5);
+    ops[88] = NPUOP(OP_REG_DPU_RDMA, value, RDMA_FEATURE_MODE_CFG);
+    ops[89] = NPUOP(OP_REG_DPU, 0x0, DPU_EW_OP_VALUE_0);
+  } else {
+    ops[82] = NPUOP(OP_REG_DPU, 0x0, DPU_EW_OP_VALUE_0);
+    ops[83] = NPUOP(OP_REG_DPU, 0x0, DPU_EW_OP_VALUE_1);
+    ops[84] = NPUOP(OP_REG_DPU, 0x0, DPU_EW_OP_VALUE_2);
+    ops[85] = NPUOP(OP_REG_DPU, 0x0, DPU_EW_OP_VALUE_3);
+    ops[86] = NPUOP(OP_REG_DPU, 0x0, DPU_EW_OP_VALUE_4);
+    ops[87] = NPUOP(OP_REG_DPU, 0x0, DPU_EW_OP_VALUE_5);
+    ops[88] = NPUOP(OP_REG_DPU, 0x0, DPU_EW_OP_VALUE_6);
+    ops[89] = NPUOP(OP_REG_DPU, 0x0, DPU_EW_OP_VALUE_7);
+  }
   value = ((dpu_desc->surf_add & 0xFFFFFFF) << 4);
   ops[90] = NPUOP(OP_REG_DPU, value, DPU_SURFACE_ADD);
   ops[91] = NPUOP(OP_REG_DPU, 0x0, DPU_40C4);
   ops[92] = NPUOP(OP_REG_DPU, 0x0, DPU_LUT_ACCESS_CFG);
   ops[93] = NPUOP(OP_REG_DPU, 0x0, DPU_LUT_ACCESS_DATA);
-  ops[94] = NPUOP(OP_REG_DPU, 0x0, DPU_LUT_CFG);
-  ops[95] = NPUOP(OP_REG_DPU, 0x0, DPU_LUT_INFO);
+  // Only the LO table is used, the LE range is left empty
+  ops[94] = NPUOP(OP_REG_DPU, lut ? dpu_desc->lut_cfg : 0x0, DPU_LUT_CFG);
+  ops[95] = NPUOP(OP_REG_DPU, lut ? dpu_desc->lut_info : 0x0, DPU_LUT_INFO);
   ops[96] = NPUOP(OP_REG_DPU, 0x0, DPU_LUT_LE_START);
   ops[97] = NPUOP(OP_REG_DPU, 0x0, DPU_LUT_LE_END);
-  ops[98] = NPUOP(OP_REG_DPU, 0x0, DPU_LUT_LO_START);
-  ops[99] = NPUOP(OP_REG_DPU, 0x0, DPU_LUT_LO_END);
+  ops[98] = NPUOP(OP_REG_DPU, lut ? dpu_desc->lut_lo_start : 0x0, DPU_LUT_LO_START);
+  ops[99] = NPUOP(OP_REG_DPU, lut ? dpu_desc->lut_lo_end : 0x0, DPU_LUT_LO_END);
   ops[100] = NPUOP(OP_REG_DPU, 0x0, DPU_LUT_LE_SLOPE_SCALE);
   ops[101] = NPUOP(OP_REG_DPU, 0x0, DPU_LUT_LE_SLOPE_SHIFT);
-  ops[102] = NPUOP(OP_REG_DPU, 0x0, DPU_LUT_LO_SLOPE_SCALE);
+  ops[102] = NPUOP(OP_REG_DPU, lut ? dpu_desc->lut_lo_slope_scale : 0x0, DPU_LUT_LO_SLOPE_SCALE);
   ops[103] = NPUOP(OP_REG_DPU, 0x0, DPU_LUT_LO_SLOPE_SHIFT);
   ops[104] = NPUOP(OP_NONE, 0x0, 0x0);
   ops[105] = NPUOP(OP_REG_PC, 0x0, PC_REGISTER_AMOUNTS);
   ops[106] = NPUOP(OP_40, 0x0, 0x0);
-  ops[107] = NPUOP(OP_ENABLE, (PC_ENABLE_DPU | PC_ENABLE_CNA | PC_ENABLE), PC_OPERATION_ENABLE);
+  value = PC_ENABLE_DPU | PC_ENABLE_CNA | PC_ENABLE | (ew_rdma ? PC_ENABLE_DPU_RDMA : 0);
+  ops[107] = NPUOP(OP_ENABLE, value, PC_OPERATION_ENABLE);
 
-  printf("DEBUG: gen_matmul_task completed successfully\n");
-  printf("DEBUG: Total operations written: 108 (ops[0] to ops[107])\n");
-  printf("DEBUG: Expected regcfg_amount: 104\n");
-  printf("DEBUG: Mismatch: 108 - 104 = 4 operations extra\n");
+  DEBUG_PRINTF("DEBUG: gen_matmul_task completed successfully\n");
+  DEBUG_PRINTF("DEBUG: Total operations written: 108 (ops[0] to ops[107])\n");
+  DEBUG_PRINTF("DEBUG: Expected regcfg_amount: 104\n");
+  DEBUG_PRINTF("DEBUG: Mismatch: 108 - 104 = 4 operations extra\n");
+}
+
+/*
+ * Point the PC at the register block of the following task so a list
+ * of tasks is walked by the hardware from a single submit. Passing a
+ * next_regcmd_dma of 0 terminates the chain.
+ */
+void gen_task_chain(uint64_t *ops, uint32_t next_regcmd_dma, uint32_t next_regcfg_amount) {
+
+  uint32_t amount = 0;
+
+  if (next_regcmd_dma != 0) {
+    amount = ((next_regcfg_amount + NPU_PC_DATA_EXTRA_AMOUNT + NPU_PC_DATA_AMOUNT_SCALE - 1) /
+      NPU_PC_DATA_AMOUNT_SCALE) - 1;
+    ops[104] = NPUOP(OP_REG_PC, next_regcmd_dma & 0xFFFFFFF0, PC_BASE_ADDRESS);
+  } else {
+    ops[104] = NPUOP(OP_NONE, 0x0, 0x0);
+  }
+  ops[105] = NPUOP(OP_REG_PC, amount & 0xFFFF, PC_REGISTER_AMOUNTS);
+}
+
+/*
+ * The decompressor's bitstream format hasn't been confirmed on hardware,
+ * so compressed weights are refused unless NPU_DCOMP_EXPERIMENTAL is set.
+ */
+static int dcomp_experimental(const npu_dcomp_info_t *dcomp) {
+  return (dcomp == NULL) || (getenv("NPU_DCOMP_EXPERIMENTAL") != NULL);
+}
+
+/*
+ * Weights compressed with weight_compress are streamed through the CNA
+ * decompressor, otherwise decompress is left disabled and CNA_DCOMP_ADDR0
+ * is just the raw weight address.
+ */
+static void set_weight_dcomp(npu_cna_desc *cna_desc, const npu_dcomp_info_t *dcomp) {
+
+  memset(cna_desc->dcomp_amount, 0, sizeof(cna_desc->dcomp_amount));
+  cna_desc->dcomp_ctrl = 0;
+  cna_desc->dcomp_regnum = 0;
+  if (dcomp == NULL) {
+    return;
+  }
+  cna_desc->dcomp_ctrl = 0x1;
+  cna_desc->dcomp_regnum = dcomp->segments;
+  for (int i = 0; i < dcomp->segments; i++) {
+    cna_desc->dcomp_amount[i] = dcomp->amount[i];
+  }
+}
+
+/*
+ * Output channels per task, N is only split when tuned to and the
+ * weights aren't compressed (segments span the whole of N). Tiles are
+ * a multiple of 32 so they start on a kernel group for fp16 and int8.
+ */
+static unsigned int matmul_tile_n(const matmul_params_t *params) {
+  unsigned int tile_n = (params->tune != NULL) ? params->tune->tile_n : 0;
+  if ((tile_n == 0) || (tile_n >= params->n) || ((tile_n % NPU_TUNE_TILE_ALIGN) != 0) ||
+    (params->n > tile_n * NPU_TUNE_MAX_TASKS) || (params->dcomp != NULL)) {
+    return params->n;
+  }
+  return tile_n;
+}
+
+int matmul_task_count(const matmul_params_t *params) {
+  unsigned int tile_n = matmul_tile_n(params);
+  unsigned int batch = params->batch > 0 ? params->batch : 1;
+  return ((params->n + tile_n - 1) / tile_n) * batch;
+}
+
+/*
+ * Emit one task per tile of tile_n output channels and input of the
+ * batch. Each tile's weights and output planes are contiguous in the
+ * weight_fp16/weight_int8 and feature_data layouts. Tiles are the outer
+ * loop so a tile's weights stay in the CBUF while the batch streams
+ * through (weight stationary), for a single input the feature data stays
+ * in the CBUF instead.
+ */
+static void gen_matmul_tiles(matmul_params_t *params, npu_cna_desc *cna_desc, npu_core_desc *core_desc,
+  npu_dpu_desc *dpu_desc, unsigned int in_size, unsigned int out_size) {
+
+   unsigned int tile_n = matmul_tile_n(params);
+   unsigned int tiles = (params->n + tile_n - 1) / tile_n;
+   unsigned int batch = params->batch > 0 ? params->batch : 1;
+   unsigned int tasks = tiles * batch;
+
+   npu_tune_apply(params->tune, cna_desc, dpu_desc);
+   for (unsigned int i = 0; i < tasks; i++) {
+     uint64_t *ops = params->tasks + (i * NPU_TASK_OPS);
+     unsigned int tile = i / batch;
+     unsigned int b = i % batch;
+     unsigned int n0 = tile * tile_n;
+     unsigned int kernels = (params->n - n0) < tile_n ? (params->n - n0) : tile_n;
+
+     cna_desc->weight_kernels = kernels;
+     cna_desc->weight_bytes = cna_desc->weight_bytes_per_kernel * kernels;
+     uint8_t resident = cna_desc->weight_bytes <= (uint32_t)cna_desc->weight_bank * NPU_CBUF_BANK_SIZE;
+     cna_desc->weight_reuse = ((b > 0) || ((i == 0) && params->weights_resident)) && resident;
+     cna_desc->data_reuse = (batch == 1) && (i > 0);
+     cna_desc->feature_base_addr = params->input_dma + b * params->input_stride;
+     cna_desc->decompress_addr0 = params->weights_dma + n0 * params->k * in_size;
+     core_desc->dataout_channel = kernels - 1;
+     dpu_desc->channel = core_desc->dataout_channel;
+     dpu_desc->channel_wdma = core_desc->dataout_channel;
+     dpu_desc->dst_base_addr = params->output_dma + b * params->output_stride + n0 * params->m * out_size;
+     dpu_desc->ew_base_addr = params->ew_mul_dma + n0 * params->m * sizeof(__fp16);
+     gen_matmul_task(ops, cna_desc, core_desc, dpu_desc);
+     if ((i + 1 < tasks) && (params->regcmd_dma != 0)) {
+       gen_task_chain(ops, params->regcmd_dma + (i + 1) * NPU_TASK_OPS * sizeof(uint64_t), NPU_TASK_REGCFG_AMOUNT);
+     }
+   }
 }
 
 /*
  * Simplified version of matrix mutliplication because :
  * a) we fail if cbuf storage is exceeded ie M,K,N get too large
- * b) because of (a) only generates a single task
+ * b) because of (a) only generates a single task per input, unless tuned to split N
  *
- * task memory needs to hold at laest 112 values
+ * task memory needs to hold at laest 112 values per task
  * TODO: Fix a) & b) 
  *
  */
@@ -238,7 +369,20 @@ int gen_matmul_fp16(matmul_params_t *params) {
    int surf_stride;
 
    // Add debug output
-   printf("DEBUG: gen_matmul_fp16 called with params: m=%d, k=%d, n=%d\n", params->m, params->k, params->n);
+   DEBUG_PRINTF("DEBUG: gen_matmul_fp16 called with params: m=%d, k=%d, n=%d\n", params->m, params->k, params->n);
+
+   if ((params->batch > 1) && ((params->ew_mul_dma != 0) || (params->lut != NULL))) {
+     return -1;
+   }
+
+   if (!dcomp_experimental(params->dcomp)) {
+     return -1;
+   }
+
+   // Tasks after the first are only reached through the chain
+   if ((matmul_task_count(params) > 1) && (params->regcmd_dma == 0)) {
+     return -3;
+   }
 
    cna_desc.conv_mode = direct_convolution;
    cna_desc.in_precision = precision_float16;
@@ -270,30 +414,32 @@ int gen_matmul_fp16(matmul_params_t *params) {
    weight_banks = ((cna_desc.weight_bytes % NPU_CBUF_BANK_SIZE)==0) ? weight_banks : weight_banks + 1;
    
    // Add debug output for CBUF calculations
-   printf("DEBUG: CBUF calculations:\n");
-   printf("  fd_bytes=%u, NPU_CBUF_BANK_SIZE=%u\n", fd_bytes, NPU_CBUF_BANK_SIZE);
-   printf("  weight_bytes_per_kernel=%u\n", cna_desc.weight_bytes_per_kernel);
-   printf("  weight_bytes=%u\n", cna_desc.weight_bytes);
-   printf("  fd_banks calculation: %u / %u = %u, remainder %u\n", 
+   DEBUG_PRINTF("DEBUG: CBUF calculations:\n");
+   DEBUG_PRINTF("  fd_bytes=%u, NPU_CBUF_BANK_SIZE=%u\n", fd_bytes, NPU_CBUF_BANK_SIZE);
+   DEBUG_PRINTF("  weight_bytes_per_kernel=%u\n", cna_desc.weight_bytes_per_kernel);
+   DEBUG_PRINTF("  weight_bytes=%u\n", cna_desc.weight_bytes);
+   DEBUG_PRINTF("  fd_banks calculation: %u / %u = %u, remainder %u\n", 
           fd_bytes, NPU_CBUF_BANK_SIZE, fd_bytes / NPU_CBUF_BANK_SIZE, fd_bytes % NPU_CBUF_BANK_SIZE);
-   printf("  weight_banks calculation: %u / %u = %u, remainder %u\n", 
+   DEBUG_PRINTF("  weight_banks calculation: %u / %u = %u, remainder %u\n", 
           cna_desc.weight_bytes, NPU_CBUF_BANK_SIZE, cna_desc.weight_bytes / NPU_CBUF_BANK_SIZE, cna_desc.weight_bytes % NPU_CBUF_BANK_SIZE);
    
    if ((fd_banks) > NPU_CBUF_BANKS-1) {
-     printf("DEBUG: ERROR: fd_banks (%u) > NPU_CBUF_BANKS-1 (%u), returning -1\n", fd_banks, NPU_CBUF_BANKS-1);
+     DEBUG_PRINTF("DEBUG: ERROR: fd_banks (%u) > NPU_CBUF_BANKS-1 (%u), returning -1\n", fd_banks, NPU_CBUF_BANKS-1);
      return -1;
    } else {
        if (cna_desc.weight_bytes_per_kernel <= NPU_CBUF_BANK_SIZE) {
         weight_banks = NPU_CBUF_BANKS - fd_banks;
-        printf("DEBUG: weight_banks recalculated to %u\n", weight_banks);
-        printf("DEBUG: Total banks used: %u + %u = %u (max: %u)\n", fd_banks, weight_banks, fd_banks + weight_banks, NPU_CBUF_BANKS);
+        DEBUG_PRINTF("DEBUG: weight_banks recalculated to %u\n", weight_banks);
+        DEBUG_PRINTF("DEBUG: Total banks used: %u + %u = %u (max: %u)\n", fd_banks, weight_banks, fd_banks + weight_banks, NPU_CBUF_BANKS);
        } else {
-         printf("DEBUG: ERROR: weight_bytes_per_kernel (%u) > NPU_CBUF_BANK_SIZE (%u), returning -2\n", 
+         DEBUG_PRINTF("DEBUG: ERROR: weight_bytes_per_kernel (%u) > NPU_CBUF_BANK_SIZE (%u), returning -2\n", 
                 cna_desc.weight_bytes_per_kernel, NPU_CBUF_BANK_SIZE);
          return -2;
        }
    }
 
+   cna_desc.weight_reuse = 0;
+   cna_desc.data_reuse = 0;
    cna_desc.weight_bank = weight_banks;
    cna_desc.data_bank = fd_banks;
    cna_desc.data_entries = (cna_desc.datain_width * cna_desc.datain_channel) / 32;
@@ -306,6 +452,15 @@ int gen_matmul_fp16(matmul_params_t *params) {
    cna_desc.cvt_scale1 = 0x1;
    cna_desc.cvt_scale2 = 0x1;
    cna_desc.cvt_scale3 = 0x1;
+   cna_desc.cvt_offset0 = 0;
+   cna_desc.cvt_offset1 = 0;
+   cna_desc.cvt_offset2 = 0;
+   cna_desc.cvt_offset3 = 0;
+   cna_desc.cvt_truncate0 = 0;
+   cna_desc.cvt_truncate1 = 0;
+   cna_desc.cvt_truncate2 = 0;
+   cna_desc.cvt_truncate3 = 0;
+   cna_desc.cvt_channel_en = 0;
    cna_desc.fc_skip_en = 0;
    cna_desc.data_offset = 0x0;
    cna_desc.pad_left = 0;
@@ -322,6 +477,7 @@ int gen_matmul_fp16(matmul_params_t *params) {
    cna_desc.dma_height = cna_desc.datain_height;
    cna_desc.dma_channel = cna_desc.datain_channel;
    cna_desc.decompress_addr0 = params->weights_dma;
+   set_weight_dcomp(&cna_desc, params->dcomp);
 
    core_desc.proc_precision = precision_float16;
    core_desc.qd_en = 1;
@@ -341,19 +497,34 @@ int gen_matmul_fp16(matmul_params_t *params) {
    dpu_desc.width = core_desc.dataout_width ;
    dpu_desc.height = core_desc.dataout_height;
    dpu_desc.channel = core_desc.dataout_channel;
-   dpu_desc.bs_bypass = 1;
+   dpu_desc.bs_bypass = params->relu ? 0 : 1;
    dpu_desc.bs_alu_bypass = 1;
    dpu_desc.bs_mul_bypass = 1;
-   dpu_desc.bs_relu_bypass = 1;
+   dpu_desc.bs_relu_bypass = params->relu ? 0 : 1;
    dpu_desc.bn_bypass =1;
    dpu_desc.bn_alu_bypass = 1;
    dpu_desc.bn_mul_bypass = 1;
    dpu_desc.bn_relu_bypass = 1;
-   dpu_desc.ew_bypass =1;
-   dpu_desc.ew_op_bypass =1;
-   dpu_desc.ew_lut_bypass =1;
+   dpu_desc.ew_bypass = (params->ew_mul_dma == 0) && (params->lut == NULL);
+   dpu_desc.ew_op_bypass = params->ew_mul_dma == 0;
+   dpu_desc.ew_lut_bypass = params->lut == NULL;
    dpu_desc.ew_op_cvt_bypass =1;
    dpu_desc.ew_relu_bypass=1;
+   dpu_desc.ew_op_type = 1;
+   dpu_desc.ew_op_src = 1;
+   dpu_desc.ew_surf_stride = cna_desc.dataout_height * cna_desc.dataout_width;
+   if (params->lut != NULL) {
+     float start = params->lut->start, end = npu_lut_end(params->lut);
+     uint16_t uflow, oflow;
+     memcpy(&uflow, &params->lut->uflow_slope, sizeof(uflow));
+     memcpy(&oflow, &params->lut->oflow_slope, sizeof(oflow));
+     // LO table for hits in both ranges and both out of range ends
+     dpu_desc.lut_cfg = (0x1 << 6) | (0x1 << 5) | (0x1 << 4);
+     dpu_desc.lut_info = (uint32_t)(uint8_t)params->lut->step_log2 << 16;
+     memcpy(&dpu_desc.lut_lo_start, &start, sizeof(start));
+     memcpy(&dpu_desc.lut_lo_end, &end, sizeof(end));
+     dpu_desc.lut_lo_slope_scale = ((uint32_t)oflow << 16) | uflow;
+   }
    dpu_desc.fp32tofp16_en = params->fp32tofp16 & 0x1;
    dpu_desc.out_cvt_scale =1;
    if (params->fp32tofp16 ==0) {
@@ -371,7 +542,8 @@ int gen_matmul_fp16(matmul_params_t *params) {
    dpu_desc.channel_wdma = core_desc.dataout_channel;
    dpu_desc.surf_add = (!params->fp32tofp16) ? dpu_desc.dst_surf_stride * 4 : dpu_desc.dst_surf_stride * 2;
 
-   gen_matmul_task(params->tasks,&cna_desc,&core_desc,&dpu_desc);
+   gen_matmul_tiles(params, &cna_desc, &core_desc, &dpu_desc, sizeof(__fp16),
+     (!params->fp32tofp16) ? sizeof(float) : sizeof(__fp16));
 
    return 0;
 }
@@ -379,9 +551,9 @@ int gen_matmul_fp16(matmul_params_t *params) {
 /*
  * Simplified version of matrix mutliplication because :
  * a) we fail if cbuf storage is exceeded ie M,K,N get too large
- * b) because of (a) only generates a single task
+ * b) because of (a) only generates a single task per input, unless tuned to split N
  *
- * task memory needs to hold at laest 112 values
+ * task memory needs to hold at laest 112 values per task
  * TODO: Fix a) & b)
  *
  */
@@ -396,6 +568,14 @@ int gen_matmul_int8(matmul_params_t *params) {
    unsigned int weight_banks;
    int surf_stride;
 
+   if ((params->ew_mul_dma != 0) || (params->lut != NULL) || !dcomp_experimental(params->dcomp)) {
+     return -1;
+   }
+
+   if ((matmul_task_count(params) > 1) && (params->regcmd_dma == 0)) {
+     return -3;
+   }
+
    cna_desc.conv_mode = direct_convolution;
    cna_desc.in_precision = precision_int8;
    cna_desc.proc_precision = precision_int8;
@@ -425,25 +605,27 @@ int gen_matmul_int8(matmul_params_t *params) {
    weight_banks = (cna_desc.weight_bytes / NPU_CBUF_BANK_SIZE);
    weight_banks = ((cna_desc.weight_bytes % NPU_CBUF_BANK_SIZE)==0) ? weight_banks : weight_banks + 1;
    
-   printf("DEBUG: int8 CBUF calculations:\n");
-   printf("  fd_bytes=%u, weight_bytes=%u\n", fd_bytes, cna_desc.weight_bytes);
-   printf("  fd_banks=%u, weight_banks=%u (available: %u)\n", 
+   DEBUG_PRINTF("DEBUG: int8 CBUF calculations:\n");
+   DEBUG_PRINTF("  fd_bytes=%u, weight_bytes=%u\n", fd_bytes, cna_desc.weight_bytes);
+   DEBUG_PRINTF("  fd_banks=%u, weight_banks=%u (available: %u)\n", 
           fd_banks, weight_banks, NPU_CBUF_BANKS);
    
    if ((fd_banks) > NPU_CBUF_BANKS-1) {
-     printf("DEBUG: ERROR: fd_banks (%u) > NPU_CBUF_BANKS-1 (%u), returning -1\n", fd_banks, NPU_CBUF_BANKS-1);
+     DEBUG_PRINTF("DEBUG: ERROR: fd_banks (%u) > NPU_CBUF_BANKS-1 (%u), returning -1\n", fd_banks, NPU_CBUF_BANKS-1);
      return -1;
    } else {
        if (cna_desc.weight_bytes_per_kernel <= NPU_CBUF_BANK_SIZE) {
         weight_banks = NPU_CBUF_BANKS - fd_banks;
-        printf("DEBUG: weight_banks recalculated to %u\n", weight_banks);
+        DEBUG_PRINTF("DEBUG: weight_banks recalculated to %u\n", weight_banks);
        } else {
-         printf("DEBUG: ERROR: weight_bytes_per_kernel (%u) > NPU_CBUF_BANK_SIZE (%u), returning -2\n", 
+         DEBUG_PRINTF("DEBUG: ERROR: weight_bytes_per_kernel (%u) > NPU_CBUF_BANK_SIZE (%u), returning -2\n", 
                 cna_desc.weight_bytes_per_kernel, NPU_CBUF_BANK_SIZE);
          return -2;
        }
    }
 
+   cna_desc.weight_reuse = 0;
+   cna_desc.data_reuse = 0;
    cna_desc.weight_bank = weight_banks;
    cna_desc.data_bank = fd_banks;
    cna_desc.data_entries = (cna_desc.datain_width * cna_desc.datain_channel) / 64;
@@ -456,6 +638,15 @@ int gen_matmul_int8(matmul_params_t *params) {
    cna_desc.cvt_scale1 = 0x1;
    cna_desc.cvt_scale2 = 0x1;
    cna_desc.cvt_scale3 = 0x1;
+   cna_desc.cvt_offset0 = 0;
+   cna_desc.cvt_offset1 = 0;
+   cna_desc.cvt_offset2 = 0;
+   cna_desc.cvt_offset3 = 0;
+   cna_desc.cvt_truncate0 = 0;
+   cna_desc.cvt_truncate1 = 0;
+   cna_desc.cvt_truncate2 = 0;
+   cna_desc.cvt_truncate3 = 0;
+   cna_desc.cvt_channel_en = 0;
    cna_desc.fc_skip_en = 0;
    cna_desc.data_offset = 0x0;
    cna_desc.pad_left = 0;
@@ -472,6 +663,7 @@ int gen_matmul_int8(matmul_params_t *params) {
    cna_desc.dma_height = cna_desc.datain_height;
    cna_desc.dma_channel = cna_desc.datain_channel;
    cna_desc.decompress_addr0 = params->weights_dma;
+   set_weight_dcomp(&cna_desc, params->dcomp);
 
    core_desc.proc_precision = precision_int8;
    core_desc.qd_en = 0;
@@ -491,10 +683,10 @@ int gen_matmul_int8(matmul_params_t *params) {
    dpu_desc.width = core_desc.dataout_width ;
    dpu_desc.height = core_desc.dataout_height;
    dpu_desc.channel = core_desc.dataout_channel;
-   dpu_desc.bs_bypass = 1;
+   dpu_desc.bs_bypass = params->relu ? 0 : 1;
    dpu_desc.bs_alu_bypass = 1;
    dpu_desc.bs_mul_bypass = 1;
-   dpu_desc.bs_relu_bypass = 1;
+   dpu_desc.bs_relu_bypass = params->relu ? 0 : 1;
    dpu_desc.bn_bypass =1;
    dpu_desc.bn_alu_bypass = 1;
    dpu_desc.bn_mul_bypass = 1;
@@ -515,11 +707,277 @@ int gen_matmul_int8(matmul_params_t *params) {
    dpu_desc.channel_wdma = core_desc.dataout_channel;
    dpu_desc.surf_add = dpu_desc.dst_surf_stride * 8;
 
-   gen_matmul_task(params->tasks,&cna_desc,&core_desc,&dpu_desc);
+   gen_matmul_tiles(params, &cna_desc, &core_desc, &dpu_desc, sizeof(int8_t), sizeof(int32_t));
 
    return 0;
 }
 
+static void matmul_batch_gemm(const matmul_batch_params_t *params, unsigned int i, matmul_gemm_t *gemm) {
+  if (params->gemms != NULL) {
+    *gemm = params->gemms[i];
+    return;
+  }
+  gemm->m = params->m;
+  gemm->k = params->k;
+  gemm->n = params->n;
+  gemm->input_dma = params->input_dma + i * params->input_stride;
+  gemm->weights_dma = params->weights_dma + i * params->weights_stride;
+  gemm->output_dma = params->output_dma + i * params->output_stride;
+}
+
+/*
+ * One task per matmul, split into contiguous ranges of roughly equal
+ * MACs per core. Each range is chained so the cores walk their tasks in
+ * parallel from a single submit, consecutive matmuls on a core sharing
+ * weights (a weights_stride of 0) reuse them from the CBUF.
+ */
+static int gen_matmul_batch(matmul_batch_params_t *params, int (*gen)(matmul_params_t *)) {
+
+  unsigned int cores = ((params->cores > 0) && (params->cores < NPU_CORES)) ? params->cores : NPU_CORES;
+  uint64_t total = 0, done = 0;
+  matmul_gemm_t gemm, prev;
+  matmul_params_t mp;
+  unsigned int core = 0;
+  int ret;
+
+  memset(&prev, 0, sizeof(prev));
+  memset(params->core_task_start, 0, sizeof(params->core_task_start));
+  memset(params->core_task_number, 0, sizeof(params->core_task_number));
+  for (unsigned int i = 0; i < params->count; i++) {
+    matmul_batch_gemm(params, i, &gemm);
+    total += (uint64_t)gemm.m * gemm.k * gemm.n;
+  }
+
+  for (unsigned int i = 0; i < params->count; i++) {
+    matmul_batch_gemm(params, i, &gemm);
+
+    // Move to the next core once this one has its share of the MACs
+    if ((core + 1 < cores) && (params->core_task_number[core] > 0) &&
+      (done * cores >= total * (core + 1))) {
+      core++;
+      params->core_task_start[core] = i;
+    }
+    if ((params->core_task_number[core] > 0) && (params->regcmd_dma == 0)) {
+      printf("matmul %u of batch needs regcmd_dma to chain from the previous task on core %u\n", i, core);
+      return -3;
+    }
+
+    memset(&mp, 0, sizeof(mp));
+    mp.m = gemm.m;
+    mp.k = gemm.k;
+    mp.n = gemm.n;
+    mp.input_dma = gemm.input_dma;
+    mp.weights_dma = gemm.weights_dma;
+    mp.output_dma = gemm.output_dma;
+    mp.tasks = params->tasks + (i * NPU_TASK_OPS);
+    mp.fp32tofp16 = params->fp32tofp16;
+    mp.relu = params->relu;
+    // The bank split depends on m as well, the weights have to be in the
+    // same banks to be reused
+    mp.weights_resident = (params->core_task_number[core] > 0) && (prev.weights_dma == gemm.weights_dma) &&
+      (prev.m == gemm.m) && (prev.k == gemm.k) && (prev.n == gemm.n);
+    if ((ret = gen(&mp)) != 0) {
+      printf("matmul %u of batch [%u,%u]x[%u,%u] failed %d\n", i, gemm.m, gemm.k, gemm.n, gemm.k, ret);
+      return ret;
+    }
+
+    // Chain from the previous task on the same core
+    if (params->core_task_number[core] > 0) {
+      gen_task_chain(params->tasks + ((i - 1) * NPU_TASK_OPS),
+        params->regcmd_dma + i * NPU_TASK_OPS * sizeof(uint64_t), NPU_TASK_REGCFG_AMOUNT);
+    }
+    params->core_task_number[core]++;
+    done += (uint64_t)gemm.m * gemm.k * gemm.n;
+    prev = gemm;
+  }
+  return 0;
+}
+
+int gen_matmul_batch_fp16(matmul_batch_params_t *params) {
+  return gen_matmul_batch(params, gen_matmul_fp16);
+}
+
+int gen_matmul_batch_int8(matmul_batch_params_t *params) {
+  return gen_matmul_batch(params, gen_matmul_int8);
+}
+
+/*
+ * Matrix vector product (params->m of 1) for decode. With a single input
+ * row every weight is used once whichever operand the CNA streams, so a
+ * core's MAC array is bound by how fast it takes in weights. N is split
+ * into a slice of whole kernel groups per core, slice i as task i run by
+ * core i, and the weights stream into all the MAC arrays at once. For
+ * M = 1 the output is a plain vector so each slice writes its own
+ * contiguous part. Uses m, k, n, the dma addresses, fp32tofp16, relu and
+ * cores of params, returns the number of tasks or < 0 on failure.
+ */
+int gen_matmul_gemv_fp16(matmul_batch_params_t *params) {
+
+  unsigned int cores = ((params->cores > 0) && (params->cores < NPU_CORES)) ? params->cores : NPU_CORES;
+  unsigned int out_size = params->fp32tofp16 ? sizeof(__fp16) : sizeof(float);
+  unsigned int slice, tasks = 0;
+  matmul_params_t mp;
+  int ret;
+
+  if ((params->m != 1) || (params->n == 0) || (params->n % 16)) {
+    return -1;
+  }
+  memset(params->core_task_start, 0, sizeof(params->core_task_start));
+  memset(params->core_task_number, 0, sizeof(params->core_task_number));
+  slice = ((params->n + cores - 1) / cores + 15) / 16 * 16;
+
+  for (unsigned int n0 = 0; n0 < params->n; n0 += slice, tasks++) {
+    memset(&mp, 0, sizeof(mp));
+    mp.m = 1;
+    mp.k = params->k;
+    mp.n = (params->n - n0) < slice ? (params->n - n0) : slice;
+    mp.input_dma = params->input_dma;
+    mp.weights_dma = params->weights_dma + n0 * params->k * sizeof(__fp16);
+    mp.output_dma = params->output_dma + n0 * out_size;
+    mp.tasks = params->tasks + (tasks * NPU_TASK_OPS);
+    mp.fp32tofp16 = params->fp32tofp16;
+    mp.relu = params->relu;
+    if ((ret = gen_matmul_fp16(&mp)) != 0) {
+      printf("gemv slice %u of [1,%u]x[%u,%u] failed %d\n", tasks, params->k, params->n, params->k, ret);
+      return ret;
+    }
+    params->core_task_start[tasks] = tasks;
+    params->core_task_number[tasks] = 1;
+  }
+  return tasks;
+}
+
+/*
+ * Lay out count weight matrices of n[i] kernels by k along N, each n[i]
+ * a multiple of the kernel group (16 fp16, 32 int8). The fused matmul is
+ * then a matmul_params_t with n = fused->n_total.
+ */
+int matmul_fused_init(matmul_fused_t *fused, uint16_t k, const uint16_t *n, int count, uint8_t int8) {
+
+  unsigned int group = int8 ? 32 : 16;
+  unsigned int total = 0;
+
+  if ((count <= 0) || (count > MATMUL_FUSED_MAX) || (k == 0)) {
+    return -1;
+  }
+  memset(fused, 0, sizeof(*fused));
+  fused->k = k;
+  fused->count = count;
+  fused->int8 = int8;
+  for (int i = 0; i < count; i++) {
+    if ((n[i] == 0) || (n[i] % group)) {
+      printf("matmul_fused matrix %d has %u kernels, not a multiple of %u\n", i, n[i], group);
+      return -1;
+    }
+    fused->n[i] = n[i];
+    fused->first[i] = total;
+    total += n[i];
+  }
+  if (total > 0xFFFF) {
+    return -1;
+  }
+  fused->n_total = total;
+  return 0;
+}
+
+// Bytes from the fused weights to matrix i
+size_t matmul_fused_weights_offset(const matmul_fused_t *fused, int i) {
+  return (size_t)fused->first[i] * fused->k * (fused->int8 ? sizeof(int8_t) : sizeof(__fp16));
+}
+
+// Bytes from the fused output to matrix i's [m,n[i]] result, out_size
+// being the output element size
+size_t matmul_fused_output_offset(const matmul_fused_t *fused, int i, uint16_t m, size_t out_size) {
+  return (size_t)fused->first[i] * m * out_size;
+}
+
+// Pack row major float [n[i],k] matrix i into the fused fp16 weights
+void matmul_fused_pack_fp16(const matmul_fused_t *fused, int i, const float *w, __fp16 *weights) {
+
+  __fp16 *dst = weights + matmul_fused_weights_offset(fused, i) / sizeof(__fp16);
+
+  for (int j = 1; j <= fused->n[i]; j++) {
+    for (int c = 1; c <= fused->k; c++) {
+      dst[weight_fp16(fused->k, j, c)] = (__fp16)w[(size_t)(j-1) * fused->k + (c-1)];
+    }
+  }
+}
+
+int matmul_shape_init(matmul_shape_t *shape, int m, int k, int n) {
+
+  if ((m <= 0) || (k <= 0) || (n <= 0) || (m > UINT16_MAX - 3) || (k > UINT16_MAX - 31) || (n > UINT16_MAX - 15)) {
+    printf("matmul shape [%d,%d]x[%d,%d] out of range\n", m, k, n, k);
+    return -1;
+  }
+  shape->m = m;
+  shape->k = k;
+  shape->n = n;
+  shape->m_pad = (m == 1) ? 1 : (m + 3) / 4 * 4;
+  shape->k_pad = (k + 31) / 32 * 32;
+  shape->n_pad = (n + 15) / 16 * 16;
+  return 0;
+}
+
+size_t matmul_shape_input_size(const matmul_shape_t *shape) {
+  return (size_t)shape->m_pad * shape->k_pad * sizeof(__fp16);
+}
+
+size_t matmul_shape_weights_size(const matmul_shape_t *shape) {
+  return (size_t)shape->n_pad * shape->k_pad * sizeof(__fp16);
+}
+
+// Output buffer size for out_size bytes per element, float32 or fp16
+size_t matmul_shape_output_size(const matmul_shape_t *shape, size_t out_size) {
+  return (size_t)shape->m_pad * shape->n_pad * out_size;
+}
+
+void matmul_shape_params(const matmul_shape_t *shape, matmul_params_t *params) {
+  params->m = shape->m_pad;
+  params->k = shape->k_pad;
+  params->n = shape->n_pad;
+}
+
+// Pack row major float [m,k] into the padded fp16 feature layout, written
+// in layout order so each element is stored once, pad or not
+void matmul_shape_pack_input_fp16(const matmul_shape_t *shape, const float *a, __fp16 *input) {
+
+  for (int plane = 0; plane < shape->k_pad / 8; plane++) {
+    for (int r = 0; r < shape->m_pad; r++) {
+      for (int c = plane * 8; c < plane * 8 + 8; c++) {
+        *input++ = ((r < shape->m) && (c < shape->k)) ? (__fp16)a[(size_t)r * shape->k + c] : (__fp16)0;
+      }
+    }
+  }
+}
+
+// Pack row major float [n,k] into the padded weight_fp16 layout, in layout
+// order as for the input
+void matmul_shape_pack_weights_fp16(const matmul_shape_t *shape, const float *w, __fp16 *weights) {
+
+  for (int group = 0; group < shape->n_pad / 16; group++) {
+    for (int block = 0; block < shape->k_pad / 32; block++) {
+      for (int j = group * 16; j < group * 16 + 16; j++) {
+        for (int c = block * 32; c < block * 32 + 32; c++) {
+          *weights++ = ((j < shape->n) && (c < shape->k)) ? (__fp16)w[(size_t)j * shape->k + c] : (__fp16)0;
+        }
+      }
+    }
+  }
+}
+
+// Read the valid [m,n] of a float32 (fp16 0) or fp16 output as row major
+void matmul_shape_unpack_output(const matmul_shape_t *shape, const void *output, uint8_t fp16, float *c) {
+
+  int c2 = fp16 ? 8 : 4;
+
+  for (int r = 1; r <= shape->m; r++) {
+    for (int j = 1; j <= shape->n; j++) {
+      int pos = feature_data(shape->n_pad, shape->m_pad, 1, c2, j, r, 1);
+      c[(size_t)(r-1) * shape->n + (j-1)] = fp16 ? (float)((const __fp16 *)output)[pos] : ((const float *)output)[pos];
+    }
+  }
+}
+
 int feature_data(int C, int H, int W, int C2, int c, int h, int w) {
 
   int plane = (c-1)/C2;
@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "npu_plan.h"
+
+// Largest first, ties by the longer lifetime then index for a stable plan
+static int before(const npu_plan_tensor_t *tensors, int a, int b) {
+  const npu_plan_tensor_t *ta = &tensors[a];
+  const npu_plan_tensor_t *tb = &tensors[b];
+  if (ta->size != tb->size) {
+    return ta->size > tb->size;
+  }
+  if ((ta->last - ta->first) != (tb->last - tb->first)) {
+    return (ta->last - ta->first) > (tb->last - tb->first);
+  }
+  return a < b;
+}
+
+static int lifetimes_overlap(const npu_plan_tensor_t *a, const npu_plan_tensor_t *b) {
+  return (a->first <= b->last) && (b->first <= a->last);
+}
+
+/*
+ * Assign offsets greedily, largest tensor first, each at the lowest
+ * aligned offset that doesn't collide with an already placed tensor live
+ * at the same time. Tensors of size 0 are skipped. The arena size is
+ * returned in stats.
+ */
+int npu_plan_arena(npu_plan_tensor_t *tensors, int count, size_t align, npu_plan_stats_t *stats) {
+
+  npu_plan_stats_t s;
+  int *order, *placed;
+  int nplaced = 0;
+  int last_op = -1;
+
+  if (align == 0) {
+    align = NPU_PLAN_ALIGN;
+  }
+  memset(&s, 0, sizeof(s));
+  order = malloc((count + 1) * sizeof(int));
+  placed = malloc((count + 1) * sizeof(int));
+  if ((order == NULL) || (placed == NULL)) {
+    free(order);
+    free(placed);
+    return -1;
+  }
+
+  int n = 0;
+  for (int i = 0; i < count; i++) {
+    if (tensors[i].size == 0) {
+      continue;
+    }
+    if (tensors[i].first > tensors[i].last) {
+      printf("npu_plan_arena tensor %d lifetime %d..%d\n", i, tensors[i].first, tensors[i].last);
+      free(order);
+      free(placed);
+      return -1;
+    }
+    order[n++] = i;
+    s.naive += (tensors[i].size + align - 1) / align * align;
+    last_op = tensors[i].last > last_op ? tensors[i].last : last_op;
+  }
+  s.tensors = n;
+
+  // Plans are a few hundred tensors at most, insertion sorts do
+  for (int i = 1; i < n; i++) {
+    int t = order[i], j = i;
+    for (; (j > 0) && before(tensors, t, order[j - 1]); j--) {
+      order[j] = order[j - 1];
+    }
+    order[j] = t;
+  }
+
+  for (int i = 0; i < n; i++) {
+    npu_plan_tensor_t *t = &tensors[order[i]];
+    size_t size = (t->size + align - 1) / align * align;
+    size_t offset = 0;
+
+    // Placed tensors are kept sorted by offset, take the first gap
+    for (int j = 0; j < nplaced; j++) {
+      const npu_plan_tensor_t *p = &tensors[placed[j]];
+      if (!lifetimes_overlap(t, p)) {
+        continue;
+      }
+      if (p->offset >= offset + size) {
+        break;
+      }
+      size_t end = (p->offset + p->size + align - 1) / align * align;
+      offset = end > offset ? end : offset;
+    }
+    t->offset = offset;
+    s.arena = (offset + size) > s.arena ? offset + size : s.arena;
+
+    int j = nplaced++;
+    for (; (j > 0) && (tensors[placed[j - 1]].offset > offset); j--) {
+      placed[j] = placed[j - 1];
+    }
+    placed[j] = order[i];
+  }
+
+  for (int op = 0; op <= last_op; op++) {
+    size_t live = 0;
+    for (int i = 0; i < n; i++) {
+      const npu_plan_tensor_t *t = &tensors[order[i]];
+      if ((t->first <= op) && (op <= t->last)) {
+        live += (t->size + align - 1) / align * align;
+      }
+    }
+    s.peak = live > s.peak ? live : s.peak;
+  }
+
+  free(order);
+  free(placed);
+  *stats = s;
+  return 0;
+}
+
+void npu_plan_report(FILE *out, const npu_plan_stats_t *stats) {
+  fprintf(out, "%d tensors: arena %zu bytes, peak live %zu, naive %zu (%.0f%% saved)\n",
+    stats->tensors, stats->arena, stats->peak, stats->naive,
+    stats->naive > 0 ? 100.0 * (double)(stats->naive - stats->arena) / (double)stats->naive : 0.0);
+}
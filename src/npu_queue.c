@@ -0,0 +1,308 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+
+#include "npu_hw.h"
+#include "npu_matmul.h"
+#include "npu_context.h"
+#include "npu_queue.h"
+
+struct npu_queue {
+  npu_context_t     *ctx;
+  npu_queue_cfg_t   cfg;
+
+  // Intrusive MPSC list, producers exchange head, the dispatcher pops
+  // from tail. stub keeps the list non empty.
+  npu_job_t *_Atomic head;
+  npu_job_t         *tail;
+  npu_job_t         stub;
+
+  sem_t             pending;        // one count per pushed job
+  npu_job_t         stop;
+  pthread_t         dispatcher;
+  npu_job_t         **batch;        // jobs gathered into one submit, max_tasks entries
+
+  _Atomic uint64_t  jobs;
+  _Atomic uint64_t  tasks;
+  _Atomic uint64_t  submits;
+};
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void queue_link(npu_queue_t *queue, npu_job_t *job) {
+  atomic_store_explicit(&job->next, NULL, memory_order_relaxed);
+  npu_job_t *prev = atomic_exchange_explicit(&queue->head, job, memory_order_acq_rel);
+  atomic_store_explicit(&prev->next, job, memory_order_release);
+}
+
+/*
+ * Pop the oldest job, NULL while a producer is between its exchange and
+ * linking the previous job to its own.
+ */
+static npu_job_t *queue_pop(npu_queue_t *queue) {
+
+  npu_job_t *tail = queue->tail;
+  npu_job_t *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+  if (tail == &queue->stub) {
+    if (next == NULL) {
+      return NULL;
+    }
+    queue->tail = next;
+    tail = next;
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  }
+  if (next != NULL) {
+    queue->tail = next;
+    return tail;
+  }
+  if (tail != atomic_load_explicit(&queue->head, memory_order_acquire)) {
+    return NULL;
+  }
+  queue_link(queue, &queue->stub);
+  next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  if (next != NULL) {
+    queue->tail = next;
+    return tail;
+  }
+  return NULL;
+}
+
+// Called after taking a count from pending, so a job is on its way
+static npu_job_t *queue_take(npu_queue_t *queue) {
+  npu_job_t *job;
+  while ((job = queue_pop(queue)) == NULL) {
+    sched_yield();
+  }
+  return job;
+}
+
+// Wait for a pending job until deadline_ns, 0 if none arrived
+static int queue_wait(npu_queue_t *queue, uint64_t deadline_ns) {
+
+  struct timespec ts;
+  uint64_t now = now_ns();
+
+  if (now >= deadline_ns) {
+    return sem_trywait(&queue->pending) == 0;
+  }
+  clock_gettime(CLOCK_REALTIME, &ts);
+  uint64_t abs = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec + (deadline_ns - now);
+  ts.tv_sec = abs / 1000000000ULL;
+  ts.tv_nsec = abs % 1000000000ULL;
+  while (sem_timedwait(&queue->pending, &ts) != 0) {
+    if (errno != EINTR) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Concatenate the jobs into the dispatcher's scratch and submit them
+ * together. Jobs are split over the cores in contiguous runs of about
+ * equal tasks, a job's own tasks stay in order on one core as they may
+ * rely on the CBUF contents of the previous task. Chaining is redone for
+ * the merged list.
+ */
+static int queue_submit(npu_queue_t *queue, npu_job_t **jobs, int njobs, int ntasks) {
+
+  unsigned int cores = ((queue->cfg.cores > 0) && (queue->cfg.cores < NPU_CORES)) ? queue->cfg.cores : NPU_CORES;
+  uint16_t core_task_start[NPU_CORES], core_task_number[NPU_CORES];
+  unsigned int core = 0;
+  int task = 0;
+
+  npu_scratch_t *scratch = npu_context_scratch(queue->ctx, ntasks);
+  if (scratch == NULL) {
+    return -1;
+  }
+
+  memset(core_task_start, 0, sizeof(core_task_start));
+  memset(core_task_number, 0, sizeof(core_task_number));
+  for (int j = 0; j < njobs; j++) {
+    if ((core + 1 < cores) && (core_task_number[core] > 0) &&
+      ((uint64_t)task * cores >= (uint64_t)ntasks * (core + 1))) {
+      core++;
+      core_task_start[core] = task;
+    }
+    memcpy(scratch->regs + task * NPU_TASK_OPS, jobs[j]->ops, jobs[j]->ntasks * NPU_TASK_OPS * sizeof(uint64_t));
+    task += jobs[j]->ntasks;
+    core_task_number[core] += jobs[j]->ntasks;
+  }
+
+  for (unsigned int c = 0; c <= core; c++) {
+    for (int i = core_task_start[c]; i < core_task_start[c] + core_task_number[c]; i++) {
+      uint32_t next = (i + 1 < core_task_start[c] + core_task_number[c]) ?
+        scratch->regcmd.dma + (i + 1) * NPU_TASK_OPS * sizeof(uint64_t) : 0;
+      gen_task_chain(scratch->regs + i * NPU_TASK_OPS, next, NPU_TASK_REGCFG_AMOUNT);
+    }
+  }
+
+  atomic_fetch_add_explicit(&queue->submits, 1, memory_order_relaxed);
+  return npu_context_submit(queue->ctx, scratch, ntasks, core_task_start, core_task_number);
+}
+
+static void *queue_dispatcher(void *arg) {
+
+  npu_queue_t *queue = arg;
+  int max_tasks = queue->cfg.max_tasks > 0 ? queue->cfg.max_tasks : NPU_QUEUE_MAX_TASKS;
+  npu_job_t **jobs = queue->batch;
+  npu_job_t *carry = NULL;
+  int stop = 0;
+
+  while (!stop) {
+    npu_job_t *job = carry;
+    int njobs = 0, ntasks = 0;
+
+    carry = NULL;
+    if (job == NULL) {
+      while (sem_wait(&queue->pending) != 0) {
+      }
+      job = queue_take(queue);
+    }
+    if (job == &queue->stop) {
+      break;
+    }
+
+    // Gather more jobs until the budget of the first runs out
+    uint64_t deadline = job->push_ns + (uint64_t)queue->cfg.budget_us * 1000;
+    jobs[njobs++] = job;
+    ntasks = job->ntasks;
+    while ((ntasks < max_tasks) && (njobs < max_tasks) && queue_wait(queue, deadline)) {
+      job = queue_take(queue);
+      if (job == &queue->stop) {
+        stop = 1;
+        break;
+      }
+      if (ntasks + job->ntasks > max_tasks) {
+        carry = job;
+        break;
+      }
+      jobs[njobs++] = job;
+      ntasks += job->ntasks;
+    }
+
+    int ret = queue_submit(queue, jobs, njobs, ntasks);
+    atomic_fetch_add_explicit(&queue->jobs, njobs, memory_order_relaxed);
+    atomic_fetch_add_explicit(&queue->tasks, ntasks, memory_order_relaxed);
+    for (int j = 0; j < njobs; j++) {
+      jobs[j]->result = ret;
+      sem_post(&jobs[j]->done);
+    }
+  }
+  return NULL;
+}
+
+npu_queue_t *npu_queue_create(npu_context_t *ctx, const npu_queue_cfg_t *cfg) {
+
+  npu_queue_t *queue = calloc(1, sizeof(npu_queue_t));
+  if (queue == NULL) {
+    return NULL;
+  }
+  queue->ctx = ctx;
+  if (cfg != NULL) {
+    queue->cfg = *cfg;
+  }
+  atomic_store(&queue->stub.next, NULL);
+  atomic_store(&queue->head, &queue->stub);
+  queue->tail = &queue->stub;
+  queue->batch = calloc(queue->cfg.max_tasks > 0 ? queue->cfg.max_tasks : NPU_QUEUE_MAX_TASKS, sizeof(npu_job_t *));
+  if (queue->batch == NULL) {
+    free(queue);
+    return NULL;
+  }
+  sem_init(&queue->pending, 0, 0);
+
+  if (pthread_create(&queue->dispatcher, NULL, queue_dispatcher, queue) != 0) {
+    sem_destroy(&queue->pending);
+    free(queue->batch);
+    free(queue);
+    return NULL;
+  }
+  return queue;
+}
+
+/*
+ * Stop the dispatcher once the jobs pushed so far are submitted. No
+ * pushes may race with this.
+ */
+void npu_queue_destroy(npu_queue_t *queue) {
+
+  if (queue == NULL) {
+    return;
+  }
+  queue_link(queue, &queue->stop);
+  sem_post(&queue->pending);
+  pthread_join(queue->dispatcher, NULL);
+  sem_destroy(&queue->pending);
+  free(queue->batch);
+  free(queue);
+}
+
+void npu_queue_stats(npu_queue_t *queue, npu_queue_stats_t *stats) {
+  stats->jobs = atomic_load_explicit(&queue->jobs, memory_order_relaxed);
+  stats->tasks = atomic_load_explicit(&queue->tasks, memory_order_relaxed);
+  stats->submits = atomic_load_explicit(&queue->submits, memory_order_relaxed);
+}
+
+/*
+ * Tasks are independent register blocks as generated (their chaining
+ * is rewritten), the job can be pushed again once it has completed.
+ */
+int npu_job_init(npu_job_t *job, const uint64_t *ops, int ntasks) {
+  memset(job, 0, sizeof(*job));
+  job->ops = ops;
+  job->ntasks = ntasks;
+  return sem_init(&job->done, 0, 0);
+}
+
+int npu_queue_push(npu_queue_t *queue, npu_job_t *job) {
+  if (job->ntasks <= 0) {
+    return -1;
+  }
+  job->push_ns = now_ns();
+  queue_link(queue, job);
+  return sem_post(&queue->pending);
+}
+
+// Block until the job's submit completes, returns its result
+int npu_job_wait(npu_job_t *job) {
+  while (sem_wait(&job->done) != 0) {
+  }
+  return job->result;
+}
+
+void npu_job_destroy(npu_job_t *job) {
+  sem_destroy(&job->done);
+}
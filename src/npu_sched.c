@@ -0,0 +1,283 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "npu_hw.h"
+#include "npu_matmul.h"
+#include "npu_context.h"
+#include "npu_queue.h"
+#include "npu_sched.h"
+
+// Ring of queued groups, the owner takes the oldest, thieves the newest
+typedef struct {
+  npu_job_t   **jobs;
+  int         capacity;
+  int         head;
+  int         count;
+  int         tasks;        // queued tasks, used to pick a victim
+} sched_deque_t;
+
+typedef struct {
+  npu_sched_t             *sched;
+  int                     core;
+  pthread_t               thread;
+  sched_deque_t           queue;
+  npu_sched_core_stats_t  stats;
+} sched_core_t;
+
+struct npu_sched {
+  npu_context_t     *ctx;
+  npu_sched_cfg_t   cfg;
+  int               cores;
+
+  // One lock over the run queues, held only to move job pointers
+  pthread_mutex_t   lock;
+  pthread_cond_t    work;
+  int               stop;
+
+  sched_core_t      core[NPU_CORES];
+  uint64_t          start_ns;
+};
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int deque_push(sched_deque_t *q, npu_job_t *job) {
+  if (q->count == q->capacity) {
+    int capacity = q->capacity ? q->capacity * 2 : 64;
+    npu_job_t **jobs = malloc(capacity * sizeof(npu_job_t *));
+    if (jobs == NULL) {
+      return -1;
+    }
+    for (int i = 0; i < q->count; i++) {
+      jobs[i] = q->jobs[(q->head + i) % q->capacity];
+    }
+    free(q->jobs);
+    q->jobs = jobs;
+    q->capacity = capacity;
+    q->head = 0;
+  }
+  q->jobs[(q->head + q->count) % q->capacity] = job;
+  q->count++;
+  q->tasks += job->ntasks;
+  return 0;
+}
+
+static npu_job_t *deque_take_oldest(sched_deque_t *q) {
+  if (q->count == 0) {
+    return NULL;
+  }
+  npu_job_t *job = q->jobs[q->head];
+  q->head = (q->head + 1) % q->capacity;
+  q->count--;
+  q->tasks -= job->ntasks;
+  return job;
+}
+
+static npu_job_t *deque_take_newest(sched_deque_t *q) {
+  if (q->count == 0) {
+    return NULL;
+  }
+  npu_job_t *job = q->jobs[(q->head + q->count - 1) % q->capacity];
+  q->count--;
+  q->tasks -= job->ntasks;
+  return job;
+}
+
+// Next group for a core, called with the lock held
+static npu_job_t *sched_next(npu_sched_t *sched, sched_core_t *core) {
+
+  npu_job_t *job = deque_take_oldest(&core->queue);
+  if ((job != NULL) || sched->cfg.no_steal) {
+    return job;
+  }
+
+  sched_core_t *victim = NULL;
+  for (int c = 0; c < sched->cores; c++) {
+    sched_core_t *other = &sched->core[c];
+    if ((other != core) && (other->queue.count > 0) &&
+      ((victim == NULL) || (other->queue.tasks > victim->queue.tasks))) {
+      victim = other;
+    }
+  }
+  if (victim == NULL) {
+    return NULL;
+  }
+  core->stats.steals++;
+  return deque_take_newest(&victim->queue);
+}
+
+// Copy a group to the worker's scratch, chain it and run it on one core
+static int sched_run(npu_sched_t *sched, sched_core_t *core, npu_job_t *job) {
+
+  uint16_t core_task_start[NPU_CORES] = { 0 }, core_task_number[NPU_CORES] = { 0 };
+
+  npu_scratch_t *scratch = npu_context_scratch(sched->ctx, job->ntasks);
+  if (scratch == NULL) {
+    return -1;
+  }
+  memcpy(scratch->regs, job->ops, job->ntasks * NPU_TASK_OPS * sizeof(uint64_t));
+  for (int i = 0; i < job->ntasks; i++) {
+    uint32_t next = (i + 1 < job->ntasks) ? scratch->regcmd.dma + (i + 1) * NPU_TASK_OPS * sizeof(uint64_t) : 0;
+    gen_task_chain(scratch->regs + i * NPU_TASK_OPS, next, NPU_TASK_REGCFG_AMOUNT);
+  }
+  core_task_number[core->core] = job->ntasks;
+  return npu_context_submit(sched->ctx, scratch, job->ntasks, core_task_start, core_task_number);
+}
+
+static void *sched_worker(void *arg) {
+
+  sched_core_t *core = arg;
+  npu_sched_t *sched = core->sched;
+
+  pthread_mutex_lock(&sched->lock);
+  for (;;) {
+    npu_job_t *job = sched_next(sched, core);
+    if (job == NULL) {
+      if (sched->stop) {
+        break;
+      }
+      pthread_cond_wait(&sched->work, &sched->lock);
+      continue;
+    }
+    pthread_mutex_unlock(&sched->lock);
+
+    uint64_t start = now_ns();
+    job->result = sched_run(sched, core, job);
+    uint64_t busy = now_ns() - start;
+
+    pthread_mutex_lock(&sched->lock);
+    core->stats.groups++;
+    core->stats.tasks += job->ntasks;
+    core->stats.busy_ns += busy;
+    sem_post(&job->done);
+  }
+  pthread_mutex_unlock(&sched->lock);
+  return NULL;
+}
+
+npu_sched_t *npu_sched_create(npu_context_t *ctx, const npu_sched_cfg_t *cfg) {
+
+  npu_sched_t *sched = calloc(1, sizeof(npu_sched_t));
+  if (sched == NULL) {
+    return NULL;
+  }
+  sched->ctx = ctx;
+  if (cfg != NULL) {
+    sched->cfg = *cfg;
+  }
+  sched->cores = ((sched->cfg.cores > 0) && (sched->cfg.cores < NPU_CORES)) ? sched->cfg.cores : NPU_CORES;
+  pthread_mutex_init(&sched->lock, NULL);
+  pthread_cond_init(&sched->work, NULL);
+  sched->start_ns = now_ns();
+
+  for (int c = 0; c < sched->cores; c++) {
+    sched->core[c].sched = sched;
+    sched->core[c].core = c;
+    if (pthread_create(&sched->core[c].thread, NULL, sched_worker, &sched->core[c]) != 0) {
+      sched->cores = c;
+      npu_sched_destroy(sched);
+      return NULL;
+    }
+  }
+  return sched;
+}
+
+/*
+ * Stop the workers once every queued group has run.
+ */
+void npu_sched_destroy(npu_sched_t *sched) {
+
+  if (sched == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&sched->lock);
+  sched->stop = 1;
+  pthread_cond_broadcast(&sched->work);
+  pthread_mutex_unlock(&sched->lock);
+
+  for (int c = 0; c < sched->cores; c++) {
+    pthread_join(sched->core[c].thread, NULL);
+    free(sched->core[c].queue.jobs);
+  }
+  pthread_cond_destroy(&sched->work);
+  pthread_mutex_destroy(&sched->lock);
+  free(sched);
+}
+
+/*
+ * Queue groups initialised with npu_job_init on a core, or each on the
+ * core with the fewest queued tasks when core is negative. Queuing them
+ * together lets idle cores see the whole list. Wait for each with
+ * npu_job_wait.
+ */
+int npu_sched_submit(npu_sched_t *sched, npu_job_t **jobs, int njobs, int core) {
+
+  int ret = 0;
+
+  if (core >= sched->cores) {
+    return -1;
+  }
+  for (int j = 0; j < njobs; j++) {
+    if (jobs[j]->ntasks <= 0) {
+      return -1;
+    }
+  }
+
+  pthread_mutex_lock(&sched->lock);
+  for (int j = 0; (j < njobs) && (ret == 0); j++) {
+    int c = core;
+    if (c < 0) {
+      c = 0;
+      for (int i = 1; i < sched->cores; i++) {
+        if (sched->core[i].queue.tasks < sched->core[c].queue.tasks) {
+          c = i;
+        }
+      }
+    }
+    ret = deque_push(&sched->core[c].queue, jobs[j]);
+  }
+  pthread_cond_broadcast(&sched->work);
+  pthread_mutex_unlock(&sched->lock);
+  return ret;
+}
+
+// stats holds one entry per scheduled core
+void npu_sched_stats(npu_sched_t *sched, npu_sched_core_stats_t *stats) {
+
+  uint64_t elapsed = now_ns() - sched->start_ns;
+
+  pthread_mutex_lock(&sched->lock);
+  for (int c = 0; c < sched->cores; c++) {
+    stats[c] = sched->core[c].stats;
+    stats[c].utilization = elapsed ? (double)stats[c].busy_ns / elapsed : 0.0;
+  }
+  pthread_mutex_unlock(&sched->lock);
+}
@@ -0,0 +1,440 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include <libdrm/drm.h>
+
+#include "rknpu-ioctl.h"
+#include "npu_interface.h"
+#include "npu_hw.h"
+#include "npu_matmul.h"
+#include "npu_cost.h"
+#include "npu_tune.h"
+
+static const char *tune_op_names[] = { "matmul_fp16", "matmul_int8" };
+
+static const uint8_t dma_bursts[] = { 3, 7, 15 };
+static const uint8_t dpu_bursts[] = { 7, 15 };
+
+#define TUNE_MAX_CANDIDATES 8
+
+/*
+ * Override the generator defaults, the data banks are only ever grown
+ * from the minimum the feature data needs and weights get the rest.
+ */
+void npu_tune_apply(const npu_tune_cfg_t *tune, npu_cna_desc *cna_desc, npu_dpu_desc *dpu_desc) {
+
+  if (tune == NULL) {
+    return;
+  }
+  if ((tune->data_banks > cna_desc->data_bank) && (tune->data_banks < NPU_CBUF_BANKS)) {
+    cna_desc->data_bank = tune->data_banks;
+    cna_desc->weight_bank = NPU_CBUF_BANKS - tune->data_banks;
+  }
+  if (tune->data_burst_len != 0) {
+    cna_desc->data_burst_len = tune->data_burst_len;
+  }
+  if (tune->weight_burst_len != 0) {
+    cna_desc->weight_burst_len = tune->weight_burst_len;
+  }
+  if (tune->dpu_burst_len != 0) {
+    dpu_desc->burst_len = tune->dpu_burst_len;
+  }
+}
+
+static const char *tune_cache_path(const char *path) {
+  if (path != NULL) {
+    return path;
+  }
+  path = getenv("NPU_TUNE_CACHE");
+  return (path != NULL) ? path : NPU_TUNE_CACHE_FILE;
+}
+
+/*
+ * Load entries from a text cache, one shape per line. A missing file is
+ * an empty cache. Returns the number of entries loaded.
+ */
+int npu_tune_cache_load(npu_tune_cache_t *cache, const char *path) {
+
+  char line[256], op[32];
+  unsigned int m, k, n, tile_n, data_banks, data_burst, weight_burst, dpu_burst;
+  double us;
+  int loaded = 0;
+
+  path = tune_cache_path(path);
+  FILE *in = fopen(path, "r");
+  if (in == NULL) {
+    if (errno == ENOENT) {
+      return 0;
+    }
+    printf("Failed to open tune cache %s\n", path);
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), in) != NULL) {
+    if ((line[0] == '#') || (line[0] == '\n')) {
+      continue;
+    }
+    if (sscanf(line, "%31s %u %u %u %u %u %u %u %u %lf", op, &m, &k, &n, &tile_n, &data_banks,
+      &data_burst, &weight_burst, &dpu_burst, &us) != 10) {
+      printf("Ignoring bad tune cache line: %s", line);
+      continue;
+    }
+    for (uint8_t i = 0; i < sizeof(tune_op_names)/sizeof(tune_op_names[0]); i++) {
+      if (strcmp(op, tune_op_names[i]) == 0) {
+        npu_tune_cfg_t cfg = {
+          .tile_n = tile_n,
+          .data_banks = data_banks,
+          .data_burst_len = data_burst,
+          .weight_burst_len = weight_burst,
+          .dpu_burst_len = dpu_burst,
+        };
+        if (npu_tune_cache_put(cache, i, m, k, n, &cfg, us) == 0) {
+          loaded++;
+        }
+      }
+    }
+  }
+
+  fclose(in);
+  return loaded;
+}
+
+int npu_tune_cache_save(const npu_tune_cache_t *cache, const char *path) {
+
+  path = tune_cache_path(path);
+  FILE *out = fopen(path, "w");
+  if (out == NULL) {
+    printf("Failed to open tune cache %s\n", path);
+    return -1;
+  }
+
+  fprintf(out, "# op m k n tile_n data_banks data_burst weight_burst dpu_burst us\n");
+  for (int i = 0; i < cache->count; i++) {
+    const npu_tune_entry_t *e = &cache->entries[i];
+    fprintf(out, "%s %u %u %u %u %u %u %u %u %.3f\n", tune_op_names[e->op], e->m, e->k, e->n,
+      e->cfg.tile_n, e->cfg.data_banks, e->cfg.data_burst_len, e->cfg.weight_burst_len,
+      e->cfg.dpu_burst_len, e->us);
+  }
+
+  fclose(out);
+  return 0;
+}
+
+static npu_tune_entry_t *tune_find(const npu_tune_cache_t *cache, uint8_t op, uint16_t m, uint16_t k, uint16_t n) {
+  for (int i = 0; i < cache->count; i++) {
+    npu_tune_entry_t *e = &cache->entries[i];
+    if ((e->op == op) && (e->m == m) && (e->k == k) && (e->n == n)) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+// Add or replace the entry for a shape
+int npu_tune_cache_put(npu_tune_cache_t *cache, uint8_t op, uint16_t m, uint16_t k, uint16_t n,
+  const npu_tune_cfg_t *cfg, double us) {
+
+  npu_tune_entry_t *e = tune_find(cache, op, m, k, n);
+
+  if (op > npu_tune_matmul_int8) {
+    return -1;
+  }
+  if (e == NULL) {
+    if (cache->count == cache->capacity) {
+      int capacity = cache->capacity ? cache->capacity * 2 : 16;
+      npu_tune_entry_t *entries = realloc(cache->entries, capacity * sizeof(npu_tune_entry_t));
+      if (entries == NULL) {
+        return -1;
+      }
+      cache->entries = entries;
+      cache->capacity = capacity;
+    }
+    e = &cache->entries[cache->count++];
+  }
+  e->op = op;
+  e->m = m;
+  e->k = k;
+  e->n = n;
+  e->cfg = *cfg;
+  e->us = us;
+  return 0;
+}
+
+const npu_tune_cfg_t *npu_tune_lookup(const npu_tune_cache_t *cache, uint8_t op, uint16_t m, uint16_t k, uint16_t n) {
+  npu_tune_entry_t *e = (cache != NULL) ? tune_find(cache, op, m, k, n) : NULL;
+  return (e != NULL) ? &e->cfg : NULL;
+}
+
+void npu_tune_cache_free(npu_tune_cache_t *cache) {
+  free(cache->entries);
+  memset(cache, 0, sizeof(*cache));
+}
+
+typedef struct {
+  int               fd;
+  matmul_params_t   params;
+  uint8_t           op;
+  uint64_t          *regs;
+  uint64_t          *regcmd;
+  uint64_t          regcmd_dma;
+  struct rknpu_task *tasks;
+  uint64_t          tasks_obj;
+  int               iterations;
+  uint64_t          *samples;
+  npu_cost_model_t  model;
+} tune_run_t;
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+/*
+ * Median submit time in us of the matmul generated with cfg, negative
+ * if the generator or the NPU rejected it.
+ */
+static double tune_time(tune_run_t *run, const npu_tune_cfg_t *cfg) {
+
+  struct timespec start, stop;
+  int ret;
+
+  run->params.tune = cfg;
+  ret = (run->op == npu_tune_matmul_int8) ? gen_matmul_int8(&run->params) : gen_matmul_fp16(&run->params);
+  if (ret != 0) {
+    return -1;
+  }
+
+  int ntasks = matmul_task_count(&run->params);
+  memcpy(run->regcmd, run->regs, ntasks * NPU_TASK_OPS * sizeof(uint64_t));
+  memset(run->tasks, 0, ntasks * sizeof(struct rknpu_task));
+  for (int i = 0; i < ntasks; i++) {
+    run->tasks[i].enable_mask = 0xd;
+    run->tasks[i].int_mask = 0x300;
+    run->tasks[i].int_clear = 0x1ffff;
+    run->tasks[i].regcfg_amount = NPU_TASK_REGCFG_AMOUNT;
+    run->tasks[i].regcmd_addr = run->regcmd_dma + i * NPU_TASK_OPS * sizeof(uint64_t);
+  }
+
+  struct rknpu_submit submit = {
+    .flags = RKNPU_JOB_PC | RKNPU_JOB_BLOCK | RKNPU_JOB_PINGPONG,
+    .timeout = 6000,
+    .task_start = 0,
+    .task_number = ntasks,
+    .task_obj_addr = run->tasks_obj,
+    .core_mask = 1,
+    .fence_fd = -1,
+    .subcore_task = { {0, ntasks}, {1, 0}, {2, 0}, {0, 0}, {0, 0} },
+  };
+
+  // One untimed submit to warm the caches
+  for (int i = -1; i < run->iterations; i++) {
+    clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+    ret = npu_ioctl(run->fd, DRM_IOCTL_RKNPU_SUBMIT, &submit);
+    clock_gettime(CLOCK_MONOTONIC_RAW, &stop);
+    if (ret < 0) {
+      return -1;
+    }
+    if (i >= 0) {
+      run->samples[i] = (uint64_t)(stop.tv_sec - start.tv_sec) * 1000000000ULL + stop.tv_nsec - start.tv_nsec;
+    }
+  }
+  qsort(run->samples, run->iterations, sizeof(uint64_t), cmp_u64);
+  return run->samples[run->iterations / 2] / 1000.0;
+}
+
+// Keep candidate as the configuration if it beats best_us
+static void tune_try(tune_run_t *run, npu_tune_cfg_t *cfg, const npu_tune_cfg_t *candidate, double *best_us) {
+  double us = tune_time(run, candidate);
+  if ((us >= 0) && (us < *best_us)) {
+    *best_us = us;
+    *cfg = *candidate;
+  }
+}
+
+/*
+ * Time every candidate for one setting the cost model finds usable,
+ * ones that can't be generated or whose feature data overflows the CBUF
+ * are dropped without a submit. The model isn't calibrated here so it
+ * only filters, the timings decide.
+ */
+static void tune_sweep(tune_run_t *run, npu_tune_cfg_t *cfg, const npu_tune_cfg_t *candidates, int ncandidates,
+  double *best_us) {
+
+  const uint64_t *plan = run->regs;
+  int ntasks, ret;
+
+  for (int i = 0; i < ncandidates; i++) {
+    run->params.tune = &candidates[i];
+    ret = (run->op == npu_tune_matmul_int8) ? gen_matmul_int8(&run->params) : gen_matmul_fp16(&run->params);
+    ntasks = matmul_task_count(&run->params);
+    if ((ret == 0) && (npu_cost_pick(&run->model, &plan, &ntasks, 1, NULL) == 0)) {
+      tune_try(run, cfg, &candidates[i], best_us);
+    }
+  }
+}
+
+/*
+ * Time candidate tilings, CBUF bank splits and burst lengths for a
+ * matmul shape, one setting at a time starting from the generator
+ * defaults. The fastest configuration is stored in the cache and
+ * returned in best.
+ */
+int npu_tune_matmul(int fd, npu_tune_cache_t *cache, uint8_t op, uint16_t m, uint16_t k, uint16_t n,
+  int iterations, npu_tune_cfg_t *best) {
+
+  uint64_t input_dma, input_obj, weights_dma, weights_obj, output_dma, output_obj, tasks_dma;
+  uint32_t regcmd_handle, tasks_handle, input_handle, weights_handle, output_handle;
+  uint64_t regcmd_obj;
+  size_t regs_size = NPU_TUNE_MAX_TASKS * NPU_TASK_OPS * sizeof(uint64_t);
+  size_t in_size = (op == npu_tune_matmul_int8) ? sizeof(int8_t) : sizeof(__fp16);
+  size_t out_size = (op == npu_tune_matmul_int8) ? sizeof(int32_t) : sizeof(float);
+  npu_tune_cfg_t cfg, candidates[TUNE_MAX_CANDIDATES];
+  uint32_t freq = 0;
+  double best_us;
+  int ncandidates;
+  int ret = 0;
+
+  tune_run_t run;
+  memset(&run, 0, sizeof(run));
+  run.fd = fd;
+  run.op = op;
+  run.iterations = (iterations > 0) ? iterations : 1;
+
+  npu_action(fd, RKNPU_GET_FREQ, &freq);
+  npu_cost_model_init(&run.model, freq);
+
+  run.regs = calloc(1, regs_size);
+  run.samples = calloc(run.iterations, sizeof(uint64_t));
+  run.regcmd = mem_allocate(fd, regs_size, &run.regcmd_dma, &regcmd_obj, 0, &regcmd_handle);
+  run.tasks = mem_allocate(fd, 1024, &tasks_dma, &run.tasks_obj, RKNPU_MEM_KERNEL_MAPPING, &tasks_handle);
+  void *input = mem_allocate(fd, (size_t)m*k*in_size, &input_dma, &input_obj, 0, &input_handle);
+  void *weights = mem_allocate(fd, (size_t)n*k*in_size, &weights_dma, &weights_obj, 0, &weights_handle);
+  void *output = mem_allocate(fd, (size_t)m*n*out_size, &output_dma, &output_obj, 0, &output_handle);
+
+  if ((run.regs == NULL) || (run.samples == NULL) || (run.regcmd == NULL) || (run.tasks == NULL) ||
+    (input == NULL) || (weights == NULL) || (output == NULL)) {
+    printf("Failed to allocate memory \n");
+    ret = -1;
+    goto cleanup;
+  }
+  // Zeroed operands, the timing doesn't depend on the values
+  memset(input, 0, (size_t)m*k*in_size);
+  memset(weights, 0, (size_t)n*k*in_size);
+
+  run.params.m = m;
+  run.params.k = k;
+  run.params.n = n;
+  run.params.input_dma = input_dma;
+  run.params.weights_dma = weights_dma;
+  run.params.output_dma = output_dma;
+  run.params.tasks = run.regs;
+  run.params.regcmd_dma = run.regcmd_dma;
+
+  memset(&cfg, 0, sizeof(cfg));
+  best_us = tune_time(&run, &cfg);
+  if (best_us < 0) {
+    printf("matmul %ux%ux%u can't be generated or submitted\n", m, k, n);
+    ret = -1;
+    goto cleanup;
+  }
+
+  // Banks the default feature data split uses, read back from CNA_CBUF_CON0
+  unsigned int min_banks = 0;
+  for (int i = 0; i < NPU_TASK_OPS; i++) {
+    if ((run.regs[i] & 0xFFFF) == CNA_CBUF_CON0) {
+      min_banks = (run.regs[i] >> 16) & 0xF;
+    }
+  }
+
+  ncandidates = 0;
+  for (unsigned int tile_n = n / 2; (tile_n >= NPU_TUNE_TILE_ALIGN) &&
+    (n <= tile_n * NPU_TUNE_MAX_TASKS) && (ncandidates < TUNE_MAX_CANDIDATES); tile_n /= 2) {
+    if ((tile_n % NPU_TUNE_TILE_ALIGN) == 0) {
+      candidates[ncandidates] = cfg;
+      candidates[ncandidates++].tile_n = tile_n;
+    }
+  }
+  tune_sweep(&run, &cfg, candidates, ncandidates, &best_us);
+
+  ncandidates = 0;
+  for (unsigned int banks = min_banks + 1; (banks <= min_banks + 3) && (banks < NPU_CBUF_BANKS); banks++) {
+    candidates[ncandidates] = cfg;
+    candidates[ncandidates++].data_banks = banks;
+  }
+  tune_sweep(&run, &cfg, candidates, ncandidates, &best_us);
+
+  for (unsigned int i = 0; i < sizeof(dma_bursts); i++) {
+    candidates[i] = cfg;
+    candidates[i].data_burst_len = dma_bursts[i];
+  }
+  tune_sweep(&run, &cfg, candidates, sizeof(dma_bursts), &best_us);
+
+  for (unsigned int i = 0; i < sizeof(dma_bursts); i++) {
+    candidates[i] = cfg;
+    candidates[i].weight_burst_len = dma_bursts[i];
+  }
+  tune_sweep(&run, &cfg, candidates, sizeof(dma_bursts), &best_us);
+
+  for (unsigned int i = 0; i < sizeof(dpu_bursts); i++) {
+    candidates[i] = cfg;
+    candidates[i].dpu_burst_len = dpu_bursts[i];
+  }
+  tune_sweep(&run, &cfg, candidates, sizeof(dpu_bursts), &best_us);
+
+  if (cache != NULL) {
+    ret = npu_tune_cache_put(cache, op, m, k, n, &cfg, best_us);
+  }
+  if (best != NULL) {
+    *best = cfg;
+  }
+
+cleanup:
+  if (run.regcmd) {
+    munmap(run.regcmd, regs_size);
+    mem_destroy(fd, regcmd_handle, regcmd_obj);
+  }
+  if (run.tasks) {
+    munmap(run.tasks, 1024);
+    mem_destroy(fd, tasks_handle, run.tasks_obj);
+  }
+  if (input) {
+    munmap(input, (size_t)m*k*in_size);
+    mem_destroy(fd, input_handle, input_obj);
+  }
+  if (weights) {
+    munmap(weights, (size_t)n*k*in_size);
+    mem_destroy(fd, weights_handle, weights_obj);
+  }
+  if (output) {
+    munmap(output, (size_t)m*n*out_size);
+    mem_destroy(fd, output_handle, output_obj);
+  }
+  free(run.regs);
+  free(run.samples);
+  return ret;
+}
@@ -24,8 +24,9 @@
 #define MAX_W 16
 #define MAX_C 128
 #define MAX_OC 128
+#define MAX_BATCH 8
 
-static uint64_t npu_regs[112];
+static uint64_t npu_regs[MAX_BATCH*112];
 
 static void conv1x1_ref_fp32(int H, int W, int C, int OC, const _Float16 *inp, const _Float16 *w, float *out) {
   for (int h = 0; h < H; ++h) {
@@ -44,29 +45,39 @@ static void conv1x1_ref_fp32(int H, int W, int C, int OC, const _Float16 *inp, c
 static float rand_float() { return rand()/(float)RAND_MAX; }
 
 int main(int argc, char **argv) {
-  int H = 4, W = 4, C = 32, OC = 32;
-  if (argc == 5) {
+  int H = 4, W = 4, C = 32, OC = 32, B = 1;
+  if (argc >= 5) {
     H = atoi(argv[1]);
     W = atoi(argv[2]);
     C = atoi(argv[3]);
     OC = atoi(argv[4]);
   }
+  if (argc == 6) {
+    B = atoi(argv[5]);
+  }
   if (H <= 0 || H > MAX_H || W <= 0 || W > MAX_W || C <= 0 || C > MAX_C || (C % 32) != 0 || OC <= 0 || OC > MAX_OC || (OC % 16) != 0) {
     printf("Bad sizes H=%d W=%d C=%d OC=%d (C%%32==0, OC%%16==0 required)\n", H, W, C, OC);
     return -1;
   }
+  if (B <= 0 || B > MAX_BATCH) {
+    printf("Bad batch %d (1..%d)\n", B, MAX_BATCH);
+    return -1;
+  }
 
   // Open NPU
   int fd = npu_open();
 
   uint64_t regcmd_dma, regcmd_obj; uint32_t regcmd_handle;
-  uint64_t *regcmd = mem_allocate(fd, 1024, &regcmd_dma, &regcmd_obj, 0, &regcmd_handle);
+  size_t regcmd_bytes = (size_t)B*112*sizeof(uint64_t);
+  uint64_t *regcmd = mem_allocate(fd, regcmd_bytes, &regcmd_dma, &regcmd_obj, 0, &regcmd_handle);
   uint64_t tasks_dma, tasks_obj; uint32_t tasks_handle;
   struct rknpu_task *tasks = mem_allocate(fd, 1024, &tasks_dma, &tasks_obj, RKNPU_MEM_KERNEL_MAPPING, &tasks_handle);
 
-  size_t in_bytes = (size_t)H*W*C*sizeof(_Float16);
+  size_t img_in_bytes = (size_t)H*W*C*sizeof(_Float16);
+  size_t img_out_bytes = (size_t)H*W*OC*sizeof(float);
+  size_t in_bytes = img_in_bytes*B;
   size_t w_bytes  = (size_t)OC*C*sizeof(_Float16);
-  size_t out_bytes = (size_t)H*W*OC*sizeof(float);
+  size_t out_bytes = img_out_bytes*B;
 
   uint64_t input_dma, input_obj; uint32_t input_handle; void *input = mem_allocate(fd, in_bytes, &input_dma, &input_obj, 0, &input_handle);
   uint64_t weights_dma, weights_obj; uint32_t weights_handle; void *weights = mem_allocate(fd, w_bytes, &weights_dma, &weights_obj, 0, &weights_handle);
@@ -91,58 +102,69 @@ int main(int argc, char **argv) {
     .weights_dma = (uint32_t)weights_dma,
     .output_dma = (uint32_t)output_dma,
     .tasks = (uint64_t*)&npu_regs,
-    .fp32tofp16 = 0
+    .fp32tofp16 = 0,
+    .batch = (uint16_t)B,
+    .input_stride = (uint32_t)img_in_bytes,
+    .output_stride = (uint32_t)img_out_bytes,
+    .regcmd_dma = (uint32_t)regcmd_dma
   };
 
   int ret = gen_conv2d_fp16(&params);
   if (ret != 0) { printf("gen_conv2d_fp16 failed %d\n", ret); return ret; }
 
-  memcpy(regcmd, npu_regs, sizeof(npu_regs));
-
-  tasks[0].flags = 0;
-  tasks[0].op_idx = 0;
-  tasks[0].enable_mask = 0xd;
-  tasks[0].int_mask = 0x300;
-  tasks[0].int_clear = 0x1ffff;
-  tasks[0].int_status = 0;
-  tasks[0].regcfg_amount = sizeof(npu_regs)/sizeof(uint64_t)-(RKNPU_PC_DATA_EXTRA_AMOUNT+4);
-  tasks[0].regcfg_offset = 0;
-  tasks[0].regcmd_addr = regcmd_dma;
+  memcpy(regcmd, npu_regs, regcmd_bytes);
+
+  for (int b = 0; b < B; ++b) {
+    tasks[b].flags = 0;
+    tasks[b].op_idx = 0;
+    tasks[b].enable_mask = 0xd;
+    tasks[b].int_mask = 0x300;
+    tasks[b].int_clear = 0x1ffff;
+    tasks[b].int_status = 0;
+    tasks[b].regcfg_amount = 112-(RKNPU_PC_DATA_EXTRA_AMOUNT+4);
+    tasks[b].regcfg_offset = 0;
+    tasks[b].regcmd_addr = regcmd_dma + b*112*sizeof(uint64_t);
+  }
 
   // Fill inputs with random whole numbers like matmul test to avoid fp16 diff noise
   srand(time(NULL));
-  _Float16 *invec = (_Float16*)input;
-  for (int i = 0; i < H*W*C; ++i) invec[i] = (_Float16)(int)(10.0f * rand_float());
-  _Float16 *wvec = (_Float16*)weights;
+  _Float16 *invec = (_Float16*)malloc(in_bytes);
+  for (int i = 0; i < B*H*W*C; ++i) invec[i] = (_Float16)(int)(10.0f * rand_float());
+  _Float16 *wvec = (_Float16*)malloc(w_bytes);
   for (int i = 0; i < OC*C; ++i) wvec[i] = (_Float16)(int)(10.0f * rand_float());
 
   // Pack weights and feature data in-place to expected layout
   // Weights: for 1x1 conv, per-output-channel kernel is just C elements; reuse weight_fp16(C, oc, c)
+  _Float16 *wp = (_Float16*)weights;
   for (int oc = 1; oc <= OC; ++oc) {
     for (int c = 1; c <= C; ++c) {
-      wvec[weight_fp16(C, oc, c)] = wvec[(oc-1)*C + (c-1)];
+      wp[weight_fp16(C, oc, c)] = wvec[(oc-1)*C + (c-1)];
     }
   }
   // Feature data: each pixel (h,w) is a row of C channels; reuse feature_data(C, H*W, 1, 8, c, pos, 1)
   // Flatten HxW into M=H*W rows, width=1 kept consistent with helper
-  _Float16 *fdp = (_Float16*)input;
-  for (int pos = 1; pos <= H*W; ++pos) {
-    for (int c = 1; c <= C; ++c) {
-      int hw = pos - 1; int h = hw / W; int widx = hw % W;
-      fdp[feature_data(C, H*W, 1, 8, c, pos, 1)] = invec[(h*W + widx)*C + (c-1)];
+  for (int b = 0; b < B; ++b) {
+    _Float16 *fdp = (_Float16*)input + b*H*W*C;
+    for (int pos = 1; pos <= H*W; ++pos) {
+      for (int c = 1; c <= C; ++c) {
+        int hw = pos - 1; int h = hw / W; int widx = hw % W;
+        fdp[feature_data(C, H*W, 1, 8, c, pos, 1)] = invec[(b*H*W + h*W + widx)*C + (c-1)];
+      }
     }
   }
 
   // CPU reference
   float *gold = (float*)malloc(out_bytes);
-  conv1x1_ref_fp32(H, W, C, OC, invec, wvec, gold);
+  for (int b = 0; b < B; ++b) {
+    conv1x1_ref_fp32(H, W, C, OC, invec + b*H*W*C, wvec, gold + b*H*W*OC);
+  }
   memset(output, 0, out_bytes);
 
   struct rknpu_submit submit = {
     .flags = RKNPU_JOB_PC | RKNPU_JOB_BLOCK | RKNPU_JOB_PINGPONG,
     .timeout = 6000,
     .task_start = 0,
-    .task_number = 1,
+    .task_number = B,
     .task_counter = 0,
     .priority = 0,
     .task_obj_addr = tasks_obj,
@@ -151,7 +173,7 @@ int main(int argc, char **argv) {
     .user_data = 0,
     .core_mask = 1,
     .fence_fd = -1,
-    .subcore_task = { {0,1}, {1,0}, {2,0}, {0,0}, {0,0} },
+    .subcore_task = { {0,B}, {1,0}, {2,0}, {0,0}, {0,0} },
   };
   ret = ioctl(fd, DRM_IOCTL_RKNPU_SUBMIT, &submit);
   printf("RKNPU_SUBMIT returned %d\n", ret);
@@ -159,26 +181,30 @@ int main(int argc, char **argv) {
 
   // Compare
   int err = 0;
-  float *outf = (float*)output;
-  for (int h = 0; h < H; ++h) {
-    for (int widx = 0; widx < W; ++widx) {
-      for (int oc = 0; oc < OC; ++oc) {
-        // Output layout uses feature_data with N=OC, M=H*W
-        int pos = h*W + widx + 1;
-        float actual = outf[feature_data(OC, H*W, 1, 4, oc+1, pos, 1)];
-        float expected = gold[(h*W + widx)*OC + oc];
-        if (actual != expected) { err = 1; goto done; }
+  for (int b = 0; b < B; ++b) {
+    float *outf = (float*)output + b*H*W*OC;
+    for (int h = 0; h < H; ++h) {
+      for (int widx = 0; widx < W; ++widx) {
+        for (int oc = 0; oc < OC; ++oc) {
+          // Output layout uses feature_data with N=OC, M=H*W
+          int pos = h*W + widx + 1;
+          float actual = outf[feature_data(OC, H*W, 1, 4, oc+1, pos, 1)];
+          float expected = gold[(b*H*W + h*W + widx)*OC + oc];
+          if (actual != expected) { err = 1; goto done; }
+        }
       }
     }
   }
 
  done:
-  if (!err) printf("conv2d 1x1 fp16 [%dx%dx%d] -> [%dx%dx%d] ok\n", H, W, C, H, W, OC);
+  if (!err) printf("conv2d 1x1 fp16 %dx[%dx%dx%d] -> [%dx%dx%d] ok\n", B, H, W, C, H, W, OC);
   else printf("conv2d 1x1 fp16 mismatch\n");
 
   // Cleanup
   free(gold);
-  munmap(regcmd, 1024);
+  free(invec);
+  free(wvec);
+  munmap(regcmd, regcmd_bytes);
   munmap(tasks, 1024);
   munmap(input, in_bytes);
   munmap(weights, w_bytes);
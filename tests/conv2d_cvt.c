@@ -0,0 +1,191 @@
+/*
+ * Conv2d (1x1) of raw 8 bit pixels through the CNA input converter,
+ * checked against a CPU normalize pass followed by the convolution
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include <libdrm/drm.h>
+
+#include "rknpu-ioctl.h"
+#include "npu_interface.h"
+#include "npu_conv.h"
+#include "npu_matmul.h" // reuse packing helpers feature_data/weight_fp16/weight_int8
+
+#define H 4
+#define W 4
+#define C 32
+#define OC 32
+
+static uint64_t npu_regs[112];
+
+static float rand_float() { return rand()/(float)RAND_MAX; }
+
+// Pixel as the converter reads it, normalized for the first 4 channels
+static float cvt_ref(int int8, float x, float mean, float scale) {
+  if (!int8) {
+    return (float)(_Float16)((x - (float)(_Float16)mean) * (float)(_Float16)scale);
+  }
+  float v = roundf((x - mean) * scale);
+  return v < -128 ? -128 : (v > 127 ? 127 : v);
+}
+
+int main(int argc, char **argv) {
+  int int8 = 0, sign = 0;
+  if (argc >= 2) {
+    int8 = strcmp(argv[1], "int8") == 0;
+  }
+  if (argc >= 3) {
+    sign = atoi(argv[2]) != 0;
+  }
+
+  int fd = npu_open();
+
+  uint64_t regcmd_dma, regcmd_obj; uint32_t regcmd_handle;
+  uint64_t *regcmd = mem_allocate(fd, sizeof(npu_regs), &regcmd_dma, &regcmd_obj, 0, &regcmd_handle);
+  uint64_t tasks_dma, tasks_obj; uint32_t tasks_handle;
+  struct rknpu_task *tasks = mem_allocate(fd, 1024, &tasks_dma, &tasks_obj, RKNPU_MEM_KERNEL_MAPPING, &tasks_handle);
+
+  size_t in_bytes = (size_t)H*W*C;
+  size_t w_bytes = (size_t)OC*C*(int8 ? sizeof(int8_t) : sizeof(_Float16));
+  size_t out_bytes = (size_t)H*W*OC*sizeof(float);
+
+  uint64_t input_dma, input_obj; uint32_t input_handle; uint8_t *input = mem_allocate(fd, in_bytes, &input_dma, &input_obj, 0, &input_handle);
+  uint64_t weights_dma, weights_obj; uint32_t weights_handle; void *weights = mem_allocate(fd, w_bytes, &weights_dma, &weights_obj, 0, &weights_handle);
+  uint64_t output_dma, output_obj; uint32_t output_handle; void *output = mem_allocate(fd, out_bytes, &output_dma, &output_obj, 0, &output_handle);
+
+  if (!regcmd || !tasks || !input || !weights || !output) { printf("alloc fail\n"); return -1; }
+
+  npu_reset(fd);
+
+  // ImageNet style normalization for fp16, a zero point and requantize
+  // scale for int8
+  float mean[4] = { 123.675f, 116.28f, 103.53f, 127.5f };
+  float scale[4] = { 1/58.395f, 1/57.12f, 1/57.375f, 1/64.0f };
+  if (int8) {
+    for (int c = 0; c < 4; c++) {
+      mean[c] = sign ? (float)(c*8 - 12) : (float)(120 + c*4);
+      scale[c] = 0.35f + 0.15f*c;
+    }
+  }
+
+  conv2d_params_t params = {
+    .height = H,
+    .width = W,
+    .in_channels = C,
+    .kernel_h = 1,
+    .kernel_w = 1,
+    .out_channels = OC,
+    .stride_y = 1,
+    .stride_x = 1,
+    .input_dma = (uint32_t)input_dma,
+    .weights_dma = (uint32_t)weights_dma,
+    .output_dma = (uint32_t)output_dma,
+    .tasks = (uint64_t*)&npu_regs,
+    .cvt_enable = 1,
+    .cvt_signed = (uint8_t)sign,
+  };
+  memcpy(params.cvt_mean, mean, sizeof(mean));
+  memcpy(params.cvt_scale, scale, sizeof(scale));
+
+  int ret = int8 ? gen_conv2d_int8(&params) : gen_conv2d_fp16(&params);
+  if (ret != 0) { printf("gen_conv2d_%s failed %d\n", int8 ? "int8" : "fp16", ret); return ret; }
+
+  memcpy(regcmd, npu_regs, sizeof(npu_regs));
+  memset(tasks, 0, sizeof(struct rknpu_task));
+  tasks[0].enable_mask = 0xd;
+  tasks[0].int_mask = 0x300;
+  tasks[0].int_clear = 0x1ffff;
+  tasks[0].regcfg_amount = 112-(RKNPU_PC_DATA_EXTRA_AMOUNT+4);
+  tasks[0].regcmd_addr = regcmd_dma;
+
+  // Pixels over the whole 8 bit range, channels past 4 are padding
+  srand(time(NULL));
+  float pix[H*W*C];
+  int wvec[OC*C];
+  for (int pos = 1; pos <= H*W; ++pos) {
+    for (int c = 1; c <= C; ++c) {
+      int v = (c <= 4) ? (int)(255.0f * rand_float()) - (sign ? 128 : 0) : 0;
+      pix[(pos-1)*C + (c-1)] = (float)v;
+      input[feature_data(C, H*W, 1, 16, c, pos, 1)] = (uint8_t)v;
+    }
+  }
+  for (int oc = 1; oc <= OC; ++oc) {
+    for (int c = 1; c <= C; ++c) {
+      int v = (int)(9.0f * rand_float()) - 4;
+      wvec[(oc-1)*C + (c-1)] = v;
+      if (int8) {
+        ((int8_t *)weights)[weight_int8(C, oc, c)] = (int8_t)v;
+      } else {
+        ((_Float16 *)weights)[weight_fp16(C, oc, c)] = (_Float16)v;
+      }
+    }
+  }
+  memset(output, 0, out_bytes);
+
+  struct rknpu_submit submit = {
+    .flags = RKNPU_JOB_PC | RKNPU_JOB_BLOCK | RKNPU_JOB_PINGPONG,
+    .timeout = 6000,
+    .task_start = 0,
+    .task_number = 1,
+    .task_counter = 0,
+    .priority = 0,
+    .task_obj_addr = tasks_obj,
+    .regcfg_obj_addr = 0,
+    .task_base_addr = 0,
+    .user_data = 0,
+    .core_mask = 1,
+    .fence_fd = -1,
+    .subcore_task = { {0,1}, {1,0}, {2,0}, {0,0}, {0,0} },
+  };
+  ret = ioctl(fd, DRM_IOCTL_RKNPU_SUBMIT, &submit);
+  printf("RKNPU_SUBMIT returned %d\n", ret);
+  if (ret < 0) return ret;
+
+  // The int8 converter rounds the mean and truncates, allow 2 per
+  // converted input, fp16 the rounding of the accumulation
+  int err = 0;
+  for (int pos = 1; pos <= H*W && !err; ++pos) {
+    for (int oc = 1; oc <= OC; ++oc) {
+      float expected = 0, tolerance = 0;
+      for (int c = 0; c < C; ++c) {
+        float x = pix[(pos-1)*C + c];
+        float w = (float)wvec[(oc-1)*C + c];
+        x = (c < 4) ? cvt_ref(int8, x, mean[c], scale[c]) : x;
+        expected += x * w;
+        tolerance += (c < 4) ? (int8 ? 2.0f : 1e-2f) * fabsf(w) : 0;
+      }
+      int idx = feature_data(OC, H*W, 1, 4, oc, pos, 1);
+      float actual = int8 ? (float)((int32_t *)output)[idx] : ((float *)output)[idx];
+      if (fabsf(actual - expected) > tolerance) {
+        printf("conv cvt mismatch pos %d channel %d, %f expected %f\n", pos, oc, actual, expected);
+        err = 1;
+        break;
+      }
+    }
+  }
+  if (!err) printf("conv2d 1x1 %s cvt %s [%dx%dx%d] -> [%dx%dx%d] ok\n", int8 ? "int8" : "fp16",
+    sign ? "int8" : "uint8", H, W, C, H, W, OC);
+
+  munmap(regcmd, sizeof(npu_regs));
+  munmap(tasks, 1024);
+  munmap(input, in_bytes);
+  munmap(weights, w_bytes);
+  munmap(output, out_bytes);
+  mem_destroy(fd, regcmd_handle, regcmd_obj);
+  mem_destroy(fd, tasks_handle, tasks_obj);
+  mem_destroy(fd, input_handle, input_obj);
+  mem_destroy(fd, weights_handle, weights_obj);
+  mem_destroy(fd, output_handle, output_obj);
+  npu_close(fd);
+  return err ? -1 : 0;
+}
@@ -115,6 +115,7 @@ int main(int argc, char **argv) {
   npu_reset(fd);
 
   matmul_params_t params;
+  memset(&params, 0, sizeof(params));
   params.m = M;
   params.k = 64;
   params.n = N;
@@ -0,0 +1,213 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include <libdrm/drm.h>
+
+#include "rknpu-ioctl.h"
+#include "npu_interface.h"
+#include "npu_hw.h"
+#include "npu_matmul.h"
+
+#define MAX_COUNT 64
+
+  // Batch of independent fp16 matmuls (eg attention heads) in a single
+  // submit spread over the three cores. First as a strided batch with
+  // per matmul weights, then as explicit matmuls sharing one weight matrix.
+
+float rand_float() {
+  return rand()/(float)RAND_MAX;
+}
+
+int check(int count, int M, int K, int N, _Float16 *a, _Float16 *b, int shared, float *output) {
+  for (int i = 0; i < count; i++) {
+    _Float16 *w = shared ? b : b + i*N*K;
+    for (int m = 1; m <= M; m++) {
+      for (int n = 1; n <= N; n++) {
+        float expected = 0;
+        for (int k = 0; k < K; k++) {
+          expected += (float)a[(i*M + m-1)*K + k] * (float)w[(n-1)*K + k];
+        }
+        float actual = output[i*M*N + feature_data(N, M, 1, 4, n, m, 1)];
+        if (actual != expected) {
+          printf("mismatch matmul %d m:%d n:%d expected:%6.5f actual:%6.5f\n", i, m, n, expected, actual);
+          return -1;
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+
+  uint64_t regcmd_dma, regcmd_obj, tasks_dma, tasks_obj;
+  uint64_t input_dma, input_obj, weights_dma, weights_obj, output_dma, output_obj;
+  uint32_t regcmd_handle, tasks_handle, input_handle, weights_handle, output_handle;
+  matmul_gemm_t gemms[MAX_COUNT];
+  int ret = 0;
+
+  if (argc != 5) {
+    printf("Invalid number of args %d, needs to supply count M K N ie matmul_batch <count> <M> <K> <N>\n", argc);
+    return -1;
+  }
+
+  int count = atoi(argv[1]);
+  int M = atoi(argv[2]);
+  int K = atoi(argv[3]);
+  int N = atoi(argv[4]);
+  if ((count <= 0) || (count > MAX_COUNT) || (M <= 0) || (((M%4) != 0) && (M != 1)) ||
+    (K <= 0) || ((K%32) != 0) || (N <= 0) || ((N%16) != 0)) {
+    printf("Invalid count [%d] or shape [%d,%d,%d]\n", count, M, K, N);
+    return -1;
+  }
+
+  size_t regcmd_size = count*NPU_TASK_OPS*sizeof(uint64_t);
+  size_t tasks_size = count*sizeof(struct rknpu_task);
+  size_t input_size = (size_t)count*M*K*sizeof(_Float16);
+  size_t weights_size = (size_t)count*N*K*sizeof(_Float16);
+  size_t output_size = (size_t)count*M*N*sizeof(float);
+
+  int fd = npu_open();
+  uint64_t *regcmd = mem_allocate(fd, regcmd_size, &regcmd_dma, &regcmd_obj, 0, &regcmd_handle);
+  struct rknpu_task *tasks = mem_allocate(fd, tasks_size, &tasks_dma, &tasks_obj, RKNPU_MEM_KERNEL_MAPPING, &tasks_handle);
+  _Float16 *input = mem_allocate(fd, input_size, &input_dma, &input_obj, 0, &input_handle);
+  _Float16 *weights = mem_allocate(fd, weights_size, &weights_dma, &weights_obj, 0, &weights_handle);
+  float *output = mem_allocate(fd, output_size, &output_dma, &output_obj, 0, &output_handle);
+  uint64_t *npu_regs = calloc(count, NPU_TASK_OPS*sizeof(uint64_t));
+  _Float16 *a = malloc(input_size);
+  _Float16 *b = malloc(weights_size);
+  if (!regcmd || !tasks || !input || !weights || !output || !npu_regs || !a || !b) {
+    printf("Failed to allocate memory \n");
+    return -1;
+  }
+
+  npu_reset(fd);
+
+  srand(time(NULL));
+  for (int i = 0; i < count*M*K; i++) {
+    a[i] = (int)(10.0*rand_float());
+  }
+  for (int i = 0; i < count*N*K; i++) {
+    b[i] = (int)(10.0*rand_float());
+  }
+  for (int i = 0; i < count; i++) {
+    for (int m = 1; m <= M; m++) {
+      for (int k = 1; k <= K; k++) {
+        input[i*M*K + feature_data(K, M, 1, 8, k, m, 1)] = a[(i*M + m-1)*K + (k-1)];
+      }
+    }
+    for (int n = 1; n <= N; n++) {
+      for (int k = 1; k <= K; k++) {
+        weights[i*N*K + weight_fp16(K, n, k)] = b[(i*N + n-1)*K + (k-1)];
+      }
+    }
+  }
+
+  matmul_batch_params_t params;
+  memset(&params, 0, sizeof(params));
+  params.count = count;
+  params.m = M;
+  params.k = K;
+  params.n = N;
+  params.input_dma = input_dma;
+  params.weights_dma = weights_dma;
+  params.output_dma = output_dma;
+  params.input_stride = M*K*sizeof(_Float16);
+  params.weights_stride = N*K*sizeof(_Float16);
+  params.output_stride = M*N*sizeof(float);
+  params.tasks = npu_regs;
+  params.regcmd_dma = regcmd_dma;
+
+  for (int pass = 0; pass < 2; pass++) {
+    if (pass == 1) {
+      // Explicit matmuls all using the first weight matrix
+      for (int i = 0; i < count; i++) {
+        gemms[i].m = M;
+        gemms[i].k = K;
+        gemms[i].n = N;
+        gemms[i].input_dma = input_dma + i*params.input_stride;
+        gemms[i].weights_dma = weights_dma;
+        gemms[i].output_dma = output_dma + i*params.output_stride;
+      }
+      params.gemms = gemms;
+    }
+    if ((ret = gen_matmul_batch_fp16(&params)) != 0) {
+      printf("gen_matmul_batch_fp16 failed %d\n", ret);
+      goto cleanup;
+    }
+    memcpy(regcmd, npu_regs, regcmd_size);
+    memset(tasks, 0, tasks_size);
+    for (int i = 0; i < count; i++) {
+      tasks[i].enable_mask = 0xd;
+      tasks[i].int_mask = 0x300;
+      tasks[i].int_clear = 0x1ffff;
+      tasks[i].regcfg_amount = NPU_TASK_REGCFG_AMOUNT;
+      tasks[i].regcmd_addr = regcmd_dma + i*NPU_TASK_OPS*sizeof(uint64_t);
+    }
+    memset(output, 0, output_size);
+
+    struct rknpu_submit submit = {
+      .flags = RKNPU_JOB_PC | RKNPU_JOB_BLOCK | RKNPU_JOB_PINGPONG,
+      .timeout = 6000,
+      .task_start = 0,
+      .task_number = count,
+      .task_obj_addr = tasks_obj,
+      .fence_fd = -1,
+    };
+    npu_submit_cores(&submit, params.core_task_start, params.core_task_number);
+    ret = npu_ioctl(fd, DRM_IOCTL_RKNPU_SUBMIT, &submit);
+    if (ret < 0) {
+      printf("RKNPU_SUBMIT failed %d\n", ret);
+      goto cleanup;
+    }
+    if ((ret = check(count, M, K, N, a, b, pass, output)) != 0) {
+      goto cleanup;
+    }
+    printf("%s batch of %d [%d,%d]x[%d,%d] on cores %d/%d/%d tasks succesful\n",
+      pass ? "Shared weight" : "Strided", count, M, K, N, K,
+      params.core_task_number[0], params.core_task_number[1], params.core_task_number[2]);
+  }
+
+cleanup:
+  munmap(regcmd, regcmd_size);
+  munmap(tasks, tasks_size);
+  munmap(input, input_size);
+  munmap(weights, weights_size);
+  munmap(output, output_size);
+
+  mem_destroy(fd, regcmd_handle, regcmd_obj);
+  mem_destroy(fd, tasks_handle, tasks_obj);
+  mem_destroy(fd, input_handle, input_obj);
+  mem_destroy(fd, weights_handle, weights_obj);
+  mem_destroy(fd, output_handle, output_obj);
+
+  free(npu_regs);
+  free(a);
+  free(b);
+  npu_close(fd);
+  return ret;
+}
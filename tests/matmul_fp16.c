@@ -134,6 +134,7 @@ int main(int argc, char **argv) {
   npu_reset(fd);
 
   matmul_params_t params;
+  memset(&params, 0, sizeof(params));
   params.m = M;
   params.k = K;
   params.n = N;
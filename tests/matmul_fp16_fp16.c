@@ -35,7 +35,7 @@
 #include "rknpu-ioctl.h"
 #include "npu_interface.h"
 #include "npu_matmul.h"
-#include <sys/time.h>
+#include "npu_bw.h"
 
 #define MAX_M 384 
 #define MAX_K 8192 
@@ -56,12 +56,6 @@
 
   uint64_t npu_regs[112];
 
-static inline int64_t getCurrentTimeUs() {
-  struct timeval tv;
-  gettimeofday(&tv,NULL);
-  return tv.tv_sec * 1000000 + tv.tv_usec;
-}
-
 void matmul_fp16(int m, int k, int n, _Float16 *src0 , _Float16 *src1, _Float16* dst) {
   for (int i = 0; i < m; i++) {
     for (int j = 0; j < n; j++) {
@@ -143,6 +137,7 @@ int main(int argc, char **argv) {
   npu_reset(fd);
 
   matmul_params_t params;
+  memset(&params, 0, sizeof(params));
   params.m = M;
   params.k = K;
   params.n = N;
@@ -225,13 +220,17 @@ int main(int argc, char **argv) {
       }, { 1, 0}, {2, 0}, {0,0}, {0,0}
     },
   };
-  uint64_t start_us;
   uint64_t elapse_us;
+  npu_bw_op_t op = {
+    .name = "matmul_fp16_fp16",
+    .macs = (uint64_t)M*K*N,
+    .est_bytes = (uint64_t)(M*K + K*N + M*N)*sizeof(_Float16),
+  };
 
-  start_us = getCurrentTimeUs();
-  ret = ioctl(fd, DRM_IOCTL_RKNPU_SUBMIT, &submit);
-  elapse_us = getCurrentTimeUs() - start_us;
+  ret = npu_submit_measured(fd, &submit, &op);
+  elapse_us = op.elapsed_ns / 1000;
   printf("Elapse Time = %2fms tps = %.2f\n",elapse_us / 1000.f, 1000.f * 1000.f /elapse_us);
+  npu_bw_report(stdout, &op, 1, NPU_PEAK_GFLOPS_FP16, NPU_PEAK_DRAM_GBPS);
  
   printf("RKNPU_SUBMIT returned %d\n", ret);
   if (ret <0) {
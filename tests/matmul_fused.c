@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "npu_hw.h"
+#include "npu_matmul.h"
+#include "npu_context.h"
+
+  // Q, K and V style projections of one input fused into a single matmul,
+  // each result checked through its view of the output.
+
+#define K 64
+#define PARTS 3
+
+static const uint16_t N[PARTS] = { 64, 32, 32 };
+
+static int run(npu_context_t *ctx, int m) {
+
+  static float x[4*K], w[PARTS][64*K];
+  npu_buffer_t input, weights, output;
+  matmul_fused_t fused;
+  unsigned int seed = m;
+  int ret = -1;
+
+  if (matmul_fused_init(&fused, K, N, PARTS, 0) != 0) {
+    return -1;
+  }
+  if ((npu_buffer_alloc(ctx, m * K * sizeof(_Float16), 0, &input) != 0) ||
+    (npu_buffer_alloc(ctx, fused.n_total * K * sizeof(_Float16), 0, &weights) != 0) ||
+    (npu_buffer_alloc(ctx, m * fused.n_total * sizeof(float), 0, &output) != 0)) {
+    return -1;
+  }
+
+  // Small whole numbers keep the fp16 products exact
+  for (int i = 0; i < m * K; i++) {
+    x[i] = (float)(rand_r(&seed) % 5) - 2.0f;
+  }
+  for (int r = 1; r <= m; r++) {
+    for (int c = 1; c <= K; c++) {
+      ((_Float16 *)input.map)[feature_data(K, m, 1, 8, c, r, 1)] = (_Float16)x[(r-1)*K+(c-1)];
+    }
+  }
+  for (int p = 0; p < PARTS; p++) {
+    for (int i = 0; i < N[p] * K; i++) {
+      w[p][i] = (float)(rand_r(&seed) % 5) - 2.0f;
+    }
+    matmul_fused_pack_fp16(&fused, p, w[p], weights.map);
+  }
+  memset(output.map, 0, output.size);
+
+  npu_scratch_t *scratch = npu_context_scratch(ctx, 1);
+  matmul_params_t params;
+  memset(&params, 0, sizeof(params));
+  params.m = m;
+  params.k = K;
+  params.n = fused.n_total;
+  params.input_dma = input.dma;
+  params.weights_dma = weights.dma;
+  params.output_dma = output.dma;
+  params.tasks = scratch->regs;
+  if ((matmul_task_count(&params) != 1) || (gen_matmul_fp16(&params) != 0) ||
+    (npu_context_submit(ctx, scratch, 1, NULL, NULL) < 0)) {
+    printf("fused matmul failed\n");
+    goto cleanup;
+  }
+
+  ret = 0;
+  for (int p = 0; (p < PARTS) && (ret == 0); p++) {
+    const float *view = (const float *)((uint8_t *)output.map + matmul_fused_output_offset(&fused, p, m, sizeof(float)));
+    for (int r = 1; (r <= m) && (ret == 0); r++) {
+      for (int j = 1; j <= N[p]; j++) {
+        float expected = 0.0f;
+        for (int c = 0; c < K; c++) {
+          expected += x[(r-1)*K+c] * w[p][(j-1)*K+c];
+        }
+        float actual = view[feature_data(N[p], m, 1, 4, j, r, 1)];
+        if (actual != expected) {
+          printf("m %d part %d mismatch at [%d,%d] %f expected %f\n", m, p, r, j, actual, expected);
+          ret = -1;
+          break;
+        }
+      }
+    }
+  }
+  if (ret == 0) {
+    printf("Fused [%d,%d] x [%d+%d+%d,%d] in one task succesful\n", m, K, N[0], N[1], N[2], K);
+  }
+
+cleanup:
+  npu_buffer_free(ctx, &input);
+  npu_buffer_free(ctx, &weights);
+  npu_buffer_free(ctx, &output);
+  return ret;
+}
+
+int main(int argc, char **argv) {
+
+  matmul_fused_t fused;
+  const uint16_t unaligned[2] = { 64, 24 };
+
+  npu_context_t *ctx = npu_context_create();
+  if (ctx == NULL) {
+    return -1;
+  }
+  int ret = run(ctx, 1);
+  if (ret == 0) {
+    ret = run(ctx, 4);
+  }
+  if ((ret == 0) && (matmul_fused_init(&fused, K, unaligned, 2, 0) == 0)) {
+    printf("expected a matrix off the kernel groups to be rejected\n");
+    ret = -1;
+  }
+  npu_context_destroy(ctx);
+
+  if (ret == 0) {
+    printf("Fused matmul checks succesful\n");
+  }
+  return ret;
+}
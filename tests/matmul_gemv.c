@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "npu_hw.h"
+#include "npu_matmul.h"
+#include "npu_context.h"
+
+  // Decode matrix vector products with N split over the cores, compared
+  // with the same product as a single task, for float32 and fused ReLU
+  // fp16 outputs.
+
+typedef struct {
+  int k, n, fp16, tasks;
+} shape_t;
+
+static const shape_t shapes[] = {
+  { 64, 400, 0, 3 },            // slices of 144, 144 and 112
+  { 96, 32, 0, 2 },             // too narrow for a slice per core
+  { 128, 48, 1, 3 },
+  { 256, 1024, 1, 3 },
+};
+
+static int run(npu_context_t *ctx, const shape_t *s) {
+
+  npu_buffer_t input, weights, single, split;
+  size_t out_size = s->fp16 ? sizeof(_Float16) : sizeof(float);
+  unsigned int seed = s->k + s->n;
+  int ret = -1;
+
+  if ((npu_buffer_alloc(ctx, s->k * sizeof(_Float16), 0, &input) != 0) ||
+    (npu_buffer_alloc(ctx, (size_t)s->n * s->k * sizeof(_Float16), 0, &weights) != 0) ||
+    (npu_buffer_alloc(ctx, s->n * out_size, 0, &single) != 0) ||
+    (npu_buffer_alloc(ctx, s->n * out_size, 0, &split) != 0)) {
+    return -1;
+  }
+  // Small whole numbers keep the fp16 products exact
+  for (int c = 1; c <= s->k; c++) {
+    ((_Float16 *)input.map)[feature_data(s->k, 1, 1, 8, c, 1, 1)] = (_Float16)((rand_r(&seed) % 5) - 2);
+  }
+  for (int j = 1; j <= s->n; j++) {
+    for (int c = 1; c <= s->k; c++) {
+      ((_Float16 *)weights.map)[weight_fp16(s->k, j, c)] = (_Float16)((rand_r(&seed) % 5) - 2);
+    }
+  }
+  memset(single.map, 0xff, single.size);
+  memset(split.map, 0xff, split.size);
+
+  npu_scratch_t *scratch = npu_context_scratch(ctx, NPU_CORES);
+  matmul_params_t params;
+  memset(&params, 0, sizeof(params));
+  params.m = 1;
+  params.k = s->k;
+  params.n = s->n;
+  params.input_dma = input.dma;
+  params.weights_dma = weights.dma;
+  params.output_dma = single.dma;
+  params.tasks = scratch->regs;
+  params.fp32tofp16 = s->fp16;
+  params.relu = s->fp16;
+  if ((gen_matmul_fp16(&params) != 0) || (npu_context_submit(ctx, scratch, 1, NULL, NULL) < 0)) {
+    printf("single task [1,%d] x [%d,%d] failed\n", s->k, s->n, s->k);
+    goto cleanup;
+  }
+
+  matmul_batch_params_t gemv;
+  memset(&gemv, 0, sizeof(gemv));
+  gemv.m = 1;
+  gemv.k = s->k;
+  gemv.n = s->n;
+  gemv.input_dma = input.dma;
+  gemv.weights_dma = weights.dma;
+  gemv.output_dma = split.dma;
+  gemv.tasks = scratch->regs;
+  gemv.fp32tofp16 = s->fp16;
+  gemv.relu = s->fp16;
+  int tasks = gen_matmul_gemv_fp16(&gemv);
+  if (tasks != s->tasks) {
+    printf("[1,%d] x [%d,%d] split into %d tasks expected %d\n", s->k, s->n, s->k, tasks, s->tasks);
+    goto cleanup;
+  }
+  if (npu_context_submit(ctx, scratch, tasks, gemv.core_task_start, gemv.core_task_number) < 0) {
+    goto cleanup;
+  }
+
+  if (memcmp(single.map, split.map, s->n * out_size) != 0) {
+    for (int j = 0; j < s->n; j++) {
+      float a = s->fp16 ? (float)((_Float16 *)single.map)[j] : ((float *)single.map)[j];
+      float b = s->fp16 ? (float)((_Float16 *)split.map)[j] : ((float *)split.map)[j];
+      if (a != b) {
+        printf("[1,%d] x [%d,%d] mismatch at %d split %f single task %f\n", s->k, s->n, s->k, j, b, a);
+        break;
+      }
+    }
+    goto cleanup;
+  }
+  printf("Gemv [1,%d] x [%d,%d] over %d cores succesful\n", s->k, s->n, s->k, tasks);
+  ret = 0;
+
+cleanup:
+  npu_buffer_free(ctx, &input);
+  npu_buffer_free(ctx, &weights);
+  npu_buffer_free(ctx, &single);
+  npu_buffer_free(ctx, &split);
+  return ret;
+}
+
+int main(int argc, char **argv) {
+
+  matmul_batch_params_t bad;
+  int ret = 0;
+
+  npu_context_t *ctx = npu_context_create();
+  if (ctx == NULL) {
+    return -1;
+  }
+  for (int i = 0; (i < (int)(sizeof(shapes) / sizeof(shapes[0]))) && (ret == 0); i++) {
+    ret = run(ctx, &shapes[i]);
+  }
+  memset(&bad, 0, sizeof(bad));
+  bad.m = 4;
+  bad.k = 64;
+  bad.n = 64;
+  if ((ret == 0) && (gen_matmul_gemv_fp16(&bad) >= 0)) {
+    printf("expected a gemv of more than one row to be rejected\n");
+    ret = -1;
+  }
+  npu_context_destroy(ctx);
+
+  if (ret == 0) {
+    printf("Gemv checks succesful\n");
+  }
+  return ret;
+}
@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "npu_hw.h"
+#include "npu_matmul.h"
+#include "npu_context.h"
+
+  // Matmuls of shapes off the M, K and N alignment, packed into buffers
+  // first filled with garbage so only the zeroed pads keep the sums right,
+  // for float32 and fp16 outputs.
+
+typedef struct {
+  int m, k, n, fp16;
+} shape_t;
+
+static const shape_t shapes[] = {
+  { 1, 50, 100, 0 },
+  { 3, 17, 5, 0 },
+  { 6, 70, 33, 0 },
+  { 9, 96, 48, 1 },
+  { 1, 200, 1001, 1 },
+};
+
+static int run(npu_context_t *ctx, const shape_t *s) {
+
+  matmul_shape_t shape;
+  npu_buffer_t input, weights, output;
+  size_t out_size = s->fp16 ? sizeof(_Float16) : sizeof(float);
+  unsigned int seed = s->m * s->k * s->n;
+  int ret = -1;
+
+  if (matmul_shape_init(&shape, s->m, s->k, s->n) != 0) {
+    return -1;
+  }
+  float *a = malloc((size_t)s->m * s->k * sizeof(float));
+  float *w = malloc((size_t)s->n * s->k * sizeof(float));
+  float *c = malloc((size_t)s->m * s->n * sizeof(float));
+  if ((a == NULL) || (w == NULL) || (c == NULL) ||
+    (npu_buffer_alloc(ctx, matmul_shape_input_size(&shape), 0, &input) != 0) ||
+    (npu_buffer_alloc(ctx, matmul_shape_weights_size(&shape), 0, &weights) != 0) ||
+    (npu_buffer_alloc(ctx, matmul_shape_output_size(&shape, out_size), 0, &output) != 0)) {
+    free(a);
+    free(w);
+    free(c);
+    return -1;
+  }
+
+  // Small whole numbers keep the fp16 products exact
+  for (int i = 0; i < s->m * s->k; i++) {
+    a[i] = (float)(rand_r(&seed) % 5) - 2.0f;
+  }
+  for (int i = 0; i < s->n * s->k; i++) {
+    w[i] = (float)(rand_r(&seed) % 5) - 2.0f;
+  }
+  memset(input.map, 0x3c, input.size);
+  memset(weights.map, 0x3c, weights.size);
+  matmul_shape_pack_input_fp16(&shape, a, input.map);
+  matmul_shape_pack_weights_fp16(&shape, w, weights.map);
+
+  npu_scratch_t *scratch = npu_context_scratch(ctx, 1);
+  matmul_params_t params;
+  memset(&params, 0, sizeof(params));
+  matmul_shape_params(&shape, &params);
+  params.input_dma = input.dma;
+  params.weights_dma = weights.dma;
+  params.output_dma = output.dma;
+  params.fp32tofp16 = s->fp16;
+  params.tasks = scratch->regs;
+  if ((gen_matmul_fp16(&params) != 0) || (npu_context_submit(ctx, scratch, 1, NULL, NULL) < 0)) {
+    printf("[%d,%d]x[%d,%d] padded to [%d,%d]x[%d,%d] failed\n", s->m, s->k, s->n, s->k, shape.m_pad, shape.k_pad,
+      shape.n_pad, shape.k_pad);
+    goto cleanup;
+  }
+  matmul_shape_unpack_output(&shape, output.map, s->fp16, c);
+
+  ret = 0;
+  for (int r = 0; (r < s->m) && (ret == 0); r++) {
+    for (int j = 0; j < s->n; j++) {
+      float expected = 0.0f;
+      for (int i = 0; i < s->k; i++) {
+        expected += a[r*s->k+i] * w[j*s->k+i];
+      }
+      if (c[r*s->n+j] != expected) {
+        printf("[%d,%d]x[%d,%d] mismatch at [%d,%d] %f expected %f\n", s->m, s->k, s->n, s->k, r, j,
+          c[r*s->n+j], expected);
+        ret = -1;
+        break;
+      }
+    }
+  }
+  if (ret == 0) {
+    printf("[%d,%d]x[%d,%d] padded to [%d,%d]x[%d,%d] succesful\n", s->m, s->k, s->n, s->k, shape.m_pad, shape.k_pad,
+      shape.n_pad, shape.k_pad);
+  }
+
+cleanup:
+  npu_buffer_free(ctx, &input);
+  npu_buffer_free(ctx, &weights);
+  npu_buffer_free(ctx, &output);
+  free(a);
+  free(w);
+  free(c);
+  return ret;
+}
+
+int main(int argc, char **argv) {
+
+  matmul_shape_t shape;
+  int ret = 0;
+
+  npu_context_t *ctx = npu_context_create();
+  if (ctx == NULL) {
+    return -1;
+  }
+  for (int i = 0; (i < (int)(sizeof(shapes) / sizeof(shapes[0]))) && (ret == 0); i++) {
+    ret = run(ctx, &shapes[i]);
+  }
+  if ((ret == 0) && (matmul_shape_init(&shape, 0, 32, 16) == 0)) {
+    printf("expected an empty shape to be rejected\n");
+    ret = -1;
+  }
+  npu_context_destroy(ctx);
+
+  if (ret == 0) {
+    printf("Matmul shape checks succesful\n");
+  }
+  return ret;
+}
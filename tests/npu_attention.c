@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "npu_context.h"
+#include "npu_attention.h"
+
+  // Attention against the float reference for decode and causal prefill
+  // shapes, with the context split into several tiles, a partial last
+  // tile and padded head sizes and query rows.
+
+static unsigned int seed = 11;
+
+static int run(npu_context_t *ctx, const npu_attention_cfg_t *cfg) {
+
+  size_t q_size = (size_t)cfg->heads * cfg->m * cfg->head_size;
+  size_t kv_size = (size_t)cfg->kv_heads * cfg->seq * cfg->head_size;
+  float *q = malloc(q_size * sizeof(float)), *out = malloc(q_size * sizeof(float));
+  float *expected = malloc(q_size * sizeof(float));
+  float *k = malloc(kv_size * sizeof(float)), *v = malloc(kv_size * sizeof(float));
+  int ret = -1;
+
+  npu_attention_t *att = npu_attention_create(ctx, cfg);
+  if ((att == NULL) || (q == NULL) || (out == NULL) || (expected == NULL) || (k == NULL) || (v == NULL)) {
+    printf("npu_attention_create failed\n");
+    goto cleanup;
+  }
+  for (size_t i = 0; i < q_size; i++) {
+    q[i] = 4.0f * rand_r(&seed) / RAND_MAX - 2.0f;
+  }
+  for (size_t i = 0; i < kv_size; i++) {
+    k[i] = 4.0f * rand_r(&seed) / RAND_MAX - 2.0f;
+    v[i] = 2.0f * rand_r(&seed) / RAND_MAX - 1.0f;
+  }
+
+  // Twice, the second run reusing the tasks and buffers
+  for (int pass = 0; pass < 2; pass++) {
+    if (npu_attention_run(att, q, k, v, out) != 0) {
+      printf("npu_attention_run failed\n");
+      goto cleanup;
+    }
+  }
+  npu_attention_reference(cfg, q, k, v, expected);
+  for (size_t i = 0; i < q_size; i++) {
+    if (fabsf(out[i] - expected[i]) > 1e-2f) {
+      printf("heads %d m %d seq %d out %zu is %f expected %f\n", cfg->heads, cfg->m, cfg->seq, i, out[i],
+        expected[i]);
+      goto cleanup;
+    }
+  }
+
+  npu_attention_stats_t stats;
+  npu_attention_stats(att, &stats);
+  if (stats.submits != 4) {
+    printf("expected 2 submits per run, %llu for 2\n", (unsigned long long)stats.submits);
+    goto cleanup;
+  }
+  ret = 0;
+  printf("%d heads (%d kv) x %d rows over %d positions of %d%s succesful\n", cfg->heads, cfg->kv_heads, cfg->m,
+    cfg->seq, cfg->head_size, cfg->causal ? " causal" : "");
+
+cleanup:
+  npu_attention_destroy(att);
+  free(q);
+  free(out);
+  free(expected);
+  free(k);
+  free(v);
+  return ret;
+}
+
+int main(int argc, char **argv) {
+
+  const npu_attention_cfg_t cfgs[] = {
+    { .heads = 4, .kv_heads = 2, .m = 1, .seq = 100, .head_size = 48, .tile = 32 },
+    { .heads = 2, .kv_heads = 1, .m = 6, .seq = 70, .head_size = 64, .tile = 64, .causal = 1 },
+    { .heads = 2, .kv_heads = 2, .m = 4, .seq = 600, .head_size = 32 },
+  };
+  npu_attention_cfg_t bad = { .heads = 3, .kv_heads = 2, .m = 1, .seq = 16, .head_size = 32 };
+
+  npu_context_t *ctx = npu_context_create();
+  if (ctx == NULL) {
+    return -1;
+  }
+  int ret = 0;
+  for (unsigned int i = 0; (i < sizeof(cfgs) / sizeof(cfgs[0])) && (ret == 0); i++) {
+    ret = run(ctx, &cfgs[i]);
+  }
+  if ((ret == 0) && (npu_attention_create(ctx, &bad) != NULL)) {
+    printf("expected heads not a multiple of kv_heads to be rejected\n");
+    ret = -1;
+  }
+  npu_context_destroy(ctx);
+
+  if (ret == 0) {
+    printf("Attention checks succesful\n");
+  }
+  return ret;
+}
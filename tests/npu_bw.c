@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "rknpu-ioctl.h"
+#include "npu_bw.h"
+
+  // Attribution and roofline maths against stubbed rw amount counters,
+  // no NPU required.
+
+  uint32_t stub_dt_rd, stub_dt_wr, stub_wt_rd;
+  int stub_cleared = 0;
+
+int stub_action(int fd, uint32_t flags, uint32_t *value) {
+  switch (flags) {
+    case RKNPU_ACT_CLR_TOTAL_RW_AMOUNT:
+      stub_cleared = 1;
+      return 0;
+    case RKNPU_GET_DT_RD_AMOUNT: *value = stub_dt_rd; return 0;
+    case RKNPU_GET_DT_WR_AMOUNT: *value = stub_dt_wr; return 0;
+    case RKNPU_GET_WT_RD_AMOUNT: *value = stub_wt_rd; return 0;
+    case RKNPU_GET_TOTAL_RW_AMOUNT: *value = stub_dt_rd + stub_dt_wr + stub_wt_rd; return 0;
+    default:
+      return -1;
+  }
+}
+
+int main(int argc, char **argv) {
+
+  npu_bw_op_t ops[3];
+  int ret = 0;
+
+  memset(ops, 0, sizeof(ops));
+
+  // 1x4096x4096 fp16 GEMV, dominated by weight reads
+  ops[0].name = "gemv 1x4096x4096";
+  ops[0].macs = 4096ULL*4096;
+  ops[0].elapsed_ns = 2000000;
+  stub_dt_rd = 4096*2; stub_wt_rd = 4096*4096*2; stub_dt_wr = 4096*2;
+  npu_bw_begin(-1, stub_action);
+  npu_bw_end(-1, stub_action, &ops[0]);
+
+  // 384x384x4096 fp16 GEMM, weights reused across rows
+  ops[1].name = "gemm 384x384x4096";
+  ops[1].macs = 384ULL*384*4096;
+  ops[1].elapsed_ns = 1500000;
+  stub_dt_rd = 384*384*2; stub_wt_rd = 384*4096*2; stub_dt_wr = 384*4096*2;
+  npu_bw_begin(-1, stub_action);
+  npu_bw_end(-1, stub_action, &ops[1]);
+
+  // Counters unavailable, falls back to the estimate
+  ops[2].name = "estimated";
+  ops[2].macs = 1000;
+  ops[2].est_bytes = 4000;
+  ops[2].elapsed_ns = 1000;
+  stub_dt_rd = 0; stub_wt_rd = 0; stub_dt_wr = 0;
+  npu_bw_end(-1, stub_action, &ops[2]);
+
+  npu_bw_report(stdout, ops, 3, NPU_PEAK_GFLOPS_FP16, NPU_PEAK_DRAM_GBPS);
+
+  if (!stub_cleared || !ops[0].counters_valid || (ops[0].wt_rd_bytes != 4096*4096*2)) {
+    printf("counters not attributed\n");
+    ret = -1;
+  }
+  if (fabs(npu_bw_gbps(&ops[0]) - (8192.0 + 33554432.0 + 8192.0) / 2000000.0) > 1e-6) {
+    printf("unexpected GB/s %f\n", npu_bw_gbps(&ops[0]));
+    ret = -1;
+  }
+  if (npu_bw_intensity(&ops[0]) >= NPU_PEAK_GFLOPS_FP16 / NPU_PEAK_DRAM_GBPS ||
+      npu_bw_intensity(&ops[1]) < NPU_PEAK_GFLOPS_FP16 / NPU_PEAK_DRAM_GBPS) {
+    printf("unexpected roofline classification\n");
+    ret = -1;
+  }
+  if (ops[2].counters_valid || (npu_bw_bytes(&ops[2]) != 4000)) {
+    printf("estimate fallback not used\n");
+    ret = -1;
+  }
+
+  if (ret == 0) {
+    printf("Bandwidth attribution succesful\n");
+  }
+  return ret;
+}
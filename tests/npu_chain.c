@@ -0,0 +1,353 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "npu_hw.h"
+#include "npu_matmul.h"
+#include "npu_conv.h"
+#include "npu_context.h"
+#include "npu_graph.h"
+
+  // Layers reading the previous layer's fp16 output as their input with
+  // a fused ReLU, first a 3 layer MLP from the matmul generator in one
+  // submit, then a conv -> per pixel matmul -> conv stack through the
+  // graph. Last an int8 matmul with the ReLU on its int32 output.
+
+#define M 4
+#define K0 64
+#define K1 96
+#define K2 64
+#define K3 32
+
+#define IMG 8
+#define C0 32
+#define C1 64
+#define C2 32
+#define C3 16
+
+static unsigned int seed = 3;
+
+static float fp16(float x) {
+  return (float)(_Float16)x;
+}
+
+static float rand_float(float scale) {
+  return fp16(scale * (2.0f * rand_r(&seed) / RAND_MAX - 1.0f));
+}
+
+// Row major [rows,k] x [n,k]^T, negatives clamped when relu, rounded to
+// fp16 unless the layer writes float32
+static int layer(const float *x, const float *w, float *y, int rows, int k, int n, int relu, int round) {
+
+  int clamped = 0;
+  for (int r = 0; r < rows; r++) {
+    for (int j = 0; j < n; j++) {
+      float acc = 0.0f;
+      for (int i = 0; i < k; i++) {
+        acc += x[r*k+i] * w[j*k+i];
+      }
+      if (relu && (acc < 0.0f)) {
+        acc = 0.0f;
+        clamped++;
+      }
+      y[r*n+j] = round ? fp16(acc) : acc;
+    }
+  }
+  return clamped;
+}
+
+static void pack_weights(_Float16 *dst, const float *w, int n, int k) {
+  for (int j = 1; j <= n; j++) {
+    for (int i = 1; i <= k; i++) {
+      dst[weight_fp16(k, j, i)] = (_Float16)w[(j-1)*k+(i-1)];
+    }
+  }
+}
+
+static int compare(const char *name, const float *out, const float *expected, int rows, int n, int clamped) {
+  for (int r = 1; r <= rows; r++) {
+    for (int j = 1; j <= n; j++) {
+      float e = expected[(r-1)*n+(j-1)];
+      float v = out[feature_data(n, rows, 1, 4, j, r, 1)];
+      if (fabsf(v - e) > 1e-2f * (1.0f + fabsf(e))) {
+        printf("%s mismatch at [%d,%d] %f expected %f\n", name, r, j, v, e);
+        return -1;
+      }
+    }
+  }
+  if (clamped == 0) {
+    printf("%s has no negative activations to clamp\n", name);
+    return -1;
+  }
+  printf("%s succesful, %d activations clamped\n", name, clamped);
+  return 0;
+}
+
+static int mlp(npu_context_t *ctx) {
+
+  static float x[M*K0], w1[K1*K0], w2[K2*K1], w3[K3*K2], h1[M*K1], h2[M*K2], y[M*K3];
+  npu_buffer_t input, weights[3], hidden[2], output;
+  int ret = -1;
+
+  for (int i = 0; i < M*K0; i++) x[i] = rand_float(1.0f);
+  for (int i = 0; i < K1*K0; i++) w1[i] = rand_float(0.25f);
+  for (int i = 0; i < K2*K1; i++) w2[i] = rand_float(0.25f);
+  for (int i = 0; i < K3*K2; i++) w3[i] = rand_float(0.25f);
+  int clamped = layer(x, w1, h1, M, K0, K1, 1, 1);
+  clamped += layer(h1, w2, h2, M, K1, K2, 1, 1);
+  layer(h2, w3, y, M, K2, K3, 0, 0);
+
+  memset(weights, 0, sizeof(weights));
+  memset(hidden, 0, sizeof(hidden));
+  if ((npu_buffer_alloc(ctx, M*K0*sizeof(_Float16), 0, &input) != 0) ||
+    (npu_buffer_alloc(ctx, K1*K0*sizeof(_Float16), 0, &weights[0]) != 0) ||
+    (npu_buffer_alloc(ctx, K2*K1*sizeof(_Float16), 0, &weights[1]) != 0) ||
+    (npu_buffer_alloc(ctx, K3*K2*sizeof(_Float16), 0, &weights[2]) != 0) ||
+    (npu_buffer_alloc(ctx, M*K1*sizeof(_Float16), 0, &hidden[0]) != 0) ||
+    (npu_buffer_alloc(ctx, M*K2*sizeof(_Float16), 0, &hidden[1]) != 0) ||
+    (npu_buffer_alloc(ctx, M*K3*sizeof(float), 0, &output) != 0)) {
+    printf("failed to allocate the mlp buffers\n");
+    return -1;
+  }
+  for (int r = 1; r <= M; r++) {
+    for (int i = 1; i <= K0; i++) {
+      ((_Float16 *)input.map)[feature_data(K0, M, 1, 8, i, r, 1)] = (_Float16)x[(r-1)*K0+(i-1)];
+    }
+  }
+  pack_weights(weights[0].map, w1, K1, K0);
+  pack_weights(weights[1].map, w2, K2, K1);
+  pack_weights(weights[2].map, w3, K3, K2);
+
+  // Each layer's fp16 output buffer is the next layer's input as is
+  const npu_buffer_t *in[3] = { &input, &hidden[0], &hidden[1] };
+  const npu_buffer_t *out[3] = { &hidden[0], &hidden[1], &output };
+  const int k[3] = { K0, K1, K2 }, n[3] = { K1, K2, K3 };
+  npu_scratch_t *scratch = npu_context_scratch(ctx, 3);
+  if (scratch == NULL) {
+    goto cleanup;
+  }
+  for (int l = 0; l < 3; l++) {
+    matmul_params_t params;
+    memset(&params, 0, sizeof(params));
+    params.m = M;
+    params.k = k[l];
+    params.n = n[l];
+    params.input_dma = in[l]->dma;
+    params.weights_dma = weights[l].dma;
+    params.output_dma = out[l]->dma;
+    params.fp32tofp16 = l < 2;
+    params.relu = l < 2;
+    params.tasks = scratch->regs + l * NPU_TASK_OPS;
+    if (gen_matmul_fp16(&params) != 0) {
+      printf("gen_matmul_fp16 layer %d failed\n", l);
+      goto cleanup;
+    }
+    uint32_t next = (l < 2) ? scratch->regcmd.dma + (l + 1) * NPU_TASK_OPS * sizeof(uint64_t) : 0;
+    gen_task_chain(params.tasks, next, NPU_TASK_REGCFG_AMOUNT);
+  }
+  if (npu_context_submit(ctx, scratch, 3, NULL, NULL) < 0) {
+    goto cleanup;
+  }
+  ret = compare("mlp [4,64] -> 96 -> 64 -> 32", output.map, y, M, K3, clamped);
+
+cleanup:
+  npu_buffer_free(ctx, &input);
+  npu_buffer_free(ctx, &output);
+  for (int i = 0; i < 3; i++) {
+    npu_buffer_free(ctx, &weights[i]);
+  }
+  for (int i = 0; i < 2; i++) {
+    npu_buffer_free(ctx, &hidden[i]);
+  }
+  return ret;
+}
+
+static int int8_relu(npu_context_t *ctx) {
+
+  static int8_t x[M*K0], w[K3*K0];
+  static int32_t y[M*K3];
+  npu_buffer_t input, weights, output;
+  int clamped = 0;
+  int ret = -1;
+
+  for (int i = 0; i < M*K0; i++) x[i] = (int8_t)(rand_r(&seed) % 255 - 127);
+  for (int i = 0; i < K3*K0; i++) w[i] = (int8_t)(rand_r(&seed) % 255 - 127);
+  for (int r = 0; r < M; r++) {
+    for (int j = 0; j < K3; j++) {
+      int32_t acc = 0;
+      for (int i = 0; i < K0; i++) {
+        acc += (int32_t)x[r*K0+i] * w[j*K0+i];
+      }
+      clamped += acc < 0;
+      y[r*K3+j] = acc < 0 ? 0 : acc;
+    }
+  }
+
+  if ((npu_buffer_alloc(ctx, M*K0, 0, &input) != 0) || (npu_buffer_alloc(ctx, K3*K0, 0, &weights) != 0) ||
+    (npu_buffer_alloc(ctx, M*K3*sizeof(int32_t), 0, &output) != 0)) {
+    printf("failed to allocate the int8 buffers\n");
+    return -1;
+  }
+  for (int r = 1; r <= M; r++) {
+    for (int i = 1; i <= K0; i++) {
+      ((int8_t *)input.map)[feature_data(K0, M, 1, 16, i, r, 1)] = x[(r-1)*K0+(i-1)];
+    }
+  }
+  for (int j = 1; j <= K3; j++) {
+    for (int i = 1; i <= K0; i++) {
+      ((int8_t *)weights.map)[weight_int8(K0, j, i)] = w[(j-1)*K0+(i-1)];
+    }
+  }
+
+  npu_scratch_t *scratch = npu_context_scratch(ctx, 1);
+  if (scratch == NULL) {
+    goto cleanup;
+  }
+  matmul_params_t params;
+  memset(&params, 0, sizeof(params));
+  params.m = M;
+  params.k = K0;
+  params.n = K3;
+  params.input_dma = input.dma;
+  params.weights_dma = weights.dma;
+  params.output_dma = output.dma;
+  params.relu = 1;
+  params.tasks = scratch->regs;
+  if (gen_matmul_int8(&params) != 0) {
+    printf("gen_matmul_int8 failed\n");
+    goto cleanup;
+  }
+  if (npu_context_submit(ctx, scratch, 1, NULL, NULL) < 0) {
+    goto cleanup;
+  }
+
+  // Integer accumulation, the clamped output has to match exactly
+  ret = 0;
+  for (int r = 1; r <= M && ret == 0; r++) {
+    for (int j = 1; j <= K3; j++) {
+      int32_t v = ((int32_t *)output.map)[feature_data(K3, M, 1, 4, j, r, 1)];
+      if (v != y[(r-1)*K3+(j-1)]) {
+        printf("int8 relu mismatch at [%d,%d] %d expected %d\n", r, j, v, y[(r-1)*K3+(j-1)]);
+        ret = -1;
+        break;
+      }
+    }
+  }
+  if ((ret == 0) && (clamped == 0)) {
+    printf("int8 relu has no negative activations to clamp\n");
+    ret = -1;
+  }
+  if (ret == 0) {
+    printf("int8 relu [4,64] -> 32 succesful, %d activations clamped\n", clamped);
+  }
+
+cleanup:
+  npu_buffer_free(ctx, &input);
+  npu_buffer_free(ctx, &weights);
+  npu_buffer_free(ctx, &output);
+  return ret;
+}
+
+static int conv_stack(npu_context_t *ctx) {
+
+  // The image is sampled with stride 2 so the stack works on its 4x4 pixels
+  enum { OUT = IMG / 2 };
+  static float img[IMG*IMG*C0], px[OUT*OUT*C0], w1[C1*C0], w2[C2*C1], w3[C3*C2];
+  static float h1[OUT*OUT*C1], h2[OUT*OUT*C2], y[OUT*OUT*C3];
+
+  for (int i = 0; i < IMG*IMG*C0; i++) img[i] = rand_float(1.0f);
+  for (int i = 0; i < C1*C0; i++) w1[i] = rand_float(0.25f);
+  for (int i = 0; i < C2*C1; i++) w2[i] = rand_float(0.25f);
+  for (int i = 0; i < C3*C2; i++) w3[i] = rand_float(0.25f);
+  for (int h = 0; h < OUT; h++) {
+    for (int w = 0; w < OUT; w++) {
+      memcpy(&px[(h*OUT+w)*C0], &img[(2*h*IMG+2*w)*C0], C0*sizeof(float));
+    }
+  }
+  int clamped = layer(px, w1, h1, OUT*OUT, C0, C1, 1, 1);
+  clamped += layer(h1, w2, h2, OUT*OUT, C1, C2, 1, 1);
+  layer(h2, w3, y, OUT*OUT, C2, C3, 0, 0);
+
+  npu_graph_t *graph = npu_graph_create(ctx);
+  int tx = npu_graph_tensor(graph, npu_layout_feature, precision_float16, IMG, IMG, C0);
+  int tw1 = npu_graph_tensor(graph, npu_layout_weights, precision_float16, C1, 1, C0);
+  int th1 = npu_graph_tensor(graph, npu_layout_feature, precision_float16, OUT, OUT, C1);
+  int tw2 = npu_graph_tensor(graph, npu_layout_weights, precision_float16, C2, 1, C1);
+  int th2 = npu_graph_tensor(graph, npu_layout_feature, precision_float16, OUT, OUT, C2);
+  int tw3 = npu_graph_tensor(graph, npu_layout_weights, precision_float16, C3, 1, C2);
+  int ty = npu_graph_tensor(graph, npu_layout_feature, precision_float32, OUT, OUT, C3);
+
+  conv2d_params_t sampled = { .kernel_h = 1, .kernel_w = 1, .stride_y = 2, .stride_x = 2, .relu = 1 };
+  conv2d_params_t pointwise = { .kernel_h = 1, .kernel_w = 1 };
+  int node;
+  if ((npu_graph_conv2d(graph, tx, tw1, th1, &sampled) < 0) ||
+    ((node = npu_graph_matmul(graph, th1, tw2, th2)) < 0) || (npu_graph_relu(graph, node) != 0) ||
+    (npu_graph_conv2d(graph, th2, tw3, ty, &pointwise) < 0) || (npu_graph_compile(graph) != 3)) {
+    printf("failed to build the conv stack\n");
+    npu_graph_destroy(graph);
+    return -1;
+  }
+
+  _Float16 *xmap = npu_graph_buffer(graph, tx)->map;
+  for (int h = 1; h <= IMG; h++) {
+    for (int w = 1; w <= IMG; w++) {
+      for (int c = 1; c <= C0; c++) {
+        xmap[feature_data(C0, IMG, IMG, 8, c, h, w)] = (_Float16)img[((h-1)*IMG+(w-1))*C0+(c-1)];
+      }
+    }
+  }
+  pack_weights(npu_graph_buffer(graph, tw1)->map, w1, C1, C0);
+  pack_weights(npu_graph_buffer(graph, tw2)->map, w2, C2, C1);
+  pack_weights(npu_graph_buffer(graph, tw3)->map, w3, C3, C2);
+
+  int ret = npu_graph_run(graph);
+  if (ret >= 0) {
+    // OUT x OUT pixels are OUT * OUT rows of the feature layout
+    ret = compare("conv 8x8x32 s2 -> 64 -> 32 -> 16", npu_graph_buffer(graph, ty)->map, y, OUT*OUT, C3, clamped);
+  }
+  npu_graph_destroy(graph);
+  return ret;
+}
+
+int main(int argc, char **argv) {
+
+  npu_context_t *ctx = npu_context_create();
+  if (ctx == NULL) {
+    return -1;
+  }
+  int ret = mlp(ctx);
+  if (ret == 0) {
+    ret = conv_stack(ctx);
+  }
+  if (ret == 0) {
+    ret = int8_relu(ctx);
+  }
+  npu_context_destroy(ctx);
+
+  if (ret == 0) {
+    printf("Layer chaining checks succesful\n");
+  }
+  return ret;
+}
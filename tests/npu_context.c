@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "npu_hw.h"
+#include "npu_matmul.h"
+#include "npu_context.h"
+
+  // Several threads generating and submitting matmuls through one
+  // context, each with its own scratch and buffers and sharing the
+  // command cache.
+
+#define THREADS 4
+#define ITERATIONS 8
+#define M 4
+#define K 64
+
+typedef struct {
+  npu_context_t *ctx;
+  int id;
+  int ret;
+  int hits;
+  npu_scratch_t *scratch;
+} worker_t;
+
+void *worker(void *arg) {
+
+  worker_t *w = arg;
+  npu_buffer_t input, weights, output;
+  unsigned int seed = w->id;
+  int N = 32 * (1 + w->id % 2);
+
+  w->ret = -1;
+  if ((npu_buffer_alloc(w->ctx, M*K*sizeof(_Float16), 0, &input) != 0) ||
+    (npu_buffer_alloc(w->ctx, N*K*sizeof(_Float16), 0, &weights) != 0) ||
+    (npu_buffer_alloc(w->ctx, M*N*sizeof(float), 0, &output) != 0)) {
+    printf("thread %d alloc failed\n", w->id);
+    return NULL;
+  }
+
+  for (int it = 0; it < ITERATIONS; it++) {
+    _Float16 a[M*K], b[N*K];
+    for (int i = 0; i < M*K; i++) {
+      a[i] = (_Float16)(rand_r(&seed) % 10);
+    }
+    for (int i = 0; i < N*K; i++) {
+      b[i] = (_Float16)(rand_r(&seed) % 10);
+    }
+    for (int m = 1; m <= M; m++) {
+      for (int k = 1; k <= K; k++) {
+        ((_Float16 *)input.map)[feature_data(K, M, 1, 8, k, m, 1)] = a[(m-1)*K+(k-1)];
+      }
+    }
+    for (int n = 1; n <= N; n++) {
+      for (int k = 1; k <= K; k++) {
+        ((_Float16 *)weights.map)[weight_fp16(K, n, k)] = b[(n-1)*K+(k-1)];
+      }
+    }
+
+    npu_scratch_t *scratch = npu_context_scratch(w->ctx, 1);
+    if ((scratch == NULL) || ((w->scratch != NULL) && (w->scratch != scratch))) {
+      printf("thread %d scratch changed\n", w->id);
+      return NULL;
+    }
+    w->scratch = scratch;
+
+    // Same shape and buffers every iteration, generated once
+    matmul_params_t params;
+    memset(&params, 0, sizeof(params));
+    params.m = M;
+    params.k = K;
+    params.n = N;
+    params.input_dma = input.dma;
+    params.weights_dma = weights.dma;
+    params.output_dma = output.dma;
+    int ntasks = npu_cmd_cache_get(w->ctx, &params, sizeof(params), scratch->regs, scratch->capacity);
+    if (ntasks == 0) {
+      params.tasks = scratch->regs;
+      params.regcmd_dma = scratch->regcmd.dma;
+      if (gen_matmul_fp16(&params) != 0) {
+        printf("thread %d gen_matmul_fp16 failed\n", w->id);
+        return NULL;
+      }
+      ntasks = matmul_task_count(&params);
+      params.tasks = NULL;
+      params.regcmd_dma = 0;
+      npu_cmd_cache_put(w->ctx, &params, sizeof(params), scratch->regs, ntasks);
+    } else {
+      w->hits++;
+    }
+
+    memset(output.map, 0, M*N*sizeof(float));
+    if (npu_context_submit(w->ctx, scratch, ntasks, NULL, NULL) < 0) {
+      return NULL;
+    }
+    for (int m = 1; m <= M; m++) {
+      for (int n = 1; n <= N; n++) {
+        float expected = 0;
+        for (int k = 0; k < K; k++) {
+          expected += (float)a[(m-1)*K+k] * (float)b[(n-1)*K+k];
+        }
+        if (((float *)output.map)[feature_data(N, M, 1, 4, n, m, 1)] != expected) {
+          printf("thread %d iteration %d mismatch at [%d,%d]\n", w->id, it, m, n);
+          return NULL;
+        }
+      }
+    }
+  }
+
+  npu_buffer_free(w->ctx, &input);
+  npu_buffer_free(w->ctx, &weights);
+  // output is left for npu_context_destroy to release
+  w->ret = 0;
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+
+  pthread_t threads[THREADS];
+  worker_t workers[THREADS];
+  int ret = 0;
+
+  npu_context_t *ctx = npu_context_create();
+  if (ctx == NULL) {
+    printf("npu_context_create failed\n");
+    return -1;
+  }
+
+  for (int i = 0; i < THREADS; i++) {
+    memset(&workers[i], 0, sizeof(worker_t));
+    workers[i].ctx = ctx;
+    workers[i].id = i;
+    pthread_create(&threads[i], NULL, worker, &workers[i]);
+  }
+  for (int i = 0; i < THREADS; i++) {
+    pthread_join(threads[i], NULL);
+    if (workers[i].ret != 0) {
+      ret = -1;
+    } else if (workers[i].hits != ITERATIONS - 1) {
+      printf("thread %d had %d command cache hits\n", i, workers[i].hits);
+      ret = -1;
+    }
+  }
+
+  npu_context_destroy(ctx);
+  if (ret == 0) {
+    printf("%d threads x %d matmuls through one context succesful\n", THREADS, ITERATIONS);
+  }
+  return ret;
+}
@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "npu_hw.h"
+#include "npu_matmul.h"
+#include "npu_conv.h"
+#include "npu_cost.h"
+
+  // Cost model over generated task lists, calibration against synthetic
+  // timings and plan selection. Runs on the CPU only, no NPU required.
+
+#define SHAPES 5
+#define BATCH 4
+
+  uint64_t shape_regs[SHAPES][NPU_TASK_OPS];
+  uint64_t batch_regs[BATCH*NPU_TASK_OPS];
+  uint64_t single_regs[BATCH*NPU_TASK_OPS];
+
+  int shapes[SHAPES][3] = { {1,4096,4096}, {1,768,768}, {64,768,768}, {256,256,2048}, {384,384,4096} };
+
+int gen_matmul(int m, int k, int n, uint64_t *ops) {
+  matmul_params_t params;
+  memset(&params, 0, sizeof(params));
+  params.m = m;
+  params.k = k;
+  params.n = n;
+  params.input_dma = 0x1000;
+  params.weights_dma = 0x100000;
+  params.output_dma = 0x1000000;
+  params.tasks = ops;
+  return gen_matmul_fp16(&params);
+}
+
+int gen_conv(uint16_t batch, uint32_t input_dma, uint32_t output_dma, uint64_t *ops) {
+  conv2d_params_t params = {
+    .height = 8,
+    .width = 8,
+    .in_channels = 64,
+    .kernel_h = 1,
+    .kernel_w = 1,
+    .out_channels = 64,
+    .stride_y = 1,
+    .stride_x = 1,
+    .input_dma = input_dma,
+    .weights_dma = 0x100000,
+    .output_dma = output_dma,
+    .tasks = ops,
+    .batch = batch,
+    .input_stride = 8*8*64*2,
+    .output_stride = 8*8*64*4,
+    .regcmd_dma = 0x300000,
+  };
+  return gen_conv2d_fp16(&params);
+}
+
+int main(int argc, char **argv) {
+
+  npu_cost_model_t model, truth;
+  npu_cost_t cost;
+  npu_cost_sample_t samples[SHAPES];
+  int ret = 0;
+
+  npu_cost_model_init(&model, 1000000000);
+
+  for (int i = 0; i < SHAPES; i++) {
+    if (gen_matmul(shapes[i][0], shapes[i][1], shapes[i][2], shape_regs[i]) != 0) {
+      printf("gen_matmul_fp16 failed for %dx%dx%d\n", shapes[i][0], shapes[i][1], shapes[i][2]);
+      return -1;
+    }
+    npu_cost_tasks(&model, shape_regs[i], 1, NULL, &cost);
+    printf("%dx%dx%d macs %llu mac cycles %llu dma cycles %llu (%llu bytes) %.1fus %s bound\n",
+      shapes[i][0], shapes[i][1], shapes[i][2], (unsigned long long)cost.macs,
+      (unsigned long long)cost.mac_cycles, (unsigned long long)cost.dma_cycles,
+      (unsigned long long)(cost.data_bytes + cost.weight_bytes + cost.output_bytes),
+      npu_cost_us(&model, &cost), npu_cost_bound_name(cost.bound));
+    if (!cost.cbuf_ok || (cost.macs != (uint64_t)shapes[i][0]*shapes[i][1]*shapes[i][2])) {
+      printf("bad decode\n");
+      ret = -1;
+    }
+  }
+
+  // GEMV streams the weights once, a large square GEMM reuses them
+  npu_cost_tasks(&model, shape_regs[0], 1, NULL, &cost);
+  if ((cost.bound != npu_bound_dma) || (cost.weight_bytes != 4096*4096*2)) {
+    printf("1x4096x4096 should be dma bound on %u weight bytes\n", 4096*4096*2);
+    ret = -1;
+  }
+  npu_cost_tasks(&model, shape_regs[4], 1, NULL, &cost);
+  if (cost.bound != npu_bound_compute) {
+    printf("384x384x4096 should be compute bound\n");
+    ret = -1;
+  }
+
+  // Timings from a model with known scales are fitted back
+  truth = model;
+  truth.mac_scale = 2.0;
+  truth.dma_scale = 1.5;
+  for (int i = 0; i < SHAPES; i++) {
+    npu_cost_tasks(&truth, shape_regs[i], 1, NULL, &cost);
+    samples[i].tasks = shape_regs[i];
+    samples[i].ntasks = 1;
+    samples[i].measured_us = npu_cost_us(&truth, &cost);
+  }
+  if (npu_cost_calibrate(&model, samples, SHAPES) != SHAPES) {
+    printf("npu_cost_calibrate failed\n");
+    ret = -1;
+  }
+  printf("calibrated mac scale %.3f dma scale %.3f\n", model.mac_scale, model.dma_scale);
+  if ((fabs(model.mac_scale - truth.mac_scale) > 0.01) || (fabs(model.dma_scale - truth.dma_scale) > 0.01)) {
+    printf("calibration expected mac scale %.3f dma scale %.3f\n", truth.mac_scale, truth.dma_scale);
+    ret = -1;
+  }
+
+  // A batch with weight reuse beats the same images as unrelated tasks
+  if (gen_conv(BATCH, 0x1000, 0x1000000, batch_regs) != 0) {
+    printf("gen_conv2d_fp16 failed\n");
+    return -1;
+  }
+  for (int i = 0; i < BATCH; i++) {
+    gen_conv(1, 0x1000 + i*8*8*64*2, 0x1000000 + i*8*8*64*4, single_regs + i*NPU_TASK_OPS);
+  }
+  const uint64_t *plans[2] = { single_regs, batch_regs };
+  int ntasks[2] = { BATCH, BATCH };
+  int pick = npu_cost_pick(&model, plans, ntasks, 2, &cost);
+  printf("picked plan %d, %llu weight bytes %.1fus\n", pick, (unsigned long long)cost.weight_bytes,
+    npu_cost_us(&model, &cost));
+  if ((pick != 1) || (cost.weight_bytes != 64*64*2)) {
+    printf("expected the weight reuse plan\n");
+    ret = -1;
+  }
+
+  if (ret == 0) {
+    printf("Cost model checks succesful\n");
+  }
+  return ret;
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rknpu-ioctl.h"
+#include "npu_dvfs.h"
+
+  // Drives the governor against a stubbed RKNPU action, no NPU required.
+
+  uint32_t stub_freq = 0;
+  int stub_set_calls = 0;
+
+int stub_action(int fd, uint32_t flags, uint32_t *value) {
+  switch (flags) {
+    case RKNPU_SET_FREQ:
+      stub_freq = *value;
+      stub_set_calls++;
+      return 0;
+    case RKNPU_GET_FREQ:
+      *value = stub_freq;
+      return 0;
+    default:
+      return -1;
+  }
+}
+
+// Job that takes work_us at 1GHz, scaled to the current stub frequency
+uint32_t job_us(uint32_t work_us) {
+  return (uint32_t)((uint64_t)work_us * 1000000000 / stub_freq);
+}
+
+int expect(const char *what, npu_dvfs_t *dvfs, uint8_t level) {
+  if ((dvfs->level != level) || (stub_freq != dvfs->freqs[level])) {
+    printf("%s: expected level %d (%u Hz) got level %d (%u Hz)\n", what, level, dvfs->freqs[level],
+      dvfs->level, stub_freq);
+    return -1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+
+  const uint32_t freqs[] = { 300000000, 600000000, 800000000, 1000000000 };
+  npu_dvfs_t dvfs;
+  uint64_t now = 1000;
+  int ret = 0;
+
+  if (npu_dvfs_init(&dvfs, -1, freqs, 4, stub_action) < 0) {
+    printf("npu_dvfs_init failed\n");
+    return -1;
+  }
+  ret |= expect("init", &dvfs, 3);
+
+  // Light load, 1ms jobs every 10ms steps down once per window
+  for (int i = 0; i < 20; i++) {
+    now += 10000;
+    npu_dvfs_update(&dvfs, now, job_us(1000), job_us(1000));
+  }
+  ret |= expect("light load", &dvfs, 0);
+
+  // Saturated, steps back up
+  for (int i = 0; i < 20; i++) {
+    now += 10000;
+    npu_dvfs_update(&dvfs, now, 9500, 9500);
+  }
+  ret |= expect("saturated", &dvfs, 3);
+
+  // Latency target holds the clock even when lightly loaded,
+  // 800MHz gives 1250us while 600MHz would miss at 1667us
+  dvfs.target_us = 1500;
+  for (int i = 0; i < 20; i++) {
+    now += 10000;
+    npu_dvfs_update(&dvfs, now, job_us(1000), job_us(1000));
+  }
+  ret |= expect("target", &dvfs, 2);
+
+  // Missing the target by more than 2x jumps to the top
+  now += 10000;
+  npu_dvfs_update(&dvfs, now, 4000, 4000);
+  ret |= expect("target miss", &dvfs, 3);
+
+  // Idle drops to the lowest step, a burst boosts straight back
+  now += dvfs.idle_us;
+  npu_dvfs_update(&dvfs, now, 0, 0);
+  ret |= expect("idle", &dvfs, 0);
+  npu_dvfs_boost(&dvfs, now);
+  ret |= expect("boost", &dvfs, 3);
+
+  // and holds there on the next tick rather than looking idle
+  now += 1000;
+  npu_dvfs_update(&dvfs, now, 0, 0);
+  ret |= expect("boost tick", &dvfs, 3);
+
+  if (ret == 0) {
+    printf("DVFS governor succesful, %d frequency changes\n", stub_set_calls);
+  }
+  return ret;
+}
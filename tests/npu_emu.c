@@ -0,0 +1,497 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "rknpu-ioctl.h"
+#include "npu_interface.h"
+#include "npu_hw.h"
+#include "npu_matmul.h"
+#include "npu_conv.h"
+#include "npu_dcomp.h"
+#include "npu_bw.h"
+
+  // Runs generated command streams through the userspace emulator
+  // (NPU_EMULATOR) and checks results and rw amount counters, no NPU
+  // required.
+
+#define M 4
+#define K 64
+#define N 32
+#define H 4
+#define W 4
+#define C 32
+#define OC 32
+#define B 3
+
+  uint64_t npu_regs[B*NPU_TASK_OPS];
+
+float rand_float() {
+  return rand()/(float)RAND_MAX;
+}
+
+void setup_tasks(struct rknpu_task *tasks, uint64_t regcmd_dma, int n) {
+  for (int i = 0; i < n; i++) {
+    memset(&tasks[i], 0, sizeof(tasks[i]));
+    tasks[i].enable_mask = 0xd;
+    tasks[i].int_mask = 0x300;
+    tasks[i].int_clear = 0x1ffff;
+    tasks[i].regcfg_amount = NPU_TASK_REGCFG_AMOUNT;
+    tasks[i].regcmd_addr = regcmd_dma + i*NPU_TASK_OPS*sizeof(uint64_t);
+  }
+}
+
+int submit(int fd, uint64_t tasks_obj, int n, npu_bw_op_t *op) {
+  struct rknpu_submit submit = {
+    .flags = RKNPU_JOB_PC | RKNPU_JOB_BLOCK | RKNPU_JOB_PINGPONG,
+    .timeout = 6000,
+    .task_number = n,
+    .task_obj_addr = tasks_obj,
+    .core_mask = 1,
+    .fence_fd = -1,
+    .subcore_task = { {0,n}, {1,0}, {2,0}, {0,0}, {0,0} },
+  };
+  return (op != NULL) ? npu_submit_measured(fd, &submit, op) : npu_ioctl(fd, DRM_IOCTL_RKNPU_SUBMIT, &submit);
+}
+
+int check_counter(int fd, uint32_t flags, const char *name, uint32_t expected) {
+  uint32_t value = 0;
+  npu_action(fd, flags, &value);
+  if (value != expected) {
+    printf("%s %u expected %u\n", name, value, expected);
+    return -1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+
+  uint64_t regcmd_dma, regcmd_obj, tasks_dma, tasks_obj;
+  uint64_t input_dma, input_obj, weights_dma, weights_obj, output_dma, output_obj;
+  uint32_t regcmd_handle, tasks_handle, input_handle, weights_handle, output_handle;
+  int ret = 0;
+
+  setenv("NPU_EMULATOR", "1", 1);
+  setenv("NPU_DCOMP_EXPERIMENTAL", "1", 1);
+  int fd = npu_open();
+  if (fd < 0) {
+    return -1;
+  }
+
+  uint64_t *regcmd = mem_allocate(fd, sizeof(npu_regs), &regcmd_dma, &regcmd_obj, 0, &regcmd_handle);
+  struct rknpu_task *tasks = mem_allocate(fd, 1024, &tasks_dma, &tasks_obj, RKNPU_MEM_KERNEL_MAPPING, &tasks_handle);
+  uint8_t *input = mem_allocate(fd, B*H*W*C*sizeof(_Float16), &input_dma, &input_obj, 0, &input_handle);
+  uint8_t *weights = mem_allocate(fd, 2*K*N*sizeof(_Float16), &weights_dma, &weights_obj, 0, &weights_handle);
+  float *output = mem_allocate(fd, B*H*W*OC*sizeof(float), &output_dma, &output_obj, 0, &output_handle);
+  if (!regcmd || !tasks || !input || !weights || !output) {
+    printf("alloc fail\n");
+    return -1;
+  }
+
+  srand(time(NULL));
+
+  // Matmul with 50% sparse weights streamed through the decompressor
+  _Float16 a[M*K], b[N*K], packed[N*K];
+  for (int i = 0; i < M*K; i++) {
+    a[i] = (_Float16)(int)(10.0*rand_float());
+  }
+  for (int n = 1; n <= N; n++) {
+    for (int k = 1; k <= K; k++) {
+      b[(n-1)*K+(k-1)] = (rand() % 2) ? 0 : (_Float16)(1 + (int)(10.0*rand_float()));
+      packed[weight_fp16(K, n, k)] = b[(n-1)*K+(k-1)];
+    }
+  }
+  for (int m = 1; m <= M; m++) {
+    for (int k = 1; k <= K; k++) {
+      ((_Float16 *)input)[feature_data(K, M, 1, 8, k, m, 1)] = a[(m-1)*K+(k-1)];
+    }
+  }
+  npu_dcomp_info_t info;
+  if (weight_compress(packed, sizeof(packed), 2, 4, weights, 2*K*N*sizeof(_Float16), &info) < 0) {
+    printf("weight_compress failed\n");
+    return -1;
+  }
+
+  matmul_params_t params;
+  memset(&params, 0, sizeof(params));
+  params.m = M;
+  params.k = K;
+  params.n = N;
+  params.input_dma = input_dma;
+  params.weights_dma = weights_dma;
+  params.output_dma = output_dma;
+  params.tasks = npu_regs;
+  params.dcomp = &info;
+  if ((ret = gen_matmul_fp16(&params)) != 0) {
+    printf("gen_matmul_fp16 failed %d\n", ret);
+    return ret;
+  }
+  memcpy(regcmd, npu_regs, NPU_TASK_OPS*sizeof(uint64_t));
+  setup_tasks(tasks, regcmd_dma, 1);
+
+  npu_action(fd, RKNPU_ACT_CLR_TOTAL_RW_AMOUNT, NULL);
+  if ((ret = submit(fd, tasks_obj, 1, NULL)) != 0) {
+    printf("matmul submit failed %d\n", ret);
+    return ret;
+  }
+  for (int m = 1; m <= M && ret == 0; m++) {
+    for (int n = 1; n <= N; n++) {
+      float expected = 0;
+      for (int k = 0; k < K; k++) {
+        expected += (float)a[(m-1)*K+k] * (float)b[(n-1)*K+k];
+      }
+      if (output[feature_data(N, M, 1, 4, n, m, 1)] != expected) {
+        printf("matmul mismatch at [%d,%d]\n", m, n);
+        ret = -1;
+        break;
+      }
+    }
+  }
+  ret |= check_counter(fd, RKNPU_GET_WT_RD_AMOUNT, "matmul wt_rd", info.total_bytes);
+  ret |= check_counter(fd, RKNPU_GET_DT_RD_AMOUNT, "matmul dt_rd", M*K*sizeof(_Float16));
+  ret |= check_counter(fd, RKNPU_GET_DT_WR_AMOUNT, "matmul dt_wr", M*N*sizeof(float));
+  if (ret != 0) {
+    goto cleanup;
+  }
+  printf("matmul [%d,%d]x[%d,%d] with %u of %u weight bytes ok\n", M, K, N, K, info.total_bytes, info.raw_bytes);
+
+  // Batch of uint8 images through the input converter, weights reused
+  uint8_t pix[B*H*W*C];
+  _Float16 w[OC*C];
+  float mean[4] = {16, 32, 64, 128};
+  float scale[4] = {0.5f, 0.25f, 1.0f, 2.0f};
+  for (int i = 0; i < B*H*W*C; i++) {
+    pix[i] = (uint8_t)(rand() % 256);
+  }
+  for (int i = 0; i < OC*C; i++) {
+    w[i] = (_Float16)(int)(4.0*rand_float());
+  }
+  for (int oc = 1; oc <= OC; oc++) {
+    for (int c = 1; c <= C; c++) {
+      ((_Float16 *)weights)[weight_fp16(C, oc, c)] = w[(oc-1)*C+(c-1)];
+    }
+  }
+  for (int i = 0; i < B; i++) {
+    for (int pos = 1; pos <= H*W; pos++) {
+      for (int c = 1; c <= C; c++) {
+        input[i*H*W*C + feature_data(C, H*W, 1, 16, c, pos, 1)] = pix[(i*H*W + pos-1)*C + (c-1)];
+      }
+    }
+  }
+
+  conv2d_params_t conv = {
+    .height = H,
+    .width = W,
+    .in_channels = C,
+    .kernel_h = 1,
+    .kernel_w = 1,
+    .out_channels = OC,
+    .stride_y = 1,
+    .stride_x = 1,
+    .input_dma = input_dma,
+    .weights_dma = weights_dma,
+    .output_dma = output_dma,
+    .tasks = npu_regs,
+    .batch = B,
+    .input_stride = H*W*C,
+    .output_stride = H*W*OC*sizeof(float),
+    .regcmd_dma = regcmd_dma,
+    .cvt_enable = 1,
+  };
+  memcpy(conv.cvt_mean, mean, sizeof(mean));
+  memcpy(conv.cvt_scale, scale, sizeof(scale));
+  // A batch without regcmd_dma can't be chained
+  conv.regcmd_dma = 0;
+  if (gen_conv2d_fp16(&conv) == 0) {
+    printf("expected a conv batch without regcmd_dma to be rejected\n");
+    ret = -1;
+    goto cleanup;
+  }
+  conv.regcmd_dma = regcmd_dma;
+  if ((ret = gen_conv2d_fp16(&conv)) != 0) {
+    printf("gen_conv2d_fp16 failed %d\n", ret);
+    goto cleanup;
+  }
+  memcpy(regcmd, npu_regs, B*NPU_TASK_OPS*sizeof(uint64_t));
+  setup_tasks(tasks, regcmd_dma, B);
+
+  npu_action(fd, RKNPU_ACT_CLR_TOTAL_RW_AMOUNT, NULL);
+  if ((ret = submit(fd, tasks_obj, B, NULL)) != 0) {
+    printf("conv submit failed %d\n", ret);
+    goto cleanup;
+  }
+  for (int i = 0; i < B && ret == 0; i++) {
+    for (int pos = 1; pos <= H*W && ret == 0; pos++) {
+      for (int oc = 1; oc <= OC; oc++) {
+        float expected = 0;
+        for (int c = 0; c < C; c++) {
+          float x = pix[(i*H*W + pos-1)*C + c];
+          x = (c < 4) ? (float)(_Float16)((x - mean[c]) * scale[c]) : x;
+          expected += x * (float)w[(oc-1)*C + c];
+        }
+        if (output[i*H*W*OC + feature_data(OC, H*W, 1, 4, oc, pos, 1)] != expected) {
+          printf("conv mismatch image %d pos %d channel %d\n", i, pos, oc);
+          ret = -1;
+          break;
+        }
+      }
+    }
+  }
+  ret |= check_counter(fd, RKNPU_GET_WT_RD_AMOUNT, "conv wt_rd", OC*C*sizeof(_Float16));
+  ret |= check_counter(fd, RKNPU_GET_DT_RD_AMOUNT, "conv dt_rd", B*H*W*C);
+  if (ret != 0) {
+    goto cleanup;
+  }
+  printf("conv2d batch %d [%dx%dx%d] uint8 -> [%dx%dx%d] ok\n", B, H, W, C, H, W, OC);
+
+  // Batch of matmuls with the weights stationary in the CBUF, then a
+  // second submit that finds them still resident
+  _Float16 x[B*M*K];
+  for (int i = 0; i < B*M*K; i++) {
+    x[i] = (_Float16)(int)(10.0*rand_float());
+  }
+  for (int i = 0; i < B; i++) {
+    for (int m = 1; m <= M; m++) {
+      for (int k = 1; k <= K; k++) {
+        ((_Float16 *)input)[i*M*K + feature_data(K, M, 1, 8, k, m, 1)] = x[(i*M + m-1)*K + (k-1)];
+      }
+    }
+  }
+  for (int n = 1; n <= N; n++) {
+    for (int k = 1; k <= K; k++) {
+      ((_Float16 *)weights)[weight_fp16(K, n, k)] = b[(n-1)*K+(k-1)];
+    }
+  }
+
+  params.dcomp = NULL;
+  params.batch = B;
+  params.input_stride = M*K*sizeof(_Float16);
+  params.output_stride = M*N*sizeof(float);
+  params.regcmd_dma = 0;
+  if (gen_matmul_fp16(&params) == 0) {
+    printf("expected a matmul batch without regcmd_dma to be rejected\n");
+    ret = -1;
+    goto cleanup;
+  }
+  params.regcmd_dma = regcmd_dma;
+  for (int pass = 0; pass < 2 && ret == 0; pass++) {
+    npu_bw_op_t op;
+    memset(&op, 0, sizeof(op));
+    op.est_wt_bytes = B*N*K*sizeof(_Float16);
+    params.weights_resident = pass;
+    if ((ret = gen_matmul_fp16(&params)) != 0) {
+      printf("gen_matmul_fp16 batch failed %d\n", ret);
+      goto cleanup;
+    }
+    memset(output, 0, B*M*N*sizeof(float));
+    memcpy(regcmd, npu_regs, B*NPU_TASK_OPS*sizeof(uint64_t));
+    setup_tasks(tasks, regcmd_dma, B);
+    if ((ret = submit(fd, tasks_obj, B, &op)) != 0) {
+      printf("matmul batch submit failed %d\n", ret);
+      goto cleanup;
+    }
+    for (int i = 0; i < B && ret == 0; i++) {
+      for (int m = 1; m <= M && ret == 0; m++) {
+        for (int n = 1; n <= N; n++) {
+          float expected = 0;
+          for (int k = 0; k < K; k++) {
+            expected += (float)x[(i*M + m-1)*K + k] * (float)b[(n-1)*K+k];
+          }
+          if (output[i*M*N + feature_data(N, M, 1, 4, n, m, 1)] != expected) {
+            printf("matmul batch mismatch input %d at [%d,%d]\n", i, m, n);
+            ret = -1;
+            break;
+          }
+        }
+      }
+    }
+    uint32_t expected_wt = pass ? 0 : N*K*sizeof(_Float16);
+    if ((op.wt_rd_bytes != expected_wt) || (npu_bw_wt_saved(&op) != op.est_wt_bytes - expected_wt)) {
+      printf("matmul batch wt_rd %u saved %llu expected %u\n", op.wt_rd_bytes,
+        (unsigned long long)npu_bw_wt_saved(&op), expected_wt);
+      ret = -1;
+    }
+    if (ret == 0) {
+      printf("matmul batch %d [%d,%d]x[%d,%d]%s, %llu weight bytes saved\n", B, M, K, N, K,
+        pass ? " weights resident" : "", (unsigned long long)npu_bw_wt_saved(&op));
+    }
+  }
+
+  // The PC only reaches the tasks after the first through the chain
+  if (ret == 0) {
+    gen_task_chain(regcmd, 0, 0);
+    if (submit(fd, tasks_obj, B, NULL) == 0) {
+      printf("expected a batch with its chain cut after the first task to fail\n");
+      ret = -1;
+    } else {
+      printf("unchained batch rejected ok\n");
+    }
+  }
+
+  // One input per core, the ranges in subcore_task[2..4] as the driver
+  // reads them with all three cores
+  matmul_gemm_t gemms[B];
+  matmul_batch_params_t batch;
+  memset(&batch, 0, sizeof(batch));
+  for (int i = 0; i < B; i++) {
+    gemms[i].m = M;
+    gemms[i].k = K;
+    gemms[i].n = N;
+    gemms[i].input_dma = input_dma + i*M*K*sizeof(_Float16);
+    gemms[i].weights_dma = weights_dma;
+    gemms[i].output_dma = output_dma + i*M*N*sizeof(float);
+  }
+  batch.gemms = gemms;
+  batch.count = B;
+  batch.tasks = npu_regs;
+  batch.cores = 1;
+  if ((ret == 0) && (gen_matmul_batch_fp16(&batch) == 0)) {
+    printf("expected a batch on one core without regcmd_dma to be rejected\n");
+    ret = -1;
+  }
+  batch.regcmd_dma = regcmd_dma;
+
+  // Shared weights after a matmul whose feature data takes more banks
+  // aren't in the same banks so can't be reused
+  if (ret == 0) {
+    matmul_gemm_t split[2] = { gemms[0], gemms[0] };
+    split[0].m = (NPU_CBUF_BANK_SIZE / (K*sizeof(_Float16))) + 4;
+    batch.gemms = split;
+    batch.count = 2;
+    if (gen_matmul_batch_fp16(&batch) != 0) {
+      printf("gen_matmul_batch_fp16 failed\n");
+      ret = -1;
+    }
+    for (int i = 0; (i < NPU_TASK_OPS) && (ret == 0); i++) {
+      if (((npu_regs[NPU_TASK_OPS + i] & 0xFFFF) == CNA_CBUF_CON0) && ((npu_regs[NPU_TASK_OPS + i] >> 16) & (1 << 13))) {
+        printf("weights reused across a different bank split\n");
+        ret = -1;
+      }
+    }
+    batch.gemms = gemms;
+    batch.count = B;
+  }
+  batch.cores = 0;
+  if ((ret == 0) && (gen_matmul_batch_fp16(&batch) != 0)) {
+    printf("gen_matmul_batch_fp16 failed\n");
+    ret = -1;
+  }
+  for (int layout = 0; (layout < 2) && (ret == 0); layout++) {
+    struct rknpu_submit cores = {
+      .flags = RKNPU_JOB_PC | RKNPU_JOB_BLOCK | RKNPU_JOB_PINGPONG,
+      .timeout = 6000,
+      .task_number = B,
+      .task_obj_addr = tasks_obj,
+      .fence_fd = -1,
+    };
+    npu_submit_cores(&cores, batch.core_task_start, batch.core_task_number);
+    if (layout == 1) {
+      // Ranges indexed by core as with one or two cores
+      memmove(&cores.subcore_task[0], &cores.subcore_task[2], 3 * sizeof(cores.subcore_task[0]));
+      memset(&cores.subcore_task[3], 0, 2 * sizeof(cores.subcore_task[0]));
+    }
+    memset(output, 0, B*M*N*sizeof(float));
+    memcpy(regcmd, npu_regs, B*NPU_TASK_OPS*sizeof(uint64_t));
+    setup_tasks(tasks, regcmd_dma, B);
+    if ((cores.core_mask != 0x7) || (npu_ioctl(fd, DRM_IOCTL_RKNPU_SUBMIT, &cores) != 0)) {
+      printf("3 core submit failed\n");
+      ret = -1;
+      break;
+    }
+    int written = 0;
+    for (int i = 0; i < B; i++) {
+      float expected = 0;
+      for (int k = 0; k < K; k++) {
+        expected += (float)x[i*M*K + k] * (float)b[k];
+      }
+      written += output[i*M*N + feature_data(N, M, 1, 4, 1, 1, 1)] == expected;
+    }
+    if (written != (layout == 0 ? B : 1)) {
+      printf("3 core submit with %s ranges wrote %d of %d outputs\n", layout ? "per core" : "driver", written, B);
+      ret = -1;
+    }
+  }
+  if (ret == 0) {
+    printf("3 core batch through subcore_task[2..4] ok\n");
+  }
+
+  // Input surfaces spaced by a padded surface stride
+  if (ret == 0) {
+    int gap = 4;
+    memset(input, 0, B*H*W*C*sizeof(_Float16));
+    for (int m = 1; m <= M; m++) {
+      for (int k = 1; k <= K; k++) {
+        int plane = (k-1) / 8;
+        ((_Float16 *)input)[plane*(M + gap)*8 + (m-1)*8 + (k-1)%8] = a[(m-1)*K+(k-1)];
+      }
+    }
+    params.batch = 0;
+    params.regcmd_dma = 0;
+    params.weights_resident = 0;
+    if ((ret = gen_matmul_fp16(&params)) != 0) {
+      printf("gen_matmul_fp16 failed %d\n", ret);
+      goto cleanup;
+    }
+    npu_regs[25] = NPUOP(OP_REG_CNA, (M + gap) - 4, CNA_DMA_CON2);
+    memcpy(regcmd, npu_regs, NPU_TASK_OPS*sizeof(uint64_t));
+    setup_tasks(tasks, regcmd_dma, 1);
+    if ((ret = submit(fd, tasks_obj, 1, NULL)) != 0) {
+      printf("strided matmul submit failed %d\n", ret);
+      goto cleanup;
+    }
+    for (int m = 1; m <= M && ret == 0; m++) {
+      for (int n = 1; n <= N; n++) {
+        float expected = 0;
+        for (int k = 0; k < K; k++) {
+          expected += (float)a[(m-1)*K+k] * (float)b[(n-1)*K+k];
+        }
+        if (output[feature_data(N, M, 1, 4, n, m, 1)] != expected) {
+          printf("strided matmul mismatch at [%d,%d]\n", m, n);
+          ret = -1;
+          break;
+        }
+      }
+    }
+    if (ret == 0) {
+      printf("matmul with surfaces %d atoms apart ok\n", M + gap);
+    }
+  }
+
+cleanup:
+  munmap(regcmd, sizeof(npu_regs));
+  munmap(tasks, 1024);
+  munmap(input, B*H*W*C*sizeof(_Float16));
+  munmap(weights, 2*K*N*sizeof(_Float16));
+  munmap(output, B*H*W*OC*sizeof(float));
+
+  mem_destroy(fd, regcmd_handle, regcmd_obj);
+  mem_destroy(fd, tasks_handle, tasks_obj);
+  mem_destroy(fd, input_handle, input_obj);
+  mem_destroy(fd, weights_handle, weights_obj);
+  mem_destroy(fd, output_handle, output_obj);
+
+  npu_close(fd);
+  return ret;
+}
@@ -0,0 +1,199 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "npu_hw.h"
+#include "npu_matmul.h"
+#include "npu_context.h"
+#include "npu_lut.h"
+#include "npu_ffn.h"
+
+  // Gated FFN w2 (silu(w1 x) * (w3 x)) in one submit of three chained
+  // tasks, SiLU by the DPU LUT and the product by the EW stage, against a
+  // float reference. Two FFNs are generated to check each keeps its own
+  // weights.
+
+#define DIM 64
+#define HIDDEN 96
+#define COUNT 2
+
+static unsigned int seed = 7;
+
+static float fp16(float x) {
+  return (float)(_Float16)x;
+}
+
+static float rand_float(float scale) {
+  return fp16(scale * (2.0f * rand_r(&seed) / RAND_MAX - 1.0f));
+}
+
+static void pack_weights(_Float16 *dst, const float *w, int n, int k) {
+  for (int j = 1; j <= n; j++) {
+    for (int i = 1; i <= k; i++) {
+      dst[weight_fp16(k, j, i)] = (_Float16)w[(j-1)*k+(i-1)];
+    }
+  }
+}
+
+// The table against SiLU itself, including past both ends
+static int check_lut(void) {
+
+  npu_lut_t lut;
+  npu_lut_silu(&lut);
+  for (float x = -16.0f; x <= 16.0f; x += 1.0f / 64) {
+    float expected = x / (1.0f + expf(-x));
+    float actual = npu_lut_eval(&lut, x);
+    if (fabsf(actual - expected) > 4e-3f * (1.0f + fabsf(expected))) {
+      printf("silu table at %f is %f expected %f\n", x, actual, expected);
+      return -1;
+    }
+  }
+  printf("SiLU table within 4e-3 over [-16, 16]\n");
+  return 0;
+}
+
+static int run(npu_context_t *ctx, int m) {
+
+  static float x[4*DIM], w1[COUNT][HIDDEN*DIM], w3[COUNT][HIDDEN*DIM], w2[COUNT][DIM*HIDDEN];
+  static float hb[4*HIDDEN], y[4*DIM];
+  npu_ffn_cfg_t cfg = { m, DIM, HIDDEN, COUNT };
+  npu_buffer_t input, weights[COUNT], output;
+  npu_lut_t silu;
+  int ret = -1;
+
+  npu_lut_silu(&silu);
+  npu_ffn_t *ffn = npu_ffn_create(ctx, &cfg);
+  if (ffn == NULL) {
+    printf("npu_ffn_create failed\n");
+    return -1;
+  }
+  memset(weights, 0, sizeof(weights));
+  memset(&output, 0, sizeof(output));
+  if ((npu_buffer_alloc(ctx, m*DIM*sizeof(_Float16), 0, &input) != 0) ||
+    (npu_buffer_alloc(ctx, m*DIM*sizeof(float), 0, &output) != 0)) {
+    goto cleanup;
+  }
+  for (int i = 0; i < m*DIM; i++) {
+    x[i] = rand_float(1.0f);
+  }
+  for (int r = 1; r <= m; r++) {
+    for (int c = 1; c <= DIM; c++) {
+      ((_Float16 *)input.map)[feature_data(DIM, m, 1, 8, c, r, 1)] = (_Float16)x[(r-1)*DIM+(c-1)];
+    }
+  }
+  for (int f = 0; f < COUNT; f++) {
+    for (int i = 0; i < HIDDEN*DIM; i++) {
+      w1[f][i] = rand_float(0.5f);
+      w3[f][i] = rand_float(0.5f);
+      w2[f][i] = rand_float(0.25f);
+    }
+    if (npu_buffer_alloc(ctx, 3*HIDDEN*DIM*sizeof(_Float16), 0, &weights[f]) != 0) {
+      goto cleanup;
+    }
+    _Float16 *w = weights[f].map;
+    pack_weights(w, w1[f], HIDDEN, DIM);
+    pack_weights(w + HIDDEN*DIM, w3[f], HIDDEN, DIM);
+    pack_weights(w + 2*HIDDEN*DIM, w2[f], DIM, HIDDEN);
+
+    npu_ffn_io_t io = { input.dma, weights[f].dma, weights[f].dma + HIDDEN*DIM*sizeof(_Float16),
+      weights[f].dma + 2*HIDDEN*DIM*sizeof(_Float16), output.dma };
+    if (npu_ffn_gen(ffn, f, &io) != 0) {
+      printf("npu_ffn_gen %d failed\n", f);
+      goto cleanup;
+    }
+  }
+
+  ret = 0;
+  for (int f = 0; (f < COUNT) && (ret == 0); f++) {
+    // Each intermediate is rounded to fp16 as the NPU writes it
+    for (int r = 0; r < m; r++) {
+      for (int j = 0; j < HIDDEN; j++) {
+        float a = 0.0f, b = 0.0f;
+        for (int i = 0; i < DIM; i++) {
+          a += x[r*DIM+i] * w1[f][j*DIM+i];
+          b += x[r*DIM+i] * w3[f][j*DIM+i];
+        }
+        hb[r*HIDDEN+j] = fp16(b * fp16(npu_lut_eval(&silu, a)));
+      }
+      for (int j = 0; j < DIM; j++) {
+        y[r*DIM+j] = 0.0f;
+        for (int i = 0; i < HIDDEN; i++) {
+          y[r*DIM+j] += hb[r*HIDDEN+i] * w2[f][j*HIDDEN+i];
+        }
+      }
+    }
+
+    memset(output.map, 0, output.size);
+    if (npu_ffn_run(ffn, f) < 0) {
+      printf("npu_ffn_run %d failed\n", f);
+      ret = -1;
+      break;
+    }
+    for (int r = 1; (r <= m) && (ret == 0); r++) {
+      for (int j = 1; j <= DIM; j++) {
+        float e = y[(r-1)*DIM+(j-1)];
+        float v = ((float *)output.map)[feature_data(DIM, m, 1, 4, j, r, 1)];
+        if (fabsf(v - e) > 1e-2f * (1.0f + fabsf(e))) {
+          printf("m %d ffn %d mismatch at [%d,%d] %f expected %f\n", m, f, r, j, v, e);
+          ret = -1;
+          break;
+        }
+      }
+    }
+  }
+  if (ret == 0) {
+    printf("FFN [%d,%d] -> %d -> %d in one submit succesful\n", m, DIM, HIDDEN, DIM);
+  }
+
+cleanup:
+  npu_buffer_free(ctx, &input);
+  npu_buffer_free(ctx, &output);
+  for (int f = 0; f < COUNT; f++) {
+    npu_buffer_free(ctx, &weights[f]);
+  }
+  npu_ffn_destroy(ffn);
+  return ret;
+}
+
+int main(int argc, char **argv) {
+
+  npu_context_t *ctx = npu_context_create();
+  if (ctx == NULL) {
+    return -1;
+  }
+  int ret = check_lut();
+  if (ret == 0) {
+    ret = run(ctx, 1);
+  }
+  if (ret == 0) {
+    ret = run(ctx, 4);
+  }
+  npu_context_destroy(ctx);
+
+  if (ret == 0) {
+    printf("FFN checks succesful\n");
+  }
+  return ret;
+}
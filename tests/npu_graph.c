@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "npu_hw.h"
+#include "npu_matmul.h"
+#include "npu_conv.h"
+#include "npu_context.h"
+#include "npu_graph.h"
+
+  // A 1x1 conv writing fp16 feeding a matmul, compiled into one task list
+  // and run twice with new inputs.
+
+#define M 8
+#define K 64
+#define N1 32
+#define N2 48
+
+int main(int argc, char **argv) {
+
+  static _Float16 x[M*K], w1[N1*K], w2[N2*N1];
+  static float h[M*N1];
+  unsigned int seed = 1;
+  int ret = 0;
+
+  npu_context_t *ctx = npu_context_create();
+  if (ctx == NULL) {
+    return -1;
+  }
+  npu_graph_t *graph = npu_graph_create(ctx);
+
+  // x [M,K] as an M x 1 x K image -> conv 1x1 -> h [M,N1] fp16 -> matmul -> y [M,N2] fp32
+  int tx = npu_graph_tensor(graph, npu_layout_feature, precision_float16, M, 1, K);
+  int tw1 = npu_graph_tensor(graph, npu_layout_weights, precision_float16, N1, 1, K);
+  int th = npu_graph_tensor(graph, npu_layout_feature, precision_float16, M, 1, N1);
+  int tw2 = npu_graph_tensor(graph, npu_layout_weights, precision_float16, N2, 1, N1);
+  int ty = npu_graph_tensor(graph, npu_layout_feature, precision_float32, M, 1, N2);
+
+  conv2d_params_t conv = { .kernel_h = 1, .kernel_w = 1 };
+  if ((npu_graph_conv2d(graph, tx, tw1, th, &conv) < 0) || (npu_graph_matmul(graph, th, tw2, ty) < 0)) {
+    printf("failed to build graph\n");
+    return -1;
+  }
+  if (npu_graph_matmul(graph, tx, tw2, ty) >= 0) {
+    printf("expected a second writer of y to be rejected\n");
+    return -1;
+  }
+  int tz = npu_graph_tensor(graph, npu_layout_feature, precision_float32, M, 1, N2);
+  if (npu_graph_matmul(graph, th, tw1, tz) >= 0) {
+    printf("expected a shape mismatch to be rejected\n");
+    return -1;
+  }
+
+  int ntasks = npu_graph_compile(graph);
+  if (ntasks != 2) {
+    printf("npu_graph_compile returned %d, expected 2 tasks\n", ntasks);
+    return -1;
+  }
+
+  _Float16 *xmap = npu_graph_buffer(graph, tx)->map;
+  _Float16 *w1map = npu_graph_buffer(graph, tw1)->map;
+  _Float16 *w2map = npu_graph_buffer(graph, tw2)->map;
+  float *ymap = npu_graph_buffer(graph, ty)->map;
+
+  for (int i = 0; i < N1*K; i++) {
+    w1[i] = (_Float16)(rand_r(&seed) % 4);
+  }
+  for (int i = 0; i < N2*N1; i++) {
+    w2[i] = (_Float16)(rand_r(&seed) % 4);
+  }
+  for (int n = 1; n <= N1; n++) {
+    for (int k = 1; k <= K; k++) {
+      w1map[weight_fp16(K, n, k)] = w1[(n-1)*K+(k-1)];
+    }
+  }
+  for (int n = 1; n <= N2; n++) {
+    for (int k = 1; k <= N1; k++) {
+      w2map[weight_fp16(N1, n, k)] = w2[(n-1)*N1+(k-1)];
+    }
+  }
+
+  for (int run = 0; (run < 2) && (ret == 0); run++) {
+    for (int i = 0; i < M*K; i++) {
+      x[i] = (_Float16)(rand_r(&seed) % 4);
+    }
+    for (int m = 1; m <= M; m++) {
+      for (int k = 1; k <= K; k++) {
+        xmap[feature_data(K, M, 1, 8, k, m, 1)] = x[(m-1)*K+(k-1)];
+      }
+    }
+    memset(ymap, 0, npu_graph_buffer(graph, ty)->size);
+
+    if (npu_graph_run(graph) < 0) {
+      printf("npu_graph_run failed\n");
+      ret = -1;
+      break;
+    }
+
+    // Small whole numbers keep the fp16 intermediate exact
+    for (int m = 0; m < M; m++) {
+      for (int n = 0; n < N1; n++) {
+        h[m*N1+n] = 0;
+        for (int k = 0; k < K; k++) {
+          h[m*N1+n] += (float)x[m*K+k] * (float)w1[n*K+k];
+        }
+      }
+    }
+    for (int m = 1; (m <= M) && (ret == 0); m++) {
+      for (int n = 1; n <= N2; n++) {
+        float expected = 0;
+        for (int k = 0; k < N1; k++) {
+          expected += h[(m-1)*N1+k] * (float)w2[(n-1)*N1+k];
+        }
+        if (ymap[feature_data(N2, M, 1, 4, n, m, 1)] != expected) {
+          printf("run %d mismatch at [%d,%d] %f expected %f\n", run, m, n,
+            ymap[feature_data(N2, M, 1, 4, n, m, 1)], expected);
+          ret = -1;
+          break;
+        }
+      }
+    }
+  }
+
+  npu_graph_destroy(graph);
+  npu_context_destroy(ctx);
+
+  if (ret == 0) {
+    printf("Graph checks succesful\n");
+  }
+  return ret;
+}
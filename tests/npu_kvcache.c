@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "npu_context.h"
+#include "npu_kvcache.h"
+
+  // Appends random keys and values and compares the attention read from
+  // the fp16 and int8 caches with a float reference at every position.
+
+#define LAYERS 2
+#define KV_HEADS 2
+#define Q_HEADS 4
+#define HEAD_SIZE 40
+#define SEQ 40
+
+#define KV_DIM (KV_HEADS * HEAD_SIZE)
+#define DIM (KV_HEADS * Q_HEADS * HEAD_SIZE)
+
+static float keys[LAYERS][SEQ][KV_DIM], values[LAYERS][SEQ][KV_DIM], queries[LAYERS][SEQ][DIM];
+
+static float fp16(float x) {
+  return (float)(_Float16)x;
+}
+
+static void reference(int layer, int pos, float *out) {
+
+  float att[SEQ];
+
+  for (int h = 0; h < KV_HEADS * Q_HEADS; h++) {
+    int kvh = (h / Q_HEADS) * HEAD_SIZE;
+    float max_val = -INFINITY, sum = 0.0f;
+    for (int s = 0; s <= pos; s++) {
+      att[s] = 0.0f;
+      for (int i = 0; i < HEAD_SIZE; i++) {
+        att[s] += fp16(queries[layer][pos][h * HEAD_SIZE + i]) * fp16(keys[layer][s][kvh + i]);
+      }
+      att[s] /= sqrtf(HEAD_SIZE);
+      max_val = att[s] > max_val ? att[s] : max_val;
+    }
+    for (int s = 0; s <= pos; s++) {
+      att[s] = expf(att[s] - max_val);
+      sum += att[s];
+    }
+    for (int i = 0; i < HEAD_SIZE; i++) {
+      out[h * HEAD_SIZE + i] = 0.0f;
+      for (int s = 0; s <= pos; s++) {
+        out[h * HEAD_SIZE + i] += fp16(att[s] / sum) * fp16(values[layer][s][kvh + i]);
+      }
+    }
+  }
+}
+
+static int run(npu_context_t *ctx, int int8, size_t *bytes) {
+
+  npu_kvcache_cfg_t cfg = { LAYERS, KV_HEADS, Q_HEADS, HEAD_SIZE, SEQ, int8 };
+  float out[DIM], expected[DIM];
+  float tolerance = int8 ? 5e-2f : 5e-3f;
+  int ret = 0;
+
+  npu_kvcache_t *kv = npu_kvcache_create(ctx, &cfg);
+  if (kv == NULL) {
+    printf("npu_kvcache_create failed\n");
+    return -1;
+  }
+  *bytes = npu_kvcache_bytes(kv);
+
+  // Attend after every append, the layers interleaved like a forward pass
+  for (int pos = 0; (pos < SEQ) && (ret == 0); pos++) {
+    for (int l = 0; (l < LAYERS) && (ret == 0); l++) {
+      if ((npu_kvcache_append(kv, l, pos, keys[l][pos], values[l][pos]) != 0) ||
+        (npu_kvcache_attend(kv, l, pos, queries[l][pos], out) != 0)) {
+        printf("%s cache failed at layer %d pos %d\n", int8 ? "int8" : "fp16", l, pos);
+        ret = -1;
+        break;
+      }
+      reference(l, pos, expected);
+      for (int i = 0; i < DIM; i++) {
+        if (fabsf(out[i] - expected[i]) > tolerance) {
+          printf("%s cache layer %d pos %d out %d is %f expected %f\n", int8 ? "int8" : "fp16", l, pos, i,
+            out[i], expected[i]);
+          ret = -1;
+          break;
+        }
+      }
+    }
+  }
+
+  npu_kvcache_stats_t stats;
+  npu_kvcache_stats(kv, &stats);
+  if ((ret == 0) && (stats.submits != 2 * SEQ * LAYERS)) {
+    printf("expected 2 submits per attention, %llu for %d\n", (unsigned long long)stats.submits, SEQ * LAYERS);
+    ret = -1;
+  }
+  npu_kvcache_destroy(kv);
+  if (ret == 0) {
+    printf("%s cache of %zu bytes, attention at %d positions succesful\n", int8 ? "int8" : "fp16", *bytes, SEQ);
+  }
+  return ret;
+}
+
+int main(int argc, char **argv) {
+
+  unsigned int seed = 5;
+  size_t fp16_bytes = 0, int8_bytes = 0;
+
+  for (int l = 0; l < LAYERS; l++) {
+    for (int s = 0; s < SEQ; s++) {
+      for (int i = 0; i < KV_DIM; i++) {
+        keys[l][s][i] = 2.0f * rand_r(&seed) / RAND_MAX - 1.0f;
+        values[l][s][i] = 2.0f * rand_r(&seed) / RAND_MAX - 1.0f;
+      }
+      for (int i = 0; i < DIM; i++) {
+        queries[l][s][i] = 2.0f * rand_r(&seed) / RAND_MAX - 1.0f;
+      }
+    }
+  }
+
+  npu_context_t *ctx = npu_context_create();
+  if (ctx == NULL) {
+    return -1;
+  }
+  int ret = run(ctx, 0, &fp16_bytes);
+  if (ret == 0) {
+    ret = run(ctx, 1, &int8_bytes);
+  }
+  // Halved per element, less the int8 keys' wider kernel groups
+  if ((ret == 0) && (int8_bytes * 5 > fp16_bytes * 3)) {
+    printf("int8 cache %zu bytes isn't smaller than fp16 %zu\n", int8_bytes, fp16_bytes);
+    ret = -1;
+  }
+  npu_context_destroy(ctx);
+
+  if (ret == 0) {
+    printf("KV cache checks succesful\n");
+  }
+  return ret;
+}
@@ -0,0 +1,245 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "npu_context.h"
+#include "npu_llama.h"
+
+  // Writes a small random llama2.c checkpoint and compares the runtime's
+  // logits with a float reference of the llama2.c forward pass, rounding
+  // weights and matmul inputs to fp16 like the NPU, with the fp16 then
+  // the int8 KV cache.
+
+#define DIM 64
+#define HIDDEN 128
+#define LAYERS 2
+#define HEADS 4
+#define KV_HEADS 2
+#define VOCAB 72
+#define SEQ 8
+
+#define HEAD_SIZE (DIM / HEADS)
+#define KV_DIM (KV_HEADS * HEAD_SIZE)
+
+typedef struct {
+  float emb[VOCAB*DIM];
+  float rms_att[LAYERS*DIM];
+  float wq[LAYERS*DIM*DIM];
+  float wk[LAYERS*KV_DIM*DIM];
+  float wv[LAYERS*KV_DIM*DIM];
+  float wo[LAYERS*DIM*DIM];
+  float rms_ffn[LAYERS*DIM];
+  float w1[LAYERS*HIDDEN*DIM];
+  float w2[LAYERS*DIM*HIDDEN];
+  float w3[LAYERS*HIDDEN*DIM];
+  float rms_final[DIM];
+  float rope[SEQ*HEAD_SIZE];
+} weights_t;
+
+static weights_t w;
+static float key_cache[LAYERS][SEQ][KV_DIM], value_cache[LAYERS][SEQ][KV_DIM];
+
+static float fp16(float x) {
+  return (float)(_Float16)x;
+}
+
+static void matmul(float *out, const float *x, const float *m, int n, int k) {
+  for (int i = 0; i < n; i++) {
+    float acc = 0.0f;
+    for (int j = 0; j < k; j++) {
+      acc += fp16(x[j]) * fp16(m[i*k+j]);
+    }
+    out[i] = acc;
+  }
+}
+
+static void rmsnorm(float *o, const float *x, const float *weight) {
+  float ss = 0.0f;
+  for (int j = 0; j < DIM; j++) {
+    ss += x[j] * x[j];
+  }
+  ss = 1.0f / sqrtf(ss / DIM + 1e-5f);
+  for (int j = 0; j < DIM; j++) {
+    o[j] = weight[j] * (ss * x[j]);
+  }
+}
+
+// llama2.c forward
+static void reference(int token, int pos, float *logits) {
+
+  static float x[DIM];
+  float xb[DIM], q[DIM], k[KV_DIM], v[KV_DIM], att[SEQ], xb2[DIM], h1[HIDDEN], h3[HIDDEN];
+
+  memcpy(x, w.emb + token * DIM, sizeof(x));
+  for (int l = 0; l < LAYERS; l++) {
+    rmsnorm(xb, x, w.rms_att + l * DIM);
+    matmul(q, xb, w.wq + l * DIM * DIM, DIM, DIM);
+    matmul(k, xb, w.wk + l * KV_DIM * DIM, KV_DIM, DIM);
+    matmul(v, xb, w.wv + l * KV_DIM * DIM, KV_DIM, DIM);
+    for (int i = 0; i < DIM; i += 2) {
+      float freq = 1.0f / powf(10000.0f, (i % HEAD_SIZE) / (float)HEAD_SIZE);
+      float fcr = cosf(pos * freq), fci = sinf(pos * freq);
+      for (int r = 0; r < (i < KV_DIM ? 2 : 1); r++) {
+        float *vec = r == 0 ? q : k;
+        float v0 = vec[i], v1 = vec[i+1];
+        vec[i] = v0 * fcr - v1 * fci;
+        vec[i+1] = v0 * fci + v1 * fcr;
+      }
+    }
+    memcpy(key_cache[l][pos], k, sizeof(k));
+    memcpy(value_cache[l][pos], v, sizeof(v));
+
+    for (int h = 0; h < HEADS; h++) {
+      int kvh = (h / (HEADS / KV_HEADS)) * HEAD_SIZE;
+      float max_val = -1e30f, sum = 0.0f;
+      for (int s = 0; s <= pos; s++) {
+        att[s] = 0.0f;
+        for (int i = 0; i < HEAD_SIZE; i++) {
+          att[s] += fp16(q[h * HEAD_SIZE + i]) * fp16(key_cache[l][s][kvh + i]);
+        }
+        att[s] /= sqrtf(HEAD_SIZE);
+        max_val = att[s] > max_val ? att[s] : max_val;
+      }
+      for (int s = 0; s <= pos; s++) {
+        att[s] = expf(att[s] - max_val);
+        sum += att[s];
+      }
+      for (int i = 0; i < HEAD_SIZE; i++) {
+        xb[h * HEAD_SIZE + i] = 0.0f;
+        for (int s = 0; s <= pos; s++) {
+          xb[h * HEAD_SIZE + i] += fp16(att[s] / sum) * fp16(value_cache[l][s][kvh + i]);
+        }
+      }
+    }
+    matmul(xb2, xb, w.wo + l * DIM * DIM, DIM, DIM);
+    for (int i = 0; i < DIM; i++) {
+      x[i] += xb2[i];
+    }
+
+    rmsnorm(xb, x, w.rms_ffn + l * DIM);
+    matmul(h1, xb, w.w1 + l * HIDDEN * DIM, HIDDEN, DIM);
+    matmul(h3, xb, w.w3 + l * HIDDEN * DIM, HIDDEN, DIM);
+    for (int i = 0; i < HIDDEN; i++) {
+      h1[i] = h1[i] / (1.0f + expf(-h1[i])) * h3[i];
+    }
+    matmul(xb2, h1, w.w2 + l * DIM * HIDDEN, DIM, HIDDEN);
+    for (int i = 0; i < DIM; i++) {
+      x[i] += xb2[i];
+    }
+  }
+  rmsnorm(xb, x, w.rms_final);
+  matmul(logits, xb, w.emb, VOCAB, DIM);
+}
+
+int main(int argc, char **argv) {
+
+  npu_llama_config_t cfg = { DIM, HIDDEN, LAYERS, HEADS, KV_HEADS, VOCAB, SEQ };
+  char path[] = "/tmp/npu_llama_XXXXXX";
+  float expected[VOCAB];
+  unsigned int seed = 11;
+  int ret = 0;
+
+  float *f = (float *)&w;
+  for (size_t i = 0; i < sizeof(w) / sizeof(float); i++) {
+    f[i] = (float)rand_r(&seed) / RAND_MAX - 0.5f;
+  }
+  for (int i = 0; i < LAYERS * DIM; i++) {
+    w.rms_att[i] = 1.0f;
+    w.rms_ffn[i] = 1.0f;
+  }
+  for (int i = 0; i < DIM; i++) {
+    w.rms_final[i] = 1.0f;
+  }
+
+  int fd = mkstemp(path);
+  if ((fd < 0) || (write(fd, &cfg, sizeof(cfg)) != sizeof(cfg)) || (write(fd, &w, sizeof(w)) != sizeof(w))) {
+    printf("failed to write checkpoint %s\n", path);
+    return -1;
+  }
+  close(fd);
+
+  npu_context_t *ctx = npu_context_create();
+  if (ctx == NULL) {
+    unlink(path);
+    return -1;
+  }
+  for (int kv_int8 = 0; (kv_int8 < 2) && (ret == 0); kv_int8++) {
+    npu_llama_opts_t opts = { kv_int8 };
+    float tolerance = kv_int8 ? 5e-2f : 1e-2f;
+    npu_llama_t *model = npu_llama_load(ctx, path, &opts);
+    if (model == NULL) {
+      printf("npu_llama_load failed\n");
+      ret = -1;
+      break;
+    }
+
+    int token = 1;
+    for (int pos = 0; (pos < SEQ) && (ret == 0); pos++) {
+      float *logits = npu_llama_forward(model, token, pos);
+      if (logits == NULL) {
+        printf("npu_llama_forward failed at %d\n", pos);
+        ret = -1;
+        break;
+      }
+      reference(token, pos, expected);
+
+      // int8 error is relative to the largest logit rather than each one
+      float range = 0.0f;
+      for (int i = 0; i < VOCAB; i++) {
+        range = fabsf(expected[i]) > range ? fabsf(expected[i]) : range;
+      }
+      int next = 0;
+      for (int i = 0; i < VOCAB; i++) {
+        if (fabsf(logits[i] - expected[i]) > tolerance * (1.0f + (kv_int8 ? range : fabsf(expected[i])))) {
+          printf("%s kv pos %d logit %d is %f expected %f\n", kv_int8 ? "int8" : "fp16", pos, i, logits[i],
+            expected[i]);
+          ret = -1;
+          break;
+        }
+        next = logits[i] > logits[next] ? i : next;
+      }
+      token = next;
+    }
+
+    npu_llama_stats_t stats;
+    npu_llama_stats(model, &stats);
+    printf("%s kv: %llu tokens in %llu submits, %.1f%% of the time on the npu\n", kv_int8 ? "int8" : "fp16",
+      (unsigned long long)stats.tokens, (unsigned long long)stats.submits,
+      stats.total_ns ? 100.0 * stats.npu_ns / stats.total_ns : 0.0);
+    if ((ret == 0) && (stats.submits != SEQ * (LAYERS * 5 + 1))) {
+      printf("expected %d submits per token\n", LAYERS * 5 + 1);
+      ret = -1;
+    }
+    npu_llama_free(model);
+  }
+  unlink(path);
+  npu_context_destroy(ctx);
+
+  if (ret == 0) {
+    printf("Llama runtime checks succesful\n");
+  }
+  return ret;
+}
@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "npu_hw.h"
+#include "npu_matmul.h"
+#include "npu_context.h"
+#include "npu_graph.h"
+#include "npu_plan.h"
+
+  // Arena planning of op sequences, then a chain of matmuls whose
+  // intermediates share the arena.
+
+#define LAYERS 4
+#define M 16
+#define K 64
+
+// No two tensors live at the same time may overlap in the arena
+static int check_plan(const npu_plan_tensor_t *t, int n, const npu_plan_stats_t *stats) {
+
+  for (int i = 0; i < n; i++) {
+    if (t[i].offset + t[i].size > stats->arena) {
+      printf("tensor %d ends past the arena\n", i);
+      return -1;
+    }
+    for (int j = i + 1; j < n; j++) {
+      if ((t[i].first <= t[j].last) && (t[j].first <= t[i].last) &&
+        (t[i].offset < t[j].offset + t[j].size) && (t[j].offset < t[i].offset + t[i].size)) {
+        printf("tensors %d and %d overlap\n", i, j);
+        return -1;
+      }
+    }
+  }
+  if ((stats->arena < stats->peak) || (stats->arena > stats->naive)) {
+    printf("arena %zu outside peak %zu and naive %zu\n", stats->arena, stats->peak, stats->naive);
+    return -1;
+  }
+  return 0;
+}
+
+static int plan_chain(void) {
+
+  npu_plan_tensor_t t[9];
+  npu_plan_stats_t stats;
+
+  // Tensor i is written by op i-1 and read by op i, a ping pong suffices
+  for (int i = 0; i < 9; i++) {
+    t[i].size = 4096;
+    t[i].first = i > 0 ? i - 1 : 0;
+    t[i].last = i < 8 ? i : 7;
+  }
+  if ((npu_plan_arena(t, 9, 0, &stats) != 0) || (check_plan(t, 9, &stats) != 0)) {
+    return -1;
+  }
+  npu_plan_report(stdout, &stats);
+  if ((stats.arena != 2 * 4096) || (stats.naive != 9 * 4096)) {
+    printf("expected a 2 tensor arena for a chain\n");
+    return -1;
+  }
+  return 0;
+}
+
+static int plan_random(void) {
+
+  npu_plan_tensor_t t[64];
+  npu_plan_stats_t stats;
+  unsigned int seed = 7;
+
+  for (int i = 0; i < 64; i++) {
+    t[i].size = (rand_r(&seed) % 64 + 1) * 100;
+    t[i].first = rand_r(&seed) % 32;
+    t[i].last = t[i].first + rand_r(&seed) % 6;
+  }
+  if ((npu_plan_arena(t, 64, 0, &stats) != 0) || (check_plan(t, 64, &stats) != 0)) {
+    return -1;
+  }
+  npu_plan_report(stdout, &stats);
+  return 0;
+}
+
+static int graph_chain(void) {
+
+  static _Float16 x[M*K], w[LAYERS][K*K];
+  static float ref[M*K], next[M*K];
+  int tensors[LAYERS + 1], weights[LAYERS];
+  npu_plan_stats_t stats;
+  unsigned int seed = 3;
+  int ret = 0;
+
+  npu_context_t *ctx = npu_context_create();
+  if (ctx == NULL) {
+    return -1;
+  }
+  npu_graph_t *graph = npu_graph_create(ctx);
+
+  // x -> fp16 -> fp16 -> fp16 -> fp32 y, the intermediates can ping pong
+  for (int l = 0; l <= LAYERS; l++) {
+    tensors[l] = npu_graph_tensor(graph, npu_layout_feature, l == LAYERS ? precision_float32 : precision_float16, M, 1, K);
+  }
+  for (int l = 0; l < LAYERS; l++) {
+    weights[l] = npu_graph_tensor(graph, npu_layout_weights, precision_float16, K, 1, K);
+    if (npu_graph_matmul(graph, tensors[l], weights[l], tensors[l + 1]) < 0) {
+      return -1;
+    }
+  }
+  if ((npu_graph_compile(graph) != LAYERS) || (npu_graph_memory(graph, &stats) != 0)) {
+    printf("npu_graph_compile failed\n");
+    return -1;
+  }
+  npu_plan_report(stdout, &stats);
+  if (stats.arena >= stats.naive) {
+    printf("expected the intermediates to share memory\n");
+    ret = -1;
+  }
+
+  for (int i = 0; i < M*K; i++) {
+    x[i] = (_Float16)(rand_r(&seed) % 2);
+    ref[i] = (float)x[i];
+  }
+  for (int m = 1; m <= M; m++) {
+    for (int k = 1; k <= K; k++) {
+      ((_Float16 *)npu_graph_buffer(graph, tensors[0])->map)[feature_data(K, M, 1, 8, k, m, 1)] = x[(m-1)*K+(k-1)];
+    }
+  }
+  // Identity plus a few ones keeps every layer's output small and exact
+  for (int l = 0; l < LAYERS; l++) {
+    _Float16 *map = npu_graph_buffer(graph, weights[l])->map;
+    for (int n = 1; n <= K; n++) {
+      for (int k = 1; k <= K; k++) {
+        w[l][(n-1)*K+(k-1)] = (_Float16)((n == k) || (rand_r(&seed) % 32 == 0));
+        map[weight_fp16(K, n, k)] = w[l][(n-1)*K+(k-1)];
+      }
+    }
+  }
+
+  if (npu_graph_run(graph) < 0) {
+    return -1;
+  }
+
+  for (int l = 0; l < LAYERS; l++) {
+    for (int m = 0; m < M; m++) {
+      for (int n = 0; n < K; n++) {
+        float acc = 0;
+        for (int k = 0; k < K; k++) {
+          acc += ref[m*K+k] * (float)w[l][n*K+k];
+        }
+        next[m*K+n] = acc;
+      }
+    }
+    memcpy(ref, next, sizeof(ref));
+  }
+  float *y = npu_graph_buffer(graph, tensors[LAYERS])->map;
+  for (int m = 1; (m <= M) && (ret == 0); m++) {
+    for (int n = 1; n <= K; n++) {
+      if (y[feature_data(K, M, 1, 4, n, m, 1)] != ref[(m-1)*K+(n-1)]) {
+        printf("mismatch at [%d,%d] %f expected %f\n", m, n, y[feature_data(K, M, 1, 4, n, m, 1)], ref[(m-1)*K+(n-1)]);
+        ret = -1;
+        break;
+      }
+    }
+  }
+
+  npu_graph_destroy(graph);
+  npu_context_destroy(ctx);
+  return ret;
+}
+
+int main(int argc, char **argv) {
+
+  int ret = 0;
+
+  ret |= plan_chain();
+  ret |= plan_random();
+  ret |= graph_chain();
+
+  if (ret == 0) {
+    printf("Memory plan checks succesful\n");
+  }
+  return ret;
+}
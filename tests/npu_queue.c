@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "npu_hw.h"
+#include "npu_matmul.h"
+#include "npu_context.h"
+#include "npu_queue.h"
+
+  // Producers pushing small matmuls through the submission queue, which
+  // should merge them into fewer submits.
+
+#define PRODUCERS 6
+#define JOBS 20
+#define M 4
+#define K 32
+#define N 32
+
+typedef struct {
+  npu_context_t *ctx;
+  npu_queue_t *queue;
+  int id;
+  int ret;
+} producer_t;
+
+void *producer(void *arg) {
+
+  producer_t *p = arg;
+  npu_buffer_t input, weights, output;
+  uint64_t ops[NPU_TASK_OPS];
+  unsigned int seed = p->id + 1;
+  npu_job_t job;
+
+  p->ret = -1;
+  if ((npu_buffer_alloc(p->ctx, M*K*sizeof(_Float16), 0, &input) != 0) ||
+    (npu_buffer_alloc(p->ctx, N*K*sizeof(_Float16), 0, &weights) != 0) ||
+    (npu_buffer_alloc(p->ctx, M*N*sizeof(float), 0, &output) != 0)) {
+    printf("producer %d alloc failed\n", p->id);
+    return NULL;
+  }
+
+  matmul_params_t params;
+  memset(&params, 0, sizeof(params));
+  params.m = M;
+  params.k = K;
+  params.n = N;
+  params.input_dma = input.dma;
+  params.weights_dma = weights.dma;
+  params.output_dma = output.dma;
+  params.tasks = ops;
+  if (gen_matmul_fp16(&params) != 0) {
+    printf("producer %d gen_matmul_fp16 failed\n", p->id);
+    return NULL;
+  }
+  npu_job_init(&job, ops, 1);
+
+  for (int it = 0; it < JOBS; it++) {
+    _Float16 a[M*K], b[N*K];
+    for (int i = 0; i < M*K; i++) {
+      a[i] = (_Float16)(rand_r(&seed) % 10);
+    }
+    for (int i = 0; i < N*K; i++) {
+      b[i] = (_Float16)(rand_r(&seed) % 10);
+    }
+    for (int m = 1; m <= M; m++) {
+      for (int k = 1; k <= K; k++) {
+        ((_Float16 *)input.map)[feature_data(K, M, 1, 8, k, m, 1)] = a[(m-1)*K+(k-1)];
+      }
+    }
+    for (int n = 1; n <= N; n++) {
+      for (int k = 1; k <= K; k++) {
+        ((_Float16 *)weights.map)[weight_fp16(K, n, k)] = b[(n-1)*K+(k-1)];
+      }
+    }
+    memset(output.map, 0, M*N*sizeof(float));
+
+    if ((npu_queue_push(p->queue, &job) != 0) || (npu_job_wait(&job) < 0)) {
+      printf("producer %d job %d failed\n", p->id, it);
+      return NULL;
+    }
+    for (int m = 1; m <= M; m++) {
+      for (int n = 1; n <= N; n++) {
+        float expected = 0;
+        for (int k = 0; k < K; k++) {
+          expected += (float)a[(m-1)*K+k] * (float)b[(n-1)*K+k];
+        }
+        if (((float *)output.map)[feature_data(N, M, 1, 4, n, m, 1)] != expected) {
+          printf("producer %d job %d mismatch at [%d,%d]\n", p->id, it, m, n);
+          return NULL;
+        }
+      }
+    }
+  }
+
+  npu_job_destroy(&job);
+  npu_buffer_free(p->ctx, &input);
+  npu_buffer_free(p->ctx, &weights);
+  npu_buffer_free(p->ctx, &output);
+  p->ret = 0;
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+
+  pthread_t threads[PRODUCERS];
+  producer_t producers[PRODUCERS];
+  npu_queue_stats_t stats;
+  int ret = 0;
+
+  npu_context_t *ctx = npu_context_create();
+  if (ctx == NULL) {
+    return -1;
+  }
+
+  npu_queue_cfg_t cfg = { .budget_us = 2000, .max_tasks = 16, .cores = 0 };
+  npu_queue_t *queue = npu_queue_create(ctx, &cfg);
+  if (queue == NULL) {
+    printf("npu_queue_create failed\n");
+    return -1;
+  }
+
+  for (int i = 0; i < PRODUCERS; i++) {
+    producers[i].ctx = ctx;
+    producers[i].queue = queue;
+    producers[i].id = i;
+    pthread_create(&threads[i], NULL, producer, &producers[i]);
+  }
+  for (int i = 0; i < PRODUCERS; i++) {
+    pthread_join(threads[i], NULL);
+    ret |= producers[i].ret;
+  }
+
+  npu_queue_stats(queue, &stats);
+  npu_queue_destroy(queue);
+  npu_context_destroy(ctx);
+
+  printf("%llu jobs (%llu tasks) in %llu submits\n", (unsigned long long)stats.jobs,
+    (unsigned long long)stats.tasks, (unsigned long long)stats.submits);
+  if ((stats.jobs != PRODUCERS*JOBS) || (stats.submits >= stats.jobs)) {
+    printf("expected %d jobs coalesced into fewer submits\n", PRODUCERS*JOBS);
+    ret = -1;
+  }
+  if (ret == 0) {
+    printf("Submission queue checks succesful\n");
+  }
+  return ret;
+}
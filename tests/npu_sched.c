@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "npu_hw.h"
+#include "npu_matmul.h"
+#include "npu_context.h"
+#include "npu_queue.h"
+#include "npu_sched.h"
+
+  // Groups all queued to core 0, the other cores should steal them.
+
+#define GROUPS 24
+#define M 16
+#define N 64
+
+typedef struct {
+  npu_buffer_t input, weights, output;
+  uint64_t ops[NPU_TASK_OPS];
+  _Float16 a[M*256], b[N*256];
+  int k;
+  npu_job_t job;
+} group_t;
+
+static int group_setup(npu_context_t *ctx, group_t *g, int id) {
+
+  unsigned int seed = id + 1;
+
+  // Mix of group sizes so the queue isn't uniform
+  g->k = (id & 1) ? 256 : 128;
+  if ((npu_buffer_alloc(ctx, M*g->k*sizeof(_Float16), 0, &g->input) != 0) ||
+    (npu_buffer_alloc(ctx, N*g->k*sizeof(_Float16), 0, &g->weights) != 0) ||
+    (npu_buffer_alloc(ctx, M*N*sizeof(float), 0, &g->output) != 0)) {
+    printf("group %d alloc failed\n", id);
+    return -1;
+  }
+
+  matmul_params_t params;
+  memset(&params, 0, sizeof(params));
+  params.m = M;
+  params.k = g->k;
+  params.n = N;
+  params.input_dma = g->input.dma;
+  params.weights_dma = g->weights.dma;
+  params.output_dma = g->output.dma;
+  params.tasks = g->ops;
+  if (gen_matmul_fp16(&params) != 0) {
+    printf("group %d gen_matmul_fp16 failed\n", id);
+    return -1;
+  }
+
+  for (int i = 0; i < M*g->k; i++) {
+    g->a[i] = (_Float16)(rand_r(&seed) % 10);
+  }
+  for (int i = 0; i < N*g->k; i++) {
+    g->b[i] = (_Float16)(rand_r(&seed) % 10);
+  }
+  for (int m = 1; m <= M; m++) {
+    for (int k = 1; k <= g->k; k++) {
+      ((_Float16 *)g->input.map)[feature_data(g->k, M, 1, 8, k, m, 1)] = g->a[(m-1)*g->k+(k-1)];
+    }
+  }
+  for (int n = 1; n <= N; n++) {
+    for (int k = 1; k <= g->k; k++) {
+      ((_Float16 *)g->weights.map)[weight_fp16(g->k, n, k)] = g->b[(n-1)*g->k+(k-1)];
+    }
+  }
+  return npu_job_init(&g->job, g->ops, 1);
+}
+
+static int group_check(group_t *g, int id) {
+  for (int m = 1; m <= M; m++) {
+    for (int n = 1; n <= N; n++) {
+      float expected = 0;
+      for (int k = 0; k < g->k; k++) {
+        expected += (float)g->a[(m-1)*g->k+k] * (float)g->b[(n-1)*g->k+k];
+      }
+      if (((float *)g->output.map)[feature_data(N, M, 1, 4, n, m, 1)] != expected) {
+        printf("group %d mismatch at [%d,%d]\n", id, m, n);
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+// Queue every group on core 0 and run them, returns the stats per core
+static int run(npu_context_t *ctx, group_t *groups, int no_steal, npu_sched_core_stats_t *stats) {
+
+  npu_sched_cfg_t cfg = { .cores = 0, .no_steal = no_steal };
+  npu_sched_t *sched = npu_sched_create(ctx, &cfg);
+  int ret = 0;
+
+  if (sched == NULL) {
+    printf("npu_sched_create failed\n");
+    return -1;
+  }
+  npu_job_t *jobs[GROUPS];
+  for (int i = 0; i < GROUPS; i++) {
+    memset(groups[i].output.map, 0, M*N*sizeof(float));
+    jobs[i] = &groups[i].job;
+  }
+  if (npu_sched_submit(sched, jobs, GROUPS, 0) != 0) {
+    printf("npu_sched_submit failed\n");
+    ret = -1;
+  }
+  for (int i = 0; (i < GROUPS) && (ret == 0); i++) {
+    if ((npu_job_wait(&groups[i].job) < 0) || (group_check(&groups[i], i) != 0)) {
+      ret = -1;
+    }
+  }
+  npu_sched_stats(sched, stats);
+  npu_sched_destroy(sched);
+
+  for (int c = 0; c < NPU_CORES; c++) {
+    printf("%s core %d: %llu groups %llu tasks %llu steals %.1f%% busy\n", no_steal ? "static" : "stealing", c,
+      (unsigned long long)stats[c].groups, (unsigned long long)stats[c].tasks,
+      (unsigned long long)stats[c].steals, stats[c].utilization * 100.0);
+  }
+  return ret;
+}
+
+int main(int argc, char **argv) {
+
+  static group_t groups[GROUPS];
+  npu_sched_core_stats_t stats[NPU_CORES];
+  int ret = 0;
+
+  npu_context_t *ctx = npu_context_create();
+  if (ctx == NULL) {
+    return -1;
+  }
+  for (int i = 0; i < GROUPS; i++) {
+    if (group_setup(ctx, &groups[i], i) != 0) {
+      return -1;
+    }
+  }
+
+  if (run(ctx, groups, 1, stats) != 0) {
+    ret = -1;
+  } else if ((stats[0].groups != GROUPS) || (stats[1].groups != 0) || (stats[2].groups != 0)) {
+    printf("expected all groups on core 0 without stealing\n");
+    ret = -1;
+  }
+
+  if (run(ctx, groups, 0, stats) != 0) {
+    ret = -1;
+  } else {
+    uint64_t total = 0, steals = 0;
+    for (int c = 0; c < NPU_CORES; c++) {
+      total += stats[c].groups;
+      steals += stats[c].steals;
+    }
+    if ((total != GROUPS) || (steals == 0) || (stats[0].steals != 0)) {
+      printf("expected idle cores to steal from core 0\n");
+      ret = -1;
+    }
+  }
+
+  for (int i = 0; i < GROUPS; i++) {
+    npu_job_destroy(&groups[i].job);
+    npu_buffer_free(ctx, &groups[i].input);
+    npu_buffer_free(ctx, &groups[i].weights);
+    npu_buffer_free(ctx, &groups[i].output);
+  }
+  npu_context_destroy(ctx);
+
+  if (ret == 0) {
+    printf("Scheduler checks succesful\n");
+  }
+  return ret;
+}
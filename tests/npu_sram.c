@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "rknpu-ioctl.h"
+#include "npu_interface.h"
+#include "npu_emu.h"
+
+  // SRAM placement against the emulator's driver, which hands out its
+  // SRAM until it runs out, no NPU required.
+
+typedef struct {
+  void      *map;
+  size_t    size;
+  uint64_t  dma;
+  uint64_t  obj;
+  uint32_t  handle;
+  int       placement;
+} sram_buf_t;
+
+int alloc(int fd, sram_buf_t *buf, size_t size, int expected, uint32_t expected_free) {
+
+  uint32_t total, free_size;
+
+  buf->size = size;
+  buf->map = mem_allocate_sram(fd, size, &buf->dma, &buf->obj, 0, &buf->handle, &buf->placement);
+  if (buf->map == NULL) {
+    printf("mem_allocate_sram of %zu bytes failed\n", size);
+    return -1;
+  }
+  if ((npu_get_sram_size(fd, &total, &free_size) != 0) || (buf->placement != expected) ||
+    (free_size != expected_free)) {
+    printf("%zu bytes placed in %s with %u of %u free, expected %s with %u free\n", size,
+      buf->placement == mem_placement_sram ? "sram" : "dram", free_size, total,
+      expected == mem_placement_sram ? "sram" : "dram", expected_free);
+    return -1;
+  }
+  return 0;
+}
+
+void release(int fd, sram_buf_t *buf) {
+  munmap(buf->map, buf->size);
+  mem_destroy(fd, buf->handle, buf->obj);
+}
+
+int main(int argc, char **argv) {
+
+  sram_buf_t lut, act, big;
+  uint32_t total, free_size;
+  int ret = 0;
+
+  int fd = npu_emu_open();
+  if ((fd < 0) || (npu_get_sram_size(fd, &total, &free_size) != 0) || (total == 0) || (free_size != total)) {
+    printf("no free sram to test with\n");
+    return -1;
+  }
+
+  // Small hot buffers fit, one larger than what's left falls back to DRAM
+  ret |= alloc(fd, &lut, 4096, mem_placement_sram, total - 4096);
+  ret |= alloc(fd, &act, total / 2, mem_placement_sram, total / 2 - 4096);
+  ret |= alloc(fd, &big, total / 2, mem_placement_dram, total / 2 - 4096);
+  if (ret != 0) {
+    return ret;
+  }
+
+  // Both placements are usable buffers
+  memset(act.map, 0x5a, act.size);
+  memset(big.map, 0xa5, big.size);
+  if ((((uint8_t *)act.map)[act.size - 1] != 0x5a) || (((uint8_t *)big.map)[0] != 0xa5)) {
+    printf("buffer contents lost\n");
+    ret = -1;
+  }
+
+  // Freeing returns the SRAM, the same size then fits
+  release(fd, &act);
+  release(fd, &big);
+  ret |= alloc(fd, &big, total / 2, mem_placement_sram, total / 2 - 4096);
+  release(fd, &big);
+  release(fd, &lut);
+  if ((npu_get_sram_size(fd, &total, &free_size) != 0) || (free_size != total)) {
+    printf("%u of %u bytes of sram free after releasing everything\n", free_size, total);
+    ret = -1;
+  }
+  npu_close(fd);
+
+  if (ret == 0) {
+    printf("SRAM placement checks succesful\n");
+  }
+  return ret;
+}
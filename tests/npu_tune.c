@@ -0,0 +1,277 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "rknpu-ioctl.h"
+#include "npu_interface.h"
+#include "npu_hw.h"
+#include "npu_matmul.h"
+#include "npu_tune.h"
+
+  // Tuning cache round trip, generator settings from a tuned config and
+  // a tiled matmul plus a tuning run.
+
+#define M 4
+#define K 64
+#define N 128
+#define TILE_N 32
+
+  uint64_t npu_regs[NPU_TUNE_MAX_TASKS*NPU_TASK_OPS];
+
+uint32_t find_reg(const uint64_t *ops, uint32_t reg) {
+  for (int i = 0; i < NPU_TASK_OPS; i++) {
+    if ((ops[i] & 0xFFFF) == reg) {
+      return (ops[i] >> 16) & 0xFFFFFFFF;
+    }
+  }
+  return 0;
+}
+
+int check_cache(const char *path) {
+
+  npu_tune_cache_t cache, loaded;
+  npu_tune_cfg_t a = { .tile_n = 64, .data_banks = 3, .data_burst_len = 7, .weight_burst_len = 3, .dpu_burst_len = 15 };
+  npu_tune_cfg_t b = { .tile_n = 0, .data_banks = 0, .data_burst_len = 15, .weight_burst_len = 15, .dpu_burst_len = 7 };
+  const npu_tune_cfg_t *cfg;
+
+  memset(&cache, 0, sizeof(cache));
+  memset(&loaded, 0, sizeof(loaded));
+
+  unlink(path);
+  if (npu_tune_cache_load(&loaded, path) != 0) {
+    printf("missing cache should load empty\n");
+    return -1;
+  }
+
+  npu_tune_cache_put(&cache, npu_tune_matmul_fp16, 1, 768, 768, &b, 12.0);
+  npu_tune_cache_put(&cache, npu_tune_matmul_int8, 1, 768, 768, &b, 9.0);
+  npu_tune_cache_put(&cache, npu_tune_matmul_fp16, 1, 768, 768, &a, 10.5);
+  if ((cache.count != 2) || (npu_tune_cache_save(&cache, path) != 0)) {
+    printf("cache put/save failed\n");
+    return -1;
+  }
+  if (npu_tune_cache_load(&loaded, path) != 2) {
+    printf("cache load failed\n");
+    return -1;
+  }
+  cfg = npu_tune_lookup(&loaded, npu_tune_matmul_fp16, 1, 768, 768);
+  if ((cfg == NULL) || (memcmp(cfg, &a, sizeof(a)) != 0)) {
+    printf("fp16 1x768x768 not restored\n");
+    return -1;
+  }
+  cfg = npu_tune_lookup(&loaded, npu_tune_matmul_int8, 1, 768, 768);
+  if ((cfg == NULL) || (memcmp(cfg, &b, sizeof(b)) != 0)) {
+    printf("int8 1x768x768 not restored\n");
+    return -1;
+  }
+  if (npu_tune_lookup(&loaded, npu_tune_matmul_fp16, 1, 768, 2048) != NULL) {
+    printf("unexpected entry for 1x768x2048\n");
+    return -1;
+  }
+
+  npu_tune_cache_free(&cache);
+  npu_tune_cache_free(&loaded);
+  unlink(path);
+  printf("cache round trip ok\n");
+  return 0;
+}
+
+int main(int argc, char **argv) {
+
+  uint64_t regcmd_dma, regcmd_obj, tasks_dma, tasks_obj;
+  uint64_t input_dma, input_obj, weights_dma, weights_obj, output_dma, output_obj;
+  uint32_t regcmd_handle, tasks_handle, input_handle, weights_handle, output_handle;
+  char path[64];
+  int ret = 0;
+
+  snprintf(path, sizeof(path), "/tmp/npu_tune_test_%d.cache", (int)getpid());
+  if (check_cache(path) != 0) {
+    return -1;
+  }
+
+  // Tuned settings reach the registers, N is split over chained tasks
+  npu_tune_cfg_t cfg = { .tile_n = TILE_N, .data_banks = 3, .data_burst_len = 3, .weight_burst_len = 7, .dpu_burst_len = 7 };
+  matmul_params_t params;
+  memset(&params, 0, sizeof(params));
+  params.m = M;
+  params.k = K;
+  params.n = N;
+  params.input_dma = 0x1000;
+  params.weights_dma = 0x100000;
+  params.output_dma = 0x200000;
+  params.tasks = npu_regs;
+  params.tune = &cfg;
+  params.regcmd_dma = 0x300000;
+  if ((gen_matmul_fp16(&params) != 0) || (matmul_task_count(&params) != N/TILE_N)) {
+    printf("expected %d tasks\n", N/TILE_N);
+    return -1;
+  }
+  for (int i = 0; i < N/TILE_N; i++) {
+    uint64_t *ops = npu_regs + i*NPU_TASK_OPS;
+    uint32_t cbuf = find_reg(ops, CNA_CBUF_CON0);
+    if ((find_reg(ops, CNA_DMA_CON0) != ((7 << 16) | 3)) || ((cbuf & 0xF) != 3) || (((cbuf >> 4) & 0xF) != 9) ||
+      (((cbuf >> 12) & 0x1) != (i > 0)) || (((find_reg(ops, DPU_FEATURE_MODE_CFG) >> 5) & 0xF) != 7) ||
+      (find_reg(ops, CNA_DCOMP_ADDR0) != params.weights_dma + i*TILE_N*K*sizeof(_Float16)) ||
+      (find_reg(ops, DPU_DST_BASE_ADD) != params.output_dma + i*TILE_N*M*sizeof(float))) {
+      printf("task %d registers don't match the tuned config\n", i);
+      return -1;
+    }
+    uint32_t next = ((ops[104] & 0xFFFF) == PC_BASE_ADDRESS) ? (ops[104] >> 16) & 0xFFFFFFFF : 0;
+    if (next != ((i + 1 < N/TILE_N) ? params.regcmd_dma + (i+1)*NPU_TASK_OPS*sizeof(uint64_t) : 0)) {
+      printf("task %d chained to 0x%x\n", i, next);
+      return -1;
+    }
+  }
+  printf("tuned generator registers ok\n");
+
+  // Tiled matmul, the feature data is only read once
+  int fd = npu_open();
+  if (fd < 0) {
+    return -1;
+  }
+
+  uint64_t *regcmd = mem_allocate(fd, sizeof(npu_regs), &regcmd_dma, &regcmd_obj, 0, &regcmd_handle);
+  struct rknpu_task *tasks = mem_allocate(fd, 1024, &tasks_dma, &tasks_obj, RKNPU_MEM_KERNEL_MAPPING, &tasks_handle);
+  _Float16 *input = mem_allocate(fd, M*K*sizeof(_Float16), &input_dma, &input_obj, 0, &input_handle);
+  _Float16 *weights = mem_allocate(fd, N*K*sizeof(_Float16), &weights_dma, &weights_obj, 0, &weights_handle);
+  float *output = mem_allocate(fd, M*N*sizeof(float), &output_dma, &output_obj, 0, &output_handle);
+  if (!regcmd || !tasks || !input || !weights || !output) {
+    printf("alloc fail\n");
+    return -1;
+  }
+
+  srand(time(NULL));
+  _Float16 a[M*K], b[N*K];
+  for (int i = 0; i < M*K; i++) {
+    a[i] = (_Float16)(rand() % 10);
+  }
+  for (int i = 0; i < N*K; i++) {
+    b[i] = (_Float16)(rand() % 10);
+  }
+  for (int m = 1; m <= M; m++) {
+    for (int k = 1; k <= K; k++) {
+      input[feature_data(K, M, 1, 8, k, m, 1)] = a[(m-1)*K+(k-1)];
+    }
+  }
+  for (int n = 1; n <= N; n++) {
+    for (int k = 1; k <= K; k++) {
+      weights[weight_fp16(K, n, k)] = b[(n-1)*K+(k-1)];
+    }
+  }
+
+  params.input_dma = input_dma;
+  params.weights_dma = weights_dma;
+  params.output_dma = output_dma;
+  params.regcmd_dma = regcmd_dma;
+  if ((ret = gen_matmul_fp16(&params)) != 0) {
+    printf("gen_matmul_fp16 failed %d\n", ret);
+    goto cleanup;
+  }
+  int ntasks = matmul_task_count(&params);
+  memcpy(regcmd, npu_regs, ntasks*NPU_TASK_OPS*sizeof(uint64_t));
+  for (int i = 0; i < ntasks; i++) {
+    memset(&tasks[i], 0, sizeof(tasks[i]));
+    tasks[i].enable_mask = 0xd;
+    tasks[i].int_mask = 0x300;
+    tasks[i].int_clear = 0x1ffff;
+    tasks[i].regcfg_amount = NPU_TASK_REGCFG_AMOUNT;
+    tasks[i].regcmd_addr = regcmd_dma + i*NPU_TASK_OPS*sizeof(uint64_t);
+  }
+  struct rknpu_submit submit = {
+    .flags = RKNPU_JOB_PC | RKNPU_JOB_BLOCK | RKNPU_JOB_PINGPONG,
+    .timeout = 6000,
+    .task_number = ntasks,
+    .task_obj_addr = tasks_obj,
+    .core_mask = 1,
+    .fence_fd = -1,
+    .subcore_task = { {0,ntasks}, {1,0}, {2,0}, {0,0}, {0,0} },
+  };
+
+  npu_action(fd, RKNPU_ACT_CLR_TOTAL_RW_AMOUNT, NULL);
+  if ((ret = npu_ioctl(fd, DRM_IOCTL_RKNPU_SUBMIT, &submit)) != 0) {
+    printf("submit failed %d\n", ret);
+    goto cleanup;
+  }
+  for (int m = 1; m <= M && ret == 0; m++) {
+    for (int n = 1; n <= N; n++) {
+      float expected = 0;
+      for (int k = 0; k < K; k++) {
+        expected += (float)a[(m-1)*K+k] * (float)b[(n-1)*K+k];
+      }
+      if (output[feature_data(N, M, 1, 4, n, m, 1)] != expected) {
+        printf("tiled matmul mismatch at [%d,%d]\n", m, n);
+        ret = -1;
+        break;
+      }
+    }
+  }
+  uint32_t dt_rd = 0;
+  npu_action(fd, RKNPU_GET_DT_RD_AMOUNT, &dt_rd);
+  if (dt_rd != M*K*sizeof(_Float16)) {
+    printf("dt_rd %u expected %u\n", dt_rd, (uint32_t)(M*K*sizeof(_Float16)));
+    ret = -1;
+  }
+  if (ret != 0) {
+    goto cleanup;
+  }
+  printf("tiled matmul [%d,%d]x[%d,%d] in %d tasks ok\n", M, K, N, K, ntasks);
+
+  // Tuner picks a valid config and records it
+  npu_tune_cache_t cache;
+  npu_tune_cfg_t best;
+  memset(&cache, 0, sizeof(cache));
+  if ((ret = npu_tune_matmul(fd, &cache, npu_tune_matmul_int8, M, K, N, 3, &best)) != 0) {
+    printf("npu_tune_matmul failed %d\n", ret);
+    goto cleanup;
+  }
+  const npu_tune_cfg_t *found = npu_tune_lookup(&cache, npu_tune_matmul_int8, M, K, N);
+  if ((found == NULL) || (memcmp(found, &best, sizeof(best)) != 0) ||
+    ((best.tile_n != 0) && ((best.tile_n % NPU_TUNE_TILE_ALIGN) != 0))) {
+    printf("tuner result not cached\n");
+    ret = -1;
+  } else {
+    printf("tuned int8 %dx%dx%d tile_n %u data_banks %u bursts %u/%u/%u\n", M, K, N, best.tile_n,
+      best.data_banks, best.data_burst_len, best.weight_burst_len, best.dpu_burst_len);
+  }
+  npu_tune_cache_free(&cache);
+
+cleanup:
+  munmap(regcmd, sizeof(npu_regs));
+  munmap(tasks, 1024);
+  munmap(input, M*K*sizeof(_Float16));
+  munmap(weights, N*K*sizeof(_Float16));
+  munmap(output, M*N*sizeof(float));
+
+  mem_destroy(fd, regcmd_handle, regcmd_obj);
+  mem_destroy(fd, tasks_handle, tasks_obj);
+  mem_destroy(fd, input_handle, input_obj);
+  mem_destroy(fd, weights_handle, weights_obj);
+  mem_destroy(fd, output_handle, output_obj);
+
+  npu_close(fd);
+  return ret;
+}
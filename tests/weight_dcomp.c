@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2024  Jasbir Matharu, <jasjnuk@gmail.com>
+ *
+ * This file is part of rk3588-npu.
+ *
+ * rk3588-npu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * rk3588-npu is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with rk3588-npu.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "npu_hw.h"
+#include "npu_matmul.h"
+#include "npu_dcomp.h"
+
+  // Round trip packed weights through weight_compress / weight_decompress
+  // and check the decompress registers emitted by gen_matmul_fp16, which
+  // are experimental and only emitted with NPU_DCOMP_EXPERIMENTAL set.
+  // Runs on the CPU only, no NPU required.
+
+  uint64_t npu_regs[112];
+
+float rand_float() {
+  return rand()/(float)RAND_MAX;
+}
+
+int round_trip(const void *packed, uint32_t bytes, uint8_t elem_size, uint8_t segments, npu_dcomp_info_t *info) {
+
+  uint32_t bound = weight_compress_bound(bytes, elem_size, segments);
+  uint8_t *compressed = malloc(bound);
+  uint8_t *restored = malloc(bytes);
+  int ret;
+
+  ret = weight_compress(packed, bytes, elem_size, segments, compressed, bound, info);
+  if (ret < 0) {
+    printf("weight_compress failed %d\n", ret);
+    goto done;
+  }
+  printf("elem_size %d segments %d raw %u compressed %u (%.1f%%)\n", elem_size, segments, bytes,
+    info->total_bytes, 100.0 * info->total_bytes / bytes);
+
+  ret = weight_decompress(compressed, info, restored);
+  if (ret != 0) {
+    printf("weight_decompress failed %d\n", ret);
+    goto done;
+  }
+  if (memcmp(packed, restored, bytes) != 0) {
+    printf("round trip mismatch\n");
+    ret = -1;
+  }
+
+done:
+  free(compressed);
+  free(restored);
+  return ret < 0 ? ret : 0;
+}
+
+int main(int argc, char **argv) {
+
+  unsigned int K = 256;
+  unsigned int N = 64;
+  unsigned int sparsity = 50;
+  int ret = 0;
+
+  if (argc == 4) {
+    K = atoi(argv[1]);
+    N = atoi(argv[2]);
+    sparsity = atoi(argv[3]);
+  }
+
+  if ((K == 0) || ((K % 32) != 0) || (N == 0) || ((N % 32) != 0) || (sparsity > 100)) {
+    printf("K [%d] and N [%d] need to be multiples of 32, sparsity [%d] a percentage\n", K, N, sparsity);
+    return -1;
+  }
+
+  srand(time(NULL));
+
+  _Float16 *weights_fp16 = calloc(N*K, sizeof(_Float16));
+  int8_t *weights_int8 = calloc(N*K, sizeof(int8_t));
+
+  for (int n = 1; n <= N; n++) {
+    for (int k = 1; k <= K; k++) {
+      int zero = (rand() % 100) < sparsity;
+      weights_fp16[weight_fp16(K, n, k)] = zero ? 0 : (_Float16)(1 + (int)(10.0*rand_float()));
+      weights_int8[weight_int8(K, n, k)] = zero ? 0 : (int8_t)(1 + (int)(10.0*rand_float()));
+    }
+  }
+
+  npu_dcomp_info_t info;
+  for (int segments = 1; segments <= NPU_DCOMP_SEGMENTS; segments *= 2) {
+    if ((ret = round_trip(weights_fp16, N*K*sizeof(_Float16), 2, segments, &info)) != 0) {
+      goto cleanup;
+    }
+    if ((ret = round_trip(weights_int8, N*K*sizeof(int8_t), 1, segments, &info)) != 0) {
+      goto cleanup;
+    }
+  }
+
+  // Check registers emitted for the last fp16 compression
+  ret = round_trip(weights_fp16, N*K*sizeof(_Float16), 2, NPU_DCOMP_SEGMENTS, &info);
+  if (ret != 0) {
+    goto cleanup;
+  }
+
+  matmul_params_t params;
+  memset(&params, 0, sizeof(params));
+  params.m = 4;
+  params.k = K;
+  params.n = N;
+  params.input_dma = 0x1000;
+  params.weights_dma = 0x2000;
+  params.output_dma = 0x3000;
+  params.tasks = (uint64_t *) &npu_regs;
+  params.dcomp = &info;
+
+  // Decompress is only emitted when opted in to
+  if (gen_matmul_fp16(&params) == 0) {
+    printf("gen_matmul_fp16 accepted compressed weights without NPU_DCOMP_EXPERIMENTAL\n");
+    ret = -1;
+    goto cleanup;
+  }
+  setenv("NPU_DCOMP_EXPERIMENTAL", "1", 1);
+  ret = gen_matmul_fp16(&params);
+  if (ret != 0) {
+    printf("gen_matmul_fp16 failed %d\n", ret);
+    goto cleanup;
+  }
+
+  if (npu_regs[29] != NPUOP(OP_REG_CNA, NPU_DCOMP_SEGMENTS, CNA_DCOMP_REGNUM)) {
+    printf("CNA_DCOMP_REGNUM not set\n");
+    ret = -1;
+  }
+  for (int i = 0; i < NPU_DCOMP_SEGMENTS; i++) {
+    if (npu_regs[31+i] != NPUOP(OP_REG_CNA, info.amount[i], (CNA_DCOMP_AMOUNT + (i * 4)))) {
+      printf("CNA_DCOMP_AMOUNT%d mismatch\n", i);
+      ret = -1;
+    }
+  }
+
+  if (ret == 0) {
+    printf("Weight compression of [%d,%d] %d%% sparse succesful\n", N, K, sparsity);
+  }
+
+cleanup:
+  free(weights_fp16);
+  free(weights_int8);
+  return ret;
+}